@@ -38,6 +38,78 @@
 /* Compile with -DUSE_INOTIFY=1 on Linux to take advantage of inotify(7). */
 #endif
 
+#ifndef USE_SPLICE
+#define USE_SPLICE 0
+/* Compile with -DUSE_SPLICE=1 on Linux to allow "sockptyr link -splice",
+ * which moves data between linked sockets with splice(2) through a kernel
+ * pipe instead of copying it through our own buffers.
+ */
+#endif
+
+#ifndef USE_OFFLOAD
+#define USE_OFFLOAD 0
+/* Compile with -DUSE_OFFLOAD=1 on Linux to allow "sockptyr link -offload",
+ * which hands linked connections to a pool of threads using epoll(7)
+ * instead of handling them in the Tcl event loop.  Needs a Tcl built with
+ * thread support.
+ */
+#endif
+
+#ifndef USE_RECORD
+#define USE_RECORD 0
+/* Compile with -DUSE_RECORD=1 to allow "sockptyr record", which records
+ * what's relayed on connections to files, written by a thread of its own
+ * so the disk doesn't hold up the relaying.  Needs a Tcl built with
+ * thread support.
+ */
+#endif
+
+#ifndef USE_READV
+#define USE_READV 1
+/* Compile with -DUSE_READV=0 to receive & send connections' data with
+ * read() & write(), which only handle one contiguous part of the buffer
+ * at a time, instead of readv() & writev(), which handle both parts when
+ * it wraps around.  For comparison, see tests/sockptyr_tests_iov.tcl.
+ */
+#endif
+
+#ifndef USE_ACCEPT4
+#define USE_ACCEPT4 0
+/* Compile with -DUSE_ACCEPT4=1 on Linux to accept connections with
+ * accept4(), which makes them non-blocking & close-on-exec in the same
+ * system call.
+ */
+#endif
+
+#ifndef USE_POSIX_SPAWN
+#define USE_POSIX_SPAWN 0
+/* Compile with -DUSE_POSIX_SPAWN=1 to start "sockptyr exec" commands with
+ * posix_spawn(), which (unlike fork()) doesn't have to copy the whole
+ * process first, so it doesn't get slower as the GUI gets bigger.
+ */
+#endif
+
+#ifndef USE_SPAWN_CLOSEFROM
+#define USE_SPAWN_CLOSEFROM 0
+/* Compile with -DUSE_SPAWN_CLOSEFROM=1, along with USE_POSIX_SPAWN, where
+ * there's posix_spawn_file_actions_addclosefrom_np() (glibc 2.34 and up)
+ * to close the file descriptors "sockptyr exec" commands shouldn't get all
+ * at once.  Otherwise, USE_POSIX_SPAWN uses the POSIX_SPAWN_CLOEXEC_DEFAULT
+ * flag where there is one (macOS) to do that; where there isn't, it's
+ * turned off, and fork() is used.  Also uses closefrom(), for "sockptyr
+ * pty_spawn", instead of closing them one at a time.
+ */
+#endif
+
+#ifndef USE_PIDFD
+#define USE_PIDFD 0
+/* Compile with -DUSE_PIDFD=1 on Linux to learn when "sockptyr spawn"
+ * processes exit by watching file descriptors from pidfd_open() (Linux
+ * 5.3 and up) in the event loop.  Otherwise, or if the kernel hasn't got
+ * it, a SIGCHLD handler wakes up the event loop through a pipe.
+ */
+#endif
+
 #ifndef USE_TCL_BACKGROUNDEXCEPTION
 #define USE_TCL_BACKGROUNDEXCEPTION 0
 /* Compile with -DUSE_TCL_BACKGROUNDEXCEPTION=1 to enable the use of
@@ -55,18 +127,100 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <limits.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#if USE_POSIX_SPAWN
+#include <spawn.h>
+#if !USE_SPAWN_CLOSEFROM && !defined(POSIX_SPAWN_CLOEXEC_DEFAULT)
+/* no way to have posix_spawn() close the file descriptors commands
+ * shouldn't inherit; fork() and close them instead
+ */
+#undef USE_POSIX_SPAWN
+#define USE_POSIX_SPAWN 0
+#endif
+#endif /* USE_POSIX_SPAWN */
+#if (USE_OFFLOAD || USE_RECORD) && !defined(TCL_THREADS)
+#define TCL_THREADS 1 /* otherwise tcl.h makes Tcl_MutexLock() etc no-ops */
+#endif
 #include <tcl.h>
 #if USE_INOTIFY
 #include <sys/inotify.h>
+#include <dirent.h>
 #endif /* USE_INOTIFY */
+#if USE_OFFLOAD
+#include <sys/epoll.h>
+#endif /* USE_OFFLOAD */
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if USE_PIDFD
+#include <sys/syscall.h>
+#endif /* USE_PIDFD */
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 
 static const char *handle_prefix = "sockptyr_";
+
+static unsigned long sockptyr_next_gen = 1; /* handle generations */
+TCL_DECLARE_MUTEX(sockptyr_gen_lock)
 static const int buf_sz = 4096;
+static const int buf_max = 262144;
+static const int buf_sweep_ms = 2000;
+static const long pool_keep_bytes = 1048576;
+
+/* Number of size classes of connection buffers in 'struct sockptyr_pool':
+ * class 'c' holds buffers of 256 << c bytes, so up to 1 gigabyte.
+ */
+#define POOL_CLASSES 23
+static const int io_budget = 65536;
+#if USE_OFFLOAD
+static const int offload_threads = 2;
+#endif /* USE_OFFLOAD */
+static const int listen_backlog = SOMAXCONN; /* default for listen() */
+static const int accept_batch = 64; /* most accept()s per wakeup */
+static const int lstn_pause_ms = 250; /* when out of file descriptors */
+static const int connect_limit = 16; /* most "connect -async" in progress */
+static const int connect_retry_ms = 5; /* first wait when backlog's full */
+static const int connect_retry_max_ms = 100; /* longest such wait */
+static const int connect_backoff_ms = 250; /* first wait after failing */
+static const int connect_backoff_max_ms = 30000; /* longest such wait */
+#if USE_RECORD
+static const int record_batch = 65536; /* bytes per batch for the writer */
+static const long record_queue_max = 16777216; /* most waiting to be written */
+static const int record_flush_ms = 200; /* longest a partial batch waits */
+static const int record_fsync_ms = 1000; /* least time between fsync()s */
+#endif /* USE_RECORD */
+#define LATENCY_SUB_BITS 6 /* histogram buckets per power of two: 2^(n-1) */
+#define LATENCY_BUCKETS (34 << (LATENCY_SUB_BITS - 1)) /* up to 2^38 us */
+#define LATENCY_MARKS 64 /* reads whose timing is kept at once */
+static const long trace_default = 65536; /* "sockptyr trace on" records */
+static const long trace_max = 16777216;
+static const char trace_magic[16] = "sockptyr trc 1\n";
+static const long scrollback_min = 4096; /* "sockptyr scrollback" sizes */
+static const long scrollback_max = 1073741824;
+static const char scrollback_magic[16] = "sockptyr sbk 1\n";
+
+/* For "sockptyr spawn" processes without a pidfd: sockptyr_sigchld()
+ * writes to this pipe when there's a SIGCHLD, and the event loop watches
+ * the other end.  Signal handlers belong to the whole process, so these
+ * are shared by all interpreters that have such processes, which are
+ * listed in sockptyr_sigchld_sds.
+ */
+static int sockptyr_sigchld_pipe[2] = { -1, -1 };
+static struct sockptyr_data *sockptyr_sigchld_sds = NULL;
+static struct sigaction sockptyr_sigchld_old; /* handler from before ours */
+
+#if USE_INOTIFY
+static const int inotify_reads = 64; /* most read()s per inotify wakeup */
+static const int inotify_flagreps_max = 256; /* flag lists cached */
+#endif /* USE_INOTIFY */
 
 #if USE_INOTIFY
 static struct {
@@ -113,18 +267,191 @@ static struct {
     { NULL, 0 }
 };
 
+/* events telling of entries coming and going in a directory, which are
+ * kept track of to rescan it after an overflow; see sockptyr_inot_overflow()
+ */
+#define INOT_ENTRIES (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+
+struct sockptyr_inotw {
+    /* An inotify(7) watch.  Handles watching the same file share it,
+     * since the kernel gives them the same watch descriptor.
+     */
+    int wd; /* watch descriptor used to identify its events; or -1 */
+    int refs; /* handles using it, plus any event being dispatched */
+    struct sockptyr_hdl *hdls; /* those handles, linked by u_inot.wnext */
+    char *path; /* normalized pathname of what's watched */
+    Tcl_HashTable *names; /* entries in the directory, if keeping track */
+};
+
+struct sockptyr_inotp {
+    /* an inotify(7) event held by "sockptyr inotify -coalesce", or made
+     * up by sockptyr_inot_overflow()
+     */
+    struct sockptyr_inotp *next;
+    uint32_t mask; /* events, merged; 0 if it's been delivered already */
+    uint32_t cookie;
+    char name[1]; /* name, allocated as long as it needs to be */
+};
+
 struct sockptyr_inot {
     /* inotify(7) watch specific information in sockptyr */
-    int wd; /* watch descriptor used to identify its events */
+    struct sockptyr_inotw *w; /* the watch */
+    struct sockptyr_hdl *wnext; /* next handle sharing 'w' */
+    uint32_t mask; /* events this handle asked for */
     Tcl_Obj *proc; /* Tcl code to run when encountered */
+    int coalesce; /* milliseconds to hold events to merge them; or 0 */
+    struct sockptyr_inotp *pend, *pend_last; /* events held, in order */
+    Tcl_HashTable *pend_names; /* events held, by name */
+    Tcl_TimerToken pend_timer; /* to deliver them */
 };
 #endif /* USE_INOTIFY */
 
+struct sockptyr_ioev {
+    /* something that happened on a connection, found by sockptyr_conn_io()
+     * and to be reported by sockptyr_conn_ioev()
+     */
+    struct sockptyr_hdl *hdl; /* the connection */
+    int kind; /* 'c' closed, 'e' error (see 'err'), 'b' bug (see 'msg') */
+    int err; /* errno value if kind == 'e' */
+    char *msg; /* message if kind == 'b' */
+};
+
+struct sockptyr_cnct {
+    /* A connection being made by "sockptyr connect -async", from when
+     * the command is run until its -command script is run.  With
+     * "-reconnect" it's kept after that, to connect again each time
+     * the connection is lost.
+     */
+    struct sockptyr_hdl *hdl; /* the connection */
+    struct sockaddr_un sa; /* address to connect to */
+    Tcl_Obj *proc; /* Tcl script to run when done */
+    /* state -- where it's at:
+     *      'q' -- queued, waiting for sd->n_connecting to go down
+     *      't' -- trying connect() again after 'retry' goes off
+     *      'w' -- waiting for the socket to be writable
+     *      'b' -- backing off after a failure, till 'retry' goes off
+     *      'd' -- done ('err' tells how), waiting for sockptyr_cnct_report()
+     *      'c' -- connected, if 'reconnect'
+     */
+    int state;
+    int started; /* counted in sd->n_connecting */
+    int err; /* errno value if it failed, 0 if it succeeded */
+    int retry_ms; /* how long the next wait in state 't' will be */
+    Tcl_TimerToken retry, deadline; /* timers for states 't' & 'b'; -timeout */
+    /* policy from "sockptyr connect" options, and how it's going:
+     *      timeout -- -timeout, 0 for none
+     *      attempts -- -attempts, 0 for unlimited
+     *      failures -- failed attempts since it started connecting
+     *      backoff_first, backoff_max -- -backoff
+     *      backoff_ms -- middle of the next wait in state 'b'
+     *      reconnect -- -reconnect
+     */
+    int timeout, attempts, failures;
+    int backoff_first, backoff_max, backoff_ms;
+    int reconnect;
+    struct sockptyr_cnct *next; /* next in the queue if state == 'q' */
+};
+
+struct sockptyr_proc {
+    /* A process started by "sockptyr spawn", from then until it exits
+     * and has been waited for.  That's done even if its handle is closed
+     * first, so it doesn't linger as a zombie.
+     */
+    struct sockptyr_data *sd; /* global data */
+    struct sockptyr_hdl *hdl; /* its handle; NULL once that's closed */
+    pid_t pid; /* process ID */
+    int pidfd; /* from pidfd_open(), or -1 to find out with SIGCHLD */
+    Tcl_Obj *onexit; /* Tcl script to run when it exits; or NULL */
+    struct sockptyr_hdl *pty; /* connection to close when it exits; or NULL */
+    unsigned long pty_gen; /* pty->gen, in case it's closed & reused first */
+    struct sockptyr_proc *next; /* next in sd->procs */
+};
+
+struct sockptyr_fan {
+    /* A fan-out group made by "sockptyr fanout".  What's received on its
+     * source stays in the source's buffer until each of its sinks has
+     * sent it; each sink keeps track of how far behind it is with
+     * 'fan_lag' in struct sockptyr_conn, and the buffer's 'buf_out' is
+     * where the one furthest behind is up to.  What's received on the
+     * sinks all goes to the source, a buffer at a time from each in turn.
+     */
+    struct sockptyr_data *sd; /* global data */
+    struct sockptyr_hdl *hdl; /* the group's handle */
+    struct sockptyr_hdl *src; /* source connection */
+    struct sockptyr_hdl *sinks; /* sink connections, through 'fan_next' */
+    int nsinks; /* number of them */
+    struct sockptyr_hdl *in_next; /* sink to send to the source from next */
+    /* The source stops receiving while its buffer is full (and can't
+     * grow), because of sinks a whole buffer behind.  If that lasts
+     * 'grace_ms' (timed by 'slow_timer'), 'policy' says what's done
+     * about those sinks:
+     *      'b' -- block: nothing, keep waiting for them to catch up
+     *      'd' -- drop: they skip what they haven't sent
+     *      'x' -- disconnect: they're removed from the group, & reported
+     *          with "sockptyr onerror"
+     */
+    int policy, grace_ms;
+    Tcl_TimerToken slow_timer;
+    unsigned long n_dropped, n_cut; /* bytes dropped; sinks removed */
+};
+
+struct sockptyr_sbk_hdr {
+    /* Start of a scrollback's memory mapping, and of its file if it has
+     * one, followed by its 'size' bytes of data.  'total' is the number
+     * of bytes ever recorded in it; the next byte goes at 'total % size'.
+     * Kept in the file so the history survives sockptyr being restarted.
+     */
+    char magic[16]; /* scrollback_magic */
+    uint64_t size, total;
+};
+
+struct sockptyr_sbk {
+    /* A connection's scrollback, set up by "sockptyr scrollback": a ring
+     * holding the last bytes received on it, in memory mapped with
+     * mmap(2), from a file or anonymous.
+     */
+    struct sockptyr_sbk_hdr *hdr; /* start of the mapping */
+    unsigned char *data; /* the ring itself, right after 'hdr' */
+    size_t size, map_len; /* size of the ring; and of the whole mapping */
+    /* Held while recording into it from sockptyr_sbk_append(), which
+     * worker threads can call, and while "sockptyr scrollback_get" reads
+     * it.  Unlinked connections (see sockptyr_conn_recv()) aren't
+     * handled by worker threads, so they don't need it.
+     */
+    Tcl_Mutex lock;
+};
+
+struct sockptyr_lat {
+    /* For "sockptyr link -latency": how long what's received on a
+     * connection waits in its buffer before it's sent.  Each read's
+     * time is remembered, in marks[], until the last of its bytes has
+     * been sent; then the wait goes in a log-linear histogram: values
+     * below 2^LATENCY_SUB_BITS microseconds each have a bucket, above
+     * that each power of two is split into 2^(LATENCY_SUB_BITS-1), so
+     * a value's bucket is within about 3% of it.
+     *      in, out -- bytes that have gone in and out of the buffer
+     *      marks -- ring of reads: where their data ends (in terms of
+     *          'in') and when they were done (from sockptyr_now_us())
+     *      mark0, nmarks -- oldest entry in marks[], how many there are
+     *      count, max -- how many waits have been counted; the longest
+     *      hist -- the histogram
+     */
+    uint64_t in, out;
+    struct {
+        uint64_t end;
+        long long us;
+    } marks[LATENCY_MARKS];
+    int mark0, nmarks;
+    uint64_t count, max;
+    uint32_t hist[LATENCY_BUCKETS];
+};
+
 struct sockptyr_conn {
     /* connection specific information in sockptyr */
     int fd; /* file descriptor; -1 if closed */
     /* buf* -- buffer for receiving data on this connection
-     *      buf -- the buffer itself
+     *      buf -- the buffer itself; NULL while it's empty, see
+     *          sockptyr_conn_drained()
      *      buf_sz -- size of the buffer in bytes
      *      buf_empty -- boolean indicating the buffer is empty
      *      buf_in -- index in buffer where next received data goes
@@ -132,25 +459,239 @@ struct sockptyr_conn {
      */
     unsigned char *buf;
     int buf_sz, buf_empty, buf_in, buf_out;
+    int buf_busy; /* buffer has filled up since last sockptyr_buf_sweep() */
+
+    int code; /* type of connection, see sockptyr_init_conn() */
+    int eio_closed; /* EIO receiving means it's closed ("pty_spawn") */
+    int reg_mask; /* mask registered with Tcl_CreateFileHandler(), or -1 */
+
+    /* n_* -- counts, for debugging & benchmarking, and "sockptyr stats"
+     *      n_ev -- events handled by sockptyr_conn_io()
+     *      n_rd -- system calls made to receive on it
+     *      n_wr -- system calls made to send on it
+     *      n_in -- bytes received on it
+     *      n_out -- bytes sent on it
+     *      n_full -- times its buffer (or pipe) filled up
+     *      peak -- most bytes that have been in its buffer (or pipe)
+     *      last_ms -- when something was last received, from
+     *          sockptyr_now_ms(); 0 if nothing has been
+     * When the connection's offloaded the worker thread updates these
+     * without locking; "sockptyr stats" doesn't mind if they're a bit off.
+     */
+    unsigned long n_ev, n_rd, n_wr, n_full;
+    unsigned long long n_in, n_out;
+    int peak;
+    long long last_ms;
+    struct sockptyr_lat *lat; /* "sockptyr link -latency", or NULL */
+
+#if USE_SPLICE
+    /* spl_* -- used instead of buf* when the connection is linked with
+     * "sockptyr link -splice".  Received data goes into a pipe, from which
+     * it's spliced out to the linked connection.
+     *      spl_fds -- pipe read & write ends; both -1 when not in use
+     *      spl_fill -- number of bytes currently in the pipe
+     *      spl_cap -- limit on spl_fill: buf_sz or the pipe's capacity,
+     *          whichever is less
+     *      spl_full -- boolean indicating the pipe refused more data even
+     *          though spl_fill < spl_cap (it can run out of slots first)
+     */
+    int spl_fds[2];
+    int spl_fill, spl_cap, spl_full;
+#endif /* USE_SPLICE */
+
+#if USE_OFFLOAD
+    /* off* -- used when the connection (and whatever it's linked to) have
+     * been handed to a worker thread with "sockptyr link -offload".  While
+     * 'offw' is set, nothing but that thread touches the connection's
+     * I/O state; see sockptyr_offload_reclaim().
+     *      offw -- the worker thread; NULL if handled in the Tcl event loop
+     *      off_mask -- epoll events the worker is watching the connection
+     *          for; -1 if it's not in the worker's epoll set
+     *      off_stopped -- boolean: the worker stopped handling this
+     *          connection, because of the event in 'off_ev'
+     *      off_pending -- boolean: 'off_ev' is waiting to be reported in
+     *          the Tcl thread, by sockptyr_offload_evproc()
+     */
+    struct sockptyr_offw *offw;
+    int off_mask, off_stopped, off_pending;
+    struct sockptyr_ioev off_ev;
+#endif /* USE_OFFLOAD */
 
     /* two connections can be (& often are) "linked"; the entry 'linked'
      * points to the connection here
      */
     struct sockptyr_hdl *linked;
 
-    char *onclose, *onerror; /* Tcl scripts to handle events */
+    /* instead of being linked, a connection can be the source or one
+     * of the sinks of a fan-out group ('fan'); a sink also has the next
+     * sink in the group, the number of bytes at the end of the source's
+     * buffer that it has yet to send, and whether it's had data dropped
+     * for being slow (with "-policy drop") and not caught up since
+     */
+    struct sockptyr_fan *fan;
+    struct sockptyr_hdl *fan_next;
+    int fan_lag, fan_slow;
+
+    /* what's received on it is also recorded in 'sbk', if it has one;
+     * and after "sockptyr link -replay" (or "sockptyr fanout -replay")
+     * what was in the scrollback of the connection it's linked to (or
+     * its group's source) gets sent on it first: 'rpl_pos' is how far
+     * it's got, and 'rpl_end' where to stop, counting like 'total' in
+     * struct sockptyr_sbk_hdr.  They're equal when there's nothing to
+     * replay.
+     */
+    struct sockptyr_sbk *sbk;
+    uint64_t rpl_pos, rpl_end;
+
+#if USE_RECORD
+    struct sockptyr_rec *rec; /* "sockptyr record", if it's being done */
+#endif /* USE_RECORD */
+
+    Tcl_Obj *onclose, *onerror; /* Tcl scripts to handle events */
+
+    /* set while "sockptyr connect -async" is still connecting; nothing's
+     * sent or received on the connection until it's done
+     */
+    struct sockptyr_cnct *cnct;
+
+    /* with "sockptyr connect -reconnect", the same as 'cnct' but kept
+     * while connected
+     */
+    struct sockptyr_cnct *rcon;
+};
+
+#if USE_OFFLOAD
+struct sockptyr_offw {
+    /* A worker thread that handles offloaded connections with epoll(7). */
+    struct sockptyr_data *sd; /* global data */
+    int num; /* index in sd->offw[] */
+    Tcl_ThreadId tid; /* the thread */
+    int epfd; /* epoll(7) instance for its connections */
+    int wake[2]; /* pipe used to wake it up when there's a request */
+
+    Tcl_Mutex lock; /* protects the fields below */
+    Tcl_Condition cond; /* signalled when a request is done */
+    int npairs; /* number of linked pairs of connections it has */
+
+    /* A request from the Tcl thread, which then waits for it to be done:
+     *      req -- 'a' to add a pair, 'r' to release a pair, 'x' to exit
+     *      req_hdl -- one of the pair for 'a' & 'r'
+     *      req_done -- set by the worker when done
+     */
+    int req;
+    struct sockptyr_hdl *req_hdl;
+    int req_done;
+};
+
+struct sockptyr_offev {
+    /* Tcl event sent by a worker thread to report sockptyr_conn_io()
+     * finding something in the connection's 'off_ev'
+     */
+    Tcl_Event header;
+    struct sockptyr_hdl *hdl;
+};
+#endif /* USE_OFFLOAD */
+
+#if USE_RECORD
+struct sockptyr_rec {
+    /* A recording made with "sockptyr record" of what's received on a
+     * connection (and maybe what's sent on it), written to a file by
+     * the writer thread, see struct sockptyr_recw.  Once the recording
+     * is stopped it belongs to that thread, which frees it after writing
+     * out what was queued for it.
+     */
+    struct sockptyr_recw *w; /* the writer thread */
+    struct sockptyr_hdl *hdl; /* the connection, for reporting errors */
+    unsigned long gen; /* hdl->gen, in case it's closed & reused first */
+    char *path; /* file it's recorded in */
+    int sent; /* -sent: also record what's sent on it */
+    long rotate; /* -rotate: start a new file after this many bytes */
+    int keep; /* -keep: how many older files to keep when rotating */
+
+    /* These are protected by w->lock:
+     *      cur -- batch being filled, in w's queue; or NULL
+     *      err -- errno value if writing failed; then nothing more is
+     *          recorded
+     *      n_bytes, n_dropped -- bytes recorded; bytes dropped because
+     *          the writer thread fell behind (see record_queue_max)
+     */
+    struct sockptyr_recb *cur;
+    int err;
+    unsigned long n_bytes, n_dropped;
+
+    /* These are only used by the writer thread, after the Tcl thread has
+     * opened the file:
+     *      fd -- the file
+     *      written -- bytes in it
+     *      dirty -- written to since the last fsync()
+     *      synced -- time of the last fsync(), in milliseconds
+     *      listed, done, wnext -- in the writer's list of recordings;
+     *          finished with; next in that list
+     */
+    int fd;
+    long written;
+    int dirty;
+    long long synced;
+    int listed, done;
+    struct sockptyr_rec *wnext;
+};
+
+struct sockptyr_recb {
+    /* A batch of records, in the format described for "sockptyr record"
+     * in sockptyr-tcl-api.txt, queued for the writer thread; 'data' has
+     * room for 'size' bytes and 'len' are used.  If 'last', the
+     * recording is stopped after it's written.
+     */
+    struct sockptyr_rec *rec;
+    unsigned char *data;
+    int len, size, last;
+    struct sockptyr_recb *next;
+};
+
+struct sockptyr_recw {
+    /* The thread that writes "sockptyr record" recordings to their files,
+     * started by the first one.  Connections (in the Tcl thread or the
+     * offload worker threads) queue batches of records for it; it writes
+     * them out when one fills up, or every record_flush_ms, and fsync()s
+     * each file at most every record_fsync_ms.
+     */
+    struct sockptyr_data *sd; /* global data */
+    Tcl_ThreadId tid; /* the thread */
+    Tcl_Mutex lock; /* protects the fields below */
+    Tcl_Condition cond; /* signalled when 'full' or 'exiting' is set */
+    struct sockptyr_recb *head, *tail; /* queue of batches */
+    long queued; /* bytes allocated for them */
+    int full; /* a batch in the queue filled up */
+    int exiting; /* told to write out everything & exit */
+    struct sockptyr_rec *recs; /* recordings it has, only it uses this */
+};
+
+struct sockptyr_recev {
+    /* Tcl event sent by the writer thread when writing a recording
+     * fails, to report it with "sockptyr onerror"
+     */
+    Tcl_Event header;
+    struct sockptyr_data *sd;
+    struct sockptyr_hdl *hdl;
+    unsigned long gen; /* hdl->gen when it was started */
+    int err; /* errno value */
 };
+#endif /* USE_RECORD */
 
 struct sockptyr_lstn {
     /* listen() socket specific information in sockptyr */
     int sok; /* socket file descriptor */
     Tcl_Obj *proc; /* Tcl code to run for each new connection */
+    int paused; /* not accepting for now; see sockptyr_lstn_pause() */
+    Tcl_TimerToken resume; /* to stop being paused */
+    unsigned long n_accepted, n_paused; /* connections accepted; pauses */
 };
 
 struct sockptyr_hdl {
     /* Info about a single handle in sockptyr. */
     struct sockptyr_data *sd; /* global data */
     int num; /* handle number */
+    unsigned long gen; /* generation: different each time it's allocated */
 
     enum usage {
         usage_empty, /* just a placeholder, not counted, available for use */
@@ -160,6 +701,8 @@ struct sockptyr_hdl {
         usage_inot, /* something monitored with "sockptyr inotify" */
 #endif /* USE_INOTIFY */
         usage_lstn, /* a listen() socket created with "sockptyr listen" */
+        usage_proc, /* a process started with "sockptyr spawn" */
+        usage_fan, /* a fan-out group made with "sockptyr fanout" */
     } usage;
 
     union {
@@ -170,17 +713,79 @@ struct sockptyr_hdl {
         struct sockptyr_inot u_inot; /* if usage == usage_inot */
 #endif /* USE_INOTIFY */
         struct sockptyr_lstn u_lstn; /* if usage == usage_lstn */
+        struct sockptyr_proc *u_proc; /* if usage == usage_proc */
+        struct sockptyr_fan *u_fan; /* if usage == usage_fan */
     } u;
 
     /* 'next' & 'prev' put handles with particular 'usage' values into
      * a doubly linked list.  So far used only used for:
      *      usage_inot: list head is inotify_hdls in struct sockptyr_data
      *      usage_empty: list head is empty_hdls in struct sockptyr_data
+     *      usage_lstn: paused ones only; list head is lstn_paused in
+     *          struct sockptyr_data
      */
     struct sockptyr_hdl *next;
     struct sockptyr_hdl *prev;
 };
 
+struct sockptyr_pool {
+    /* Pool of memory for connection buffers, which connections only hold
+     * while there's data in them.  Sorted into size classes (see
+     * POOL_CLASSES) with a list of free buffers for each, linked through
+     * their first bytes.  Worker threads use it too, so it's protected
+     * by 'lock'.
+     */
+    Tcl_Mutex lock;
+    void *free[POOL_CLASSES];
+    int nfree[POOL_CLASSES];
+    /* counts & totals, for "sockptyr info"
+     *      n_used -- buffers being used by connections
+     *      n_gets -- times buffers have been gotten
+     *      n_hits -- times buffers have been gotten from the free lists
+     *      bytes_used -- size of buffers being used
+     *      bytes_free -- size of buffers in the free lists
+     */
+    unsigned long n_used, n_gets, n_hits;
+    long bytes_used, bytes_free;
+};
+
+/* "sockptyr trace" event types, in struct sockptyr_trec 'type' */
+enum sockptyr_trace_type {
+    trace_reg = 1, /* registered with Tcl_CreateFileHandler(); arg = mask */
+    trace_io, /* sockptyr_conn_io() called; arg = mask */
+    trace_read, /* received; len = bytes or -1, arg = pieces of buffer */
+    trace_write, /* sent; likewise */
+    trace_splice_in, /* spliced into its pipe; len = bytes or -1 */
+    trace_splice_out, /* spliced out of the linked one's pipe; likewise */
+    trace_close, /* closed, being reported */
+    trace_error, /* error, being reported */
+    trace_inot_add, /* "sockptyr inotify" watch; arg = watch descriptor */
+    trace_inot_del, /* its handle closed; likewise */
+    trace_inot_ev /* event from inotify(7), num = -1; likewise */
+};
+
+struct sockptyr_trec {
+    /* one "sockptyr trace" record */
+    uint64_t us; /* time, from sockptyr_now_us() */
+    uint32_t num; /* handle number */
+    int32_t len; /* depends on 'type' */
+    uint16_t type; /* enum sockptyr_trace_type */
+    uint16_t err; /* errno value, or 0 */
+    uint32_t arg; /* depends on 'type' */
+};
+
+struct sockptyr_trace {
+    /* "sockptyr trace" ring of records of what's happened, allocated the
+     * first time it's turned on and kept till the end (since worker
+     * threads may be writing in it).  Records go in the slot numbered
+     * by 'next' (mod 'size', a power of two), which is incremented
+     * atomically so the threads don't need a lock.
+     */
+    struct sockptyr_trec *recs;
+    unsigned long size;
+    uint64_t next;
+};
+
 struct sockptyr_data {
     /* state of the whole sockptyr instance on a given interpreter */
 
@@ -188,40 +793,145 @@ struct sockptyr_data {
     struct sockptyr_hdl *empty_hdls; /* handles with usage_empty */
     struct sockptyr_hdl **hdls; /* handles that have been created */
     int ahdls; /* count of entries in hdls[] */
-    int buf_sz; /* value for new connections' buf_sz */
+    /* sockptyr_allocate_handle() growing hdls[]: how many times, how
+     * many of those ckrealloc() moved it, and microseconds taken (total
+     * and longest)
+     */
+    unsigned long n_hdl_grow, n_hdl_moved;
+    long long hdl_grow_us, hdl_grow_max_us;
+    /* buf_* -- connection buffer sizes, see "sockptyr buffer_size"
+     *      buf_sz -- size new connections' buffers start at
+     *      buf_min, buf_max -- range buffers grow & shrink within
+     *      buf_cap -- limit on the buffer memory connections hold (see
+     *          sockptyr_pool_in_use()); 0 for none
+     *      buf_timer -- timer for sockptyr_buf_sweep(), if it's pending
+     */
+    int buf_sz, buf_min, buf_max;
+    long buf_cap;
+    Tcl_TimerToken buf_timer;
+    struct sockptyr_pool pool; /* memory for connection buffers */
+    unsigned char discard[4096]; /* receives unlinked connections' data */
+    int io_budget; /* most bytes sockptyr_conn_io() moves per event */
+
+    /* counts of sockptyr_register_conn_handler() calls that did call
+     * Tcl_CreateFileHandler(), and that didn't since the mask was the same
+     */
+    unsigned long n_reg_done, n_reg_skipped;
+    int n_lstn_paused; /* listen() sockets paused by sockptyr_lstn_pause() */
+    struct sockptyr_hdl *lstn_paused; /* list of them */
+    /* "sockptyr connect -async" connections in progress:
+     *      connect_limit -- most that can be started at once
+     *      n_connecting -- how many are started (struct sockptyr_cnct
+     *          'started' is set)
+     *      cnct_head, cnct_tail -- queue of the rest, in the order given
+     */
+    int connect_limit, n_connecting;
+    struct sockptyr_cnct *cnct_head, *cnct_tail;
+    uint32_t rand; /* state for sockptyr_random() */
+    /* processes from "sockptyr spawn" that haven't been waited for yet;
+     * and whether this is in sockptyr_sigchld_sds, for those without
+     * a pidfd
+     */
+    struct sockptyr_proc *procs;
+    int sigchld;
+    struct sockptyr_data *sigchld_next;
 #if USE_INOTIFY
     int inotify_fd; /* file descriptor for inotify(7) */
     struct sockptyr_hdl *inotify_hdls; /* handles with usage_inot */
+    Tcl_HashTable inotify_wds; /* struct sockptyr_inotw by watch desc. */
+    Tcl_HashTable inotify_flagreps; /* sockptyr_inot_flagrep() results */
+    unsigned long inotify_overflows; /* times the kernel's queue overflowed */
 #endif /* USE_INOTIFY */
+#if USE_OFFLOAD || USE_RECORD
+    Tcl_ThreadId tid; /* thread the interpreter runs in */
+#endif /* USE_OFFLOAD || USE_RECORD */
+#if USE_OFFLOAD
+    int noffw; /* number of worker threads to use */
+    int aoffw; /* number of worker threads started, in offw[] */
+    struct sockptyr_offw **offw;
+#endif /* USE_OFFLOAD */
+#if USE_RECORD
+    struct sockptyr_recw *recw; /* writer thread, once it's started */
+#endif /* USE_RECORD */
+    int trace_on; /* recording in 'trace', see sockptyr_trace() */
+    struct sockptyr_trace trace;
 };
 
+/* SOCKPTYR_TRACE(): Add a record to the "sockptyr trace" ring, if it's
+ * on; see sockptyr_trace().  Costs no more than checking a flag when
+ * it's off.
+ */
+#define SOCKPTYR_TRACE(sd, type, num, len, err, arg) \
+    do { \
+        if ((sd)->trace_on) { \
+            sockptyr_trace((sd), (type), (num), (len), (err), (arg)); \
+        } \
+    } while (0)
+
 static char *sockptyr_errkws_bug[] = { "bug", NULL };
+static char *sockptyr_errkws_fanslow[] = { "fanout", "slow", NULL };
+#if USE_RECORD
+static char *sockptyr_errkws_record[] = { "record", "io", NULL };
+#endif /* USE_RECORD */
 
 static struct sockptyr_hdl *sockptyr_allocate_handle(struct sockptyr_data *sd);
 static struct sockptyr_hdl *sockptyr_lookup_handle(struct sockptyr_data *sd,
-                                                   const char *hdls);
+                                                   Tcl_Obj *obj);
+static Tcl_Obj *sockptyr_handle_obj(struct sockptyr_hdl *hdl);
+static void sockptyr_handle_update_string(Tcl_Obj *obj);
+static int sockptyr_handle_set_from_any(Tcl_Interp *interp, Tcl_Obj *obj);
 static void sockptyr_cleanup(ClientData cd);
 static int sockptyr_cmd(ClientData cd, Tcl_Interp *interp,
-                        int argc, const char *argv[]);
+                        int objc, Tcl_Obj *const objv[]);
 static int sockptyr_cmd_open_pty(ClientData cd, Tcl_Interp *interp,
-                                 int argc, const char *argv[]);
+                                 int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_pty_spawn(ClientData cd, Tcl_Interp *interp,
+                                  int objc, Tcl_Obj *const objv[]);
+static int sockptyr_pty_open(Tcl_Interp *interp, const char *what, int *fdp);
+static void sockptyr_pty_child(int slave, const char *command);
 static int sockptyr_cmd_connect(ClientData cd, Tcl_Interp *interp,
-                                int argc, const char *argv[]);
+                                int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_connect_limit(ClientData cd, Tcl_Interp *interp,
+                                      int objc, Tcl_Obj *const objv[]);
 static int sockptyr_cmd_listen(ClientData cd, Tcl_Interp *interp,
-                               int argc, const char *argv[]);
+                               int objc, Tcl_Obj *const objv[]);
 static int sockptyr_cmd_link(ClientData cd, Tcl_Interp *interp,
-                             int argc, const char *argv[]);
+                             int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_fanout(ClientData cd, Tcl_Interp *interp,
+                               int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_fanout_add(ClientData cd, Tcl_Interp *interp,
+                                   int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_fanout_remove(ClientData cd, Tcl_Interp *interp,
+                                      int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_fanout_sinks(struct sockptyr_data *sd,
+                                     Tcl_Interp *interp,
+                                     int objc, Tcl_Obj *const objv[],
+                                     char *what, int doadd);
+static struct sockptyr_hdl *sockptyr_fan_lookup(struct sockptyr_data *sd,
+                                                Tcl_Interp *interp,
+                                                Tcl_Obj *obj);
+static int sockptyr_cmd_scrollback(ClientData cd, Tcl_Interp *interp,
+                                   int objc, Tcl_Obj *const objv[]);
+#if USE_RECORD
+static int sockptyr_cmd_record(ClientData cd, Tcl_Interp *interp,
+                               int objc, Tcl_Obj *const objv[]);
+#endif /* USE_RECORD */
+static int sockptyr_cmd_scrollback_get(ClientData cd, Tcl_Interp *interp,
+                                       int objc, Tcl_Obj *const objv[]);
 static int sockptyr_cmd_onclose(ClientData cd, Tcl_Interp *interp,
-                                int argc, const char *argv[]);
+                                int objc, Tcl_Obj *const objv[]);
 static int sockptyr_cmd_onerror(ClientData cd, Tcl_Interp *interp,
-                                int argc, const char *argv[]);
+                                int objc, Tcl_Obj *const objv[]);
 static int sockptyr_cmd_onclose_onerror(struct sockptyr_data *sd,
                                         Tcl_Interp *interp,
-                                        int argc, const char *argv[],
+                                        int objc, Tcl_Obj *const objv[],
                                         char *what, int isonerror);
 static int sockptyr_cmd_buffer_size(ClientData cd, Tcl_Interp *interp,
-                                    int argc, const char *argv[]);
-static int sockptyr_cmd_dbg_handles(ClientData cd, Tcl_Interp *interp);
+                                    int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_io_budget(ClientData cd, Tcl_Interp *interp,
+                                  int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_dbg_handles(ClientData cd, Tcl_Interp *interp,
+                                    int objc, Tcl_Obj *const objv[]);
 static void sockptyr_dbg_handles_one(Tcl_Interp *interp,
                                      struct sockptyr_hdl *hdl, int num,
                                      char *err, int errsz);
@@ -231,36 +941,236 @@ static void sockptyr_dbg_handles_lst(Tcl_Interp *interp,
                                      enum usage usage, const char *lbl,
                                      char *err, int errsz);
 static int sockptyr_cmd_info(ClientData cd, Tcl_Interp *interp,
-                             int argc, const char *argv[]);
+                             int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_stats(ClientData cd, Tcl_Interp *interp,
+                              int objc, Tcl_Obj *const objv[]);
+static void sockptyr_stats_add(struct sockptyr_conn *tot,
+                               Tcl_WideInt *buf_tot,
+                               struct sockptyr_conn *conn);
+static void sockptyr_stats_put(Tcl_Obj *d, const char *key, long long val);
 #if USE_INOTIFY
 static int sockptyr_cmd_inotify(ClientData cd, Tcl_Interp *interp,
-                                int argc, const char *argv[]);
+                                int objc, Tcl_Obj *const objv[]);
 #endif /* USE_INOTIFY */
 static int sockptyr_cmd_close(ClientData cd, Tcl_Interp *interp,
-                              int argc, const char *argv[]);
+                              int objc, Tcl_Obj *const objv[]);
 static int sockptyr_cmd_exec(ClientData cd, Tcl_Interp *interp,
-                             int argc, const char *argv[]);
+                             int objc, Tcl_Obj *const objv[]);
+static int sockptyr_cmd_spawn(ClientData cd, Tcl_Interp *interp,
+                              int objc, Tcl_Obj *const objv[]);
+static int sockptyr_spawn_sh(Tcl_Interp *interp, const char *command,
+                             pid_t *child);
+static Tcl_Obj *sockptyr_wstatus_obj(int wstatus);
+static struct sockptyr_hdl *sockptyr_proc_new(struct sockptyr_data *sd,
+                                              pid_t pid, Tcl_Obj *onexit,
+                                              struct sockptyr_hdl *pty);
+#if USE_PIDFD
+static void sockptyr_proc_handler(ClientData cd, int mask);
+#endif /* USE_PIDFD */
+static void sockptyr_proc_exited(struct sockptyr_proc *p, int wstatus);
+static void sockptyr_proc_free(struct sockptyr_proc *p);
+static void sockptyr_sigchld_start(struct sockptyr_data *sd);
+static void sockptyr_sigchld_stop(struct sockptyr_data *sd);
+static void sockptyr_sigchld(int sig);
+static void sockptyr_sigchld_handler(ClientData cd, int mask);
 static void sockptyr_clobber_handle(struct sockptyr_hdl *hdl, int dofree);
 static void sockptyr_init_conn(struct sockptyr_hdl *hdl, int fd, int code);
+static int sockptyr_set_nonblock(int fd);
 static void sockptyr_register_conn_handler(struct sockptyr_hdl *hdl);
 static void sockptyr_conn_handler(ClientData cd, int mask);
+static int sockptyr_conn_io(struct sockptyr_hdl *hdl, int mask,
+                            struct sockptyr_ioev *ev);
+static int sockptyr_conn_recv(struct sockptyr_hdl *hdl, int *blocked,
+                              struct sockptyr_ioev *ev);
+static int sockptyr_conn_send(struct sockptyr_hdl *hdl, int *blocked,
+                              struct sockptyr_ioev *ev);
+static int sockptyr_conn_writev(struct sockptyr_hdl *hdl,
+                                struct iovec *iov, int niov, int *blocked,
+                                struct sockptyr_ioev *ev);
+static void sockptyr_conn_consumed(struct sockptyr_data *sd,
+                                   struct sockptyr_conn *conn, int n);
+static void sockptyr_conn_ioev(struct sockptyr_ioev *ev);
+#if USE_SPLICE
+static int sockptyr_conn_splice_recv(struct sockptyr_hdl *hdl, int *blocked,
+                                     struct sockptyr_ioev *ev);
+static int sockptyr_conn_splice_send(struct sockptyr_hdl *hdl, int *blocked,
+                                     struct sockptyr_ioev *ev);
+#endif /* USE_SPLICE */
 static void sockptyr_lstn_handler(ClientData cd, int mask);
+static void sockptyr_lstn_pause(struct sockptyr_hdl *hdl, int ms);
+static void sockptyr_lstn_resume_timer(ClientData cd);
+static void sockptyr_lstn_resume(struct sockptyr_hdl *hdl);
+static void sockptyr_lstn_resume_all(struct sockptyr_data *sd);
 static void sockptyr_conn_unlink(struct sockptyr_hdl *hdl);
+static void sockptyr_fan_join(struct sockptyr_fan *fan,
+                              struct sockptyr_hdl *hdl, int issrc,
+                              int replay);
+static void sockptyr_fan_leave(struct sockptyr_hdl *hdl);
+static void sockptyr_fan_detach(struct sockptyr_hdl *hdl);
+static void sockptyr_fan_register(struct sockptyr_fan *fan);
+static int sockptyr_fan_pending(struct sockptyr_hdl *hdl);
+static void sockptyr_fan_received(struct sockptyr_fan *fan, int n);
+static void sockptyr_fan_sync(struct sockptyr_fan *fan);
+static int sockptyr_fan_data(struct sockptyr_conn *conn, int lag,
+                             struct iovec *iov);
+static int sockptyr_fan_send(struct sockptyr_hdl *hdl, int *blocked,
+                             struct sockptyr_ioev *ev);
+static int sockptyr_fan_push(struct sockptyr_hdl *hdl, int *blocked,
+                             struct sockptyr_ioev *ev);
+static void sockptyr_fan_slow(ClientData cd);
+static void sockptyr_fan_drop(struct sockptyr_fan *fan, int known);
+static struct sockptyr_sbk *sockptyr_sbk_open(Tcl_Interp *interp,
+                                              long size, const char *path);
+static void sockptyr_sbk_free(struct sockptyr_sbk *sbk);
+static int sockptyr_sbk_space(struct sockptyr_sbk *sbk, struct iovec *iov);
+static void sockptyr_sbk_append(struct sockptyr_sbk *sbk,
+                                struct iovec *iov, int n);
+static void sockptyr_sbk_rewind(struct sockptyr_hdl *hdl);
+static int sockptyr_sbk_replay(struct sockptyr_hdl *hdl, int *blocked,
+                               struct sockptyr_ioev *ev);
+#if USE_RECORD
+static struct sockptyr_recw *sockptyr_rec_writer(struct sockptyr_data *sd);
+static int sockptyr_rec_open(struct sockptyr_rec *rec, int trunc);
+static void sockptyr_rec_add(struct sockptyr_rec *rec, struct iovec *iov,
+                             int n, int sent);
+static void sockptyr_rec_stop(struct sockptyr_rec *rec);
+static void sockptyr_rec_shutdown(struct sockptyr_data *sd);
+static Tcl_ThreadCreateType sockptyr_recw_main(ClientData cd);
+static void sockptyr_recw_write(struct sockptyr_recw *w,
+                                struct sockptyr_recb *b);
+static int sockptyr_recw_rotate(struct sockptyr_rec *rec);
+static void sockptyr_recw_fail(struct sockptyr_recw *w,
+                               struct sockptyr_rec *rec, int err);
+static int sockptyr_rec_evproc(Tcl_Event *evp, int flags);
+static int sockptyr_rec_evdel(Tcl_Event *evp, ClientData cd);
+#endif /* USE_RECORD */
+static void sockptyr_cnct_start(struct sockptyr_hdl *hdl);
+static void sockptyr_cnct_next(struct sockptyr_data *sd);
+static void sockptyr_cnct_queue(struct sockptyr_data *sd,
+                                struct sockptyr_cnct *c);
+static void sockptyr_cnct_unqueue(struct sockptyr_data *sd,
+                                  struct sockptyr_cnct *c);
+static void sockptyr_cnct_try(struct sockptyr_hdl *hdl);
+static void sockptyr_cnct_retry_timer(ClientData cd);
+static void sockptyr_cnct_writable(ClientData cd, int mask);
+static void sockptyr_cnct_deadline(ClientData cd);
+static void sockptyr_cnct_done(struct sockptyr_hdl *hdl, int err);
+static int sockptyr_cnct_socket(void);
+static int sockptyr_cnct_backoff(struct sockptyr_hdl *hdl, int *err);
+static void sockptyr_cnct_backoff_timer(ClientData cd);
+static void sockptyr_cnct_lost(struct sockptyr_hdl *hdl, const char *why);
+static uint32_t sockptyr_random(struct sockptyr_data *sd);
+static void sockptyr_cnct_report(ClientData cd);
+static void sockptyr_cnct_cancel(struct sockptyr_hdl *hdl);
+static int sockptyr_conn_can_recv(struct sockptyr_conn *conn);
+static int sockptyr_ring_space(struct sockptyr_conn *conn, struct iovec *iov);
+static int sockptyr_ring_data(struct sockptyr_conn *conn, struct iovec *iov);
+static int sockptyr_conn_has_data(struct sockptyr_conn *conn);
+static void sockptyr_conn_grow(struct sockptyr_hdl *hdl);
+static void sockptyr_conn_resize(struct sockptyr_hdl *hdl, int sz);
+static void sockptyr_buf_sweep(ClientData cd);
+static void sockptyr_buf_sweep_arm(struct sockptyr_data *sd);
+static void sockptyr_conn_drained(struct sockptyr_data *sd,
+                                  struct sockptyr_conn *conn);
+static int sockptyr_pool_class(int sz);
+static void *sockptyr_pool_get(struct sockptyr_data *sd, int sz);
+static void sockptyr_pool_put(struct sockptyr_data *sd, void *buf, int sz);
+static void sockptyr_pool_cleanup(struct sockptyr_data *sd);
+static long sockptyr_pool_in_use(struct sockptyr_data *sd);
+#if USE_SPLICE
+static void sockptyr_conn_splice_start(struct sockptyr_hdl *hdl);
+static void sockptyr_conn_splice_stop(struct sockptyr_conn *conn);
+#endif /* USE_SPLICE */
 static void sockptyr_conn_event(struct sockptyr_hdl *hdl,
                                 char **errkws, char *errstr);
-static void sockptyr_conn_event_sys(struct sockptyr_hdl *hdl,
-                                    int e, int blocking);
+static void sockptyr_conn_event_sys(struct sockptyr_hdl *hdl, int e);
+#if USE_OFFLOAD
+static int sockptyr_cmd_offload_threads(ClientData cd, Tcl_Interp *interp,
+                                        int objc, Tcl_Obj *const objv[]);
+static struct sockptyr_offw *sockptyr_offload_pick(struct sockptyr_data *sd);
+static void sockptyr_offload_start(struct sockptyr_offw *w,
+                                   struct sockptyr_hdl *hdl);
+static void sockptyr_offload_reclaim(struct sockptyr_hdl *hdl);
+static void sockptyr_offload_request(struct sockptyr_offw *w, int req,
+                                     struct sockptyr_hdl *hdl);
+static void sockptyr_offload_shutdown(struct sockptyr_data *sd);
+static Tcl_ThreadCreateType sockptyr_offw_main(ClientData cd);
+static void sockptyr_offw_update(struct sockptyr_offw *w,
+                                 struct sockptyr_hdl *hdl);
+static void sockptyr_offw_stop(struct sockptyr_offw *w,
+                               struct sockptyr_ioev *ev);
+static int sockptyr_offload_evproc(Tcl_Event *evp, int flags);
+static int sockptyr_offload_evdel(Tcl_Event *evp, ClientData cd);
+#endif /* USE_OFFLOAD */
+static void sockptyr_conn_count_in(struct sockptyr_conn *conn, int n,
+                                   int fill, int full);
+static void sockptyr_lat_in(struct sockptyr_lat *lat, int n, int wasempty);
+static void sockptyr_lat_out(struct sockptyr_lat *lat, int n);
+static int sockptyr_lat_bucket(uint64_t us);
+static uint64_t sockptyr_lat_value(int bucket);
+static uint64_t sockptyr_lat_percentile(struct sockptyr_lat *lat,
+                                        double pct);
+static long long sockptyr_now_ms(void);
+static long long sockptyr_now_us(void);
+static int sockptyr_cmd_trace(ClientData cd, Tcl_Interp *interp,
+                              int objc, Tcl_Obj *const objv[]);
+static int sockptyr_trace_dump(Tcl_Interp *interp, struct sockptyr_data *sd,
+                               const char *path);
+static void sockptyr_trace(struct sockptyr_data *sd, int type, int num,
+                           int len, int err, int arg);
+static void sockptyr_put_le(unsigned char *p, uint64_t v, int n);
 static void sockptyr_lst_insert(struct sockptyr_hdl **head,
                                 struct sockptyr_hdl *hdl);
 static void sockptyr_lst_remove(struct sockptyr_hdl **head,
                                 struct sockptyr_hdl *hdl);
 #if USE_INOTIFY
 static void sockptyr_inot_handler(ClientData cd, int mask);
-static Tcl_Obj *sockptyr_inot_flagrep(Tcl_Interp *interp, uint32_t flags);
+static void sockptyr_inot_event(struct sockptyr_data *sd,
+                                struct inotify_event *ie);
+static void sockptyr_inot_dispatch(struct sockptyr_data *sd,
+                                   struct sockptyr_inotw *w,
+                                   uint32_t mask, uint32_t cookie,
+                                   const char *name, int namelen,
+                                   int unserved);
+static void sockptyr_inot_run(struct sockptyr_hdl *hdl,
+                              uint32_t mask, uint32_t cookie,
+                              const char *name, int namelen);
+static void sockptyr_inot_hold(struct sockptyr_hdl *hdl,
+                               uint32_t mask, uint32_t cookie,
+                               const char *name);
+static void sockptyr_inot_timer(ClientData cd);
+static void sockptyr_inot_flush(struct sockptyr_hdl *hdl, const char *name);
+static void sockptyr_inot_pend_free(struct sockptyr_hdl *hdl, int dofree);
+static void sockptyr_inot_overflow(struct sockptyr_data *sd);
+static struct sockptyr_inotp *sockptyr_inot_diff(struct sockptyr_inotp *diffs,
+                                                 uint32_t mask, const char *n);
+static int sockptyr_inot_scan(const char *path, Tcl_HashTable *names);
+static void sockptyr_inot_names_free(struct sockptyr_inotw *w);
+static void sockptyr_inot_release(struct sockptyr_data *sd,
+                                  struct sockptyr_inotw *w);
+static Tcl_Obj *sockptyr_inot_flagrep(struct sockptyr_data *sd,
+                                      uint32_t flags);
 static void sockptyr_inotify_fatal_error(struct sockptyr_data *sd,
                                          const char *fmt, ...);
 #endif /* USE_INOTIFY */
 
+/* Handles are strings of the form "sockptyr_${num}_${gen}" where $num is
+ * the handle number, an index into sd->hdls[], and $gen its generation.
+ * The generation is different every time a handle is allocated (even
+ * across interpreters) so that if a handle number is reused, strings
+ * referring to its old use won't be taken as referring to the new one.
+ * Tcl_Obj's that have been looked up as handles get this type, and
+ * remember the number & generation so they needn't be parsed again:
+ * internalRep.ptrAndLongRep.ptr is the number, .value the generation.
+ */
+static const Tcl_ObjType sockptyr_handle_type = {
+    "sockptyr_handle",
+    NULL, /* freeIntRepProc: nothing to free */
+    NULL, /* dupIntRepProc: copy internalRep as is */
+    &sockptyr_handle_update_string,
+    &sockptyr_handle_set_from_any
+};
+
 /*
  * Sockptyr_Init() -- The only external interface of "sockptyr_core.c" this
  * is run when you do "load $filename sockptyr" in Tcl.  It in turn registers
@@ -278,58 +1188,110 @@ int Sockptyr_Init(Tcl_Interp *interp)
     sd->hdls = NULL;
     sd->ahdls = 0;
     sd->empty_hdls = NULL;
+    sd->lstn_paused = NULL;
     sd->interp = interp;
-    sd->buf_sz = buf_sz;
+    sd->buf_sz = sd->buf_min = buf_sz;
+    sd->buf_max = buf_max;
+    sd->buf_cap = 0;
+    sd->buf_timer = NULL;
+    sd->io_budget = io_budget;
+    sd->connect_limit = connect_limit;
+    sd->n_connecting = 0;
+    sd->cnct_head = sd->cnct_tail = NULL;
+    sd->rand = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    if (sd->rand == 0) {
+        sd->rand = 1; /* sockptyr_random() would get stuck on 0 */
+    }
+    sd->procs = NULL;
+    sd->sigchld = 0;
 #if USE_INOTIFY
     sd->inotify_fd = -1;
     sd->inotify_hdls = NULL;
+    Tcl_InitHashTable(&(sd->inotify_wds), TCL_ONE_WORD_KEYS);
+    Tcl_InitHashTable(&(sd->inotify_flagreps), TCL_ONE_WORD_KEYS);
 #endif /* USE_INOTIFY */
-
-    Tcl_CreateCommand(interp, "sockptyr",
-                      &sockptyr_cmd, sd, &sockptyr_cleanup);
+#if USE_OFFLOAD || USE_RECORD
+    sd->tid = Tcl_GetCurrentThread();
+#endif /* USE_OFFLOAD || USE_RECORD */
+#if USE_OFFLOAD
+    sd->noffw = offload_threads;
+    sd->aoffw = 0;
+    sd->offw = NULL;
+#endif /* USE_OFFLOAD */
+#if USE_RECORD
+    sd->recw = NULL;
+#endif /* USE_RECORD */
+    sd->trace_on = 0;
+    sd->trace.recs = NULL;
+    sd->trace.size = 0;
+    sd->trace.next = 0;
+
+    Tcl_CreateObjCommand(interp, "sockptyr",
+                         &sockptyr_cmd, sd, &sockptyr_cleanup);
     return(TCL_OK);
 }
 
+/* The "sockptyr" subcommands, for sockptyr_cmd() to look up with
+ * Tcl_GetIndexFromObjStruct(); that caches the result in the subcommand
+ * name's Tcl_Obj, so a script that runs the same subcommand over and
+ * over doesn't search this each time.  Each gets its arguments after
+ * "sockptyr $subcommand".
+ */
+static const struct sockptyr_subcmd {
+    const char *name;
+    Tcl_ObjCmdProc *proc;
+} sockptyr_subcmds[] = {
+    { "buffer_size", &sockptyr_cmd_buffer_size },
+    { "close", &sockptyr_cmd_close },
+    { "connect", &sockptyr_cmd_connect },
+    { "connect_limit", &sockptyr_cmd_connect_limit },
+    { "dbg_handles", &sockptyr_cmd_dbg_handles },
+    { "exec", &sockptyr_cmd_exec },
+    { "fanout", &sockptyr_cmd_fanout },
+    { "fanout_add", &sockptyr_cmd_fanout_add },
+    { "fanout_remove", &sockptyr_cmd_fanout_remove },
+    { "info", &sockptyr_cmd_info },
+#if USE_INOTIFY
+    { "inotify", &sockptyr_cmd_inotify },
+#endif /* USE_INOTIFY */
+    { "io_budget", &sockptyr_cmd_io_budget },
+    { "link", &sockptyr_cmd_link },
+    { "listen", &sockptyr_cmd_listen },
+#if USE_OFFLOAD
+    { "offload_threads", &sockptyr_cmd_offload_threads },
+#endif /* USE_OFFLOAD */
+    { "onclose", &sockptyr_cmd_onclose },
+    { "onerror", &sockptyr_cmd_onerror },
+    { "open_pty", &sockptyr_cmd_open_pty },
+    { "pty_spawn", &sockptyr_cmd_pty_spawn },
+#if USE_RECORD
+    { "record", &sockptyr_cmd_record },
+#endif /* USE_RECORD */
+    { "scrollback", &sockptyr_cmd_scrollback },
+    { "scrollback_get", &sockptyr_cmd_scrollback_get },
+    { "spawn", &sockptyr_cmd_spawn },
+    { "stats", &sockptyr_cmd_stats },
+    { "trace", &sockptyr_cmd_trace },
+    { NULL, NULL }
+};
+
 /* sockptyr_cmd() -- handle the "sockptyr" command invoked in Tcl.
  */
 static int sockptyr_cmd(ClientData cd, Tcl_Interp *interp,
-                        int argc, const char *argv[])
+                        int objc, Tcl_Obj *const objv[])
 {
-    if (argc < 2) {
-        Tcl_SetResult(interp,
-                      "wrong # args: should be"
-                      " \"sockptyr subcommand ?arg ...\"", TCL_STATIC);
+    int idx;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?arg ...?");
         return(TCL_ERROR);
-    } else if (!strcmp(argv[1], "open_pty")) {
-        return(sockptyr_cmd_open_pty(cd, interp, argc - 2, argv + 2));
-    } else if (!strcmp(argv[1], "connect")) {
-        return(sockptyr_cmd_connect(cd, interp, argc - 2, argv + 2));
-    } else if (!strcmp(argv[1], "listen")) {
-        return(sockptyr_cmd_listen(cd, interp, argc - 2, argv + 2));
-    } else if (!strcmp(argv[1], "link")) {
-        return(sockptyr_cmd_link(cd, interp, argc - 2, argv + 2));
-    } else if (!strcmp(argv[1], "onclose")) {
-        return(sockptyr_cmd_onclose(cd, interp, argc - 2, argv + 2));
-    } else if (!strcmp(argv[1], "onerror")) {
-        return(sockptyr_cmd_onerror(cd, interp, argc - 2, argv + 2));
-    } else if (!strcmp(argv[1], "close")) {
-        return(sockptyr_cmd_close(cd, interp, argc - 2, argv + 2));
-    } else if (!strcmp(argv[1], "buffer_size")) {
-        return(sockptyr_cmd_buffer_size(cd, interp, argc - 2, argv + 2));
-    } else if (!strcmp(argv[1], "exec")) {
-        return(sockptyr_cmd_exec(cd, interp, argc - 2, argv + 2));
-    } else if (!strcmp(argv[1], "info")) {
-        return(sockptyr_cmd_info(cd, interp, argc - 2, argv + 2));
-#if USE_INOTIFY
-    } else if (!strcmp(argv[1], "inotify")) {
-        return(sockptyr_cmd_inotify(cd, interp, argc - 2, argv + 2));
-#endif /* USE_INOTIFY */
-    } else if (!strcmp(argv[1], "dbg_handles")) {
-        return(sockptyr_cmd_dbg_handles(cd, interp));
-    } else {
-        Tcl_SetResult(interp, "unknown subcommand", TCL_STATIC);
+    }
+    if (Tcl_GetIndexFromObjStruct(interp, objv[1], sockptyr_subcmds,
+                                  sizeof(sockptyr_subcmds[0]), "subcommand",
+                                  TCL_EXACT, &idx) != TCL_OK) {
         return(TCL_ERROR);
     }
+    return(sockptyr_subcmds[idx].proc(cd, interp, objc - 2, objv + 2));
 }
 
 /* sockptyr_cleanup() -- free a 'struct sockptyr_data' and everything that goes
@@ -339,6 +1301,29 @@ static void sockptyr_cleanup(ClientData cd)
 {
     struct sockptyr_data *sd = cd;
     int i;
+#if USE_INOTIFY
+    Tcl_HashEntry *he;
+    Tcl_HashSearch hs;
+#endif /* USE_INOTIFY */
+
+    if (sd->buf_timer) {
+        Tcl_DeleteTimerHandler(sd->buf_timer);
+        sd->buf_timer = NULL;
+    }
+
+    /* so clobbering a connection that's connecting won't start another */
+    sd->connect_limit = 0;
+
+#if USE_OFFLOAD
+    /* get all the connections back from worker threads, and stop them */
+    for (i = 0; i < sd->ahdls; ++i) {
+        if (sd->hdls[i]->usage == usage_conn) {
+            sockptyr_offload_reclaim(sd->hdls[i]);
+        }
+    }
+    Tcl_DeleteEvents(&sockptyr_offload_evdel, (ClientData)sd);
+    sockptyr_offload_shutdown(sd);
+#endif /* USE_OFFLOAD */
 
     for (i = 0; i < sd->ahdls; ++i) {
         sockptyr_clobber_handle(sd->hdls[i], 1);
@@ -349,12 +1334,41 @@ static void sockptyr_cleanup(ClientData cd)
     }
     sd->hdls = NULL;
     sd->ahdls = 0;
+    sockptyr_pool_cleanup(sd);
+#if USE_RECORD
+    /* the connections' recordings were stopped, now finish writing them */
+    sockptyr_rec_shutdown(sd);
+#endif /* USE_RECORD */
+    sd->trace_on = 0;
+    if (sd->trace.recs) {
+        ckfree((void *)sd->trace.recs); /* worker threads are gone */
+        sd->trace.recs = NULL;
+    }
+
+    /* "sockptyr spawn" processes still running: let Tcl wait for them
+     * (in Tcl_ReapDetachedProcs()) since we won't be around
+     */
+    while (sd->procs != NULL) {
+        struct sockptyr_proc *p = sd->procs;
+        Tcl_Pid pid = (Tcl_Pid)(intptr_t)p->pid;
+
+        sd->procs = p->next;
+        Tcl_DetachPids(1, &pid);
+        sockptyr_proc_free(p);
+    }
+    sockptyr_sigchld_stop(sd);
 #if USE_INOTIFY
     if (sd->inotify_fd >= 0) {
         Tcl_DeleteFileHandler(sd->inotify_fd);
         close(sd->inotify_fd);
         sd->inotify_fd = -1;
     }
+    Tcl_DeleteHashTable(&(sd->inotify_wds)); /* emptied by clobbering */
+    for (he = Tcl_FirstHashEntry(&(sd->inotify_flagreps), &hs);
+         he != NULL; he = Tcl_NextHashEntry(&hs)) {
+        Tcl_DecrRefCount((Tcl_Obj *)Tcl_GetHashValue(he));
+    }
+    Tcl_DeleteHashTable(&(sd->inotify_flagreps));
 #endif /* USE_INOTIFY */
     ckfree((void *)sd);
 }
@@ -363,71 +1377,309 @@ static void sockptyr_cleanup(ClientData cd)
  * and file pathname.
  */
 static int sockptyr_cmd_open_pty(ClientData cd, Tcl_Interp *interp,
-                                 int argc, const char *argv[])
+                                 int objc, Tcl_Obj *const objv[])
 {
     struct sockptyr_data *sd = cd;
     struct sockptyr_hdl *hdl;
-    char rb[128];
+    Tcl_Obj *rv[2];
     int fd;
 
-    if (argc != 0) {    
+    if (objc != 0) {    
         Tcl_SetResult(interp, "usage: sockptyr open_pty", TCL_STATIC);
         return(TCL_ERROR);
     }
 
-    /* get a handle we can use for our result */
+    /* open the PTY and set it up for use */
+    if (sockptyr_pty_open(interp, "open_pty", &fd) != TCL_OK) {
+        return(TCL_ERROR);
+    }
+
+    /* return a handle string that leads back to 'hdl'; and the PTY filename */
+    hdl = sockptyr_allocate_handle(sd);
+    sockptyr_init_conn(hdl, fd, 'p');
+    rv[0] = sockptyr_handle_obj(hdl);
+    rv[1] = Tcl_NewStringObj(ptsname(fd), -1);
+    Tcl_SetObjResult(interp, Tcl_NewListObj(2, rv));
+    return(TCL_OK);
+}
+
+/* Tcl command "sockptyr pty_spawn" -- Open a PTY, and execute a command
+ * in the shell with the PTY as its controlling terminal and its stdin,
+ * stdout & stderr.  Return a connection handle for the PTY and a process
+ * handle (as from "sockptyr spawn") for the process.
+ *
+ * Parameters:
+ *      -onexit $proc: as in "sockptyr spawn"
+ *      command: shell command to execute
+ */
+static int sockptyr_cmd_pty_spawn(ClientData cd, Tcl_Interp *interp,
+                                  int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    struct sockptyr_hdl *hdl;
+    Tcl_Obj *onexit = NULL, *rv[2];
+    const char *command;
+    int fd, slave;
+    pid_t child;
+
+    if (objc == 3 && !strcmp(Tcl_GetString(objv[0]), "-onexit")) {
+        onexit = objv[1];
+        objc -= 2;
+        objv += 2;
+    }
+    if (objc != 1) {
+        Tcl_SetResult(interp, "usage: sockptyr pty_spawn ?-onexit $proc?"
+                      " $command", TCL_STATIC);
+        return(TCL_ERROR);
+    }
+
+    /* get the string now: the child mustn't call into Tcl after fork() */
+    command = Tcl_GetString(objv[0]);
+
+    if (sockptyr_pty_open(interp, "pty_spawn", &fd) != TCL_OK) {
+        return(TCL_ERROR);
+    }
+
+    /* Get the other end, the "slave" side, for the child process; if
+     * possible straight from 'fd' rather than by looking up its name.
+     */
+    slave = -1;
+#ifdef TIOCGPTPEER
+    slave = ioctl(fd, TIOCGPTPEER, O_RDWR | O_NOCTTY | O_CLOEXEC);
+#endif /* TIOCGPTPEER */
+    if (slave < 0) {
+        slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+        if (slave >= 0) {
+            fcntl(slave, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    if (slave < 0) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("sockptyr pty_spawn:"
+                                       " opening PTY slave failed: %s",
+                                       strerror(errno)));
+        close(fd);
+        return(TCL_ERROR);
+    }
+
+    /* Start the process.  posix_spawn() has no way to give it a
+     * controlling terminal, so this uses fork().
+     */
+    child = fork();
+    if (child < 0) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("fork failed: %s",
+                                       strerror(errno)));
+        close(slave);
+        close(fd);
+        return(TCL_ERROR);
+    } else if (child == 0) {
+        sockptyr_pty_child(slave, command);
+    }
+    close(slave);
+
+    /* Once the process, and anything else it leaves with the terminal
+     * open, is done with it, receiving from 'fd' fails with EIO.
+     */
     hdl = sockptyr_allocate_handle(sd);
+    sockptyr_init_conn(hdl, fd, 'p');
+    hdl->u.u_conn.eio_closed = 1;
+    rv[0] = sockptyr_handle_obj(hdl);
+    rv[1] = sockptyr_handle_obj(sockptyr_proc_new(sd, child, onexit, NULL));
+    Tcl_SetObjResult(interp, Tcl_NewListObj(2, rv));
+    return(TCL_OK);
+}
+
+/* sockptyr_pty_open(): Open a PTY, for "sockptyr $what", ready to be used
+ * as a connection: fills in '*fdp' with the file descriptor for its
+ * "master" side and returns TCL_OK; or leaves an error message in 'interp'
+ * and returns TCL_ERROR.
+ */
+static int sockptyr_pty_open(Tcl_Interp *interp, const char *what, int *fdp)
+{
+    int fd;
 
-    /* and open the PTY and set it up for use */
     fd = posix_openpt(O_RDWR | O_NOCTTY);
     if (fd < 0) {
         Tcl_SetObjResult(interp,
-                         Tcl_ObjPrintf("sockptyr open_pty:"
+                         Tcl_ObjPrintf("sockptyr %s:"
                                        " posix_openpt() failed: %s",
-                                       strerror(errno)));
+                                       what, strerror(errno)));
         return(TCL_ERROR);
     }
     if (grantpt(fd) < 0) {
         Tcl_SetObjResult(interp,
-                         Tcl_ObjPrintf("sockptyr open_pty:"
+                         Tcl_ObjPrintf("sockptyr %s:"
                                        " grantpt() failed: %s",
-                                       strerror(errno)));
+                                       what, strerror(errno)));
         close(fd);
         return(TCL_ERROR);
     }
     if (unlockpt(fd) < 0) {
         Tcl_SetObjResult(interp,
-                         Tcl_ObjPrintf("sockptyr open_pty:"
+                         Tcl_ObjPrintf("sockptyr %s:"
                                        " unlockpt() failed: %s",
-                                       strerror(errno)));
+                                       what, strerror(errno)));
         close(fd);
         return(TCL_ERROR);
     }
-
-    /* return a handle string that leads back to 'hdl'; and the PTY filename */
-    sockptyr_init_conn(hdl, fd, 'p');
-    snprintf(rb, sizeof(rb), "%s%d %s",
-             handle_prefix, (int)hdl->num, ptsname(fd));
-    Tcl_SetResult(interp, rb, TCL_VOLATILE);
+    if (sockptyr_set_nonblock(fd) < 0 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("sockptyr %s:"
+                                       " fcntl() failed: %s",
+                                       what, strerror(errno)));
+        close(fd);
+        return(TCL_ERROR);
+    }
+    *fdp = fd;
     return(TCL_OK);
 }
 
+/* sockptyr_pty_child(): In the child process of "sockptyr pty_spawn",
+ * make PTY slave 'slave' its controlling terminal and its stdin, stdout &
+ * stderr, close other file descriptors, and run 'command' via the shell.
+ * Doesn't return.
+ */
+static void sockptyr_pty_child(int slave, const char *command)
+{
+    int fd;
+#if !USE_SPAWN_CLOSEFROM
+    int maxfd;
+#endif /* !USE_SPAWN_CLOSEFROM */
+
+    /* a new session, of which the PTY is the controlling terminal */
+    setsid();
+    ioctl(slave, TIOCSCTTY, 0);
+
+    for (fd = STDIN_FILENO; fd <= STDERR_FILENO; ++fd) {
+        if (fd != slave) {
+            dup2(slave, fd);
+        } else {
+            fcntl(fd, F_SETFD, 0); /* keep it after exec */
+        }
+    }
+
+    /* close file descriptors other than stdin/stderr/stdout */
+#if USE_SPAWN_CLOSEFROM
+    closefrom(STDERR_FILENO + 1);
+#else /* USE_SPAWN_CLOSEFROM */
+    maxfd = sysconf(_SC_OPEN_MAX);
+    for (fd = STDERR_FILENO + 1; fd < maxfd; ++fd) {
+        close(fd);
+    }
+#endif /* USE_SPAWN_CLOSEFROM */
+
+    /* run $command via the shell */
+    execl("/bin/sh", "sh", "-c", command, NULL);
+
+    /* execl() should never return, if it does it indicates a serious
+     * problem
+     */
+    fprintf(stderr, "Unable to run shell?!\n");
+    _exit(1);
+}
+
 /* Tcl command "sockptyr connect" -- Connect to a unix domain stream socket
  * given by pathname.  Return handle for the connection.
+ *
+ * Parameters:
+ *      -async: return the handle right away, and finish connecting from
+ *          the event loop; nothing's sent or received on it till then
+ *      -command $proc: required with -async; Tcl script to execute when
+ *          done, after appending three words:
+ *              the handle
+ *              "ok", "error", or with -reconnect "lost"
+ *              error message, empty if "ok"
+ *          On error the handle has already been closed.
+ *      -timeout $ms: with -async, give up after this many milliseconds,
+ *          counting time spent waiting for "sockptyr connect_limit"
+ *      -attempts $n: with -async, how many times to try connect() before
+ *          giving up, 0 for no limit; default 1
+ *      -backoff {$first_ms $max_ms}: with -async, how long to wait
+ *          between attempts: starting at $first_ms and doubling up to
+ *          $max_ms, each randomly shortened by up to half
+ *      -reconnect: with -async, when the connection is lost, connect
+ *          again instead of running "sockptyr onclose" or "sockptyr
+ *          onerror" scripts; it keeps its handle & linkage
+ *      path: filename/address of the socket to connect to
  */
 static int sockptyr_cmd_connect(ClientData cd, Tcl_Interp *interp,
-                                int argc, const char *argv[])
+                                int objc, Tcl_Obj *const objv[])
 {
     struct sockptyr_data *sd = cd;
     struct sockptyr_hdl *hdl;
+    struct sockptyr_cnct *c;
     struct sockaddr_un sa;
-    char rb[128];
-    int fd, l;
-
-    if (argc != 1) {
-        Tcl_SetResult(interp, "usage: sockptyr connect $path", TCL_STATIC);
+    Tcl_Obj *proc = NULL, **bov;
+    const char *path, *opt;
+    int fd, l, bc, async = 0, asyncopt = 0, timeout = 0, attempts = 1;
+    int backoff_first = connect_backoff_ms;
+    int backoff_max = connect_backoff_max_ms, reconnect = 0;
+
+    for (; objc > 1; --objc, ++objv) {
+        opt = Tcl_GetString(objv[0]);
+        if (!strcmp(opt, "-async")) {
+            async = 1;
+        } else if (!strcmp(opt, "-reconnect")) {
+            reconnect = asyncopt = 1;
+        } else if (!strcmp(opt, "-command") && objc > 2) {
+            proc = objv[1];
+            asyncopt = 1;
+            --objc;
+            ++objv;
+        } else if ((!strcmp(opt, "-timeout") || !strcmp(opt, "-attempts"))
+                   && objc > 2) {
+            if (Tcl_GetIntFromObj(interp, objv[1],
+                                  opt[1] == 't' ? &timeout : &attempts)
+                != TCL_OK) {
+                return(TCL_ERROR);
+            }
+            if (timeout < 0 || attempts < 0) {
+                Tcl_SetObjResult(interp,
+                                 Tcl_ObjPrintf("%s must not be negative",
+                                               opt + 1));
+                return(TCL_ERROR);
+            }
+            asyncopt = 1;
+            --objc;
+            ++objv;
+        } else if (!strcmp(opt, "-backoff") && objc > 2) {
+            if (Tcl_ListObjGetElements(interp, objv[1], &bc, &bov)
+                != TCL_OK) {
+                return(TCL_ERROR);
+            }
+            if (bc != 2) {
+                Tcl_SetResult(interp, "-backoff takes {$first_ms $max_ms}",
+                              TCL_STATIC);
+                return(TCL_ERROR);
+            }
+            if (Tcl_GetIntFromObj(interp, bov[0], &backoff_first)
+                != TCL_OK ||
+                Tcl_GetIntFromObj(interp, bov[1], &backoff_max)
+                != TCL_OK) {
+                return(TCL_ERROR);
+            }
+            if (backoff_first <= 0 || backoff_max < backoff_first) {
+                Tcl_SetResult(interp, "-backoff times must be positive"
+                              " and in order", TCL_STATIC);
+                return(TCL_ERROR);
+            }
+            asyncopt = 1;
+            --objc;
+            ++objv;
+        } else {
+            break;
+        }
+    }
+    if (objc != 1 || (async && proc == NULL) || (!async && asyncopt)) {
+        Tcl_SetResult(interp, "usage: sockptyr connect"
+                      " ?-async -command $proc ?-timeout $ms?"
+                      " ?-attempts $n? ?-backoff {$first_ms $max_ms}?"
+                      " ?-reconnect?? $path", TCL_STATIC);
         return(TCL_ERROR);
     }
+    path = Tcl_GetStringFromObj(objv[0], &l);
 
     /* process the address we were given */
     memset(&sa, 0, sizeof(sa));
@@ -435,13 +1687,12 @@ static int sockptyr_cmd_connect(ClientData cd, Tcl_Interp *interp,
     sa.sun_len = sizeof(sa);
 #endif
     sa.sun_family = AF_UNIX;
-    l = strlen(argv[0]);
     if (l >= sizeof(sa.sun_path)) {
         Tcl_SetResult(interp, "sockptyr connect: path name too long",
                       TCL_STATIC);
         return(TCL_ERROR);
     }
-    strcpy(&(sa.sun_path[0]), argv[0]);
+    strcpy(&(sa.sun_path[0]), path);
 
     /* open a socket and connect */
     fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -452,20 +1703,95 @@ static int sockptyr_cmd_connect(ClientData cd, Tcl_Interp *interp,
                                        strerror(errno)));
         return(TCL_ERROR);
     }
-    if (connect(fd, (void *)&sa, sizeof(sa)) < 0) {
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+        (async && sockptyr_set_nonblock(fd) < 0)) {
         Tcl_SetObjResult(interp,
                          Tcl_ObjPrintf("sockptyr connect:"
-                                       " connect(%s) failed: %s",
-                                       argv[0], strerror(errno)));
+                                       " fcntl() failed: %s",
+                                       strerror(errno)));
         close(fd);
         return(TCL_ERROR);
     }
-
-    /* get a handle we can use for our result; return a string for it */
-    hdl = sockptyr_allocate_handle(sd);
+    if (async) {
+        /* Set up the handle without its file descriptor, so
+         * sockptyr_init_conn() doesn't register it for I/O; then queue
+         * the connect() for sockptyr_cnct_next() to start.
+         */
+        hdl = sockptyr_allocate_handle(sd);
+        sockptyr_init_conn(hdl, -1, 'c');
+        hdl->u.u_conn.fd = fd;
+        c = (void *)ckalloc(sizeof(*c));
+        memset(c, 0, sizeof(*c));
+        c->hdl = hdl;
+        c->sa = sa;
+        c->proc = proc;
+        Tcl_IncrRefCount(c->proc);
+        c->timeout = timeout;
+        c->attempts = attempts;
+        c->backoff_first = backoff_first;
+        c->backoff_max = backoff_max;
+        c->reconnect = reconnect;
+        hdl->u.u_conn.cnct = c;
+        if (reconnect) {
+            hdl->u.u_conn.rcon = c;
+        }
+        sockptyr_cnct_start(hdl);
+        Tcl_SetObjResult(interp, sockptyr_handle_obj(hdl));
+        return(TCL_OK);
+    }
+    if (connect(fd, (void *)&sa, sizeof(sa)) < 0) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("sockptyr connect:"
+                                       " connect(%s) failed: %s",
+                                       path, strerror(errno)));
+        close(fd);
+        return(TCL_ERROR);
+    }
+    if (sockptyr_set_nonblock(fd) < 0) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("sockptyr connect:"
+                                       " fcntl() failed: %s",
+                                       strerror(errno)));
+        close(fd);
+        return(TCL_ERROR);
+    }
+
+    /* get a handle we can use for our result; return a string for it */
+    hdl = sockptyr_allocate_handle(sd);
     sockptyr_init_conn(hdl, fd, 'c');
-    snprintf(rb, sizeof(rb), "%s%d", handle_prefix, (int)hdl->num);
-    Tcl_SetResult(interp, rb, TCL_VOLATILE);
+    Tcl_SetObjResult(interp, sockptyr_handle_obj(hdl));
+    return(TCL_OK);
+}
+
+/* Tcl command "sockptyr connect_limit ?$n?" -- Set the most connections
+ * "sockptyr connect -async" works on at once; the rest wait their turn.
+ * Returns the number.
+ */
+static int sockptyr_cmd_connect_limit(ClientData cd, Tcl_Interp *interp,
+                                      int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    int n;
+
+    if (objc > 1) {
+        Tcl_SetResult(interp, "usage: sockptyr connect_limit ?$n?",
+                      TCL_STATIC);
+        return(TCL_ERROR);
+    }
+
+    if (objc > 0) {
+        if (Tcl_GetIntFromObj(interp, objv[0], &n) != TCL_OK) {
+            return(TCL_ERROR);
+        }
+        if (n <= 0) {
+            Tcl_SetResult(interp, "connect limit must be positive",
+                          TCL_STATIC);
+            return(TCL_ERROR);
+        }
+        sd->connect_limit = n;
+        sockptyr_cnct_next(sd); /* in case it went up */
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(sd->connect_limit));
     return(TCL_OK);
 }
 
@@ -474,6 +1800,7 @@ static int sockptyr_cmd_connect(ClientData cd, Tcl_Interp *interp,
  * script for each new connection.
  *
  * Parameters:
+ *      -backlog $n: how many connections can wait to be accepted
  *      path: filename/address of the socket to listen on
  *      proc: Tcl script to execute after appending two words:
  *          a handle for the new connection
@@ -482,18 +1809,32 @@ static int sockptyr_cmd_connect(ClientData cd, Tcl_Interp *interp,
  * This creates the socket file, and fails if it already exists.
  */
 static int sockptyr_cmd_listen(ClientData cd, Tcl_Interp *interp,
-                               int argc, const char *argv[])
+                               int objc, Tcl_Obj *const objv[])
 {
     struct sockptyr_data *sd = cd;
     struct sockptyr_hdl *hdl;
     struct sockptyr_lstn *lstn;
     struct sockaddr_un sa;
-    int sok, l;
+    const char *path;
+    int sok, l, backlog = listen_backlog;
 
-    if (argc != 2) {
-        Tcl_SetResult(interp, "usage: sockptyr listen $path $proc", TCL_STATIC);
+    if (objc == 4 && !strcmp(Tcl_GetString(objv[0]), "-backlog")) {
+        if (Tcl_GetIntFromObj(interp, objv[1], &backlog) != TCL_OK) {
+            return(TCL_ERROR);
+        }
+        if (backlog <= 0) {
+            Tcl_SetResult(interp, "backlog must be positive", TCL_STATIC);
+            return(TCL_ERROR);
+        }
+        objc -= 2;
+        objv += 2;
+    }
+    if (objc != 2) {
+        Tcl_SetResult(interp, "usage: sockptyr listen ?-backlog $n?"
+                      " $path $proc", TCL_STATIC);
         return(TCL_ERROR);
     }
+    path = Tcl_GetStringFromObj(objv[0], &l);
 
     /* process the address we were given */
     memset(&sa, 0, sizeof(sa));
@@ -501,13 +1842,12 @@ static int sockptyr_cmd_listen(ClientData cd, Tcl_Interp *interp,
     sa.sun_len = sizeof(sa);
 #endif
     sa.sun_family = AF_UNIX;
-    l = strlen(argv[0]);
     if (l >= sizeof(sa.sun_path)) {
         Tcl_SetResult(interp, "sockptyr connect: path name too long",
                       TCL_STATIC);
         return(TCL_ERROR);
     }
-    strcpy(&(sa.sun_path[0]), argv[0]);
+    strcpy(&(sa.sun_path[0]), path);
 
     /* open a socket and listen */
     sok = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -522,11 +1862,11 @@ static int sockptyr_cmd_listen(ClientData cd, Tcl_Interp *interp,
         Tcl_SetObjResult(interp,
                          Tcl_ObjPrintf("sockptyr listen:"
                                        " bind(%s) failed: %s",
-                                       argv[0], strerror(errno)));
+                                       path, strerror(errno)));
         close(sok);
         return(TCL_ERROR);
     }
-    if (listen(sok, 2) < 0) {
+    if (listen(sok, backlog) < 0) {
         Tcl_SetObjResult(interp,
                          Tcl_ObjPrintf("sockptyr listen:"
                                        " listen() failed: %s",
@@ -534,6 +1874,16 @@ static int sockptyr_cmd_listen(ClientData cd, Tcl_Interp *interp,
         close(sok);
         return(TCL_ERROR);
     }
+    if (sockptyr_set_nonblock(sok) < 0 ||
+        fcntl(sok, F_SETFD, FD_CLOEXEC) < 0) {
+        /* so sockptyr_lstn_handler() can accept until there are no more */
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("sockptyr listen:"
+                                       " fcntl() failed: %s",
+                                       strerror(errno)));
+        close(sok);
+        return(TCL_ERROR);
+    }
 
     /* get a handle we can use for our result; return a string for it */
     hdl = sockptyr_allocate_handle(sd);
@@ -541,39 +1891,69 @@ static int sockptyr_cmd_listen(ClientData cd, Tcl_Interp *interp,
     lstn = &(hdl->u.u_lstn);
     memset(lstn, 0, sizeof(*lstn));
     lstn->sok = sok;
-    lstn->proc = Tcl_NewStringObj(argv[1], strlen(argv[1]));
+    lstn->proc = objv[1];
     Tcl_IncrRefCount(lstn->proc);
     Tcl_CreateFileHandler(lstn->sok, TCL_READABLE, &sockptyr_lstn_handler,
                           (ClientData)hdl);
-    Tcl_SetObjResult(interp,
-                     Tcl_ObjPrintf("%s%d", handle_prefix, (int)hdl->num));
+    Tcl_SetObjResult(interp, sockptyr_handle_obj(hdl));
     return(TCL_OK);
 }
 
-/* Tcl command "sockptyr link $hdl1 $hdl2" to link two connections together */
+/* Tcl command "sockptyr link ?-splice? ?-offload? ?-replay? ?-latency?
+ * $hdl1 $hdl2" to link two connections together
+ */
 static int sockptyr_cmd_link(ClientData cd, Tcl_Interp *interp,
-                             int argc, const char *argv[])
+                             int objc, Tcl_Obj *const objv[])
 {
     struct sockptyr_data *sd = cd;
     struct sockptyr_hdl *hdls[2];
     struct sockptyr_conn *conns[2];
-    int i;
-    char buf[512];
+    int i, dosplice = 0, dooffload = 0, doreplay = 0, dolatency = 0;
+    const char *opt;
+#if USE_OFFLOAD
+    struct sockptyr_offw *w;
+#endif /* USE_OFFLOAD */
+
+    for (; objc > 0; --objc, ++objv) {
+        if (objv[0]->typePtr == &sockptyr_handle_type) {
+            break; /* a handle, not an option */
+        }
+        opt = Tcl_GetString(objv[0]);
+        if (opt[0] != '-') {
+            break;
+        } else if (!strcmp(opt, "-splice")) {
+            /* Accepted even without USE_SPLICE: it's only a request, and
+             * connections that can't be spliced use their buffers anyway.
+             */
+            dosplice = 1;
+#if USE_OFFLOAD
+        } else if (!strcmp(opt, "-offload")) {
+            dooffload = 1;
+#endif /* USE_OFFLOAD */
+        } else if (!strcmp(opt, "-replay")) {
+            doreplay = 1;
+        } else if (!strcmp(opt, "-latency")) {
+            dolatency = 1;
+        } else {
+            break;
+        }
+    }
 
-    if (argc < 1 || argc > 2) {
-        Tcl_SetResult(interp, "usage: sockptyr link $hdl1 ?$hdl2?", TCL_STATIC);
+    if (objc < 1 || objc > 2 || (dooffload && objc < 2)) {
+        Tcl_SetResult(interp, "usage: sockptyr link ?-splice? ?-offload?"
+                      " ?-replay? ?-latency? $hdl1 ?$hdl2?", TCL_STATIC);
         return(TCL_ERROR);
     }
 
     /* find out what connections we're to operate on */
-    for (i = 0; i < argc; ++i) {
-        hdls[i] = sockptyr_lookup_handle(sd, argv[i]);
+    for (i = 0; i < objc; ++i) {
+        hdls[i] = sockptyr_lookup_handle(sd, objv[i]);
         if (hdls[i] == NULL || hdls[i]->usage != usage_conn) {
-            if (argc >= 2) {
-                snprintf(buf, sizeof(buf),
-                         "handle %s is not a connection handle",
-                         argv[i]);
-                Tcl_SetResult(interp, buf, TCL_VOLATILE);
+            if (objc >= 2) {
+                Tcl_SetObjResult(interp,
+                                 Tcl_ObjPrintf("handle %s"
+                                               " is not a connection handle",
+                                               Tcl_GetString(objv[i])));
                 return(TCL_ERROR);
             } else {
                 /*
@@ -585,37 +1965,533 @@ static int sockptyr_cmd_link(ClientData cd, Tcl_Interp *interp,
             }
         }
         conns[i] = &(hdls[i]->u.u_conn);
+        if (dooffload && conns[i]->cnct) {
+            /* the worker thread would try I/O on it */
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("sockptyr link -offload:"
+                                           " handle %s is still connecting",
+                                           Tcl_GetString(objv[i])));
+            return(TCL_ERROR);
+        }
+    }
+
+#if USE_OFFLOAD
+    /* find a worker thread to hand them to, before changing anything */
+    w = NULL;
+    if (dooffload) {
+        w = sockptyr_offload_pick(sd);
+        if (w == NULL) {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("sockptyr link -offload: %s",
+                                           sd->noffw < 1 ? "no threads" :
+                                           "unable to start thread"));
+            return(TCL_ERROR);
+        }
     }
+#endif /* USE_OFFLOAD */
 
     /* unlink them from whatever they were on before */
-    for (i = 0; i < argc; ++i) {
+    for (i = 0; i < objc; ++i) {
         if (conns[i]->linked) {
             sockptyr_conn_unlink(hdls[i]);
         }
+        if (conns[i]->fan) {
+            sockptyr_fan_leave(hdls[i]);
+        }
     }
 
-    if (argc > 1) {
+    if (objc > 1) {
         /* link them to each other */
         conns[0]->linked = hdls[1];
         conns[1]->linked = hdls[0];
+        if (doreplay) {
+            /* each gets the other's history first */
+            sockptyr_sbk_rewind(hdls[0]);
+            sockptyr_sbk_rewind(hdls[1]);
+        }
+        for (i = 0; dolatency && i < 2; ++i) {
+            if (conns[i]->lat == NULL) {
+                conns[i]->lat = (void *)ckalloc(sizeof(*conns[i]->lat));
+                memset(conns[i]->lat, 0, sizeof(*conns[i]->lat));
+            }
+        }
+#if USE_SPLICE
+        if (dosplice) {
+            sockptyr_conn_splice_start(hdls[0]);
+        }
+#endif /* USE_SPLICE */
     }
 
     /* and update what events they can handle based on the new linkage */
-    for (i = 0; i < argc; ++i) {
+    for (i = 0; i < objc; ++i) {
         sockptyr_register_conn_handler(hdls[i]);
     }
 
+#if USE_OFFLOAD
+    if (w) {
+        sockptyr_offload_start(w, hdls[0]);
+    }
+#endif /* USE_OFFLOAD */
+
+    return(TCL_OK);
+}
+
+/* Tcl command "sockptyr fanout ?-policy $policy? ?-grace $ms? ?-replay?
+ * $src ?$sink ...?" to make a fan-out group: what's received on connection
+ * $src is sent out each $sink, and what's received on the sinks is sent
+ * out $src.  Returns a handle for the group.
+ */
+static int sockptyr_cmd_fanout(ClientData cd, Tcl_Interp *interp,
+                               int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    struct sockptyr_hdl *hdl, *src, *sink;
+    struct sockptyr_fan *fan;
+    int i, policy = 'b', grace_ms = 500, doreplay = 0;
+    const char *opt;
+
+    for (; objc > 0; --objc, ++objv) {
+        if (objv[0]->typePtr == &sockptyr_handle_type) {
+            break; /* a handle, not an option */
+        }
+        opt = Tcl_GetString(objv[0]);
+        if (opt[0] != '-') {
+            break;
+        } else if (!strcmp(opt, "-replay")) {
+            doreplay = 1;
+        } else if (objc < 2) {
+            break;
+        } else if (!strcmp(opt, "-policy")) {
+            opt = Tcl_GetString(objv[1]);
+            if (!strcmp(opt, "block")) {
+                policy = 'b';
+            } else if (!strcmp(opt, "drop")) {
+                policy = 'd';
+            } else if (!strcmp(opt, "disconnect")) {
+                policy = 'x';
+            } else {
+                Tcl_SetObjResult(interp,
+                                 Tcl_ObjPrintf("sockptyr fanout: unknown"
+                                               " policy \"%s\", must be"
+                                               " block, drop or disconnect",
+                                               opt));
+                return(TCL_ERROR);
+            }
+            --objc;
+            ++objv;
+        } else if (!strcmp(opt, "-grace")) {
+            if (Tcl_GetIntFromObj(interp, objv[1], &grace_ms) != TCL_OK) {
+                return(TCL_ERROR);
+            }
+            if (grace_ms < 0) {
+                Tcl_SetResult(interp, "sockptyr fanout: -grace must not"
+                              " be negative", TCL_STATIC);
+                return(TCL_ERROR);
+            }
+            --objc;
+            ++objv;
+        } else {
+            break;
+        }
+    }
+
+    if (objc < 1) {
+        Tcl_SetResult(interp, "usage: sockptyr fanout ?-policy $policy?"
+                      " ?-grace $ms? ?-replay? $src ?$sink ...?",
+                      TCL_STATIC);
+        return(TCL_ERROR);
+    }
+
+    /* check all the connections before changing anything */
+    src = sockptyr_fan_lookup(sd, interp, objv[0]);
+    if (src == NULL) {
+        return(TCL_ERROR);
+    }
+    for (i = 1; i < objc; ++i) {
+        sink = sockptyr_fan_lookup(sd, interp, objv[i]);
+        if (sink == NULL) {
+            return(TCL_ERROR);
+        }
+        if (sink == src) {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("sockptyr fanout: handle %s"
+                                           " can't be its own sink",
+                                           Tcl_GetString(objv[i])));
+            return(TCL_ERROR);
+        }
+    }
+
+    hdl = sockptyr_allocate_handle(sd);
+    fan = (void *)ckalloc(sizeof(*fan));
+    memset(fan, 0, sizeof(*fan));
+    fan->sd = sd;
+    fan->hdl = hdl;
+    fan->src = fan->sinks = fan->in_next = NULL;
+    fan->nsinks = 0;
+    fan->policy = policy;
+    fan->grace_ms = grace_ms;
+    fan->slow_timer = NULL;
+    fan->n_dropped = fan->n_cut = 0;
+    hdl->usage = usage_fan;
+    hdl->u.u_fan = fan;
+
+    sockptyr_fan_join(fan, src, 1, 0);
+    for (i = 1; i < objc; ++i) {
+        sockptyr_fan_join(fan, sockptyr_lookup_handle(sd, objv[i]), 0,
+                          doreplay);
+    }
+
+    Tcl_SetObjResult(interp, sockptyr_handle_obj(hdl));
+    return(TCL_OK);
+}
+
+/* Tcl "sockptyr fanout_add ?-replay? $grp ?$sink ...?": Add sinks to
+ * a fan-out group.
+ */
+static int sockptyr_cmd_fanout_add(ClientData cd, Tcl_Interp *interp,
+                                   int objc, Tcl_Obj *const objv[])
+{
+    return(sockptyr_cmd_fanout_sinks(cd, interp, objc, objv,
+                                     "fanout_add", 1));
+}
+
+/* Tcl "sockptyr fanout_remove $grp ?$sink ...?": Remove sinks from a
+ * fan-out group, leaving them unlinked.
+ */
+static int sockptyr_cmd_fanout_remove(ClientData cd, Tcl_Interp *interp,
+                                      int objc, Tcl_Obj *const objv[])
+{
+    return(sockptyr_cmd_fanout_sinks(cd, interp, objc, objv,
+                                     "fanout_remove", 0));
+}
+
+/* sockptyr_cmd_fanout_sinks() -- common code of sockptyr_cmd_fanout_add()
+ * and sockptyr_cmd_fanout_remove(), as indicated by 'doadd'.  'what' is
+ * the subcommand name, for error messages.
+ */
+static int sockptyr_cmd_fanout_sinks(struct sockptyr_data *sd,
+                                     Tcl_Interp *interp,
+                                     int objc, Tcl_Obj *const objv[],
+                                     char *what, int doadd)
+{
+    struct sockptyr_hdl *grp, *sink;
+    struct sockptyr_fan *fan;
+    int i, doreplay = 0;
+
+    if (doadd && objc > 0 && objv[0]->typePtr != &sockptyr_handle_type &&
+        !strcmp(Tcl_GetString(objv[0]), "-replay")) {
+        doreplay = 1;
+        --objc;
+        ++objv;
+    }
+    if (objc < 1) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("usage: sockptyr %s%s $grp"
+                                       " ?$sink ...?",
+                                       what, doadd ? " ?-replay?" : ""));
+        return(TCL_ERROR);
+    }
+    grp = sockptyr_lookup_handle(sd, objv[0]);
+    if (grp == NULL || grp->usage != usage_fan) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("handle %s is not a fan-out group",
+                                       Tcl_GetString(objv[0])));
+        return(TCL_ERROR);
+    }
+    fan = grp->u.u_fan;
+
+    /* check all the connections before changing anything */
+    for (i = 1; i < objc; ++i) {
+        sink = sockptyr_fan_lookup(sd, interp, objv[i]);
+        if (sink == NULL) {
+            return(TCL_ERROR);
+        }
+        if (sink == fan->src) {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("sockptyr %s: handle %s is"
+                                           " the group's source",
+                                           what, Tcl_GetString(objv[i])));
+            return(TCL_ERROR);
+        }
+    }
+
+    for (i = 1; i < objc; ++i) {
+        sink = sockptyr_lookup_handle(sd, objv[i]);
+        if (doadd) {
+            sockptyr_fan_join(fan, sink, 0, doreplay);
+        } else if (sink->u.u_conn.fan == fan) {
+            sockptyr_fan_leave(sink);
+        }
+    }
+    return(TCL_OK);
+}
+
+/* sockptyr_fan_lookup() -- Look up connection handle 'obj' for
+ * "sockptyr fanout" & co.  If it isn't one, returns NULL with an error
+ * message in 'interp'.
+ */
+static struct sockptyr_hdl *sockptyr_fan_lookup(struct sockptyr_data *sd,
+                                                Tcl_Interp *interp,
+                                                Tcl_Obj *obj)
+{
+    struct sockptyr_hdl *hdl;
+
+    hdl = sockptyr_lookup_handle(sd, obj);
+    if (hdl == NULL || hdl->usage != usage_conn) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("handle %s is not a connection handle",
+                                       Tcl_GetString(obj)));
+        return(NULL);
+    }
+    return(hdl);
+}
+
+/* Tcl command "sockptyr scrollback $hdl $bytes ?$path?": Keep the last
+ * $bytes received on connection $hdl, in a ring mapped from file $path
+ * (kept from before if it's the same size) or in anonymous memory.
+ * $bytes of 0 stops keeping them.
+ */
+static int sockptyr_cmd_scrollback(ClientData cd, Tcl_Interp *interp,
+                                   int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    struct sockptyr_hdl *hdl, *sink;
+    struct sockptyr_conn *conn;
+    struct sockptyr_sbk *sbk = NULL;
+    long bytes;
+#if USE_OFFLOAD
+    struct sockptyr_offw *w;
+#endif /* USE_OFFLOAD */
+
+    if (objc < 2 || objc > 3) {
+        Tcl_SetResult(interp, "usage: sockptyr scrollback $hdl $bytes"
+                      " ?$path?", TCL_STATIC);
+        return(TCL_ERROR);
+    }
+    hdl = sockptyr_lookup_handle(sd, objv[0]);
+    if (hdl == NULL || hdl->usage != usage_conn) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("handle %s is not a connection handle",
+                                       Tcl_GetString(objv[0])));
+        return(TCL_ERROR);
+    }
+    conn = &(hdl->u.u_conn);
+    if (Tcl_GetLongFromObj(interp, objv[1], &bytes) != TCL_OK) {
+        return(TCL_ERROR);
+    }
+    if (bytes != 0 && (bytes < scrollback_min || bytes > scrollback_max)) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("sockptyr scrollback: size must be 0,"
+                                       " or %ld to %ld bytes",
+                                       scrollback_min, scrollback_max));
+        return(TCL_ERROR);
+    }
+    if (bytes > 0) {
+        sbk = sockptyr_sbk_open(interp, bytes,
+                                (objc > 2) ? Tcl_GetString(objv[2]) : NULL);
+        if (sbk == NULL) {
+            return(TCL_ERROR);
+        }
+    }
+
+    /* a worker thread might be recording into the old one */
+#if USE_OFFLOAD
+    w = conn->offw;
+    sockptyr_offload_reclaim(hdl);
+#endif /* USE_OFFLOAD */
+    if (conn->sbk) {
+        sockptyr_sbk_free(conn->sbk);
+    }
+    conn->sbk = sbk;
+
+    /* whatever was replaying the old one's history can't any more */
+    if (conn->linked) {
+        conn->linked->u.u_conn.rpl_pos = conn->linked->u.u_conn.rpl_end = 0;
+    }
+    if (conn->fan && conn->fan->src == hdl) {
+        for (sink = conn->fan->sinks; sink != NULL;
+             sink = sink->u.u_conn.fan_next) {
+            sink->u.u_conn.rpl_pos = sink->u.u_conn.rpl_end = 0;
+        }
+    }
+
+#if USE_OFFLOAD
+    if (w != NULL) {
+        sockptyr_offload_start(w, hdl);
+    }
+#endif /* USE_OFFLOAD */
+    return(TCL_OK);
+}
+
+/* Tcl command "sockptyr scrollback_get $hdl": Return what's in connection
+ * $hdl's scrollback, oldest first, as a byte array.
+ */
+static int sockptyr_cmd_scrollback_get(ClientData cd, Tcl_Interp *interp,
+                                       int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    struct sockptyr_hdl *hdl;
+    struct sockptyr_sbk *sbk;
+    Tcl_Obj *obj;
+    unsigned char *p;
+    uint64_t total;
+    size_t len, pos, k;
+
+    if (objc != 1) {
+        Tcl_SetResult(interp, "usage: sockptyr scrollback_get $hdl",
+                      TCL_STATIC);
+        return(TCL_ERROR);
+    }
+    hdl = sockptyr_lookup_handle(sd, objv[0]);
+    if (hdl == NULL || hdl->usage != usage_conn) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("handle %s is not a connection handle",
+                                       Tcl_GetString(objv[0])));
+        return(TCL_ERROR);
+    }
+    sbk = hdl->u.u_conn.sbk;
+    obj = Tcl_NewByteArrayObj(NULL, 0);
+    if (sbk != NULL) {
+        Tcl_MutexLock(&(sbk->lock));
+        total = sbk->hdr->total;
+        len = (total < sbk->size) ? (size_t)total : sbk->size;
+        p = Tcl_SetByteArrayLength(obj, len);
+        pos = (size_t)((total - len) % sbk->size); /* the oldest byte */
+        k = sbk->size - pos;
+        if (k > len) {
+            k = len;
+        }
+        memcpy(p, sbk->data + pos, k);
+        memcpy(p + k, sbk->data, len - k);
+        Tcl_MutexUnlock(&(sbk->lock));
+    }
+    Tcl_SetObjResult(interp, obj);
+    return(TCL_OK);
+}
+
+#if USE_RECORD
+/* Tcl command "sockptyr record ?-sent? ?-rotate $bytes? ?-keep $n? $hdl
+ * ?$path?": Record what's received on connection $hdl (and with -sent,
+ * what's sent on it too) in file $path, appending to it.  With -rotate,
+ * when the file would go past $bytes it's renamed to $path.1 ($path.1 to
+ * $path.2 and so on, keeping $n old ones, default 1) and a new one
+ * started.  Leave out $path to stop recording.
+ */
+static int sockptyr_cmd_record(ClientData cd, Tcl_Interp *interp,
+                               int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    struct sockptyr_hdl *hdl;
+    struct sockptyr_conn *conn;
+    struct sockptyr_rec *rec = NULL;
+    struct sockptyr_recw *w;
+    const char *opt, *path;
+    long rotate = 0;
+    int sent = 0, keep = 1, e;
+#if USE_OFFLOAD
+    struct sockptyr_offw *offw;
+#endif /* USE_OFFLOAD */
+
+    for (; objc > 1; --objc, ++objv) {
+        opt = Tcl_GetString(objv[0]);
+        if (!strcmp(opt, "-sent")) {
+            sent = 1;
+        } else if (!strcmp(opt, "-rotate") && objc > 2) {
+            if (Tcl_GetLongFromObj(interp, objv[1], &rotate) != TCL_OK) {
+                return(TCL_ERROR);
+            }
+            if (rotate < 0) {
+                Tcl_SetResult(interp, "-rotate must not be negative",
+                              TCL_STATIC);
+                return(TCL_ERROR);
+            }
+            --objc;
+            ++objv;
+        } else if (!strcmp(opt, "-keep") && objc > 2) {
+            if (Tcl_GetIntFromObj(interp, objv[1], &keep) != TCL_OK) {
+                return(TCL_ERROR);
+            }
+            if (keep < 0) {
+                Tcl_SetResult(interp, "-keep must not be negative",
+                              TCL_STATIC);
+                return(TCL_ERROR);
+            }
+            --objc;
+            ++objv;
+        } else {
+            break;
+        }
+    }
+    if (objc < 1 || objc > 2) {
+        Tcl_SetResult(interp, "usage: sockptyr record ?-sent?"
+                      " ?-rotate $bytes? ?-keep $n? $hdl ?$path?",
+                      TCL_STATIC);
+        return(TCL_ERROR);
+    }
+    hdl = sockptyr_lookup_handle(sd, objv[0]);
+    if (hdl == NULL || hdl->usage != usage_conn) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("handle %s is not a connection handle",
+                                       Tcl_GetString(objv[0])));
+        return(TCL_ERROR);
+    }
+    conn = &(hdl->u.u_conn);
+
+    if (objc > 1) {
+        w = sockptyr_rec_writer(sd);
+        if (w == NULL) {
+            Tcl_SetResult(interp, "sockptyr record: couldn't start"
+                          " writer thread", TCL_STATIC);
+            return(TCL_ERROR);
+        }
+        path = Tcl_GetString(objv[1]);
+        rec = (void *)ckalloc(sizeof(*rec));
+        memset(rec, 0, sizeof(*rec));
+        rec->w = w;
+        rec->hdl = hdl;
+        rec->gen = hdl->gen;
+        rec->path = ckalloc(strlen(path) + 1);
+        strcpy(rec->path, path);
+        rec->sent = sent;
+        rec->rotate = rotate;
+        rec->keep = keep;
+        if (sockptyr_rec_open(rec, 0) < 0) {
+            e = errno;
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("sockptyr record: %s: %s",
+                                           path, strerror(e)));
+            ckfree(rec->path);
+            ckfree((void *)rec);
+            return(TCL_ERROR);
+        }
+    }
+
+    /* a worker thread might be recording into the old one */
+#if USE_OFFLOAD
+    offw = conn->offw;
+    sockptyr_offload_reclaim(hdl);
+#endif /* USE_OFFLOAD */
+    if (conn->rec) {
+        sockptyr_rec_stop(conn->rec);
+    }
+    conn->rec = rec;
+#if USE_OFFLOAD
+    if (offw != NULL) {
+        sockptyr_offload_start(offw, hdl);
+    }
+#endif /* USE_OFFLOAD */
     return(TCL_OK);
 }
+#endif /* USE_RECORD */
 
 /* Tcl "sockptyr onclose $hdl $proc": When $hdl is closed, invoke
  * Tcl script $proc.
  * Leave out $proc to cancel it.
  */
 static int sockptyr_cmd_onclose(ClientData cd, Tcl_Interp *interp,
-                                int argc, const char *argv[])
+                                int objc, Tcl_Obj *const objv[])
 {
-    return(sockptyr_cmd_onclose_onerror(cd, interp, argc, argv,
+    return(sockptyr_cmd_onclose_onerror(cd, interp, objc, objv,
                                         "onclose", 0));
 }
 
@@ -627,19 +2503,19 @@ static int sockptyr_cmd_onclose(ClientData cd, Tcl_Interp *interp,
  * Leave out $proc to cancel it.
  */
 static int sockptyr_cmd_onerror(ClientData cd, Tcl_Interp *interp,
-                                int argc, const char *argv[])
+                                int objc, Tcl_Obj *const objv[])
 {
-    return(sockptyr_cmd_onclose_onerror(cd, interp, argc, argv,
+    return(sockptyr_cmd_onclose_onerror(cd, interp, objc, objv,
                                         "onerror", 1));
 }
 
 static int sockptyr_cmd_onclose_onerror(struct sockptyr_data *sd,
                                         Tcl_Interp *interp,
-                                        int argc, const char *argv[],
+                                        int objc, Tcl_Obj *const objv[],
                                         char *what, int isonerror)
 {
     struct sockptyr_hdl *hdl;
-    char **resp;
+    Tcl_Obj **resp;
 
     if (sd->interp != interp) {
         /* shouldn't happen */
@@ -647,20 +2523,20 @@ static int sockptyr_cmd_onclose_onerror(struct sockptyr_data *sd,
         return(TCL_ERROR);
     }
 
-    if (argc < 1 || argc > 2) {
+    if (objc < 1 || objc > 2) {
         Tcl_SetObjResult(interp,
                          Tcl_ObjPrintf("usage: sockptyr %s $hdl ?$proc?",
                                        what));
         return(TCL_ERROR);
     }
 
-    hdl = sockptyr_lookup_handle(sd, argv[0]);
+    hdl = sockptyr_lookup_handle(sd, objv[0]);
     if (hdl == NULL || hdl->usage != usage_conn) {
-        if (argc >= 2) {
+        if (objc >= 2) {
             Tcl_SetObjResult(interp,
                              Tcl_ObjPrintf("handle %s"
                                            " is not a connection handle",
-                                           argv[0]));
+                                           Tcl_GetString(objv[0])));
             return(TCL_ERROR);
         } else {
             /*
@@ -673,13 +2549,15 @@ static int sockptyr_cmd_onclose_onerror(struct sockptyr_data *sd,
     }
 
     resp = isonerror ? &(hdl->u.u_conn.onerror) : &(hdl->u.u_conn.onclose);
+    if (objc > 1) {
+        Tcl_IncrRefCount(objv[1]);
+    }
     if (*resp) {
-        ckfree(*resp);
+        Tcl_DecrRefCount(*resp);
         *resp = NULL;
     }
-    if (argc > 1) {
-        *resp = ckalloc(strlen(argv[1]) + 1);
-        strcpy(*resp, argv[1]);
+    if (objc > 1) {
+        *resp = objv[1];
     }
 
     return(TCL_OK);
@@ -695,6 +2573,8 @@ static struct sockptyr_hdl *sockptyr_allocate_handle(struct sockptyr_data *sd)
     if (sd->empty_hdls == NULL) {
         /* we need some empty handles */
         int i = sd->ahdls;
+        long long us = sockptyr_now_us();
+        void *old = sd->hdls;
 
         sd->ahdls += 1 + (sd->ahdls >> 2);
         sd->hdls = (void *)ckrealloc((void *)sd->hdls,
@@ -707,6 +2587,17 @@ static struct sockptyr_hdl *sockptyr_allocate_handle(struct sockptyr_data *sd)
             hdl->usage = usage_empty;
             sockptyr_lst_insert(&(sd->empty_hdls), hdl);
         }
+
+        /* keep count, for "sockptyr dbg_handles" */
+        us = sockptyr_now_us() - us;
+        ++sd->n_hdl_grow;
+        if (old && (void *)sd->hdls != old) {
+            ++sd->n_hdl_moved;
+        }
+        sd->hdl_grow_us += us;
+        if (us > sd->hdl_grow_max_us) {
+            sd->hdl_grow_max_us = us;
+        }
     }
 
     /* pick one of the empty handles in the doubly-linked-list of them */
@@ -716,29 +2607,29 @@ static struct sockptyr_hdl *sockptyr_allocate_handle(struct sockptyr_data *sd)
     /* prepare it */
     hdl->next = hdl->prev = NULL;
     hdl->usage = usage_dead;
+    Tcl_MutexLock(&sockptyr_gen_lock);
+    hdl->gen = sockptyr_next_gen++;
+    Tcl_MutexUnlock(&sockptyr_gen_lock);
 
     return(hdl);
 }
 
-/* sockptyr_lookup_handle() -- look up the specified handle, and return
- * it, or NULL if not found or not allocated.
+/* sockptyr_lookup_handle() -- look up the handle in 'obj', and return
+ * a pointer to it; or NULL if it's not a handle, or no longer refers
+ * to anything.  Converts 'obj' to sockptyr_handle_type, so that next
+ * time it doesn't have to be parsed.
  */
 static struct sockptyr_hdl *sockptyr_lookup_handle(struct sockptyr_data *sd,
-                                                   const char *hdls)
+                                                   Tcl_Obj *obj)
 {
-    int hdln;
     struct sockptyr_hdl *hdl;
+    int hdln;
 
-    if (!hdls) {
-        return(NULL); /* no handle */
-    }
-    if (strncasecmp(hdls, handle_prefix, strlen(handle_prefix)) != 0) {
-        return(NULL); /* not a handle */
-    }
-    hdln = atoi(hdls + strlen(handle_prefix));
-    if (hdln < 0) {
+    if (obj->typePtr != &sockptyr_handle_type &&
+        Tcl_ConvertToType(NULL, obj, &sockptyr_handle_type) != TCL_OK) {
         return(NULL); /* not a handle */
     }
+    hdln = (int)(intptr_t)obj->internalRep.ptrAndLongRep.ptr;
     if (hdln >= sd->ahdls) {
         return(NULL); /* this handle number has never been allocated */
     }
@@ -748,41 +2639,152 @@ static struct sockptyr_hdl *sockptyr_lookup_handle(struct sockptyr_data *sd,
     if (hdl->usage == usage_empty) {
         return(NULL); /* handle not allocated */
     }
+    if (hdl->gen != obj->internalRep.ptrAndLongRep.value) {
+        return(NULL); /* handle has since been reused for something else */
+    }
     return(hdl);
 }
 
-/* sockptyr_clobber_handle() -- Clean up handle 'hdl'.
- * The handle continues to exist but is moved to usage_dead or usage_empty
- * (depending on parameter 'dofree') and has any stuff specific to its
- * current usage value destroyed.
+/* sockptyr_handle_obj() -- Return a new Tcl_Obj holding the handle string
+ * for 'hdl', already converted to sockptyr_handle_type.
  */
-static void sockptyr_clobber_handle(struct sockptyr_hdl *hdl, int dofree)
+static Tcl_Obj *sockptyr_handle_obj(struct sockptyr_hdl *hdl)
 {
-    if (!hdl) return; /* nothing to do */
+    Tcl_Obj *obj;
+    char buf[128];
+    int len;
+
+    /* not Tcl_ObjPrintf(), whose result has an internal rep of its own */
+    len = snprintf(buf, sizeof(buf), "%s%d_%lu", handle_prefix,
+                   (int)hdl->num, hdl->gen);
+    obj = Tcl_NewStringObj(buf, len);
+    obj->internalRep.ptrAndLongRep.ptr = (void *)(intptr_t)hdl->num;
+    obj->internalRep.ptrAndLongRep.value = hdl->gen;
+    obj->typePtr = &sockptyr_handle_type;
+    return(obj);
+}
 
-    /* get rid of any data particular to the hdl->usage value */
-    switch (hdl->usage) {
-    case usage_empty:
-        /* no usage-specific data */
-        break;
-    case usage_dead:
-        /* no usage-specific data */
-        break;
+/* sockptyr_handle_update_string() -- updateStringProc for
+ * sockptyr_handle_type: make the handle string from the number and
+ * generation.
+ */
+static void sockptyr_handle_update_string(Tcl_Obj *obj)
+{
+    char buf[128];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "%s%d_%lu", handle_prefix,
+                   (int)(intptr_t)obj->internalRep.ptrAndLongRep.ptr,
+                   obj->internalRep.ptrAndLongRep.value);
+    obj->bytes = ckalloc(len + 1);
+    memcpy(obj->bytes, buf, len + 1);
+    obj->length = len;
+}
+
+/* sockptyr_handle_set_from_any() -- setFromAnyProc for
+ * sockptyr_handle_type: parse a handle string.  This only checks its
+ * form; sockptyr_lookup_handle() checks whether it refers to anything.
+ */
+static int sockptyr_handle_set_from_any(Tcl_Interp *interp, Tcl_Obj *obj)
+{
+    const char *str, *p;
+    char *e;
+    unsigned long num, gen;
+    int l;
+
+    str = Tcl_GetString(obj);
+    l = strlen(handle_prefix);
+    if (strncasecmp(str, handle_prefix, l) != 0 || !isdigit(str[l])) {
+        goto bad;
+    }
+    num = strtoul(str + l, &e, 10);
+    if (num > INT_MAX || *e != '_' || !isdigit(e[1])) {
+        goto bad;
+    }
+    p = e + 1;
+    gen = strtoul(p, &e, 10);
+    if (*e != '\0') {
+        goto bad;
+    }
+
+    if (obj->typePtr != NULL && obj->typePtr->freeIntRepProc != NULL) {
+        obj->typePtr->freeIntRepProc(obj);
+    }
+    obj->internalRep.ptrAndLongRep.ptr = (void *)(intptr_t)num;
+    obj->internalRep.ptrAndLongRep.value = gen;
+    obj->typePtr = &sockptyr_handle_type;
+    return(TCL_OK);
+
+bad:
+    if (interp != NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("\"%s\" is not a handle", str));
+    }
+    return(TCL_ERROR);
+}
+
+/* sockptyr_clobber_handle() -- Clean up handle 'hdl'.
+ * The handle continues to exist but is moved to usage_dead or usage_empty
+ * (depending on parameter 'dofree') and has any stuff specific to its
+ * current usage value destroyed.
+ */
+static void sockptyr_clobber_handle(struct sockptyr_hdl *hdl, int dofree)
+{
+    if (!hdl) return; /* nothing to do */
+
+    /* get rid of any data particular to the hdl->usage value */
+    switch (hdl->usage) {
+    case usage_empty:
+        /* no usage-specific data */
+        break;
+    case usage_dead:
+        /* no usage-specific data */
+        break;
     case usage_conn:
         {
             struct sockptyr_conn *conn = &(hdl->u.u_conn);
             if (conn) {
+#if USE_OFFLOAD
+                sockptyr_offload_reclaim(hdl);
+#endif /* USE_OFFLOAD */
+                if (conn->cnct || conn->rcon) {
+                    sockptyr_cnct_cancel(hdl);
+                }
                 if (conn->fd >= 0) {
                     Tcl_DeleteFileHandler(conn->fd);
+                    conn->reg_mask = -1;
                     close(conn->fd);
                     conn->fd = -1;
+                    if (hdl->sd->n_lstn_paused > 0) {
+                        /* might be able to accept connections again */
+                        sockptyr_lstn_resume_all(hdl->sd);
+                    }
                 }
                 if (conn->linked != NULL && conn->linked != hdl) {
                     sockptyr_conn_unlink(hdl);
                 }
-                ckfree((void *)conn->buf);
-                if (conn->onclose) ckfree(conn->onclose);
-                if (conn->onerror) ckfree(conn->onerror);
+                if (conn->fan != NULL) {
+                    sockptyr_fan_leave(hdl);
+                }
+#if USE_SPLICE
+                sockptyr_conn_splice_stop(conn);
+#endif /* USE_SPLICE */
+                sockptyr_conn_drained(hdl->sd, conn);
+                if (conn->sbk) {
+                    sockptyr_sbk_free(conn->sbk);
+                    conn->sbk = NULL;
+                }
+                if (conn->lat) {
+                    ckfree((void *)conn->lat);
+                    conn->lat = NULL;
+                }
+#if USE_RECORD
+                if (conn->rec) {
+                    sockptyr_rec_stop(conn->rec);
+                    conn->rec = NULL;
+                }
+#endif /* USE_RECORD */
+                if (conn->onclose) Tcl_DecrRefCount(conn->onclose);
+                if (conn->onerror) Tcl_DecrRefCount(conn->onerror);
             }
         }
         break;
@@ -790,12 +2792,17 @@ static void sockptyr_clobber_handle(struct sockptyr_hdl *hdl, int dofree)
     case usage_inot:
         {
             struct sockptyr_inot *inot = &(hdl->u.u_inot);
+            struct sockptyr_hdl **hp;
             if (inot) {
-#if 0
-                fprintf(stderr, "removing inotify: num %d wd %d\n",
-                        (int)hdl->num, (int)inot->wd);
-#endif
-                inotify_rm_watch(hdl->sd->inotify_fd, inot->wd);
+                SOCKPTYR_TRACE(hdl->sd, trace_inot_del, hdl->num, 0, 0,
+                               inot->w->wd);
+                for (hp = &(inot->w->hdls); *hp != hdl;
+                     hp = &((*hp)->u.u_inot.wnext)) {
+                    assert(*hp != NULL);
+                }
+                *hp = inot->wnext;
+                sockptyr_inot_pend_free(hdl, 1);
+                sockptyr_inot_release(hdl->sd, inot->w);
                 sockptyr_lst_remove(&(hdl->sd->inotify_hdls), hdl);
                 Tcl_DecrRefCount(inot->proc);
             }
@@ -806,6 +2813,15 @@ static void sockptyr_clobber_handle(struct sockptyr_hdl *hdl, int dofree)
         {
             struct sockptyr_lstn *lstn = &(hdl->u.u_lstn);
             if (lstn) {
+                if (lstn->paused) {
+                    if (lstn->resume != NULL) {
+                        Tcl_DeleteTimerHandler(lstn->resume);
+                        lstn->resume = NULL;
+                    }
+                    lstn->paused = 0;
+                    --hdl->sd->n_lstn_paused;
+                    sockptyr_lst_remove(&(hdl->sd->lstn_paused), hdl);
+                }
                 if (lstn->sok >= 0) {
                     Tcl_DeleteFileHandler(lstn->sok);
                     close(lstn->sok);
@@ -815,6 +2831,48 @@ static void sockptyr_clobber_handle(struct sockptyr_hdl *hdl, int dofree)
             }
         }
         break;
+    case usage_proc:
+        {
+            /* The process stays in sd->procs till it exits, so it can
+             * be waited for, but nothing else is done then.
+             */
+            struct sockptyr_proc *p = hdl->u.u_proc;
+            if (p) {
+                p->hdl = NULL;
+                if (p->onexit) {
+                    Tcl_DecrRefCount(p->onexit);
+                    p->onexit = NULL;
+                }
+                p->pty = NULL;
+            }
+        }
+        break;
+    case usage_fan:
+        {
+            /* break up the group, leaving its connections unlinked */
+            struct sockptyr_fan *fan = hdl->u.u_fan;
+            struct sockptyr_hdl *member;
+            if (fan) {
+                if (fan->slow_timer != NULL) {
+                    Tcl_DeleteTimerHandler(fan->slow_timer);
+                }
+                member = fan->src;
+                if (member != NULL) {
+                    fan->src = NULL;
+                    member->u.u_conn.fan = NULL;
+                    sockptyr_conn_drained(hdl->sd, &(member->u.u_conn));
+                    sockptyr_register_conn_handler(member);
+                }
+                while (fan->sinks != NULL) {
+                    member = fan->sinks;
+                    sockptyr_fan_detach(member);
+                    sockptyr_register_conn_handler(member);
+                }
+                ckfree((void *)fan);
+                hdl->u.u_fan = NULL;
+            }
+        }
+        break;
     default:
         /* shouldn't happen */
         --*(unsigned *)1; /* this is intended to crash */
@@ -836,6 +2894,8 @@ static void sockptyr_clobber_handle(struct sockptyr_hdl *hdl, int dofree)
  * tracking a connection.  'fd' is the file descriptor for that connection
  * (often, a socket).  'code' is a code indicating the type of connection:
  *      'p' - PTY
+ *      'c' - socket from "sockptyr connect"
+ *      'a' - socket accepted on a "sockptyr listen" socket
  */
 static void sockptyr_init_conn(struct sockptyr_hdl *hdl, int fd, int code)
 {
@@ -846,11 +2906,33 @@ static void sockptyr_init_conn(struct sockptyr_hdl *hdl, int fd, int code)
     memset(conn, 0, sizeof(*conn));
     conn->fd = fd;
     conn->buf_sz = hdl->sd->buf_sz;
-    conn->buf = (void *)ckalloc(conn->buf_sz);
+    conn->buf = NULL; /* until there's something to put in it */
     conn->buf_empty = 1;
     conn->buf_in = conn->buf_out = 0;
+    conn->code = code;
+    conn->eio_closed = 0;
+    conn->reg_mask = -1;
+#if USE_SPLICE
+    conn->spl_fds[0] = conn->spl_fds[1] = -1;
+    conn->spl_fill = conn->spl_cap = conn->spl_full = 0;
+#endif /* USE_SPLICE */
+#if USE_OFFLOAD
+    conn->offw = NULL;
+    conn->off_mask = -1;
+    conn->off_stopped = conn->off_pending = 0;
+#endif /* USE_OFFLOAD */
     conn->linked = NULL;
+    conn->fan = NULL;
+    conn->fan_next = NULL;
+    conn->fan_lag = conn->fan_slow = 0;
+    conn->sbk = NULL;
+    conn->rpl_pos = conn->rpl_end = 0;
+    conn->lat = NULL;
+#if USE_RECORD
+    conn->rec = NULL;
+#endif /* USE_RECORD */
     conn->onclose = conn->onerror = NULL;
+    conn->cnct = conn->rcon = NULL;
     sockptyr_register_conn_handler(hdl);
 }
 
@@ -859,12 +2941,20 @@ static void sockptyr_init_conn(struct sockptyr_hdl *hdl, int fd, int code)
  * things like type and links and how they fit together.  For debugging
  * in case the name didn't make that clear.
  */
-static int sockptyr_cmd_dbg_handles(ClientData cd, Tcl_Interp *interp)
+static int sockptyr_cmd_dbg_handles(ClientData cd, Tcl_Interp *interp,
+                                    int objc, Tcl_Obj *const objv[])
 {
-    char err[512];
+    char err[512], buf[128];
     struct sockptyr_data *sd = cd;
+    struct sockptyr_cnct *c;
+    struct sockptyr_proc *p;
     int i;
 
+    if (objc != 0) {
+        Tcl_SetResult(interp, "usage: sockptyr dbg_handles", TCL_STATIC);
+        return(TCL_ERROR);
+    }
+
     Tcl_SetResult(interp, "", TCL_STATIC);
     err[0] = '\0';
     for (i = 0; i < sd->ahdls; ++i) {
@@ -880,6 +2970,35 @@ static int sockptyr_cmd_dbg_handles(ClientData cd, Tcl_Interp *interp)
                              err, sizeof(err));
 #endif
 
+    Tcl_AppendElement(interp, "alloc");
+    snprintf(buf, sizeof(buf), "handles %d grows %lu moved %lu"
+             " grow_us %lld grow_max_us %lld",
+             sd->ahdls, sd->n_hdl_grow, sd->n_hdl_moved,
+             sd->hdl_grow_us, sd->hdl_grow_max_us);
+    Tcl_AppendElement(interp, buf);
+    Tcl_AppendElement(interp, "reg");
+    snprintf(buf, sizeof(buf), "done %lu skipped %lu",
+             sd->n_reg_done, sd->n_reg_skipped);
+    Tcl_AppendElement(interp, buf);
+    Tcl_AppendElement(interp, "connect");
+    for (i = 0, c = sd->cnct_head; c != NULL; c = c->next) {
+        ++i;
+    }
+    snprintf(buf, sizeof(buf), "limit %d started %d queued %d",
+             sd->connect_limit, sd->n_connecting, i);
+    Tcl_AppendElement(interp, buf);
+    Tcl_AppendElement(interp, "spawn");
+    for (i = 0, p = sd->procs; p != NULL; p = p->next) {
+        ++i;
+    }
+    snprintf(buf, sizeof(buf), "running %d sigchld %d", i, sd->sigchld);
+    Tcl_AppendElement(interp, buf);
+#if USE_INOTIFY
+    Tcl_AppendElement(interp, "inotify");
+    snprintf(buf, sizeof(buf), "overflows %lu", sd->inotify_overflows);
+    Tcl_AppendElement(interp, buf);
+#endif /* USE_INOTIFY */
+
     if (err[0]) {
         Tcl_AppendElement(interp, "err");
         Tcl_AppendElement(interp, err);
@@ -914,6 +3033,8 @@ static void sockptyr_dbg_handles_one(Tcl_Interp *interp,
     case usage_inot:    Tcl_AppendElement(interp, "inot"); break;
 #endif
     case usage_lstn:    Tcl_AppendElement(interp, "lstn"); break;
+    case usage_proc:    Tcl_AppendElement(interp, "proc"); break;
+    case usage_fan:     Tcl_AppendElement(interp, "fan"); break;
     default:
         if (!err[0]) {
             snprintf(err, errsz, "unknown usage value %d", (int)hdl->usage);
@@ -922,6 +3043,10 @@ static void sockptyr_dbg_handles_one(Tcl_Interp *interp,
         Tcl_AppendElement(interp, buf);
         break;
     }
+    snprintf(buf, sizeof(buf), "%d gen", (int)hdl->num);
+    Tcl_AppendElement(interp, buf);
+    snprintf(buf, sizeof(buf), "%lu", hdl->gen);
+    Tcl_AppendElement(interp, buf);
 
     switch (hdl->usage) {
     case usage_empty:
@@ -944,6 +3069,72 @@ static void sockptyr_dbg_handles_one(Tcl_Interp *interp,
                      (int)conn->buf_sz, (int)conn->buf_empty,
                      (int)conn->buf_in, (int)conn->buf_out);
             Tcl_AppendElement(interp, buf);
+            snprintf(buf, sizeof(buf), "%d reg", (int)hdl->num);
+            Tcl_AppendElement(interp, buf);
+            snprintf(buf, sizeof(buf), "%d", (int)conn->reg_mask);
+            Tcl_AppendElement(interp, buf);
+            snprintf(buf, sizeof(buf), "%d io", (int)hdl->num);
+            Tcl_AppendElement(interp, buf);
+            snprintf(buf, sizeof(buf), "ev %lu rd %lu wr %lu",
+                     conn->n_ev, conn->n_rd, conn->n_wr);
+            Tcl_AppendElement(interp, buf);
+            if (conn->sbk) {
+                snprintf(buf, sizeof(buf), "%d sbk", (int)hdl->num);
+                Tcl_AppendElement(interp, buf);
+                snprintf(buf, sizeof(buf), "sz %lu total %llu",
+                         (unsigned long)conn->sbk->size,
+                         (unsigned long long)conn->sbk->hdr->total);
+                Tcl_AppendElement(interp, buf);
+            }
+            if (conn->rpl_pos != conn->rpl_end) {
+                snprintf(buf, sizeof(buf), "%d replay", (int)hdl->num);
+                Tcl_AppendElement(interp, buf);
+                snprintf(buf, sizeof(buf), "%llu %llu",
+                         (unsigned long long)conn->rpl_pos,
+                         (unsigned long long)conn->rpl_end);
+                Tcl_AppendElement(interp, buf);
+                if (!conn->linked && !conn->fan && !err[0]) {
+                    snprintf(err, errsz, "%d replaying while unlinked",
+                             (int)hdl->num);
+                }
+            }
+#if USE_RECORD
+            if (conn->rec) {
+                struct sockptyr_rec *rec = conn->rec;
+                snprintf(buf, sizeof(buf), "%d rec", (int)hdl->num);
+                Tcl_AppendElement(interp, buf);
+                Tcl_MutexLock(&(rec->w->lock));
+                snprintf(buf, sizeof(buf), "bytes %lu dropped %lu err %d",
+                         rec->n_bytes, rec->n_dropped, rec->err);
+                Tcl_MutexUnlock(&(rec->w->lock));
+                Tcl_AppendElement(interp, buf);
+            }
+#endif /* USE_RECORD */
+#if USE_SPLICE
+            if (conn->spl_fds[0] >= 0) {
+                snprintf(buf, sizeof(buf), "%d spl", (int)hdl->num);
+                Tcl_AppendElement(interp, buf);
+                snprintf(buf, sizeof(buf), "r %d w %d fill %d cap %d full %d",
+                         (int)conn->spl_fds[0], (int)conn->spl_fds[1],
+                         (int)conn->spl_fill, (int)conn->spl_cap,
+                         (int)conn->spl_full);
+                Tcl_AppendElement(interp, buf);
+            }
+#endif /* USE_SPLICE */
+#if USE_OFFLOAD
+            if (conn->offw) {
+                /* this is read while the worker thread may be changing
+                 * it; good enough for debugging
+                 */
+                snprintf(buf, sizeof(buf), "%d offload", (int)hdl->num);
+                Tcl_AppendElement(interp, buf);
+                snprintf(buf, sizeof(buf), "w %d mask %d stopped %d"
+                         " pending %d",
+                         (int)conn->offw->num, (int)conn->off_mask,
+                         (int)conn->off_stopped, (int)conn->off_pending);
+                Tcl_AppendElement(interp, buf);
+            }
+#endif /* USE_OFFLOAD */
             if (conn->linked) {
                 snprintf(buf, sizeof(buf), "%d linked", (int)hdl->num);
                 Tcl_AppendElement(interp, buf);
@@ -961,15 +3152,44 @@ static void sockptyr_dbg_handles_one(Tcl_Interp *interp,
                                    conn->linked->u.u_conn.linked->num : -1));
                 }
             }
+            if (conn->fan) {
+                snprintf(buf, sizeof(buf), "%d fan", (int)hdl->num);
+                Tcl_AppendElement(interp, buf);
+                if (conn->fan->src == hdl) {
+                    snprintf(buf, sizeof(buf), "%d src",
+                             (int)conn->fan->hdl->num);
+                } else {
+                    snprintf(buf, sizeof(buf), "%d lag %d slow %d",
+                             (int)conn->fan->hdl->num, (int)conn->fan_lag,
+                             (int)conn->fan_slow);
+                }
+                Tcl_AppendElement(interp, buf);
+                if (conn->linked && !err[0]) {
+                    snprintf(err, errsz, "%d in fan-out group & linked",
+                             (int)hdl->num);
+                }
+            }
+            if (conn->cnct || conn->rcon) {
+                struct sockptyr_cnct *c = conn->cnct ? conn->cnct : conn->rcon;
+                /* with -reconnect, 'rcon' stays once it's connected */
+                snprintf(buf, sizeof(buf), "%d %s", (int)hdl->num,
+                         conn->cnct ? "connecting" : "connected");
+                Tcl_AppendElement(interp, buf);
+                snprintf(buf, sizeof(buf), "state %c started %d retry %d"
+                         " failures %d backoff %d",
+                         c->state, (int)c->started, (int)c->retry_ms,
+                         (int)c->failures, (int)c->backoff_ms);
+                Tcl_AppendElement(interp, buf);
+            }
             if (conn->onclose) {
                 snprintf(buf, sizeof(buf), "%d onclose", (int)hdl->num);
                 Tcl_AppendElement(interp, buf);
-                Tcl_AppendElement(interp, conn->onclose);
+                Tcl_AppendElement(interp, Tcl_GetString(conn->onclose));
             }
             if (conn->onerror) {
                 snprintf(buf, sizeof(buf), "%d onerror", (int)hdl->num);
                 Tcl_AppendElement(interp, buf);
-                Tcl_AppendElement(interp, conn->onerror);
+                Tcl_AppendElement(interp, Tcl_GetString(conn->onerror));
             }
         }
         break;
@@ -977,8 +3197,19 @@ static void sockptyr_dbg_handles_one(Tcl_Interp *interp,
     case usage_inot:
         snprintf(buf, sizeof(buf), "%d wd", (int)hdl->num);
         Tcl_AppendElement(interp, buf);
-        snprintf(buf, sizeof(buf), "%d", (int)hdl->u.u_inot.wd);
+        snprintf(buf, sizeof(buf), "%d", (int)hdl->u.u_inot.w->wd);
         Tcl_AppendElement(interp, buf);
+        snprintf(buf, sizeof(buf), "%d refs", (int)hdl->num);
+        Tcl_AppendElement(interp, buf);
+        snprintf(buf, sizeof(buf), "%d", (int)hdl->u.u_inot.w->refs);
+        Tcl_AppendElement(interp, buf);
+        if (hdl->u.u_inot.w->names) {
+            snprintf(buf, sizeof(buf), "%d names", (int)hdl->num);
+            Tcl_AppendElement(interp, buf);
+            snprintf(buf, sizeof(buf), "%d",
+                     (int)hdl->u.u_inot.w->names->numEntries);
+            Tcl_AppendElement(interp, buf);
+        }
         snprintf(buf, sizeof(buf), "%d proc", (int)hdl->num);
         Tcl_AppendElement(interp, buf);
         Tcl_AppendElement(interp, Tcl_GetString(hdl->u.u_inot.proc));
@@ -989,10 +3220,90 @@ static void sockptyr_dbg_handles_one(Tcl_Interp *interp,
         Tcl_AppendElement(interp, buf);
         snprintf(buf, sizeof(buf), "%d", (int)hdl->u.u_lstn.sok);
         Tcl_AppendElement(interp, buf);
+        snprintf(buf, sizeof(buf), "%d accept", (int)hdl->num);
+        Tcl_AppendElement(interp, buf);
+        snprintf(buf, sizeof(buf), "accepted %lu paused %lu now %d",
+                 hdl->u.u_lstn.n_accepted, hdl->u.u_lstn.n_paused,
+                 hdl->u.u_lstn.paused);
+        Tcl_AppendElement(interp, buf);
         snprintf(buf, sizeof(buf), "%d proc", (int)hdl->num);
         Tcl_AppendElement(interp, buf);
         Tcl_AppendElement(interp, Tcl_GetString(hdl->u.u_lstn.proc));
         break;
+    case usage_proc:
+        snprintf(buf, sizeof(buf), "%d pid", (int)hdl->num);
+        Tcl_AppendElement(interp, buf);
+        snprintf(buf, sizeof(buf), "%d pidfd %d",
+                 (int)hdl->u.u_proc->pid, hdl->u.u_proc->pidfd);
+        Tcl_AppendElement(interp, buf);
+        if (hdl->u.u_proc->pty) {
+            snprintf(buf, sizeof(buf), "%d pty", (int)hdl->num);
+            Tcl_AppendElement(interp, buf);
+            snprintf(buf, sizeof(buf), "%d", (int)hdl->u.u_proc->pty->num);
+            Tcl_AppendElement(interp, buf);
+        }
+        if (hdl->u.u_proc->onexit) {
+            snprintf(buf, sizeof(buf), "%d onexit", (int)hdl->num);
+            Tcl_AppendElement(interp, buf);
+            Tcl_AppendElement(interp, Tcl_GetString(hdl->u.u_proc->onexit));
+        }
+        break;
+    case usage_fan:
+        {
+            struct sockptyr_fan *fan = hdl->u.u_fan;
+            struct sockptyr_conn *sconn = &(fan->src->u.u_conn);
+            struct sockptyr_hdl *sink;
+            int n, lag, used;
+            Tcl_Obj *lst;
+
+            snprintf(buf, sizeof(buf), "%d src", (int)hdl->num);
+            Tcl_AppendElement(interp, buf);
+            snprintf(buf, sizeof(buf), "%d", (int)fan->src->num);
+            Tcl_AppendElement(interp, buf);
+            snprintf(buf, sizeof(buf), "%d sinks", (int)hdl->num);
+            Tcl_AppendElement(interp, buf);
+            lst = Tcl_NewListObj(0, NULL);
+            Tcl_IncrRefCount(lst);
+            for (n = lag = 0, sink = fan->sinks; sink != NULL;
+                 ++n, sink = sink->u.u_conn.fan_next) {
+                Tcl_ListObjAppendElement(interp, lst,
+                                         Tcl_NewIntObj(sink->num));
+                if (sink->u.u_conn.fan_lag > lag) {
+                    lag = sink->u.u_conn.fan_lag;
+                }
+                if (sink->u.u_conn.fan != fan && !err[0]) {
+                    snprintf(err, errsz, "fan %d sink %d in fan %d",
+                             (int)hdl->num, (int)sink->num,
+                             (int)(sink->u.u_conn.fan ?
+                                   sink->u.u_conn.fan->hdl->num : -1));
+                }
+            }
+            Tcl_AppendElement(interp, Tcl_GetString(lst));
+            Tcl_DecrRefCount(lst);
+            snprintf(buf, sizeof(buf), "%d policy", (int)hdl->num);
+            Tcl_AppendElement(interp, buf);
+            snprintf(buf, sizeof(buf), "%c dropped %lu cut %lu",
+                     fan->policy, fan->n_dropped, fan->n_cut);
+            Tcl_AppendElement(interp, buf);
+
+            /* the source's buffer holds what the furthest behind sink
+             * has yet to send
+             */
+            used = sconn->buf_empty ? 0 :
+                (sconn->buf_in - sconn->buf_out + sconn->buf_sz - 1)
+                % sconn->buf_sz + 1;
+            if (n != fan->nsinks && !err[0]) {
+                snprintf(err, errsz, "fan %d has %d sinks, exp %d",
+                         (int)hdl->num, n, fan->nsinks);
+            } else if (sconn->fan != fan && !err[0]) {
+                snprintf(err, errsz, "fan %d source not in it",
+                         (int)hdl->num);
+            } else if (n > 0 && used != lag && !err[0]) {
+                snprintf(err, errsz, "fan %d source has %d, lag %d",
+                         (int)hdl->num, used, lag);
+            }
+        }
+        break;
     }
 }
 
@@ -1072,11 +3383,14 @@ static void sockptyr_dbg_handles_lst(Tcl_Interp *interp,
  * to initialize an array.
  */
 static int sockptyr_cmd_info(ClientData cd, Tcl_Interp *interp,
-                             int argc, const char *argv[])
+                             int objc, Tcl_Obj *const objv[])
 {
+    struct sockptyr_data *sd = cd;
+    unsigned long n_used, n_gets, n_hits;
+    long bytes_used, bytes_free;
     char buf[512];
 
-    if (argc != 0) {    
+    if (objc != 0) {    
         Tcl_SetResult(interp, "usage: sockptyr info", TCL_STATIC);
         return(TCL_ERROR);
     }
@@ -1087,15 +3401,346 @@ static int sockptyr_cmd_info(ClientData cd, Tcl_Interp *interp,
     snprintf(buf, sizeof(buf), "%d", (int)USE_INOTIFY);
     Tcl_AppendElement(interp, buf);
 
+    Tcl_AppendElement(interp, "USE_SPLICE");
+    snprintf(buf, sizeof(buf), "%d", (int)USE_SPLICE);
+    Tcl_AppendElement(interp, buf);
+
+    Tcl_AppendElement(interp, "USE_OFFLOAD");
+    snprintf(buf, sizeof(buf), "%d", (int)USE_OFFLOAD);
+    Tcl_AppendElement(interp, buf);
+
+    Tcl_AppendElement(interp, "USE_RECORD");
+    snprintf(buf, sizeof(buf), "%d", (int)USE_RECORD);
+    Tcl_AppendElement(interp, buf);
+
+    Tcl_AppendElement(interp, "USE_READV");
+    snprintf(buf, sizeof(buf), "%d", (int)USE_READV);
+    Tcl_AppendElement(interp, buf);
+
+    Tcl_AppendElement(interp, "USE_ACCEPT4");
+    snprintf(buf, sizeof(buf), "%d", (int)USE_ACCEPT4);
+    Tcl_AppendElement(interp, buf);
+
+    Tcl_AppendElement(interp, "USE_POSIX_SPAWN");
+    snprintf(buf, sizeof(buf), "%d", (int)USE_POSIX_SPAWN);
+    Tcl_AppendElement(interp, buf);
+
+    Tcl_AppendElement(interp, "USE_SPAWN_CLOSEFROM");
+    snprintf(buf, sizeof(buf), "%d", (int)USE_SPAWN_CLOSEFROM);
+    Tcl_AppendElement(interp, buf);
+
+    Tcl_AppendElement(interp, "USE_PIDFD");
+    snprintf(buf, sizeof(buf), "%d", (int)USE_PIDFD);
+    Tcl_AppendElement(interp, buf);
+
+    /* and statistics of the connection buffer pool */
+    Tcl_MutexLock(&(sd->pool.lock));
+    n_used = sd->pool.n_used;
+    n_gets = sd->pool.n_gets;
+    n_hits = sd->pool.n_hits;
+    bytes_used = sd->pool.bytes_used;
+    bytes_free = sd->pool.bytes_free;
+    Tcl_MutexUnlock(&(sd->pool.lock));
+    Tcl_AppendElement(interp, "pool_used");
+    snprintf(buf, sizeof(buf), "%lu", n_used);
+    Tcl_AppendElement(interp, buf);
+    Tcl_AppendElement(interp, "pool_bytes_used");
+    snprintf(buf, sizeof(buf), "%ld", bytes_used);
+    Tcl_AppendElement(interp, buf);
+    Tcl_AppendElement(interp, "pool_bytes_free");
+    snprintf(buf, sizeof(buf), "%ld", bytes_free);
+    Tcl_AppendElement(interp, buf);
+    Tcl_AppendElement(interp, "pool_gets");
+    snprintf(buf, sizeof(buf), "%lu", n_gets);
+    Tcl_AppendElement(interp, buf);
+    Tcl_AppendElement(interp, "pool_hits");
+    snprintf(buf, sizeof(buf), "%lu", n_hits);
+    Tcl_AppendElement(interp, buf);
+
+    return(TCL_OK);
+}
+
+/* Tcl command "sockptyr stats ?$hdl?" -- Return traffic counts for
+ * connection $hdl, or added up for all connections, as a dict; see
+ * sockptyr-tcl-api.txt for what's in it.  "sockptyr stats -latency $hdl"
+ * instead returns percentiles of how long what $hdl received waited to
+ * be sent, from "sockptyr link -latency".
+ */
+static int sockptyr_cmd_stats(ClientData cd, Tcl_Interp *interp,
+                              int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    struct sockptyr_hdl *hdl;
+    struct sockptyr_conn tot;
+    struct sockptyr_lat *lat;
+    Tcl_Obj *d;
+    Tcl_WideInt buf_tot = 0;
+    int i, nconn = 0, latency = 0;
+
+    if (objc > 0 && !strcmp(Tcl_GetString(objv[0]), "-latency")) {
+        latency = 1;
+        --objc;
+        ++objv;
+    }
+    if (objc > 1 || (latency && objc != 1)) {
+        Tcl_SetResult(interp, "usage: sockptyr stats ?$hdl?"
+                      " or sockptyr stats -latency $hdl", TCL_STATIC);
+        return(TCL_ERROR);
+    }
+    memset(&tot, 0, sizeof(tot));
+    if (objc > 0) {
+        hdl = sockptyr_lookup_handle(sd, objv[0]);
+        if (hdl == NULL || hdl->usage != usage_conn) {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("handle %s is not a connection"
+                                           " handle",
+                                           Tcl_GetString(objv[0])));
+            return(TCL_ERROR);
+        }
+        if (latency) {
+            /* read while a worker thread may be changing it; it's only
+             * statistics
+             */
+            d = Tcl_NewDictObj();
+            lat = hdl->u.u_conn.lat;
+            sockptyr_stats_put(d, "count", lat ? lat->count : 0);
+            sockptyr_stats_put(d, "p50",
+                               lat ? sockptyr_lat_percentile(lat, 50) : 0);
+            sockptyr_stats_put(d, "p99",
+                               lat ? sockptyr_lat_percentile(lat, 99) : 0);
+            sockptyr_stats_put(d, "p999",
+                               lat ? sockptyr_lat_percentile(lat, 99.9) : 0);
+            sockptyr_stats_put(d, "max", lat ? lat->max : 0);
+            Tcl_SetObjResult(interp, d);
+            return(TCL_OK);
+        }
+        sockptyr_stats_add(&tot, &buf_tot, &(hdl->u.u_conn));
+        nconn = 1;
+    } else {
+        for (i = 0; i < sd->ahdls; ++i) {
+            if (sd->hdls[i]->usage == usage_conn) {
+                sockptyr_stats_add(&tot, &buf_tot,
+                                   &(sd->hdls[i]->u.u_conn));
+                ++nconn;
+            }
+        }
+    }
+
+    d = Tcl_NewDictObj();
+    sockptyr_stats_put(d, "connections", nconn);
+    sockptyr_stats_put(d, "bytes_in", tot.n_in);
+    sockptyr_stats_put(d, "bytes_out", tot.n_out);
+    sockptyr_stats_put(d, "reads", tot.n_rd);
+    sockptyr_stats_put(d, "writes", tot.n_wr);
+    sockptyr_stats_put(d, "events", tot.n_ev);
+    sockptyr_stats_put(d, "buffer_full", tot.n_full);
+    sockptyr_stats_put(d, "buffer_size", buf_tot);
+    sockptyr_stats_put(d, "peak_fill", tot.peak);
+    sockptyr_stats_put(d, "idle_ms", (tot.last_ms == 0) ? -1 :
+                       sockptyr_now_ms() - tot.last_ms);
+    Tcl_SetObjResult(interp, d);
+    return(TCL_OK);
+}
+
+/* sockptyr_stats_add(): For "sockptyr stats", add one connection's
+ * counts into 'tot': most are summed, but 'peak' is the highest and
+ * 'last_ms' the latest.  Buffer sizes are summed into '*buf_tot'
+ * instead, since added up they can overflow an int.
+ */
+static void sockptyr_stats_add(struct sockptyr_conn *tot,
+                               Tcl_WideInt *buf_tot,
+                               struct sockptyr_conn *conn)
+{
+    tot->n_in += conn->n_in;
+    tot->n_out += conn->n_out;
+    tot->n_rd += conn->n_rd;
+    tot->n_wr += conn->n_wr;
+    tot->n_ev += conn->n_ev;
+    tot->n_full += conn->n_full;
+    *buf_tot += conn->buf_sz;
+    if (conn->peak > tot->peak) {
+        tot->peak = conn->peak;
+    }
+    if (conn->last_ms > tot->last_ms) {
+        tot->last_ms = conn->last_ms;
+    }
+}
+
+/* sockptyr_stats_put(): Put a number in the dict "sockptyr stats"
+ * returns.
+ */
+static void sockptyr_stats_put(Tcl_Obj *d, const char *key, long long val)
+{
+    Tcl_DictObjPut(NULL, d, Tcl_NewStringObj(key, -1),
+                   Tcl_NewWideIntObj((Tcl_WideInt)val));
+}
+
+/* Tcl command "sockptyr trace on ?$records?", "sockptyr trace off",
+ * "sockptyr trace dump $file" -- Record what happens on connections
+ * in a ring in memory, and write it to a file to be looked at with
+ * tests/sockptyr_trace_decode.tcl.
+ */
+static int sockptyr_cmd_trace(ClientData cd, Tcl_Interp *interp,
+                              int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    struct sockptyr_trace *tr = &(sd->trace);
+    const char *what = (objc > 0) ? Tcl_GetString(objv[0]) : "";
+    long n = trace_default;
+    unsigned long size;
+
+    if (!strcmp(what, "on") && objc <= 2) {
+        if (objc > 1) {
+            if (Tcl_GetLongFromObj(interp, objv[1], &n) != TCL_OK) {
+                return(TCL_ERROR);
+            }
+            if (n < 1 || n > trace_max) {
+                Tcl_SetObjResult(interp,
+                                 Tcl_ObjPrintf("sockptyr trace: size must"
+                                               " be 1 to %ld records",
+                                               trace_max));
+                return(TCL_ERROR);
+            }
+        }
+        for (size = 1; size < (unsigned long)n; size <<= 1)
+            ; /* a power of two */
+        if (tr->recs == NULL) {
+            tr->recs = (void *)ckalloc(sizeof(tr->recs[0]) * size);
+            memset(tr->recs, 0, sizeof(tr->recs[0]) * size);
+            tr->size = size;
+            tr->next = 0;
+        } else if (objc > 1 && size != tr->size) {
+            /* worker threads might be writing in it, so it stays */
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("sockptyr trace: ring already"
+                                           " has %lu records", tr->size));
+            return(TCL_ERROR);
+        }
+        sd->trace_on = 1;
+        return(TCL_OK);
+    } else if (!strcmp(what, "off") && objc == 1) {
+        sd->trace_on = 0;
+        return(TCL_OK);
+    } else if (!strcmp(what, "dump") && objc == 2) {
+        return(sockptyr_trace_dump(interp, sd, Tcl_GetString(objv[1])));
+    } else {
+        Tcl_SetResult(interp, "usage: sockptyr trace on ?$records?"
+                      " | off | dump $file", TCL_STATIC);
+        return(TCL_ERROR);
+    }
+}
+
+/* sockptyr_trace_dump(): For "sockptyr trace dump": write what's in the
+ * trace ring, oldest first, to file 'path', in the format described in
+ * sockptyr-tcl-api.txt.  Records being written at the time may come out
+ * garbled.  Returns a Tcl result code, with the number of records
+ * written in 'interp' if it worked.
+ */
+static int sockptyr_trace_dump(Tcl_Interp *interp, struct sockptyr_data *sd,
+                               const char *path)
+{
+    struct sockptyr_trace *tr = &(sd->trace);
+    struct sockptyr_trec *r;
+    struct timeval tv;
+    unsigned char *buf, *p;
+    uint64_t next, i, n;
+    size_t len, pos;
+    int fd, rv, e;
+
+    next = (tr->recs != NULL) ? __atomic_load_n(&(tr->next), __ATOMIC_ACQUIRE)
+                              : 0;
+    n = (next < tr->size) ? next : tr->size;
+    len = 32 + 24 * (size_t)n;
+    buf = (void *)ckalloc(len);
+
+    /* header: magic, record size, number of records, and what to add to
+     * their times to get the time of day, all in microseconds
+     */
+    memcpy(buf, trace_magic, sizeof(trace_magic));
+    sockptyr_put_le(buf + 16, 24, 4);
+    sockptyr_put_le(buf + 20, n, 4);
+    gettimeofday(&tv, NULL);
+    sockptyr_put_le(buf + 24, (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec -
+                    (uint64_t)sockptyr_now_us(), 8);
+    p = buf + 32;
+    for (i = next - n; i < next; ++i) {
+        r = &(tr->recs[i & (tr->size - 1)]);
+        sockptyr_put_le(p, r->us, 8);
+        sockptyr_put_le(p + 8, r->num, 4);
+        sockptyr_put_le(p + 12, (uint32_t)r->len, 4);
+        sockptyr_put_le(p + 16, r->type, 2);
+        sockptyr_put_le(p + 18, r->err, 2);
+        sockptyr_put_le(p + 20, r->arg, 4);
+        p += 24;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    e = errno;
+    for (pos = 0; fd >= 0 && pos < len; pos += rv) {
+        rv = write(fd, buf + pos, len - pos);
+        if (rv < 0 && errno == EINTR) {
+            rv = 0;
+        } else if (rv < 0) {
+            e = errno;
+            break;
+        }
+    }
+    if (fd >= 0 && close(fd) < 0 && pos >= len) {
+        e = errno;
+        pos = 0;
+    }
+    ckfree((void *)buf);
+    if (fd < 0 || pos < len) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("sockptyr trace dump: %s: %s",
+                                       path, strerror(e)));
+        return(TCL_ERROR);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)n));
     return(TCL_OK);
 }
 
+/* sockptyr_trace(): Add a record to the "sockptyr trace" ring, from
+ * whatever thread; use SOCKPTYR_TRACE() to only do it if it's on.
+ * Leaves errno alone.
+ */
+static void sockptyr_trace(struct sockptyr_data *sd, int type, int num,
+                           int len, int err, int arg)
+{
+    struct sockptyr_trace *tr = &(sd->trace);
+    struct sockptyr_trec *r;
+    uint64_t i;
+    int e = errno;
+
+    i = __atomic_fetch_add(&(tr->next), 1, __ATOMIC_RELAXED);
+    r = &(tr->recs[i & (tr->size - 1)]);
+    r->us = sockptyr_now_us();
+    r->num = num;
+    r->len = len;
+    r->type = type;
+    r->err = err;
+    r->arg = arg;
+    errno = e;
+}
+
+/* sockptyr_put_le(): Store 'v' in 'n' bytes at 'p', little endian. */
+static void sockptyr_put_le(unsigned char *p, uint64_t v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        p[i] = (v >> (8 * i)) & 0xff;
+    }
+}
+
 #if USE_INOTIFY
 /* Tcl command "sockptyr inotify" -- Interface to Linux's inotify(7)
  * subsystem. The first call to "sockptyr inotify" creates a notify
  * instance; each call adds a watch to it.
  *
  * Parameters:
+ *      -coalesce $ms: hold IN_CREATE, IN_ATTRIB & IN_MOVED_TO events
+ *          for up to that long, merging those for the same name
  *      filename
  *      list of events to watch for (along with a few additional flags
  *          inotify_add_watch() takes); example: {IN_ACCESS IN_ATTRIB}
@@ -1104,32 +3749,57 @@ static int sockptyr_cmd_info(ClientData cd, Tcl_Interp *interp,
  *          cookie associating related events
  *          name field if any, or empty string
  *
- * This implementation is inefficient for having a lot of watches; doesn't
+ * Watches are found by watch descriptor in a hash table.  Several
+ * handles can watch the same file: they share a watch, whose mask is
+ * all the events any of them asked for, and each gets the events it
+ * asked for.  If any of them asked for events about directory entries,
+ * the watch keeps track of the entries, so that if the kernel's queue
+ * overflows, sockptyr_inot_overflow() can find what it missed.  Doesn't
  * provide all the conceivable options; is only available on Linux.
  */
 static int sockptyr_cmd_inotify(ClientData cd, Tcl_Interp *interp,
-                                int argc, const char *argv[])
+                                int objc, Tcl_Obj *const objv[])
 {
     struct sockptyr_data *sd = cd;
     struct sockptyr_hdl *hdl;
     struct sockptyr_inot *inot;
-    uint32_t mask;
-    int mask_argc, i, j, wd;
-    const char **mask_argv;
-    char *ep;
-
-    if (argc != 3) {
-        Tcl_SetResult(interp, "usage: sockptyr inotify $path $mask $run",
-                      TCL_STATIC);
+    struct sockptyr_inotw *w;
+    Tcl_HashEntry *he;
+    uint32_t mask, kmask;
+    int mask_objc, i, j, wd, isnew;
+    Tcl_Obj **mask_objv, *npath;
+    const char *code;
+    long v;
+    int coalesce = 0;
+
+    if (objc == 5 && !strcmp(Tcl_GetString(objv[0]), "-coalesce")) {
+        if (Tcl_GetIntFromObj(interp, objv[1], &coalesce) != TCL_OK) {
+            return(TCL_ERROR);
+        }
+        if (coalesce < 0) {
+            Tcl_SetResult(interp, "coalescing time must not be negative",
+                          TCL_STATIC);
+            return(TCL_ERROR);
+        }
+        objc -= 2;
+        objv += 2;
+    }
+    if (objc != 3) {
+        Tcl_SetResult(interp, "usage: sockptyr inotify ?-coalesce $ms?"
+                      " $path $mask $run", TCL_STATIC);
+        return(TCL_ERROR);
+    }
+    npath = Tcl_FSGetNormalizedPath(interp, objv[0]);
+    if (npath == NULL) {
         return(TCL_ERROR);
     }
 
     /* create an inotify instance if we haven't already */
     if (sd->inotify_fd < 0) {
-        sd->inotify_fd = inotify_init();
+        sd->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
         if (sd->inotify_fd < 0) {
             Tcl_SetObjResult(interp,
-                             Tcl_ObjPrintf("inotify_init() failed: %s",
+                             Tcl_ObjPrintf("inotify_init1() failed: %s",
                                            strerror(errno)));
             return(TCL_ERROR);
         }
@@ -1139,36 +3809,51 @@ static int sockptyr_cmd_inotify(ClientData cd, Tcl_Interp *interp,
 
     /* process the mask value */
     mask = 0;
-    mask_argc = 0;
-    mask_argv = NULL;
-    if (Tcl_SplitList(interp, argv[1], &mask_argc, &mask_argv) != TCL_OK) {
+    if (Tcl_ListObjGetElements(interp, objv[1],
+                               &mask_objc, &mask_objv) != TCL_OK) {
         return(TCL_ERROR);
     }
-    for (i = 0; i < mask_argc; ++i) {
+    for (i = 0; i < mask_objc; ++i) {
+        /* Usually it's a flag name spelled as in the table; that lookup
+         * gets cached in the object.  Otherwise try it without regard
+         * to case, then as a number.
+         */
+        if (Tcl_GetIndexFromObjStruct(NULL, mask_objv[i], inotify_bits,
+                                      sizeof(inotify_bits[0]), "flag",
+                                      TCL_EXACT, &j) == TCL_OK) {
+            mask |= inotify_bits[j].value;
+            continue;
+        }
+        code = Tcl_GetString(mask_objv[i]);
         for (j = 0; inotify_bits[j].name; ++j) {
-            if (!strcasecmp(mask_argv[i], inotify_bits[j].name)) {
+            if (!strcasecmp(code, inotify_bits[j].name)) {
                 break;
             }
         }
         if (inotify_bits[j].name) {
             mask |= inotify_bits[j].value;
+        } else if (Tcl_GetLongFromObj(NULL, mask_objv[i], &v) == TCL_OK) {
+            mask |= v;
         } else {
-            ep = NULL;
-            mask |= strtol(mask_argv[i], &ep, 0);
-            if (ep && *ep) {
-                Tcl_SetObjResult(interp,
-                                 Tcl_ObjPrintf("sockptyr inotify:"
-                                               " unrecognized mask code '%s'",
-                                               mask_argv[i]));
-                Tcl_Free((void *)mask_argv);
-                return(TCL_ERROR);
-            }
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("sockptyr inotify:"
+                                           " unrecognized mask code '%s'",
+                                           code));
+            return(TCL_ERROR);
         }
     }
-    Tcl_Free((void *)mask_argv);
 
-    /* set up the watch */
-    wd = inotify_add_watch(sd->inotify_fd, argv[0], mask);
+    /* set up the watch; if there already is one on the same file, that
+     * gets it and IN_MASK_ADD keeps what the others asked for.  To keep
+     * track of a directory's entries (below) it has to hear of all of
+     * them coming and going, not just what this handle asked for;
+     * sockptyr_inot_dispatch() leaves out the rest.
+     */
+    kmask = mask | IN_MASK_ADD;
+    if (mask & INOT_ENTRIES) {
+        kmask |= INOT_ENTRIES;
+    }
+    wd = inotify_add_watch(sd->inotify_fd, Tcl_GetString(objv[0]), kmask);
     if (wd < 0) {
         Tcl_SetObjResult(interp,
                          Tcl_ObjPrintf("sockptyr inotify:"
@@ -1182,18 +3867,40 @@ static int sockptyr_cmd_inotify(ClientData cd, Tcl_Interp *interp,
     hdl->usage = usage_inot;
     inot = &(hdl->u.u_inot);
     memset(inot, 0, sizeof(*inot));
-    inot->wd = wd;
-    inot->proc = Tcl_NewStringObj(argv[2], strlen(argv[2]));
+    he = Tcl_CreateHashEntry(&(sd->inotify_wds), (void *)(intptr_t)wd, &isnew);
+    if (isnew) {
+        w = (void *)ckalloc(sizeof(*w));
+        w->wd = wd;
+        w->refs = 0;
+        w->hdls = NULL;
+        w->path = ckalloc(strlen(Tcl_GetString(npath)) + 1);
+        strcpy(w->path, Tcl_GetString(npath));
+        w->names = NULL;
+        Tcl_SetHashValue(he, w);
+    } else {
+        w = Tcl_GetHashValue(he);
+    }
+    ++w->refs;
+    inot->w = w;
+    inot->wnext = w->hdls;
+    w->hdls = hdl;
+    inot->mask = mask;
+    inot->coalesce = coalesce;
+    inot->proc = objv[2];
+    if (w->names == NULL && (mask & INOT_ENTRIES)) {
+        /* keep track of the directory's entries, if it's a directory */
+        w->names = (void *)ckalloc(sizeof(*w->names));
+        Tcl_InitHashTable(w->names, TCL_STRING_KEYS);
+        if (sockptyr_inot_scan(w->path, w->names) < 0) {
+            sockptyr_inot_names_free(w);
+        }
+    }
     Tcl_IncrRefCount(inot->proc);
     sockptyr_lst_insert(&(sd->inotify_hdls), hdl);
-#if 0
-    fprintf(stderr, "added inotify: num %d wd %d\n",
-            (int)hdl->num, (int)inot->wd);
-#endif
+    SOCKPTYR_TRACE(sd, trace_inot_add, hdl->num, 0, 0, inot->w->wd);
 
     /* return a handle string identifying it */
-    Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s%d",
-                                           handle_prefix, (int)hdl->num));
+    Tcl_SetObjResult(interp, sockptyr_handle_obj(hdl));
     return(TCL_OK);
 }
 #endif /* !USE_INOTIFY */
@@ -1204,23 +3911,25 @@ static int sockptyr_cmd_inotify(ClientData cd, Tcl_Interp *interp,
  *      sockptyr connect
  *      sockptyr inotify
  *      sockptyr listen
+ *      sockptyr spawn
+ *      sockptyr fanout
  * If this gets called on an already closed handle, nothing happens.
  */
 static int sockptyr_cmd_close(ClientData cd, Tcl_Interp *interp,
-                              int argc, const char *argv[])
+                              int objc, Tcl_Obj *const objv[])
 {
     struct sockptyr_data *sd = cd;
     struct sockptyr_hdl *hdl;
 
-    if (argc != 1) {
+    if (objc != 1) {
         Tcl_SetResult(interp, "usage: sockptyr close $hdl", TCL_STATIC);
         return(TCL_ERROR);
     }
 
-    hdl = sockptyr_lookup_handle(sd, argv[0]);
+    hdl = sockptyr_lookup_handle(sd, objv[0]);
     if (hdl == NULL) {
         Tcl_SetObjResult(interp, Tcl_ObjPrintf("handle %s is not a handle",
-                                               argv[0]));
+                                               Tcl_GetString(objv[0])));
         return(TCL_ERROR);
     }
 
@@ -1229,77 +3938,339 @@ static int sockptyr_cmd_close(ClientData cd, Tcl_Interp *interp,
     return(TCL_OK);
 }
 
-/* Tcl command "sockptyr buffer_size" -- Set buffer size for future
- * connection handles, in bytes.
+/* Tcl command "sockptyr buffer_size" -- Set buffer sizes for connections,
+ * in bytes: the size new ones start at, the range they grow and shrink
+ * within, and the cap on the total.  Returns the settings.
  */
 static int sockptyr_cmd_buffer_size(ClientData cd, Tcl_Interp *interp,
-                                    int argc, const char *argv[])
+                                    int objc, Tcl_Obj *const objv[])
 {
     struct sockptyr_data *sd = cd;
-    int bytes;
-
-    if (argc != 1) {
-        Tcl_SetResult(interp, "usage: sockptyr buffer_size $bytes", TCL_STATIC);
-        return(TCL_ERROR);
+    int sz, min, max, i, fixed = 0;
+    long cap, v;
+    const char *opt;
+
+    sz = sd->buf_sz;
+    min = sd->buf_min;
+    max = sd->buf_max;
+    cap = sd->buf_cap;
+    for (i = 0; i < objc; ++i) {
+        opt = Tcl_GetString(objv[i]);
+        if (opt[0] != '-') {
+            /* a plain size: fixed, unless -min or -max say otherwise */
+            if (Tcl_GetLongFromObj(interp, objv[i], &v) != TCL_OK) {
+                return(TCL_ERROR);
+            }
+            if (v <= 0 || v > INT_MAX) {
+                Tcl_SetResult(interp, "buffer size must be positive",
+                              TCL_STATIC);
+                return(TCL_ERROR);
+            }
+            sz = v;
+            fixed |= 1;
+            continue;
+        }
+        if (i + 1 >= objc || (strcmp(opt, "-min") && strcmp(opt, "-max") &&
+                              strcmp(opt, "-cap"))) {
+            break; /* unknown option, or no value: usage error below */
+        }
+        if (Tcl_GetLongFromObj(interp, objv[i + 1], &v) != TCL_OK) {
+            return(TCL_ERROR);
+        }
+        if (!strcmp(opt, "-cap")) {
+            if (v < 0) {
+                Tcl_SetResult(interp, "buffer size cap can't be negative",
+                              TCL_STATIC);
+                return(TCL_ERROR);
+            }
+            cap = v;
+        } else if (v <= 0 || v > INT_MAX) {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("buffer size %s must be positive",
+                                           opt + 1));
+            return(TCL_ERROR);
+        } else if (!strcmp(opt, "-min")) {
+            min = v;
+            fixed |= 2;
+        } else {
+            max = v;
+            fixed |= 4;
+        }
+        ++i;
+    }
+    if (i < objc) {
+        Tcl_SetResult(interp, "usage: sockptyr buffer_size ?$bytes?"
+                      " ?-min $bytes? ?-max $bytes? ?-cap $bytes?",
+                      TCL_STATIC);
+        return(TCL_ERROR);
+    }
+    if (fixed & 1) {
+        if (!(fixed & 2)) {
+            min = sz;
+        }
+        if (!(fixed & 4)) {
+            max = sz;
+        }
+    }
+    if (min > max) {
+        Tcl_SetResult(interp, "buffer size minimum is more than maximum",
+                      TCL_STATIC);
+        return(TCL_ERROR);
+    }
+    if (sz < min) {
+        sz = min;
+    }
+    if (sz > max) {
+        sz = max;
+    }
+    sd->buf_sz = sz;
+    sd->buf_min = min;
+    sd->buf_max = max;
+    sd->buf_cap = cap;
+
+    /* existing connections' buffers might be outside the new range */
+    sockptyr_buf_sweep_arm(sd);
+
+    Tcl_SetObjResult(interp,
+                     Tcl_ObjPrintf("size %d min %d max %d cap %ld total %ld",
+                                   sd->buf_sz, sd->buf_min, sd->buf_max,
+                                   sd->buf_cap, sockptyr_pool_in_use(sd)));
+    return(TCL_OK);
+}
+
+/* Tcl command "sockptyr io_budget ?$bytes?" -- Set the most bytes that
+ * will be relayed on a connection each time it's found ready for I/O,
+ * before going on to others; returns the number.
+ */
+static int sockptyr_cmd_io_budget(ClientData cd, Tcl_Interp *interp,
+                                  int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    int bytes;
+
+    if (objc > 1) {
+        Tcl_SetResult(interp, "usage: sockptyr io_budget ?$bytes?",
+                      TCL_STATIC);
+        return(TCL_ERROR);
     }
 
-    bytes = atoi(argv[0]);
-    if (bytes <= 0) {
-        Tcl_SetResult(interp, "buffer size must be positive", TCL_STATIC);
+    if (objc > 0) {
+        if (Tcl_GetIntFromObj(interp, objv[0], &bytes) != TCL_OK) {
+            return(TCL_ERROR);
+        }
+        if (bytes <= 0) {
+            Tcl_SetResult(interp, "I/O budget must be positive", TCL_STATIC);
+            return(TCL_ERROR);
+        }
+        /* Worker threads read this without locking; an int gets written
+         * all at once, and it doesn't matter just when they see it.
+         */
+        sd->io_budget = bytes;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(sd->io_budget));
+    return(TCL_OK);
+}
+
+#if USE_OFFLOAD
+/* Tcl command "sockptyr offload_threads ?$n?" -- Set the number of worker
+ * threads used for "sockptyr link -offload"; returns the number.
+ */
+static int sockptyr_cmd_offload_threads(ClientData cd, Tcl_Interp *interp,
+                                        int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    int n;
+
+    if (objc > 1) {
+        Tcl_SetResult(interp, "usage: sockptyr offload_threads ?$n?",
+                      TCL_STATIC);
         return(TCL_ERROR);
     }
-    sd->buf_sz = bytes;
+
+    if (objc > 0) {
+        if (Tcl_GetIntFromObj(interp, objv[0], &n) != TCL_OK) {
+            return(TCL_ERROR);
+        }
+        if (n < 0) {
+            Tcl_SetResult(interp, "number of threads must not be negative",
+                          TCL_STATIC);
+            return(TCL_ERROR);
+        }
+        sd->noffw = n;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(sd->noffw));
     return(TCL_OK);
 }
+#endif /* USE_OFFLOAD */
 
 /* Tcl command "sockptyr exec $command" -- Execute $command in the shell
  * and wait for it to complete.  Returns information about its result.
  * See sockptyr-tcl-api.txt for further discussion.
  */
 static int sockptyr_cmd_exec(ClientData cd, Tcl_Interp *interp,
-                             int argc, const char *argv[])
+                             int objc, Tcl_Obj *const objv[])
 {
     pid_t child;
-    int wstatus, fd, maxfd;
+    int wstatus;
 
-    if (argc != 1) {
+    if (objc != 1) {
         Tcl_SetResult(interp, "usage: sockptyr exec $command", TCL_STATIC);
         return(TCL_ERROR);
     }
 
+    if (sockptyr_spawn_sh(interp, Tcl_GetString(objv[0]), &child)
+        != TCL_OK) {
+        return(TCL_ERROR);
+    }
+
+    /* wait for child to end */
+    wstatus = 0;
+    while (waitpid(child, &wstatus, 0) < 0 && errno == EINTR)
+        ;
+    /* return an indication of its result */
+    Tcl_SetObjResult(interp, sockptyr_wstatus_obj(wstatus));
+    return(TCL_OK);
+}
+
+/* Tcl command "sockptyr spawn" -- Execute a command in the shell, like
+ * "sockptyr exec", but don't wait for it.  Return a handle for the process.
+ *
+ * Parameters:
+ *      -onexit $proc: Tcl script to execute when the process exits, after
+ *          appending two words: the handle, and its result in the form
+ *          "sockptyr exec" returns.  By then the handle's gone.
+ *      -pty $hdl: connection (usually a PTY) to close when the process
+ *          exits, as if it had been closed from the other end: after
+ *          the -onexit script, its "sockptyr onclose" script is run
+ *      command: shell command to execute
+ */
+static int sockptyr_cmd_spawn(ClientData cd, Tcl_Interp *interp,
+                              int objc, Tcl_Obj *const objv[])
+{
+    struct sockptyr_data *sd = cd;
+    struct sockptyr_hdl *hdl, *pty = NULL;
+    Tcl_Obj *onexit = NULL;
+    const char *opt;
+    pid_t child;
+
+    for (; objc > 1; objc -= 2, objv += 2) {
+        opt = Tcl_GetString(objv[0]);
+        if (!strcmp(opt, "-onexit") && objc > 2) {
+            onexit = objv[1];
+        } else if (!strcmp(opt, "-pty") && objc > 2) {
+            pty = sockptyr_lookup_handle(sd, objv[1]);
+            if (pty == NULL || pty->usage != usage_conn) {
+                Tcl_SetObjResult(interp,
+                                 Tcl_ObjPrintf("handle %s"
+                                               " is not a connection handle",
+                                               Tcl_GetString(objv[1])));
+                return(TCL_ERROR);
+            }
+        } else {
+            break;
+        }
+    }
+    if (objc != 1) {
+        Tcl_SetResult(interp, "usage: sockptyr spawn ?-onexit $proc?"
+                      " ?-pty $hdl? $command", TCL_STATIC);
+        return(TCL_ERROR);
+    }
+
+    if (sockptyr_spawn_sh(interp, Tcl_GetString(objv[0]), &child)
+        != TCL_OK) {
+        return(TCL_ERROR);
+    }
+    hdl = sockptyr_proc_new(sd, child, onexit, pty);
+    Tcl_SetObjResult(interp, sockptyr_handle_obj(hdl));
+    return(TCL_OK);
+}
+
+/* sockptyr_spawn_sh(): Start a process running shell command 'command',
+ * for "sockptyr exec" and "sockptyr spawn", with stdin from /dev/null,
+ * stdout & stderr left alone, and other file descriptors closed.  Fills
+ * in '*child' and returns TCL_OK; or leaves an error message in 'interp'
+ * and returns TCL_ERROR.
+ */
+static int sockptyr_spawn_sh(Tcl_Interp *interp, const char *command,
+                             pid_t *child)
+{
+#if USE_POSIX_SPAWN
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t *attrp = NULL;
+    char *argv[4];
+    extern char **environ;
+    int e;
+#if !USE_SPAWN_CLOSEFROM
+    posix_spawnattr_t attr;
+    int fd;
+#endif /* !USE_SPAWN_CLOSEFROM */
+
+    /* new process, with stdin from /dev/null, running $command via the
+     * shell; see USE_SPAWN_CLOSEFROM about other file descriptors
+     */
+    argv[0] = "sh";
+    argv[1] = "-c";
+    argv[2] = (char *)command;
+    argv[3] = NULL;
+    e = posix_spawn_file_actions_init(&fa);
+    if (e == 0) {
+        e = posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+                                             O_RDONLY, 0);
+    }
+#if USE_SPAWN_CLOSEFROM
+    if (e == 0) {
+        e = posix_spawn_file_actions_addclosefrom_np(&fa, STDERR_FILENO + 1);
+    }
+#else /* USE_SPAWN_CLOSEFROM */
+    /* close everything but what the file actions name; so name stdout
+     * and stderr (dup2() onto themselves keeps them open)
+     */
+    for (fd = STDOUT_FILENO; e == 0 && fd <= STDERR_FILENO; ++fd) {
+        if (fcntl(fd, F_GETFD) >= 0) {
+            e = posix_spawn_file_actions_adddup2(&fa, fd, fd);
+        }
+    }
+    if (e == 0) {
+        e = posix_spawnattr_init(&attr);
+        if (e == 0) {
+            attrp = &attr;
+            e = posix_spawnattr_setflags(&attr, POSIX_SPAWN_CLOEXEC_DEFAULT);
+        }
+    }
+#endif /* USE_SPAWN_CLOSEFROM */
+    if (e == 0) {
+        e = posix_spawn(child, "/bin/sh", &fa, attrp, argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    if (attrp) {
+        posix_spawnattr_destroy(attrp);
+    }
+    if (e != 0) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("posix_spawn failed: %s",
+                                       strerror(e)));
+        return(TCL_ERROR);
+    }
+#else /* USE_POSIX_SPAWN */
+    int fd, maxfd;
+
     /* new process */
-    child = fork();
+    *child = fork();
 
     /* which one are we now? */
-    if (child < 0) {
+    if (*child < 0) {
         /* fork() failed; uncommon */
         Tcl_SetObjResult(interp,
                          Tcl_ObjPrintf("fork failed: %s",
                                        strerror(errno)));
         return(TCL_ERROR);
-    } else if (child > 0) {
-        /* parent process */
-        /* wait for child to end */
-        wstatus = 0;
-        while (waitpid(child, &wstatus, 0) < 0)
-            ;
-        /* return an indication of its result */
-        if (WIFEXITED(wstatus)) {
-            Tcl_SetObjResult(interp,
-                             Tcl_ObjPrintf("exit %d",
-                                           (int)WEXITSTATUS(wstatus)));
-        } else if (WIFSIGNALED(wstatus)) {
-            Tcl_SetResult(interp, "signal", TCL_STATIC);
-            Tcl_AppendElement(interp, strsignal(WTERMSIG(wstatus)));
-        } else {
-            Tcl_SetResult(interp, "unknown-termination", TCL_STATIC);
-        }
-        return(TCL_OK);
-    } else {
+    } else if (*child == 0) {
         /* child process */
         /* redirect stdin from /dev/null */
         fd = open("/dev/null", O_RDONLY);
-        dup2(STDIN_FILENO, fd);
+        if (fd >= 0 && fd != STDIN_FILENO) {
+            dup2(fd, STDIN_FILENO);
+        }
 
         /* close file descriptors other than stdin/stderr/stdout */
         maxfd = sysconf(_SC_OPEN_MAX);
@@ -1308,7 +4279,7 @@ static int sockptyr_cmd_exec(ClientData cd, Tcl_Interp *interp,
         }
 
         /* run $command via the shell */
-        execl("/bin/sh", "sh", "-c", argv[argc - 1], NULL);
+        execl("/bin/sh", "sh", "-c", command, NULL);
 
         /* execl() should never return, if it does it indicates a serious
          * problem
@@ -1316,559 +4287,4195 @@ static int sockptyr_cmd_exec(ClientData cd, Tcl_Interp *interp,
         fprintf(stderr, "Unable to run shell?!\n");
         _exit(1);
     }
+#endif /* USE_POSIX_SPAWN */
+
+    /* parent process */
+    return(TCL_OK);
 }
 
-/* sockptyr_register_conn_handler(): For the given handle (which is
- * assumed to refer to a connection) set/clear file event handlers as
- * appropriate to handle the events that this connection is able to
- * deal with at the moment.
+/* sockptyr_wstatus_obj(): Describe how a process ended, given its status
+ * from waitpid(), as "exit $st" or "signal $sig"; see "sockptyr exec".
  */
-static void sockptyr_register_conn_handler(struct sockptyr_hdl *hdl)
+static Tcl_Obj *sockptyr_wstatus_obj(int wstatus)
 {
-    int mask = 0;
-    struct sockptyr_conn *conn = &(hdl->u.u_conn);
-
-    /* Sanity checks */
-    assert(hdl->usage == usage_conn);
-    if (conn->fd < 0) {
-        /* nothing to do */
-        return;
-    }
-
-    if (conn->buf_empty || conn->buf_in != conn->buf_out) {
-        /* buffer isn't full; we can receive into it */
-        mask |= TCL_READABLE;
-    }
-    if (conn->linked && !conn->linked->u.u_conn.buf_empty) {
-        /* linked connection's buffer isn't empty; we can send from it */
-        mask |= TCL_WRITABLE;
+    Tcl_Obj *rv[2];
+
+    if (WIFEXITED(wstatus)) {
+        rv[0] = Tcl_NewStringObj("exit", -1);
+        rv[1] = Tcl_NewIntObj(WEXITSTATUS(wstatus));
+    } else if (WIFSIGNALED(wstatus)) {
+        rv[0] = Tcl_NewStringObj("signal", -1);
+        rv[1] = Tcl_NewStringObj(strsignal(WTERMSIG(wstatus)), -1);
+    } else {
+        return(Tcl_NewStringObj("unknown-termination", -1));
     }
-#if 0
-    fprintf(stderr, "sockptyr_register_conn_handler(): on %d mask %d\n",
-            (int)hdl->num, (int)mask);
-#endif
-    Tcl_CreateFileHandler(conn->fd, mask, &sockptyr_conn_handler,
-                          (ClientData)hdl);
+    return(Tcl_NewListObj(2, rv));
 }
 
-/* sockptyr_conn_handler(): Called by the Tcl event loop when the file
- * descriptor associated with one of our connections can do something
- * we want to do.  'cd' contains the 'struct sockptyr_hdl *' associated
- * with the connection.
+/* sockptyr_proc_new(): Allocate a handle for process 'pid', just started
+ * by "sockptyr spawn", and start watching for it to exit.  'onexit' and
+ * 'pty' are from its -onexit and -pty options; either may be NULL.
  */
-static void sockptyr_conn_handler(ClientData cd, int mask)
+static struct sockptyr_hdl *sockptyr_proc_new(struct sockptyr_data *sd,
+                                              pid_t pid, Tcl_Obj *onexit,
+                                              struct sockptyr_hdl *pty)
 {
-    struct sockptyr_hdl *hdl = cd;
-    struct sockptyr_conn *conn, *lconn;
-    int rv, len;
-
-    /* Sanity checks */
-    assert(hdl != NULL);
-    assert(hdl->usage == usage_conn);
-    conn = &(hdl->u.u_conn);
-
-#if 0
-    fprintf(stderr, "sockptyr_conn_handler() on %d mask %d\n",
-            (int)hdl->num, (int)mask);
-#endif
-    if (conn->fd < 0) {
-        sockptyr_register_conn_handler(hdl);
-        sockptyr_conn_event(hdl, sockptyr_errkws_bug,
-                            "event on closed file descriptor");
-        return;
-    }
+    struct sockptyr_hdl *hdl;
+    struct sockptyr_proc *p;
 
-    /* see about receiving on this connection, into its buffer */
-    if ((mask & TCL_READABLE) && (conn->buf_empty ||
-                                  conn->buf_in != conn->buf_out)) {
-        if (conn->buf_empty) {
-            len = conn->buf_sz;
-            conn->buf_in = conn->buf_out = 0;
-        } else if (conn->buf_out > conn->buf_in) {
-            len = conn->buf_out - conn->buf_in;
-        } else {
-            len = conn->buf_sz - conn->buf_in;
-        }
-        rv = read(conn->fd, conn->buf + conn->buf_in, len);
-#if 0
-        {
-            int e = errno;
-            fprintf(stderr, "read(): on %d, len %d rv %d errno %d\n",
-                    (int)hdl->num, (int)len, (int)rv, (int)e);
-            errno = e;
-        }
-#endif
-        if (rv < 0) {
-            if (errno == EINTR) {
-                /* not really an error, just let it slide */
-            } else {
-                rv = errno;
-                sockptyr_register_conn_handler(hdl);
-                sockptyr_conn_event_sys(hdl, rv, 1);
-                return;
-            }
-        } else if (rv == 0) {
-            /* connection closed */
-            sockptyr_conn_event(hdl, NULL, NULL);
-            return;
-        } else {
-            /* got something, record it in the buffer */
-            conn->buf_empty = 0;
-            conn->buf_in += rv;
-        }
-        if (conn->buf_in == conn->buf_sz) {
-            /* wrap around */
-            conn->buf_in = 0;
-        }
+    hdl = sockptyr_allocate_handle(sd);
+    p = (void *)ckalloc(sizeof(*p));
+    memset(p, 0, sizeof(*p));
+    p->sd = sd;
+    p->hdl = hdl;
+    p->pid = pid;
+    p->onexit = onexit;
+    if (onexit != NULL) {
+        Tcl_IncrRefCount(onexit);
     }
-
-    /* see about sending on this connection, from the linked connection's
-     * buffer
+    p->pty = pty;
+    p->pty_gen = pty ? pty->gen : 0;
+    p->next = sd->procs;
+    sd->procs = p;
+    hdl->usage = usage_proc;
+    hdl->u.u_proc = p;
+
+    /* Watch for it to exit.  If it already has, either way finds out
+     * the next time through the event loop.
      */
-    if ((mask & TCL_WRITABLE) && conn->linked &&
-        !conn->linked->u.u_conn.buf_empty) {
-
-        lconn = &(conn->linked->u.u_conn);
-        if (lconn->buf_in > lconn->buf_out) {
-            len = lconn->buf_in - lconn->buf_out;
-        } else {
-            len = lconn->buf_sz - lconn->buf_out;
-        }
-        rv = write(conn->fd, lconn->buf + lconn->buf_out, len);
-#if 0
-        {
-            int e = errno;
-            fprintf(stderr, "write(): on %d, len %d rv %d errno %d\n",
-                    (int)hdl->num, (int)len, (int)rv, (int)e);
-            errno = e;
-        }
-#endif
-        if (rv < 0) {
-            /* EAGAIN / EWOULDBLOCK shouldn't happen on a blocking socket */
-            if (errno == EINTR) {
-                /* not really an error, just let it slide */
-            } else {
-                rv = errno;
-                sockptyr_register_conn_handler(hdl);
-                sockptyr_conn_event_sys(hdl, rv, 1);
-                return;
-            }
-        } else if (rv == 0) {
-            /* shouldn't have happened */
-            sockptyr_register_conn_handler(hdl);
-            sockptyr_conn_event(hdl, sockptyr_errkws_bug, "zero length write");
-            return;
-        } else {
-            lconn->buf_out += rv;
-            if (lconn->buf_out == lconn->buf_sz) {
-                lconn->buf_out = 0; /* wrap around */
-            }
-            if (lconn->buf_in == lconn->buf_out) {
-                /* became empty */
-                lconn->buf_empty = 1;
-                lconn->buf_in = lconn->buf_out = 0;
-            }
-        }
+#if USE_PIDFD
+    p->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (p->pidfd >= 0) {
+        fcntl(p->pidfd, F_SETFD, FD_CLOEXEC);
+        Tcl_CreateFileHandler(p->pidfd, TCL_READABLE,
+                              &sockptyr_proc_handler, p);
+        return(hdl);
     }
+#else /* USE_PIDFD */
+    p->pidfd = -1;
+#endif /* USE_PIDFD */
+    sockptyr_sigchld_start(sd);
+    return(hdl);
+}
 
-    /* if the connetion isn't linked, just make it a bit bucket */
-    if (!conn->linked) {
-        conn->buf_empty = 1;
-        conn->buf_in = conn->buf_out = 0;
+#if USE_PIDFD
+/* sockptyr_proc_handler(): Called by the Tcl event loop when the pidfd
+ * of a "sockptyr spawn" process is readable, meaning it's exited.
+ */
+static void sockptyr_proc_handler(ClientData cd, int mask)
+{
+    struct sockptyr_proc *p = cd;
+    int wstatus = 0;
+    pid_t r;
+
+    while ((r = waitpid(p->pid, &wstatus, WNOHANG)) < 0 && errno == EINTR)
+        ;
+    if (r == 0) {
+        return; /* not yet, somehow */
     }
-
-    /* since buffer pointers may have moved, maybe the set of events we could
-     * handle has changed
-     */
-    sockptyr_register_conn_handler(hdl);
-    if (conn->linked) {
-        sockptyr_register_conn_handler(conn->linked);
+    if (r < 0) {
+        /* someone else waited for it (ECHILD); don't keep trying */
+        wstatus = 0;
     }
+    sockptyr_proc_exited(p, wstatus);
 }
+#endif /* USE_PIDFD */
 
-#if USE_INOTIFY
-/* sockptyr_inot_handler() -- When an inotify(7) message comes in,
- * read it, find the handler that was registered for it, and run
- * it.
+/* sockptyr_proc_exited(): Handle a "sockptyr spawn" process having exited
+ * with status 'wstatus': free its handle and 'p', run its -onexit script,
+ * and close its -pty connection.
  */
-static void sockptyr_inot_handler(ClientData cd, int mask)
+static void sockptyr_proc_exited(struct sockptyr_proc *p, int wstatus)
 {
-    struct sockptyr_data *sd = cd;
-    struct inotify_event *ie;
-    struct sockptyr_hdl *hdl;
-    struct sockptyr_inot *inot;
-    char buf[65536];
-    int got, pos;
+    struct sockptyr_data *sd = p->sd;
+    Tcl_Interp *interp = sd->interp;
+    struct sockptyr_proc **pp;
+    struct sockptyr_hdl *pty = NULL;
+    unsigned long pty_gen = p->pty_gen;
+    Tcl_Obj *cmd = NULL;
 #if USE_TCL_BACKGROUNDEXCEPTION
     int result;
 #endif
-    Tcl_Obj *tclcom, *flags;
-    Tcl_Interp *interp = sd->interp;
-
-    /* sanity checks */
-    assert(mask & TCL_READABLE);
-    assert(sd);
-    assert(sd->inotify_fd >= 0);
 
-    /* read some events into buf[] */
-    got = read(sd->inotify_fd, buf, sizeof(buf));
-    if (got < 0) {
-        /* some kind of error happened */
-        if (errno == EINTR) {
-            /* not really an error, just let it slide */
-        } else {
-            /* really an error, but not much we can do right here! */
-            sockptyr_inotify_fatal_error(sd,
-                                         "sockptyr_inot_handler() read() error:"
-                                         " %s\n",
-                                         strerror(errno));
-            return;
-        }
-    } else if (got == 0) {
-        /* End of file shouldn't happen, and we shouldn't have been
-         * called if there was nothing to read.  Don't let that happen
-         * frequently.
-         */
-        sockptyr_inotify_fatal_error(sd,
-                                     "sockptyr_inot_handler() read empty\n");
-        return;
+    for (pp = &(sd->procs); *pp != p; pp = &((*pp)->next)) {
+        assert(*pp != NULL);
     }
-
-    for (pos = 0; pos < got; ) {
-        ie = (void *)&(buf[pos]);
-        if (got - pos < sizeof(*ie) ||
-            got - pos < sizeof(*ie) + ie->len) {
-            /* Not enough left in the buffer to make a whole event.
-             * This shouldn't have happened:  I *think* the kernel shouldn't
-             * do this.
-             */
-            sockptyr_inotify_fatal_error(sd,
-                                         "sockptyr_inot_handler() read"
-                                         " incomplete\n");
-            return;
+    *pp = p->next;
+
+    if (p->hdl != NULL) {
+        /* take what's needed from it before the handle's freed */
+        if (p->onexit != NULL) {
+            cmd = Tcl_DuplicateObj(p->onexit);
+            Tcl_IncrRefCount(cmd);
+            Tcl_ListObjAppendElement(interp, cmd, sockptyr_handle_obj(p->hdl));
+            Tcl_ListObjAppendElement(interp, cmd,
+                                     sockptyr_wstatus_obj(wstatus));
         }
-
-        /* Find our own watch information about ie->wd */
-#if 0
-        fprintf(stderr, "received inotify: wd %d\n", (int)ie->wd);
-#endif
-        for (hdl = sd->inotify_hdls; hdl; hdl = hdl->next) {
-            if (ie->wd == hdl->u.u_inot.wd)
-                break;
-        }
-        if (!hdl) {
-            if (ie->mask & IN_IGNORED) {
-                /* It's normal to get this when a watch is removed; silently
-                 * ignore it.
-                 */
-            } else {
-                /* shouldn't happen */
-                fprintf(stderr,
-                        "sockptyr_inot_handler() unknown wd %d; ignoring\n",
-                        (int)ie->wd);
-                inotify_rm_watch(sd->inotify_fd, ie->wd);
-            }
-            pos += sizeof(*ie) + ie->len;
-            continue;
+        if (p->pty != NULL && p->pty->usage == usage_conn &&
+            p->pty->gen == p->pty_gen) {
+            pty = p->pty;
         }
-        inot = &(hdl->u.u_inot);
+        sockptyr_clobber_handle(p->hdl, 1);
+    }
+    sockptyr_proc_free(p);
 
-        /* append additional info to inot->proc and call it */
-        tclcom = Tcl_DuplicateObj(inot->proc);
-        Tcl_IncrRefCount(tclcom);
-        flags = sockptyr_inot_flagrep(interp, ie->mask);
-        Tcl_ListObjAppendElement(interp, tclcom, flags);
-        Tcl_DecrRefCount(flags);
-        Tcl_ListObjAppendElement(interp, tclcom,
-                                 Tcl_ObjPrintf("%lu",
-                                               (unsigned long)ie->cookie));
-        Tcl_ListObjAppendElement(interp, tclcom,
-                                 Tcl_NewStringObj(ie->name,
-                                                  strnlen(ie->name, ie->len)));
+    if (cmd != NULL) {
         Tcl_Preserve(interp);
 #if USE_TCL_BACKGROUNDEXCEPTION
         result =
 #endif
-        Tcl_EvalObjEx(interp, tclcom, TCL_EVAL_GLOBAL);
+        Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL);
 #if USE_TCL_BACKGROUNDEXCEPTION
         if (result != TCL_OK) {
             Tcl_BackgroundException(interp, result);
         }
 #endif
         Tcl_Release(interp);
-        Tcl_DecrRefCount(tclcom);
+        Tcl_DecrRefCount(cmd);
+    }
 
-        /* move on to the next one, if any */
-        pos += sizeof(*ie) + ie->len;
+    /* the -onexit script might have closed it already */
+    if (pty != NULL && pty->usage == usage_conn && pty->gen == pty_gen) {
+        if (pty->u.u_conn.onclose != NULL) {
+            sockptyr_conn_event(pty, NULL, NULL);
+        } else {
+            sockptyr_clobber_handle(pty, 1);
+        }
     }
 }
 
-/* sockptyr_inotify_fatal_error() -- something bad happened involving
- * "inotify", so bad we have to shut down "inotify".
+/* sockptyr_proc_free(): Stop watching a "sockptyr spawn" process and
+ * free 'p'; which sockptyr_clobber_handle() has already detached from
+ * its handle, and which isn't in sd->procs.
  */
-static void sockptyr_inotify_fatal_error(struct sockptyr_data *sd,
-                                         const char *fmt, ...)
+static void sockptyr_proc_free(struct sockptyr_proc *p)
 {
-    va_list ap;
+    if (p->pidfd >= 0) {
+        Tcl_DeleteFileHandler(p->pidfd);
+        close(p->pidfd);
+        p->pidfd = -1;
+    }
+    ckfree((void *)p);
+}
+
+/* sockptyr_sigchld_start(): Get ready to find out about "sockptyr spawn"
+ * processes in 'sd' exiting through SIGCHLD, for those without a pidfd.
+ */
+static void sockptyr_sigchld_start(struct sockptyr_data *sd)
+{
+    struct sigaction sa;
+
+    if (sd->sigchld) {
+        return; /* already did */
+    }
+
+    if (sockptyr_sigchld_pipe[0] < 0) {
+        /* first time in this process: the pipe, and the signal handler
+         * that writes to it
+         */
+        if (pipe(sockptyr_sigchld_pipe) < 0) {
+            /* the processes will linger as zombies, but it's not worth
+             * making "sockptyr spawn" fail for
+             */
+            return;
+        }
+        sockptyr_set_nonblock(sockptyr_sigchld_pipe[0]);
+        sockptyr_set_nonblock(sockptyr_sigchld_pipe[1]);
+        fcntl(sockptyr_sigchld_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(sockptyr_sigchld_pipe[1], F_SETFD, FD_CLOEXEC);
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &sockptyr_sigchld;
+        sigemptyset(&(sa.sa_mask));
+        sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigaction(SIGCHLD, &sa, &sockptyr_sigchld_old);
+    }
+    if (sockptyr_sigchld_sds == NULL) {
+        Tcl_CreateFileHandler(sockptyr_sigchld_pipe[0], TCL_READABLE,
+                              &sockptyr_sigchld_handler, NULL);
+    }
+    sd->sigchld = 1;
+    sd->sigchld_next = sockptyr_sigchld_sds;
+    sockptyr_sigchld_sds = sd;
+
+    /* in case it's exited already, before there was a handler */
+    if (write(sockptyr_sigchld_pipe[1], "", 1) < 0) {
+        /* the pipe's full, which does the same thing */
+    }
+}
+
+/* sockptyr_sigchld_stop(): Undo sockptyr_sigchld_start(), when 'sd' is
+ * being cleaned up.  The signal handler & pipe are kept.
+ */
+static void sockptyr_sigchld_stop(struct sockptyr_data *sd)
+{
+    struct sockptyr_data **sdp;
+
+    if (!sd->sigchld) {
+        return;
+    }
+    for (sdp = &sockptyr_sigchld_sds; *sdp != sd;
+         sdp = &((*sdp)->sigchld_next)) {
+        assert(*sdp != NULL);
+    }
+    *sdp = sd->sigchld_next;
+    sd->sigchld = 0;
+    if (sockptyr_sigchld_sds == NULL) {
+        Tcl_DeleteFileHandler(sockptyr_sigchld_pipe[0]);
+    }
+}
+
+/* sockptyr_sigchld(): SIGCHLD signal handler: wake up the event loop,
+ * where sockptyr_sigchld_handler() does the rest.  Also calls any handler
+ * that was there before.
+ */
+static void sockptyr_sigchld(int sig)
+{
+    int e = errno;
+
+    if (write(sockptyr_sigchld_pipe[1], "", 1) < 0) {
+        /* the pipe's full, which does the same thing */
+    }
+    if (!(sockptyr_sigchld_old.sa_flags & SA_SIGINFO) &&
+        sockptyr_sigchld_old.sa_handler != SIG_DFL &&
+        sockptyr_sigchld_old.sa_handler != SIG_IGN) {
+        sockptyr_sigchld_old.sa_handler(sig);
+    }
+    errno = e;
+}
+
+/* sockptyr_sigchld_handler(): Called by the Tcl event loop when
+ * sockptyr_sigchld() has written to the pipe.  Empties the pipe, and
+ * checks on each "sockptyr spawn" process that has no pidfd.
+ */
+static void sockptyr_sigchld_handler(ClientData cd, int mask)
+{
+    struct sockptyr_data *sd;
+    struct sockptyr_proc *p;
+    char buf[64];
+    int wstatus;
+    pid_t r;
+
+    while (read(sockptyr_sigchld_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+
+    for (sd = sockptyr_sigchld_sds; sd != NULL; sd = sd->sigchld_next) {
+        /* start over after each one that's exited, since its -onexit
+         * script might have changed sd->procs
+         */
+        for (p = sd->procs; p != NULL; ) {
+            if (p->pidfd >= 0) {
+                p = p->next;
+                continue;
+            }
+            wstatus = 0;
+            r = waitpid(p->pid, &wstatus, WNOHANG);
+            if (r == 0 || (r < 0 && errno == EINTR)) {
+                p = p->next;
+                continue;
+            }
+            sockptyr_proc_exited(p, r < 0 ? 0 : wstatus);
+            p = sd->procs;
+        }
+    }
+}
+
+/* sockptyr_set_nonblock(): Put file descriptor 'fd' into non-blocking
+ * mode, as all connections are, so that sockptyr_conn_io() can keep
+ * reading & writing until it would block.  Returns 0 on success, -1
+ * (with errno set) on failure.
+ */
+static int sockptyr_set_nonblock(int fd)
+{
+    int fl;
+
+    fl = fcntl(fd, F_GETFL);
+    if (fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+        return(-1);
+    }
+    return(0);
+}
+
+/* sockptyr_register_conn_handler(): For the given handle (which is
+ * assumed to refer to a connection) set/clear file event handlers as
+ * appropriate to handle the events that this connection is able to
+ * deal with at the moment.  This gets called after every bit of I/O,
+ * and usually nothing has changed, so it remembers what it registered
+ * and leaves it alone in that case.
+ */
+static void sockptyr_register_conn_handler(struct sockptyr_hdl *hdl)
+{
+    int mask = 0;
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+
+    /* Sanity checks */
+    assert(hdl->usage == usage_conn);
+    if (conn->fd < 0) {
+        /* nothing to do */
+        return;
+    }
+#if USE_OFFLOAD
+    if (conn->offw) {
+        /* handled by a worker thread, not the Tcl event loop */
+        return;
+    }
+#endif /* USE_OFFLOAD */
+    if (conn->cnct) {
+        /* not connected yet; sockptyr_cnct_report() will call this */
+        return;
+    }
+
+    if (sockptyr_conn_can_recv(conn)) {
+        /* buffer isn't full; we can receive into it */
+        mask |= TCL_READABLE;
+    }
+    if (conn->linked && sockptyr_conn_has_data(&(conn->linked->u.u_conn))) {
+        /* linked connection's buffer isn't empty; we can send from it */
+        mask |= TCL_WRITABLE;
+    }
+    if (conn->fan && sockptyr_fan_pending(hdl)) {
+        /* something in its fan-out group for it to send */
+        mask |= TCL_WRITABLE;
+    }
+    if (conn->rpl_pos != conn->rpl_end) {
+        /* history from "-replay" to send */
+        mask |= TCL_WRITABLE;
+    }
+    if (mask == conn->reg_mask) {
+        /* already registered that way */
+        ++hdl->sd->n_reg_skipped;
+        return;
+    }
+    ++hdl->sd->n_reg_done;
+    SOCKPTYR_TRACE(hdl->sd, trace_reg, hdl->num, 0, 0, mask);
+    Tcl_CreateFileHandler(conn->fd, mask, &sockptyr_conn_handler,
+                          (ClientData)hdl);
+    conn->reg_mask = mask;
+}
+
+/* sockptyr_conn_can_recv(): Is there room to receive data on this
+ * connection (into its buffer, or into its pipe if spliced)?
+ */
+static int sockptyr_conn_can_recv(struct sockptyr_conn *conn)
+{
+#if USE_SPLICE
+    if (conn->spl_fds[0] >= 0) {
+        return(conn->spl_fill < conn->spl_cap && !conn->spl_full);
+    }
+#endif /* USE_SPLICE */
+    return(conn->buf_empty || conn->buf_in != conn->buf_out);
+}
+
+/* sockptyr_conn_has_data(): Has this connection received data that's
+ * waiting to be sent to whatever it's linked to?
+ */
+static int sockptyr_conn_has_data(struct sockptyr_conn *conn)
+{
+#if USE_SPLICE
+    if (conn->spl_fds[0] >= 0) {
+        return(conn->spl_fill > 0);
+    }
+#endif /* USE_SPLICE */
+    return(!conn->buf_empty);
+}
+
+/* sockptyr_ring_space(): Fill in 'iov' with the free space in a
+ * connection's buffer, into which data can be received: one piece, or two
+ * if it wraps around the end of the buffer.  Returns the number of pieces.
+ * Moves the (empty) buffer's indexes back to the start if it's empty, to
+ * have it all in one piece.  Not to be called if the buffer is full,
+ * or hasn't been allocated.
+ */
+static int sockptyr_ring_space(struct sockptyr_conn *conn, struct iovec *iov)
+{
+    if (conn->buf_empty) {
+        conn->buf_in = conn->buf_out = 0;
+    } else if (conn->buf_out > conn->buf_in) {
+        iov[0].iov_base = conn->buf + conn->buf_in;
+        iov[0].iov_len = conn->buf_out - conn->buf_in;
+        return(1);
+    }
+    iov[0].iov_base = conn->buf + conn->buf_in;
+    iov[0].iov_len = conn->buf_sz - conn->buf_in;
+    if (conn->buf_out == 0) {
+        return(1);
+    }
+    iov[1].iov_base = conn->buf;
+    iov[1].iov_len = conn->buf_out;
+    return(2);
+}
+
+/* sockptyr_ring_data(): Fill in 'iov' with the data in a connection's
+ * buffer, waiting to be sent: one piece, or two if it wraps around the end
+ * of the buffer.  Returns the number of pieces.  Not to be called if the
+ * buffer is empty.
+ */
+static int sockptyr_ring_data(struct sockptyr_conn *conn, struct iovec *iov)
+{
+    iov[0].iov_base = conn->buf + conn->buf_out;
+    if (conn->buf_in > conn->buf_out) {
+        iov[0].iov_len = conn->buf_in - conn->buf_out;
+        return(1);
+    }
+    iov[0].iov_len = conn->buf_sz - conn->buf_out;
+    if (conn->buf_in == 0) {
+        return(1);
+    }
+    iov[1].iov_base = conn->buf;
+    iov[1].iov_len = conn->buf_in;
+    return(2);
+}
+
+/* sockptyr_conn_grow(): Called when a connection's buffer has filled up,
+ * to double its size, within the limits set by "sockptyr buffer_size".
+ * Buffers that stop filling up get shrunk again by sockptyr_buf_sweep().
+ */
+static void sockptyr_conn_grow(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_data *sd = hdl->sd;
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    int sz;
+
+    conn->buf_busy = 1;
+#if USE_OFFLOAD
+    if (conn->offw) {
+        return; /* offloaded connections' buffers don't change size */
+    }
+#endif /* USE_OFFLOAD */
+    if (conn->buf_sz >= sd->buf_max) {
+        return; /* as big as it gets */
+    }
+    sz = (conn->buf_sz > sd->buf_max / 2) ? sd->buf_max : conn->buf_sz * 2;
+    if (sz < sd->buf_min) {
+        sz = sd->buf_min;
+    }
+    if (sd->buf_cap > 0 &&
+        sockptyr_pool_in_use(sd) + (sz - conn->buf_sz) > sd->buf_cap) {
+        return; /* all connections together have used up the room */
+    }
+    sockptyr_conn_resize(hdl, sz);
+    sockptyr_buf_sweep_arm(sd);
+}
+
+/* sockptyr_conn_resize(): Change the size of a connection's buffer to
+ * 'sz' bytes, keeping the data in it.  The caller is responsible for
+ * 'sz' being big enough to hold that data.
+ */
+static void sockptyr_conn_resize(struct sockptyr_hdl *hdl, int sz)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct iovec iov[2];
+    unsigned char *nbuf;
+    int len, niov, i;
+
+    if (conn->buf_empty) {
+        /* nothing to keep; a buffer of the new size can wait until
+         * there's something to put in it
+         */
+        sockptyr_conn_drained(hdl->sd, conn);
+        conn->buf_sz = sz;
+        return;
+    }
+
+    nbuf = sockptyr_pool_get(hdl->sd, sz);
+    len = 0;
+    niov = sockptyr_ring_data(conn, iov);
+    for (i = 0; i < niov; ++i) {
+        memcpy(nbuf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    assert(len <= sz);
+    sockptyr_pool_put(hdl->sd, conn->buf, conn->buf_sz);
+    conn->buf = nbuf;
+    conn->buf_sz = sz;
+    conn->buf_out = 0;
+    conn->buf_in = (len == sz) ? 0 : len;
+}
+
+/* sockptyr_conn_drained(): Called when a connection's buffer has become
+ * empty (or should be emptied): reset it, and give its memory back to
+ * the pool until there's more data to put in it.
+ */
+static void sockptyr_conn_drained(struct sockptyr_data *sd,
+                                  struct sockptyr_conn *conn)
+{
+    conn->buf_empty = 1;
+    conn->buf_in = conn->buf_out = 0;
+    if (conn->buf != NULL) {
+        sockptyr_pool_put(sd, conn->buf, conn->buf_sz);
+        conn->buf = NULL;
+    }
+}
+
+/* sockptyr_pool_class(): Size class in 'struct sockptyr_pool' for a buffer
+ * of 'sz' bytes; or -1 if it's too big for any.
+ */
+static int sockptyr_pool_class(int sz)
+{
+    int c;
+
+    for (c = 0; c < POOL_CLASSES; ++c) {
+        if ((256 << c) >= sz) {
+            return(c);
+        }
+    }
+    return(-1);
+}
+
+/* sockptyr_pool_get(): Get a buffer of at least 'sz' bytes from the pool,
+ * or allocate one if none are free.  Can be called from any thread.
+ */
+static void *sockptyr_pool_get(struct sockptyr_data *sd, int sz)
+{
+    struct sockptyr_pool *pool = &(sd->pool);
+    void *buf = NULL;
+    int c;
+
+    c = sockptyr_pool_class(sz);
+    if (c >= 0) {
+        sz = 256 << c;
+    }
+    Tcl_MutexLock(&(pool->lock));
+    ++pool->n_gets;
+    ++pool->n_used;
+    pool->bytes_used += sz;
+    if (c >= 0 && pool->free[c] != NULL) {
+        buf = pool->free[c];
+        pool->free[c] = *(void **)buf;
+        --pool->nfree[c];
+        pool->bytes_free -= sz;
+        ++pool->n_hits;
+    }
+    Tcl_MutexUnlock(&(pool->lock));
+    if (buf == NULL) {
+        buf = (void *)ckalloc(sz);
+    }
+    return(buf);
+}
+
+/* sockptyr_pool_put(): Give back a buffer gotten from sockptyr_pool_get()
+ * with the same 'sz'.  It's kept for reuse, unless there are already
+ * enough free ones of its size.  Can be called from any thread.
+ */
+static void sockptyr_pool_put(struct sockptyr_data *sd, void *buf, int sz)
+{
+    struct sockptyr_pool *pool = &(sd->pool);
+    int c;
+
+    c = sockptyr_pool_class(sz);
+    if (c >= 0) {
+        sz = 256 << c;
+    }
+    Tcl_MutexLock(&(pool->lock));
+    --pool->n_used;
+    pool->bytes_used -= sz;
+    if (c >= 0 && (pool->nfree[c] < 4 ||
+                   pool->nfree[c] < pool_keep_bytes / sz)) {
+        *(void **)buf = pool->free[c];
+        pool->free[c] = buf;
+        ++pool->nfree[c];
+        pool->bytes_free += sz;
+        buf = NULL;
+    }
+    Tcl_MutexUnlock(&(pool->lock));
+    if (buf != NULL) {
+        ckfree(buf);
+    }
+}
+
+/* sockptyr_pool_in_use(): Total size of the buffers connections have
+ * gotten from the pool and are holding now.  Connections with nothing
+ * in their buffers don't hold any.
+ */
+static long sockptyr_pool_in_use(struct sockptyr_data *sd)
+{
+    long bytes_used;
+
+    Tcl_MutexLock(&(sd->pool.lock));
+    bytes_used = sd->pool.bytes_used;
+    Tcl_MutexUnlock(&(sd->pool.lock));
+    return(bytes_used);
+}
+
+/* sockptyr_pool_cleanup(): Free the buffers in the pool; called after all
+ * connections are gone.
+ */
+static void sockptyr_pool_cleanup(struct sockptyr_data *sd)
+{
+    struct sockptyr_pool *pool = &(sd->pool);
+    void *buf;
+    int c;
+
+    for (c = 0; c < POOL_CLASSES; ++c) {
+        while ((buf = pool->free[c]) != NULL) {
+            pool->free[c] = *(void **)buf;
+            ckfree(buf);
+        }
+        pool->nfree[c] = 0;
+    }
+    pool->bytes_free = 0;
+    Tcl_MutexFinalize(&(pool->lock));
+}
+
+/* sockptyr_buf_sweep(): Timer handler that goes over the connections,
+ * shrinking buffers that haven't filled up since last time (by half,
+ * down to the minimum), and bringing them within the range set by
+ * "sockptyr buffer_size".  Only buffers that are empty are touched,
+ * and not ones being handled by worker threads.  'cd' is the
+ * 'struct sockptyr_data *'.
+ */
+static void sockptyr_buf_sweep(ClientData cd)
+{
+    struct sockptyr_data *sd = cd;
+    struct sockptyr_hdl *hdl;
+    struct sockptyr_conn *conn;
+    int i, sz, again = 0;
+
+    sd->buf_timer = NULL;
+    for (i = 0; i < sd->ahdls; ++i) {
+        hdl = sd->hdls[i];
+        if (hdl->usage != usage_conn) {
+            continue;
+        }
+        conn = &(hdl->u.u_conn);
+        if (conn->buf_sz <= sd->buf_min && conn->buf_sz <= sd->buf_max) {
+            continue; /* nothing to shrink */
+        }
+#if USE_OFFLOAD
+        if (conn->offw) {
+            again = 1; /* maybe later */
+            continue;
+        }
+#endif /* USE_OFFLOAD */
+        sz = conn->buf_sz;
+        if (conn->buf_empty && (!conn->buf_busy || sz > sd->buf_max)) {
+            sz /= 2;
+            if (sz < sd->buf_min) {
+                sz = sd->buf_min;
+            }
+            if (sz > sd->buf_max) {
+                sz = sd->buf_max;
+            }
+            sockptyr_conn_resize(hdl, sz);
+        }
+        conn->buf_busy = 0;
+        if (sz > sd->buf_min) {
+            again = 1;
+        }
+    }
+    if (again) {
+        sockptyr_buf_sweep_arm(sd);
+    }
+}
+
+/* sockptyr_buf_sweep_arm(): Make sure sockptyr_buf_sweep() will run. */
+static void sockptyr_buf_sweep_arm(struct sockptyr_data *sd)
+{
+    if (sd->buf_timer == NULL) {
+        sd->buf_timer = Tcl_CreateTimerHandler(buf_sweep_ms,
+                                               &sockptyr_buf_sweep,
+                                               (ClientData)sd);
+    }
+}
+
+/* sockptyr_conn_handler(): Called by the Tcl event loop when the file
+ * descriptor associated with one of our connections can do something
+ * we want to do.  'cd' contains the 'struct sockptyr_hdl *' associated
+ * with the connection.
+ */
+static void sockptyr_conn_handler(ClientData cd, int mask)
+{
+    struct sockptyr_hdl *hdl = cd;
+    struct sockptyr_conn *conn;
+    struct sockptyr_ioev ev;
+
+    /* Sanity checks */
+    assert(hdl != NULL);
+    assert(hdl->usage == usage_conn);
+    conn = &(hdl->u.u_conn);
+
+    if (sockptyr_conn_io(hdl, mask, &ev) < 0) {
+        if (ev.kind != 'c') {
+            /* the event may be on the linked connection, not this one */
+            sockptyr_register_conn_handler(ev.hdl);
+        }
+        sockptyr_conn_ioev(&ev);
+        return;
+    }
+
+    /* since buffer pointers may have moved, maybe the set of events we could
+     * handle has changed
+     */
+    sockptyr_register_conn_handler(hdl);
+    if (conn->linked) {
+        sockptyr_register_conn_handler(conn->linked);
+    }
+    if (conn->fan) {
+        sockptyr_fan_register(conn->fan);
+    }
+}
+
+/* sockptyr_conn_io(): Do the I/O on a connection that its file descriptor
+ * is ready for, according to 'mask' (TCL_READABLE and/or TCL_WRITABLE):
+ * receive into its buffer, and send to it from the buffer of the
+ * connection it's linked to.  What it receives it also tries to send on
+ * to the linked connection right away, without waiting to be told that's
+ * ready.  In a fan-out group the source's sinks, and a sink's source,
+ * take the place of the linked connection.
+ * All connections are non-blocking, so this keeps going until
+ * there's nothing more that can be done without blocking, or until it's
+ * moved the number of bytes set by "sockptyr io_budget", so that one busy
+ * connection doesn't starve all the others.
+ *
+ * This doesn't touch Tcl or the registered event handlers, so it can be
+ * used from other threads than the interpreter's.  If something happens
+ * that should be reported (like the connection being closed, or an error)
+ * it fills in '*ev' and returns -1; the caller should then pass it to
+ * sockptyr_conn_ioev() in the interpreter's thread.  'ev->hdl' might be
+ * the linked connection rather than 'hdl'.  Otherwise it returns 0.
+ */
+static int sockptyr_conn_io(struct sockptyr_hdl *hdl, int mask,
+                            struct sockptyr_ioev *ev)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_hdl *lhdl;
+    int rv, moved, budget, got, rblk, wblk, lblk, fblk;
+
+    ev->hdl = hdl;
+    ev->kind = 0;
+    ev->err = 0;
+    ev->msg = NULL;
+
+    if (conn->fd < 0) {
+        ev->kind = 'b';
+        ev->msg = "event on closed file descriptor";
+        return(-1);
+    }
+    ++conn->n_ev;
+    SOCKPTYR_TRACE(hdl->sd, trace_io, hdl->num, 0, 0, mask);
+
+    /* rblk, wblk, lblk, fblk -- set once receiving on this connection,
+     * sending on it, sending on the linked connection (for a fan-out
+     * group's sink, its source), or sending on a fan-out group source's
+     * sinks would block
+     */
+    lhdl = conn->linked;
+    if (conn->fan) {
+        lhdl = (conn->fan->src == hdl) ? NULL : conn->fan->src;
+    }
+    rblk = !(mask & TCL_READABLE);
+    wblk = !(mask & TCL_WRITABLE);
+    lblk = (lhdl == NULL || lhdl == hdl);
+    fblk = !(conn->fan && conn->fan->src == hdl);
+    budget = hdl->sd->io_budget;
+    for (moved = 0; moved < budget; moved += got) {
+        got = 0;
+        if (!rblk) {
+            rv = sockptyr_conn_recv(hdl, &rblk, ev);
+            if (rv < 0) {
+                return(-1);
+            }
+            got += rv;
+        }
+        if (!wblk) {
+            rv = sockptyr_conn_send(hdl, &wblk, ev);
+            if (rv < 0) {
+                return(-1);
+            }
+            got += rv;
+        }
+        if (!lblk) {
+            rv = sockptyr_conn_send(lhdl, &lblk, ev);
+            if (rv < 0) {
+                return(-1);
+            }
+            got += rv;
+        }
+        if (!fblk) {
+            rv = sockptyr_fan_push(hdl, &fblk, ev);
+            if (rv < 0) {
+                return(-1);
+            }
+            got += rv;
+        }
+        if (got == 0) {
+            break; /* nothing more to do for now */
+        }
+    }
+
+    return(0);
+}
+
+/* sockptyr_conn_recv(): Receive what we can on a connection, with one
+ * system call, into its buffer (or its pipe if spliced).  Returns the
+ * number of bytes received, which may be 0 if there's no room or
+ * nothing to receive; sets '*blocked' if it would block.  If something
+ * should be reported, fills in '*ev' and returns -1, as sockptyr_conn_io().
+ */
+static int sockptyr_conn_recv(struct sockptyr_hdl *hdl, int *blocked,
+                              struct sockptyr_ioev *ev)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct iovec iov[2];
+    int rv, niov, keep;
+
+#if USE_SPLICE
+    if (conn->spl_fds[0] >= 0) {
+        /* linked with "-splice"; data doesn't go through our buffers */
+        return(sockptyr_conn_splice_recv(hdl, blocked, ev));
+    }
+#endif /* USE_SPLICE */
+
+    /* what's received is kept if there's somewhere to send it */
+    keep = (conn->linked != NULL ||
+            (conn->fan != NULL && conn->fan->nsinks > 0));
+    if (!keep && conn->sbk != NULL) {
+        /* not linked, but recorded: receive right into the scrollback */
+        niov = sockptyr_sbk_space(conn->sbk, iov);
+    } else if (!keep) {
+        /* not linked: it's a bit bucket; receive and throw away */
+        iov[0].iov_base = hdl->sd->discard;
+        iov[0].iov_len = sizeof(hdl->sd->discard);
+        niov = 1;
+    } else if (!sockptyr_conn_can_recv(conn)) {
+        return(0); /* no room */
+    } else {
+        if (conn->buf == NULL) {
+            conn->buf = sockptyr_pool_get(hdl->sd, conn->buf_sz);
+        }
+        niov = sockptyr_ring_space(conn, iov);
+    }
+    ++conn->n_rd;
+#if USE_READV
+    rv = readv(conn->fd, iov, niov);
+#else /* USE_READV */
+    rv = read(conn->fd, iov[0].iov_base, iov[0].iov_len);
+#endif /* USE_READV */
+    SOCKPTYR_TRACE(hdl->sd, trace_read, hdl->num, rv,
+                   (rv < 0) ? errno : 0, niov);
+    if (rv < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* nothing more to receive right now */
+            *blocked = 1;
+            return(0);
+        } else if (errno == EINTR) {
+            /* not really an error, just let it slide */
+            return(0);
+        } else if (errno == EIO && conn->eio_closed) {
+            /* from "sockptyr pty_spawn": the other side's all closed */
+            ev->hdl = hdl;
+            ev->kind = 'c';
+            return(-1);
+        } else {
+            ev->hdl = hdl;
+            ev->kind = 'e';
+            ev->err = errno;
+            return(-1);
+        }
+    } else if (rv == 0) {
+        /* connection closed */
+        ev->hdl = hdl;
+        ev->kind = 'c';
+        return(-1);
+    }
+
+#if USE_RECORD
+    if (conn->rec != NULL) {
+        sockptyr_rec_add(conn->rec, iov, rv, 0);
+    }
+#endif /* USE_RECORD */
+    if (!keep) {
+        if (conn->sbk != NULL) {
+            conn->sbk->hdr->total += rv;
+        }
+        sockptyr_conn_count_in(conn, rv, 0, 0);
+        return(rv); /* thrown away, or kept only in the scrollback */
+    }
+    if (conn->sbk != NULL) {
+        sockptyr_sbk_append(conn->sbk, iov, rv);
+    }
+
+    /* got something, record it in the buffer */
+    if (conn->lat != NULL) {
+        sockptyr_lat_in(conn->lat, rv, conn->buf_empty);
+    }
+    conn->buf_empty = 0;
+    conn->buf_in += rv;
+    if (conn->buf_in >= conn->buf_sz) {
+        /* wrap around */
+        conn->buf_in -= conn->buf_sz;
+    }
+    if (conn->fan && conn->fan->src == hdl) {
+        sockptyr_fan_received(conn->fan, rv);
+    }
+
+    if (conn->buf_in == conn->buf_out) {
+        /* it's full; maybe it could use more room */
+        sockptyr_conn_count_in(conn, rv, conn->buf_sz, 1);
+        sockptyr_conn_grow(hdl);
+    } else {
+        sockptyr_conn_count_in(conn, rv,
+                               (conn->buf_in - conn->buf_out + conn->buf_sz)
+                               % conn->buf_sz, 0);
+    }
+
+    return(rv);
+}
+
+/* sockptyr_conn_count_in(): Count 'n' bytes received on a connection,
+ * for "sockptyr stats", leaving 'fill' bytes in its buffer (or pipe);
+ * 'full' if that filled it up.
+ */
+static void sockptyr_conn_count_in(struct sockptyr_conn *conn, int n,
+                                   int fill, int full)
+{
+    conn->n_in += n;
+    conn->n_full += full;
+    if (fill > conn->peak) {
+        conn->peak = fill;
+    }
+    conn->last_ms = sockptyr_now_ms();
+}
+
+/* sockptyr_lat_in(): For "sockptyr link -latency", note that 'n' bytes
+ * were just received into a connection's buffer, which was empty before
+ * if 'wasempty'.  If there are too many reads waiting already, these
+ * bytes are timed from the last of them.
+ */
+static void sockptyr_lat_in(struct sockptyr_lat *lat, int n, int wasempty)
+{
+    int i;
+
+    if (wasempty) {
+        /* whatever was in there is gone, one way or another */
+        lat->out = lat->in;
+        lat->nmarks = 0;
+    }
+    lat->in += n;
+    if (lat->nmarks < LATENCY_MARKS) {
+        i = (lat->mark0 + lat->nmarks++) % LATENCY_MARKS;
+        lat->marks[i].us = sockptyr_now_us();
+    } else {
+        i = (lat->mark0 + LATENCY_MARKS - 1) % LATENCY_MARKS;
+    }
+    lat->marks[i].end = lat->in;
+}
+
+/* sockptyr_lat_out(): For "sockptyr link -latency", note that 'n' bytes
+ * from a connection's buffer were just sent, and count how long each
+ * read whose data has now all been sent was waiting.
+ */
+static void sockptyr_lat_out(struct sockptyr_lat *lat, int n)
+{
+    long long now;
+    uint64_t us;
+    int b;
+
+    lat->out += n;
+    if (lat->out > lat->in) {
+        lat->out = lat->in; /* from before measuring started */
+    }
+    if (lat->nmarks == 0 || lat->marks[lat->mark0].end > lat->out) {
+        return; /* nothing finished */
+    }
+    now = sockptyr_now_us();
+    while (lat->nmarks > 0 && lat->marks[lat->mark0].end <= lat->out) {
+        us = (now > lat->marks[lat->mark0].us) ?
+            (uint64_t)(now - lat->marks[lat->mark0].us) : 0;
+        b = sockptyr_lat_bucket(us);
+        ++lat->hist[b];
+        ++lat->count;
+        if (us > lat->max) {
+            lat->max = us;
+        }
+        lat->mark0 = (lat->mark0 + 1) % LATENCY_MARKS;
+        --lat->nmarks;
+    }
+}
+
+/* sockptyr_lat_bucket(): Which bucket of a struct sockptyr_lat histogram
+ * a wait of 'us' microseconds goes in.
+ */
+static int sockptyr_lat_bucket(uint64_t us)
+{
+    int e, b;
+
+    if (us < (1 << LATENCY_SUB_BITS)) {
+        return((int)us);
+    }
+    for (e = LATENCY_SUB_BITS; e < 63 && (us >> (e + 1)) != 0; ++e)
+        ; /* e is the highest bit that's set */
+    b = (1 << LATENCY_SUB_BITS) +
+        ((e - LATENCY_SUB_BITS) << (LATENCY_SUB_BITS - 1)) +
+        (int)((us >> (e - LATENCY_SUB_BITS + 1)) -
+              (1 << (LATENCY_SUB_BITS - 1)));
+    return((b < LATENCY_BUCKETS) ? b : LATENCY_BUCKETS - 1);
+}
+
+/* sockptyr_lat_value(): The highest wait, in microseconds, that goes in
+ * a given bucket of a struct sockptyr_lat histogram.
+ */
+static uint64_t sockptyr_lat_value(int bucket)
+{
+    int k, e;
+    uint64_t m;
+
+    if (bucket < (1 << LATENCY_SUB_BITS)) {
+        return((uint64_t)bucket);
+    }
+    k = bucket - (1 << LATENCY_SUB_BITS);
+    e = (k >> (LATENCY_SUB_BITS - 1)) + LATENCY_SUB_BITS;
+    m = (k & ((1 << (LATENCY_SUB_BITS - 1)) - 1)) +
+        (1 << (LATENCY_SUB_BITS - 1));
+    return(((m + 1) << (e - LATENCY_SUB_BITS + 1)) - 1);
+}
+
+/* sockptyr_lat_percentile(): The wait, in microseconds, that 'pct'
+ * percent of those counted in a struct sockptyr_lat were no longer than
+ * (to within its histogram's precision, but never more than the longest).
+ */
+static uint64_t sockptyr_lat_percentile(struct sockptyr_lat *lat,
+                                        double pct)
+{
+    uint64_t want, seen = 0, v;
+    int b;
+
+    if (lat->count == 0) {
+        return(0);
+    }
+    want = (uint64_t)(lat->count * pct / 100.0 + 0.5);
+    if (want < 1) {
+        want = 1;
+    }
+    for (b = 0; b < LATENCY_BUCKETS; ++b) {
+        seen += lat->hist[b];
+        if (seen >= want) {
+            break;
+        }
+    }
+    v = sockptyr_lat_value(b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1);
+    return((v < lat->max) ? v : lat->max);
+}
+
+/* sockptyr_conn_send(): Send what we can on a connection, with one
+ * system call, from the buffer (or pipe) of the connection it's linked to
+ * (or for a fan-out group, see sockptyr_fan_send(); or history being
+ * replayed, see sockptyr_sbk_replay()).
+ * Returns the number of bytes sent, which may be 0 if there's nothing
+ * to send; sets '*blocked' if it would block.  If something should be
+ * reported, fills in '*ev' and returns -1, as sockptyr_conn_io().
+ */
+static int sockptyr_conn_send(struct sockptyr_hdl *hdl, int *blocked,
+                              struct sockptyr_ioev *ev)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn), *lconn;
+    struct iovec iov[2];
+    int rv, niov;
+
+    if (conn->rpl_pos != conn->rpl_end) {
+        /* history from "-replay" goes before anything newer */
+        rv = sockptyr_sbk_replay(hdl, blocked, ev);
+        if (rv != 0 || *blocked) {
+            return(rv);
+        }
+    }
+    if (conn->fan) {
+        return(sockptyr_fan_send(hdl, blocked, ev));
+    }
+    if (!conn->linked || !sockptyr_conn_has_data(&(conn->linked->u.u_conn))) {
+        return(0); /* nothing to send */
+    }
+    if (conn->cnct) {
+        /* not connected yet; the data waits in the linked buffer */
+        *blocked = 1;
+        return(0);
+    }
+#if USE_SPLICE
+    if (conn->linked->u.u_conn.spl_fds[0] >= 0) {
+        /* linked with "-splice"; data doesn't go through our buffers */
+        return(sockptyr_conn_splice_send(hdl, blocked, ev));
+    }
+#endif /* USE_SPLICE */
+
+    lconn = &(conn->linked->u.u_conn);
+    niov = sockptyr_ring_data(lconn, iov);
+    rv = sockptyr_conn_writev(hdl, iov, niov, blocked, ev);
+    if (rv > 0) {
+        sockptyr_conn_consumed(hdl->sd, lconn, rv);
+    }
+    return(rv);
+}
+
+/* sockptyr_conn_writev(): The system call part of sockptyr_conn_send():
+ * send the data in 'iov' (with 'niov' pieces) on a connection.  Same
+ * return value as sockptyr_conn_send().
+ */
+static int sockptyr_conn_writev(struct sockptyr_hdl *hdl,
+                                struct iovec *iov, int niov, int *blocked,
+                                struct sockptyr_ioev *ev)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    int rv;
+
+    ++conn->n_wr;
+#if USE_READV
+    rv = writev(conn->fd, iov, niov);
+#else /* USE_READV */
+    rv = write(conn->fd, iov[0].iov_base, iov[0].iov_len);
+#endif /* USE_READV */
+    SOCKPTYR_TRACE(hdl->sd, trace_write, hdl->num, rv,
+                   (rv < 0) ? errno : 0, niov);
+    if (rv < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* no room to send more right now */
+            *blocked = 1;
+            return(0);
+        } else if (errno == EINTR) {
+            /* not really an error, just let it slide */
+            return(0);
+        } else {
+            ev->hdl = hdl;
+            ev->kind = 'e';
+            ev->err = errno;
+            return(-1);
+        }
+    } else if (rv == 0) {
+        /* shouldn't have happened */
+        ev->hdl = hdl;
+        ev->kind = 'b';
+        ev->msg = "zero length write";
+        return(-1);
+    }
+#if USE_RECORD
+    if (conn->rec != NULL && conn->rec->sent) {
+        sockptyr_rec_add(conn->rec, iov, rv, 1);
+    }
+#endif /* USE_RECORD */
+    conn->n_out += rv;
+    return(rv);
+}
+
+/* sockptyr_conn_consumed(): Remove 'n' bytes, which have been sent,
+ * from the start of the data in a connection's buffer.
+ */
+static void sockptyr_conn_consumed(struct sockptyr_data *sd,
+                                   struct sockptyr_conn *conn, int n)
+{
+    if (conn->lat != NULL) {
+        sockptyr_lat_out(conn->lat, n);
+    }
+    conn->buf_out += n;
+    if (conn->buf_out >= conn->buf_sz) {
+        conn->buf_out -= conn->buf_sz; /* wrap around */
+    }
+    if (conn->buf_in == conn->buf_out) {
+        /* became empty */
+        sockptyr_conn_drained(sd, conn);
+    }
+}
+
+/* sockptyr_conn_ioev(): Report something that sockptyr_conn_io() found
+ * happening on a connection, by way of sockptyr_conn_event().  The same
+ * cautions apply as for that function.
+ */
+static void sockptyr_conn_ioev(struct sockptyr_ioev *ev)
+{
+    switch (ev->kind) {
+    case 'c':
+        sockptyr_conn_event(ev->hdl, NULL, NULL);
+        break;
+    case 'e':
+        sockptyr_conn_event_sys(ev->hdl, ev->err);
+        break;
+    case 'b':
+        sockptyr_conn_event(ev->hdl, sockptyr_errkws_bug, ev->msg);
+        break;
+    default:
+        /* nothing happened */
+        break;
+    }
+}
+
+#if USE_SPLICE
+/* sockptyr_conn_splice_recv(): The part of sockptyr_conn_recv() for
+ * connections linked with "-splice".  Data received on a connection is
+ * spliced into its pipe, and from there spliced out to the linked
+ * connection (by sockptyr_conn_splice_send()), never being copied into
+ * our memory.  Same parameters and return value as sockptyr_conn_recv().
+ */
+static int sockptyr_conn_splice_recv(struct sockptyr_hdl *hdl, int *blocked,
+                                     struct sockptyr_ioev *ev)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    int rv;
+
+    if (!sockptyr_conn_can_recv(conn)) {
+        return(0); /* no room */
+    }
+    ++conn->n_rd;
+    rv = splice(conn->fd, NULL, conn->spl_fds[1], NULL,
+                conn->spl_cap - conn->spl_fill,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    SOCKPTYR_TRACE(hdl->sd, trace_splice_in, hdl->num, rv,
+                   (rv < 0) ? errno : 0, 0);
+    if (rv < 0) {
+        if (errno == EINTR) {
+            /* not really an error, just let it slide */
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* Either there was nothing to receive after all, or
+             * the pipe is full even though spl_fill doesn't say so
+             * (it ran out of slots).  In the latter case stop
+             * receiving until some gets spliced out.
+             */
+            if (conn->spl_fill > 0) {
+                conn->spl_full = 1;
+                ++conn->n_full;
+            }
+            *blocked = 1;
+        } else {
+            ev->hdl = hdl;
+            ev->kind = 'e';
+            ev->err = errno;
+            return(-1);
+        }
+        return(0);
+    } else if (rv == 0) {
+        /* connection closed */
+        ev->hdl = hdl;
+        ev->kind = 'c';
+        return(-1);
+    }
+    conn->spl_fill += rv;
+    sockptyr_conn_count_in(conn, rv, conn->spl_fill,
+                           conn->spl_fill >= conn->spl_cap);
+    return(rv);
+}
+
+/* sockptyr_conn_splice_send(): The part of sockptyr_conn_send() for
+ * connections linked with "-splice": splice out of the linked connection's
+ * pipe.  Same parameters and return value as sockptyr_conn_send().
+ */
+static int sockptyr_conn_splice_send(struct sockptyr_hdl *hdl, int *blocked,
+                                     struct sockptyr_ioev *ev)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn), *lconn;
+    int rv;
+
+    lconn = &(conn->linked->u.u_conn);
+    ++conn->n_wr;
+    rv = splice(lconn->spl_fds[0], NULL, conn->fd, NULL,
+                lconn->spl_fill, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    SOCKPTYR_TRACE(hdl->sd, trace_splice_out, hdl->num, rv,
+                   (rv < 0) ? errno : 0, 0);
+    if (rv < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* no room to send more right now */
+            *blocked = 1;
+        } else if (errno == EINTR) {
+            /* not really an error, just let it slide */
+        } else {
+            ev->hdl = hdl;
+            ev->kind = 'e';
+            ev->err = errno;
+            return(-1);
+        }
+        return(0);
+    } else if (rv == 0) {
+        /* shouldn't have happened */
+        ev->hdl = hdl;
+        ev->kind = 'b';
+        ev->msg = "zero length splice";
+        return(-1);
+    }
+    lconn->spl_fill -= rv;
+    lconn->spl_full = 0;
+    conn->n_out += rv;
+    return(rv);
+}
+
+/* sockptyr_conn_splice_start(): Switch a newly linked connection, and
+ * the one it's linked to, over to using splice(2) instead of their buffers.
+ * Only done if they're both sockets (not PTYs) without scrollback,
+ * recording or latency measurement --
+ * otherwise, or if anything fails, they're left using their buffers.  Their buffers
+ * are assumed to be empty, as they are after sockptyr_conn_unlink().
+ */
+static void sockptyr_conn_splice_start(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_hdl *hdls[2];
+    struct sockptyr_conn *conn;
+    int i, n, cap;
+
+    hdls[0] = hdl;
+    hdls[1] = hdl->u.u_conn.linked;
+    n = (hdls[1] == NULL || hdls[1] == hdl) ? 1 : 2;
+
+    for (i = 0; i < n; ++i) {
+        if (hdls[i]->u.u_conn.code == 'p') {
+            return; /* a PTY; leave them using their buffers */
+        }
+        if (hdls[i]->u.u_conn.sbk != NULL) {
+            return; /* its scrollback needs to see what it receives */
+        }
+#if USE_RECORD
+        if (hdls[i]->u.u_conn.rec != NULL) {
+            return; /* likewise its recording */
+        }
+#endif /* USE_RECORD */
+        if (hdls[i]->u.u_conn.lat != NULL) {
+            return; /* and its latency measurement */
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        conn = &(hdls[i]->u.u_conn);
+        if (pipe2(conn->spl_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+            conn->spl_fds[0] = conn->spl_fds[1] = -1;
+            break;
+        }
+
+        /* The pipe doesn't need to hold more than buf_sz; and can't
+         * hold more than its capacity, which we can try to adjust.
+         */
+        cap = fcntl(conn->spl_fds[1], F_SETPIPE_SZ, conn->buf_sz);
+        if (cap < 0) {
+            cap = fcntl(conn->spl_fds[1], F_GETPIPE_SZ);
+        }
+        if (cap <= 0) {
+            break;
+        }
+        conn->spl_cap = (cap < conn->buf_sz) ? cap : conn->buf_sz;
+        conn->spl_fill = 0;
+        conn->spl_full = 0;
+    }
+
+    if (i < n) {
+        /* failed; go back to buffers */
+        for (i = 0; i < n; ++i) {
+            sockptyr_conn_splice_stop(&(hdls[i]->u.u_conn));
+        }
+    }
+}
+
+/* sockptyr_conn_splice_stop(): Stop using splice(2) on a connection,
+ * discarding anything that was in its pipe.  Does nothing if it wasn't
+ * using splice(2).
+ */
+static void sockptyr_conn_splice_stop(struct sockptyr_conn *conn)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        if (conn->spl_fds[i] >= 0) {
+            close(conn->spl_fds[i]);
+            conn->spl_fds[i] = -1;
+        }
+    }
+    conn->spl_fill = conn->spl_cap = conn->spl_full = 0;
+}
+#endif /* USE_SPLICE */
+
+#if USE_OFFLOAD
+/* sockptyr_offload_pick(): Choose a worker thread to hand a linked pair of
+ * connections to: the least busy one, starting a new one if fewer than
+ * sd->noffw have been started.  Returns NULL if there isn't one.
+ */
+static struct sockptyr_offw *sockptyr_offload_pick(struct sockptyr_data *sd)
+{
+    struct sockptyr_offw *w, *best;
+    struct epoll_event ee;
+    int i;
+
+    if (sd->aoffw < sd->noffw) {
+        /* start another thread */
+        w = (void *)ckalloc(sizeof(*w));
+        memset(w, 0, sizeof(*w));
+        w->sd = sd;
+        w->num = sd->aoffw;
+        w->wake[0] = w->wake[1] = -1;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        memset(&ee, 0, sizeof(ee));
+        ee.events = EPOLLIN;
+        ee.data.ptr = NULL; /* identifies the wake[] pipe */
+        if (w->epfd >= 0 &&
+            pipe2(w->wake, O_NONBLOCK | O_CLOEXEC) >= 0 &&
+            epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake[0], &ee) >= 0 &&
+            Tcl_CreateThread(&(w->tid), &sockptyr_offw_main, (ClientData)w,
+                             TCL_THREAD_STACK_DEFAULT,
+                             TCL_THREAD_JOINABLE) == TCL_OK) {
+            sd->offw = (void *)ckrealloc((void *)sd->offw,
+                                         sizeof(sd->offw[0]) *
+                                         (sd->aoffw + 1));
+            sd->offw[sd->aoffw++] = w;
+            return(w);
+        }
+
+        /* failed; do without it */
+        for (i = 0; i < 2; ++i) {
+            if (w->wake[i] >= 0) close(w->wake[i]);
+        }
+        if (w->epfd >= 0) close(w->epfd);
+        ckfree((void *)w);
+    }
+
+    /* Pick among the ones we have.  'npairs' is only changed in this
+     * thread so can be read without locking.
+     */
+    best = NULL;
+    for (i = 0; i < sd->aoffw && i < sd->noffw; ++i) {
+        w = sd->offw[i];
+        if (best == NULL || w->npairs < best->npairs) {
+            best = w;
+        }
+    }
+    return(best);
+}
+
+/* sockptyr_offload_start(): Hand a linked pair of connections ('hdl' and
+ * whatever it's linked to) to worker thread 'w'.  From then on they're
+ * not handled in the Tcl event loop, until sockptyr_offload_reclaim().
+ */
+static void sockptyr_offload_start(struct sockptyr_offw *w,
+                                   struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_hdl *hdls[2];
+    struct sockptyr_conn *conn;
+    int i, n;
+
+    hdls[0] = hdl;
+    hdls[1] = hdl->u.u_conn.linked;
+    n = (hdls[1] == NULL || hdls[1] == hdl) ? 1 : 2;
+
+    for (i = 0; i < n; ++i) {
+        conn = &(hdls[i]->u.u_conn);
+        Tcl_DeleteFileHandler(conn->fd);
+        conn->reg_mask = -1;
+        conn->offw = w;
+        conn->off_mask = -1;
+        conn->off_stopped = conn->off_pending = 0;
+    }
+    ++w->npairs;
+    sockptyr_offload_request(w, 'a', hdl);
+}
+
+/* sockptyr_offload_reclaim(): If 'hdl' is a connection that was handed to
+ * a worker thread, take it (and whatever it's linked to) back, to be
+ * handled in the Tcl event loop again.  Must be done before touching an
+ * offloaded connection's I/O state.  If the worker stopped on some event
+ * that hasn't been reported yet, it's forgotten; whatever caused it will
+ * most likely be seen again in the Tcl event loop.
+ */
+static void sockptyr_offload_reclaim(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_hdl *hdls[2];
+    struct sockptyr_offw *w;
+    int i, n;
+
+    if (hdl->usage != usage_conn || hdl->u.u_conn.offw == NULL) {
+        return; /* nothing to do */
+    }
+    w = hdl->u.u_conn.offw;
+    sockptyr_offload_request(w, 'r', hdl);
+    --w->npairs;
+
+    hdls[0] = hdl;
+    hdls[1] = hdl->u.u_conn.linked;
+    n = (hdls[1] == NULL || hdls[1] == hdl) ? 1 : 2;
+    for (i = 0; i < n; ++i) {
+        hdls[i]->u.u_conn.off_pending = 0;
+        sockptyr_register_conn_handler(hdls[i]);
+    }
+}
+
+/* sockptyr_offload_request(): From the Tcl thread, ask worker thread 'w'
+ * to do something ('req' and 'hdl', see struct sockptyr_offw) and wait
+ * for it to be done.
+ */
+static void sockptyr_offload_request(struct sockptyr_offw *w, int req,
+                                     struct sockptyr_hdl *hdl)
+{
+    char c = 0;
+
+    Tcl_MutexLock(&(w->lock));
+    w->req = req;
+    w->req_hdl = hdl;
+    w->req_done = 0;
+    while (write(w->wake[1], &c, 1) < 0 && errno == EINTR)
+        ; /* if the pipe is full that's fine, it's awake anyway */
+    while (!w->req_done) {
+        Tcl_ConditionWait(&(w->cond), &(w->lock), NULL);
+    }
+    w->req = 0;
+    w->req_hdl = NULL;
+    Tcl_MutexUnlock(&(w->lock));
+}
+
+/* sockptyr_offload_shutdown(): Stop all the worker threads and free
+ * them.  They must not have any connections.
+ */
+static void sockptyr_offload_shutdown(struct sockptyr_data *sd)
+{
+    struct sockptyr_offw *w;
+    int i, result;
+
+    for (i = 0; i < sd->aoffw; ++i) {
+        w = sd->offw[i];
+        sockptyr_offload_request(w, 'x', NULL);
+        Tcl_JoinThread(w->tid, &result);
+        close(w->epfd);
+        close(w->wake[0]);
+        close(w->wake[1]);
+        Tcl_MutexFinalize(&(w->lock));
+        Tcl_ConditionFinalize(&(w->cond));
+        ckfree((void *)w);
+    }
+    if (sd->offw) {
+        ckfree((void *)sd->offw);
+    }
+    sd->offw = NULL;
+    sd->aoffw = 0;
+}
+
+/* sockptyr_offw_main(): Main loop of a worker thread, 'cd' being its
+ * 'struct sockptyr_offw *'.  Waits for connections to be ready for I/O
+ * and does it with sockptyr_conn_io(), much as the Tcl event loop would
+ * do with sockptyr_conn_handler(); also handles requests from the Tcl
+ * thread.
+ */
+static Tcl_ThreadCreateType sockptyr_offw_main(ClientData cd)
+{
+    struct sockptyr_offw *w = cd;
+    struct epoll_event evs[64];
+    struct sockptyr_hdl *hdl, *hdls[2];
+    struct sockptyr_conn *conn;
+    struct sockptyr_ioev ev;
+    int got, i, j, n, mask, req;
+    char junk[64];
+
+    for (;;) {
+        got = epoll_wait(w->epfd, evs, sizeof(evs) / sizeof(evs[0]), -1);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue; /* not really an error */
+            }
+            /* shouldn't happen, and there's no good way to go on */
+            fprintf(stderr, "sockptyr offload thread: epoll_wait()"
+                    " failed: %s\n", strerror(errno));
+            abort();
+        }
+
+        /* Handle the connections first and any request after: so that
+         * none of the events we got refer to connections that a request
+         * has taken away.
+         */
+        req = 0;
+        for (i = 0; i < got; ++i) {
+            hdl = evs[i].data.ptr;
+            if (hdl == NULL) {
+                req = 1;
+                continue;
+            }
+            conn = &(hdl->u.u_conn);
+            if (conn->off_stopped) {
+                continue; /* stopped earlier in this batch */
+            }
+            mask = 0;
+            if ((evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                (conn->off_mask & EPOLLIN)) {
+                mask |= TCL_READABLE;
+            }
+            if ((evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) &&
+                (conn->off_mask & EPOLLOUT)) {
+                mask |= TCL_WRITABLE;
+            }
+            if (conn->off_mask < 0) {
+                mask = 0; /* removed earlier in this batch */
+            }
+            if (sockptyr_conn_io(hdl, mask, &ev) < 0) {
+                sockptyr_offw_stop(w, &ev);
+                continue;
+            }
+            sockptyr_offw_update(w, hdl);
+            if (conn->linked && conn->linked != hdl) {
+                sockptyr_offw_update(w, conn->linked);
+            }
+        }
+        if (!req) {
+            continue;
+        }
+
+        while (read(w->wake[0], junk, sizeof(junk)) > 0)
+            ;
+        Tcl_MutexLock(&(w->lock));
+        req = (w->req_done) ? 0 : w->req;
+        if (req == 'a' || req == 'r') {
+            hdls[0] = w->req_hdl;
+            hdls[1] = hdls[0]->u.u_conn.linked;
+            n = (hdls[1] == NULL || hdls[1] == hdls[0]) ? 1 : 2;
+            for (j = 0; j < n; ++j) {
+                conn = &(hdls[j]->u.u_conn);
+                if (req == 'r') {
+                    if (conn->off_mask >= 0) {
+                        epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    }
+                    conn->offw = NULL;
+                    conn->off_mask = -1;
+                    conn->off_stopped = 0;
+                }
+            }
+        }
+        if (req) {
+            w->req_done = 1;
+            Tcl_ConditionNotify(&(w->cond));
+        }
+        Tcl_MutexUnlock(&(w->lock));
+        if (req == 'a') {
+            /* start watching the new ones */
+            for (j = 0; j < n; ++j) {
+                sockptyr_offw_update(w, hdls[j]);
+            }
+        } else if (req == 'x') {
+            break;
+        }
+    }
+
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/* sockptyr_offw_update(): In worker thread 'w', set which events its
+ * epoll(7) set watches for on connection 'hdl', according to what I/O
+ * it can do right now.  The worker's equivalent of
+ * sockptyr_register_conn_handler().
+ */
+static void sockptyr_offw_update(struct sockptyr_offw *w,
+                                 struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct epoll_event ee;
+    struct sockptyr_ioev ev;
+    int mask = 0, rv;
+
+    if (conn->off_stopped) {
+        return; /* not handling this one any more */
+    }
+    if (sockptyr_conn_can_recv(conn)) {
+        mask |= EPOLLIN;
+    }
+    if (conn->linked && sockptyr_conn_has_data(&(conn->linked->u.u_conn))) {
+        mask |= EPOLLOUT;
+    }
+    if (conn->rpl_pos != conn->rpl_end) {
+        mask |= EPOLLOUT;
+    }
+    if (mask == conn->off_mask || (mask == 0 && conn->off_mask < 0)) {
+        return; /* no change */
+    }
+
+    /* When there's nothing to wait for, take it out of the set entirely:
+     * otherwise epoll would keep reporting EPOLLHUP once it's closed.
+     */
+    memset(&ee, 0, sizeof(ee));
+    ee.events = mask;
+    ee.data.ptr = hdl;
+    if (mask == 0) {
+        rv = epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->off_mask = -1;
+    } else {
+        rv = epoll_ctl(w->epfd,
+                       (conn->off_mask < 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                       conn->fd, &ee);
+        conn->off_mask = mask;
+    }
+    if (rv < 0) {
+        ev.hdl = hdl;
+        ev.kind = 'e';
+        ev.err = errno;
+        ev.msg = NULL;
+        sockptyr_offw_stop(w, &ev);
+    }
+}
+
+/* sockptyr_offw_stop(): In worker thread 'w', stop handling the linked
+ * pair of connections that 'ev->hdl' is in, and send an event to the Tcl
+ * thread to report 'ev' and take them back.
+ */
+static void sockptyr_offw_stop(struct sockptyr_offw *w,
+                               struct sockptyr_ioev *ev)
+{
+    struct sockptyr_hdl *hdls[2];
+    struct sockptyr_conn *conn;
+    struct sockptyr_offev *oe;
+    int i, n;
+
+    hdls[0] = ev->hdl;
+    hdls[1] = ev->hdl->u.u_conn.linked;
+    n = (hdls[1] == NULL || hdls[1] == hdls[0]) ? 1 : 2;
+    for (i = 0; i < n; ++i) {
+        conn = &(hdls[i]->u.u_conn);
+        if (conn->off_mask >= 0) {
+            epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        }
+        conn->off_mask = -1;
+        conn->off_stopped = 1;
+    }
+
+    Tcl_MutexLock(&(w->lock));
+    conn = &(ev->hdl->u.u_conn);
+    conn->off_ev = *ev;
+    conn->off_pending = 1;
+    Tcl_MutexUnlock(&(w->lock));
+
+    oe = (void *)ckalloc(sizeof(*oe));
+    memset(oe, 0, sizeof(*oe));
+    oe->header.proc = &sockptyr_offload_evproc;
+    oe->hdl = ev->hdl;
+    Tcl_ThreadQueueEvent(w->sd->tid, &(oe->header), TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(w->sd->tid);
+}
+
+/* sockptyr_offload_evproc(): Handle, in the Tcl thread, an event sent by
+ * sockptyr_offw_stop(): take the connections back from the worker thread
+ * and report what happened.  Returns 1 when the event has been handled,
+ * 0 to leave it for later, as Tcl_QueueEvent() event handlers do.
+ */
+static int sockptyr_offload_evproc(Tcl_Event *evp, int flags)
+{
+    struct sockptyr_hdl *hdl = ((struct sockptyr_offev *)evp)->hdl;
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_offw *w;
+    struct sockptyr_ioev ev;
+    int pending;
+
+    if (!(flags & TCL_FILE_EVENTS)) {
+        return(0); /* not handling file events right now */
+    }
+    if (hdl->usage != usage_conn || conn->offw == NULL) {
+        return(1); /* it's already been taken back */
+    }
+
+    w = conn->offw;
+    Tcl_MutexLock(&(w->lock));
+    pending = conn->off_pending;
+    ev = conn->off_ev;
+    Tcl_MutexUnlock(&(w->lock));
+    if (!pending) {
+        return(1); /* left over from some earlier use of the handle */
+    }
+
+    sockptyr_offload_reclaim(hdl);
+    sockptyr_conn_ioev(&ev);
+    return(1);
+}
+
+/* sockptyr_offload_evdel(): For Tcl_DeleteEvents(), identify events sent
+ * by sockptyr_offw_stop() for 'struct sockptyr_data *' 'cd'.
+ */
+static int sockptyr_offload_evdel(Tcl_Event *evp, ClientData cd)
+{
+    return(evp->proc == &sockptyr_offload_evproc &&
+           ((struct sockptyr_offev *)evp)->hdl->sd == cd);
+}
+#endif /* USE_OFFLOAD */
+
+#if USE_INOTIFY
+/* sockptyr_inot_handler() -- When inotify(7) messages come in, read
+ * them and handle each with sockptyr_inot_event().  Keeps reading until
+ * there are no more, within reason:  after a lot it lets the Tcl event
+ * loop handle other things before coming back.
+ */
+static void sockptyr_inot_handler(ClientData cd, int mask)
+{
+    struct sockptyr_data *sd = cd;
+    struct inotify_event *ie;
+    char buf[65536]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int got, pos, reads;
+
+    /* sanity checks */
+    assert(mask & TCL_READABLE);
+    assert(sd);
+    assert(sd->inotify_fd >= 0);
+
+    for (reads = 0; reads < inotify_reads; ++reads) {
+        if (sd->inotify_fd < 0) {
+            return; /* shut down while handling an event */
+        }
+
+        /* read some events into buf[] */
+        got = read(sd->inotify_fd, buf, sizeof(buf));
+        if (got < 0) {
+            /* some kind of error happened */
+            if (errno == EINTR) {
+                /* not really an error, just let it slide */
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* not an error: we've read everything there is */
+                return;
+            } else {
+                /* really an error, but not much we can do right here! */
+                sockptyr_inotify_fatal_error(sd,
+                                             "sockptyr_inot_handler() read()"
+                                             " error: %s\n",
+                                             strerror(errno));
+                return;
+            }
+        } else if (got == 0) {
+            /* End of file shouldn't happen.  Don't let it happen
+             * frequently.
+             */
+            sockptyr_inotify_fatal_error(sd,
+                                         "sockptyr_inot_handler()"
+                                         " read empty\n");
+            return;
+        }
+
+        for (pos = 0; pos < got; ) {
+            ie = (void *)&(buf[pos]);
+            if (got - pos < sizeof(*ie) ||
+                got - pos < sizeof(*ie) + ie->len) {
+                /* Not enough left in the buffer to make a whole event.
+                 * This shouldn't have happened:  I *think* the kernel
+                 * shouldn't do this.
+                 */
+                sockptyr_inotify_fatal_error(sd,
+                                             "sockptyr_inot_handler() read"
+                                             " incomplete\n");
+                return;
+            }
+
+            sockptyr_inot_event(sd, ie);
+
+            /* move on to the next one, if any */
+            pos += sizeof(*ie) + ie->len;
+        }
+    }
+}
+
+/* sockptyr_inot_event() -- Handle an inotify(7) event: find the watch
+ * it's for, keep track of the directory entries it tells of, and pass
+ * it on with sockptyr_inot_dispatch().
+ */
+static void sockptyr_inot_event(struct sockptyr_data *sd,
+                                struct inotify_event *ie)
+{
+    struct sockptyr_inotw *w;
+    Tcl_HashEntry *he, *nhe;
+    int namelen, isnew;
+
+    if (ie->wd < 0 && (ie->mask & IN_Q_OVERFLOW)) {
+        /* the kernel's queue overflowed: events have been lost */
+        sockptyr_inot_overflow(sd);
+        return;
+    }
+
+    /* Find our own watch information about ie->wd */
+    SOCKPTYR_TRACE(sd, trace_inot_ev, -1, 0, 0, ie->wd);
+    he = Tcl_FindHashEntry(&(sd->inotify_wds), (void *)(intptr_t)ie->wd);
+    if (he == NULL) {
+        if (ie->mask & IN_IGNORED) {
+            /* It's normal to get this when a watch is removed; silently
+             * ignore it.
+             */
+        } else {
+            /* shouldn't happen */
+            fprintf(stderr,
+                    "sockptyr_inot_handler() unknown wd %d; ignoring\n",
+                    (int)ie->wd);
+            inotify_rm_watch(sd->inotify_fd, ie->wd);
+        }
+        return;
+    }
+    w = Tcl_GetHashValue(he);
+    namelen = strnlen(ie->name, ie->len);
+    if (ie->mask & IN_IGNORED) {
+        /* the kernel has dropped the watch (say the file was deleted);
+         * its descriptor might get reused for a new one
+         */
+        Tcl_DeleteHashEntry(he);
+        w->wd = -1;
+        sockptyr_inot_names_free(w);
+    } else if (w->names != NULL && namelen > 0) {
+        /* keep track of what's in the directory, for rescanning */
+        if (ie->mask & (IN_CREATE | IN_MOVED_TO)) {
+            nhe = Tcl_CreateHashEntry(w->names, ie->name, &isnew);
+            Tcl_SetHashValue(nhe, (void *)(uintptr_t)(ie->mask & IN_ISDIR));
+        } else if (ie->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            nhe = Tcl_FindHashEntry(w->names, ie->name);
+            if (nhe != NULL) {
+                Tcl_DeleteHashEntry(nhe);
+            }
+        }
+    }
+
+    ++w->refs;
+    sockptyr_inot_dispatch(sd, w, ie->mask, ie->cookie, ie->name, namelen,
+                           0);
+    sockptyr_inot_release(sd, w);
+}
+
+/* sockptyr_inot_dispatch() -- Pass an event on watch 'w' to each of the
+ * handles sharing that watch that asked for this kind of event: run its
+ * script, or hold the event if it's coalescing them.  If 'unserved',
+ * only to those that asked for events a rescan after overflow can't make
+ * up (see sockptyr_inot_overflow()).  The caller holds a reference to 'w'.
+ */
+static void sockptyr_inot_dispatch(struct sockptyr_data *sd,
+                                   struct sockptyr_inotw *w,
+                                   uint32_t mask, uint32_t cookie,
+                                   const char *name, int namelen,
+                                   int unserved)
+{
+    struct sockptyr_hdl *hdl, *hdls_short[8], **hdls;
+    struct sockptyr_inot *inot;
+    unsigned long gens_short[8], *gens;
+    uint32_t always = IN_IGNORED | IN_Q_OVERFLOW | IN_UNMOUNT;
+    uint32_t holdable = IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_ISDIR;
+    uint32_t asked;
+    int nhdls, i;
+
+    /* The scripts we run might close any of the handles, including ones
+     * we haven't gotten to yet.  So list them, with their generations to
+     * tell if they've been closed and reused.
+     */
+    for (nhdls = 0, hdl = w->hdls; hdl; hdl = hdl->u.u_inot.wnext) {
+        ++nhdls;
+    }
+    if (nhdls <= sizeof(hdls_short) / sizeof(hdls_short[0])) {
+        hdls = hdls_short;
+        gens = gens_short;
+    } else {
+        hdls = (void *)ckalloc(sizeof(hdls[0]) * nhdls);
+        gens = (void *)ckalloc(sizeof(gens[0]) * nhdls);
+    }
+    for (i = 0, hdl = w->hdls; hdl; hdl = hdl->u.u_inot.wnext, ++i) {
+        hdls[i] = hdl;
+        gens[i] = hdl->gen;
+    }
+
+    for (i = 0; i < nhdls; ++i) {
+        hdl = hdls[i];
+        if (hdl->usage != usage_inot || hdl->gen != gens[i]) {
+            continue; /* closed by an earlier script */
+        }
+        inot = &(hdl->u.u_inot);
+        asked = inot->mask & IN_ALL_EVENTS;
+        if (!(mask & (asked | always))) {
+            continue; /* this handle didn't ask for it */
+        }
+        if (unserved && asked != 0 && !(asked & ~INOT_ENTRIES) &&
+            (asked & IN_CREATE || !(asked & IN_MOVED_TO)) &&
+            (asked & IN_DELETE || !(asked & IN_MOVED_FROM))) {
+            continue; /* the made up IN_CREATE & IN_DELETE will do */
+        }
+        if (inot->coalesce > 0) {
+            if (namelen > 0 && !(mask & ~holdable)) {
+                sockptyr_inot_hold(hdl, mask, cookie, name);
+                continue;
+            }
+            /* anything held has to go first, to keep things in order */
+            if (namelen > 0) {
+                sockptyr_inot_flush(hdl, name);
+            } else if (mask & always) {
+                sockptyr_inot_flush(hdl, NULL);
+            }
+            if (hdl->usage != usage_inot || hdl->gen != gens[i]) {
+                continue; /* closed by that */
+            }
+        }
+        sockptyr_inot_run(hdl, mask, cookie, name, namelen);
+    }
+
+    if (hdls != hdls_short) {
+        ckfree((void *)hdls);
+        ckfree((void *)gens);
+    }
+}
+
+/* sockptyr_inot_run() -- Run an inotify handle's script for an event. */
+static void sockptyr_inot_run(struct sockptyr_hdl *hdl,
+                              uint32_t mask, uint32_t cookie,
+                              const char *name, int namelen)
+{
+    struct sockptyr_data *sd = hdl->sd;
+    Tcl_Interp *interp = sd->interp;
+    Tcl_Obj *tclcom, *flags;
+#if USE_TCL_BACKGROUNDEXCEPTION
+    int result;
+#endif
+
+    /* append additional info to the handle's proc and call it */
+    tclcom = Tcl_DuplicateObj(hdl->u.u_inot.proc);
+    Tcl_IncrRefCount(tclcom);
+    flags = sockptyr_inot_flagrep(sd, mask);
+    Tcl_ListObjAppendElement(interp, tclcom, flags);
+    Tcl_DecrRefCount(flags);
+    Tcl_ListObjAppendElement(interp, tclcom,
+                             Tcl_ObjPrintf("%lu", (unsigned long)cookie));
+    Tcl_ListObjAppendElement(interp, tclcom,
+                             Tcl_NewStringObj(name, namelen));
+    Tcl_Preserve(interp);
+#if USE_TCL_BACKGROUNDEXCEPTION
+    result =
+#endif
+    Tcl_EvalObjEx(interp, tclcom, TCL_EVAL_GLOBAL);
+#if USE_TCL_BACKGROUNDEXCEPTION
+    if (result != TCL_OK) {
+        Tcl_BackgroundException(interp, result);
+    }
+#endif
+    Tcl_Release(interp);
+    Tcl_DecrRefCount(tclcom);
+}
+
+/* sockptyr_inot_hold() -- For "sockptyr inotify -coalesce": hold an event
+ * until the end of the handle's window, merged with any others for the
+ * same name.
+ */
+static void sockptyr_inot_hold(struct sockptyr_hdl *hdl,
+                               uint32_t mask, uint32_t cookie,
+                               const char *name)
+{
+    struct sockptyr_inot *inot = &(hdl->u.u_inot);
+    struct sockptyr_inotp *p;
+    Tcl_HashEntry *he;
+    int isnew;
+
+    if (inot->pend_names == NULL) {
+        inot->pend_names = (void *)ckalloc(sizeof(*inot->pend_names));
+        Tcl_InitHashTable(inot->pend_names, TCL_STRING_KEYS);
+    }
+    he = Tcl_CreateHashEntry(inot->pend_names, name, &isnew);
+    if (!isnew) {
+        p = Tcl_GetHashValue(he);
+        p->mask |= mask;
+        if (cookie) {
+            p->cookie = cookie;
+        }
+        return;
+    }
+    p = (void *)ckalloc(sizeof(*p) + strlen(name));
+    p->next = NULL;
+    p->mask = mask;
+    p->cookie = cookie;
+    strcpy(p->name, name);
+    Tcl_SetHashValue(he, p);
+    if (inot->pend == NULL) {
+        inot->pend = p;
+        inot->pend_timer = Tcl_CreateTimerHandler(inot->coalesce,
+                                                  &sockptyr_inot_timer, hdl);
+    } else {
+        inot->pend_last->next = p;
+    }
+    inot->pend_last = p;
+}
+
+/* sockptyr_inot_timer() -- Timer handler for the end of a "sockptyr
+ * inotify -coalesce" window: deliver what was held.
+ */
+static void sockptyr_inot_timer(ClientData cd)
+{
+    struct sockptyr_hdl *hdl = cd;
+
+    hdl->u.u_inot.pend_timer = NULL;
+    sockptyr_inot_flush(hdl, NULL);
+}
+
+/* sockptyr_inot_flush() -- Deliver the events held for 'name', or all of
+ * them if it's NULL, in the order they first came in.
+ */
+static void sockptyr_inot_flush(struct sockptyr_hdl *hdl, const char *name)
+{
+    struct sockptyr_inot *inot = &(hdl->u.u_inot);
+    struct sockptyr_inotp *p, *pend;
+    Tcl_HashEntry *he;
+    unsigned long gen = hdl->gen;
+    uint32_t mask;
+
+    if (inot->pend_names == NULL) {
+        return; /* nothing held */
+    }
+    if (name != NULL) {
+        /* just the one; leave its place in the list, as a blank */
+        he = Tcl_FindHashEntry(inot->pend_names, name);
+        if (he == NULL) {
+            return;
+        }
+        p = Tcl_GetHashValue(he);
+        Tcl_DeleteHashEntry(he);
+        mask = p->mask;
+        p->mask = 0;
+        sockptyr_inot_run(hdl, mask, p->cookie, p->name, strlen(p->name));
+        return;
+    }
+
+    /* Take everything held; so that scripts that close the handle, or
+     * cause more events to be held, don't get in the way.
+     */
+    pend = inot->pend;
+    sockptyr_inot_pend_free(hdl, 0);
+    while (pend != NULL) {
+        p = pend;
+        pend = p->next;
+        if (p->mask != 0 && hdl->usage == usage_inot && hdl->gen == gen) {
+            sockptyr_inot_run(hdl, p->mask, p->cookie,
+                              p->name, strlen(p->name));
+        }
+        ckfree((void *)p);
+    }
+}
+
+/* sockptyr_inot_pend_free() -- Forget the events held for an inotify
+ * handle; and free them if 'dofree'.
+ */
+static void sockptyr_inot_pend_free(struct sockptyr_hdl *hdl, int dofree)
+{
+    struct sockptyr_inot *inot = &(hdl->u.u_inot);
+    struct sockptyr_inotp *p;
+
+    if (inot->pend_timer != NULL) {
+        Tcl_DeleteTimerHandler(inot->pend_timer);
+        inot->pend_timer = NULL;
+    }
+    if (inot->pend_names != NULL) {
+        Tcl_DeleteHashTable(inot->pend_names);
+        ckfree((void *)inot->pend_names);
+        inot->pend_names = NULL;
+    }
+    while (dofree && inot->pend != NULL) {
+        p = inot->pend;
+        inot->pend = p->next;
+        ckfree((void *)p);
+    }
+    inot->pend = inot->pend_last = NULL;
+}
+
+/* sockptyr_inot_overflow() -- Handle the kernel's inotify queue having
+ * overflowed.  Events have been lost, for any of the watches.  For the
+ * directories whose entries we've been keeping track of, read them again
+ * and make up IN_CREATE & IN_DELETE events for the differences.  The
+ * others, and handles that asked for events those don't stand in for
+ * (like IN_MOVED_TO without IN_CREATE, or IN_MODIFY), get IN_Q_OVERFLOW.
+ */
+static void sockptyr_inot_overflow(struct sockptyr_data *sd)
+{
+    struct sockptyr_inotw **ws, *w;
+    struct sockptyr_inotp *diffs, *p;
+    Tcl_HashTable *names;
+    Tcl_HashEntry *he, *ohe;
+    Tcl_HashSearch hs;
+    int nws, i;
+    char *n;
+
+    ++sd->inotify_overflows;
+
+    /* List the watches and hold onto them, since the scripts we run
+     * could close any of them.
+     */
+    nws = sd->inotify_wds.numEntries;
+    ws = (void *)ckalloc(sizeof(ws[0]) * (nws + 1));
+    for (i = 0, he = Tcl_FirstHashEntry(&(sd->inotify_wds), &hs);
+         he != NULL; he = Tcl_NextHashEntry(&hs), ++i) {
+        ws[i] = Tcl_GetHashValue(he);
+        ++ws[i]->refs;
+    }
+
+    for (i = 0; i < nws; ++i) {
+        w = ws[i];
+        if (w->wd < 0) {
+            /* the kernel dropped it while we were going */
+        } else if (w->names == NULL) {
+            sockptyr_inot_dispatch(sd, w, IN_Q_OVERFLOW, 0, "", 0, 0);
+        } else {
+            names = (void *)ckalloc(sizeof(*names));
+            Tcl_InitHashTable(names, TCL_STRING_KEYS);
+            if (sockptyr_inot_scan(w->path, names) < 0) {
+                /* can't read it, so can't tell what changed */
+                Tcl_DeleteHashTable(names);
+                ckfree((void *)names);
+                sockptyr_inot_dispatch(sd, w, IN_Q_OVERFLOW, 0, "", 0, 0);
+                continue;
+            }
+
+            /* Find the differences before running any scripts (which
+             * might change things); then switch to the new list.
+             */
+            diffs = NULL;
+            for (he = Tcl_FirstHashEntry(names, &hs);
+                 he != NULL; he = Tcl_NextHashEntry(&hs)) {
+                n = Tcl_GetHashKey(names, he);
+                if (Tcl_FindHashEntry(w->names, n) == NULL) {
+                    diffs = sockptyr_inot_diff(diffs, IN_CREATE |
+                                               (uint32_t)(uintptr_t)
+                                               Tcl_GetHashValue(he), n);
+                }
+            }
+            for (ohe = Tcl_FirstHashEntry(w->names, &hs);
+                 ohe != NULL; ohe = Tcl_NextHashEntry(&hs)) {
+                n = Tcl_GetHashKey(w->names, ohe);
+                if (Tcl_FindHashEntry(names, n) == NULL) {
+                    diffs = sockptyr_inot_diff(diffs, IN_DELETE |
+                                               (uint32_t)(uintptr_t)
+                                               Tcl_GetHashValue(ohe), n);
+                }
+            }
+            sockptyr_inot_names_free(w);
+            w->names = names;
+
+            sockptyr_inot_dispatch(sd, w, IN_Q_OVERFLOW, 0, "", 0, 1);
+            while (diffs != NULL) {
+                p = diffs;
+                diffs = p->next;
+                if (w->wd >= 0) {
+                    sockptyr_inot_dispatch(sd, w, p->mask, 0,
+                                           p->name, strlen(p->name), 0);
+                }
+                ckfree((void *)p);
+            }
+        }
+    }
+
+    for (i = 0; i < nws; ++i) {
+        sockptyr_inot_release(sd, ws[i]);
+    }
+    ckfree((void *)ws);
+}
+
+/* sockptyr_inot_diff() -- Add a made up event to the list 'diffs' for
+ * sockptyr_inot_overflow(); returns the new list.
+ */
+static struct sockptyr_inotp *sockptyr_inot_diff(struct sockptyr_inotp *diffs,
+                                                 uint32_t mask, const char *n)
+{
+    struct sockptyr_inotp *p;
+
+    p = (void *)ckalloc(sizeof(*p) + strlen(n));
+    p->next = diffs;
+    p->mask = mask;
+    p->cookie = 0;
+    strcpy(p->name, n);
+    return(p);
+}
+
+/* sockptyr_inot_scan() -- Read the directory 'path' into 'names': the
+ * keys are the entries' names, and the values IN_ISDIR for directories,
+ * otherwise 0.  Returns 0 on success, -1 on failure (with errno set),
+ * for instance if 'path' isn't a directory.
+ */
+static int sockptyr_inot_scan(const char *path, Tcl_HashTable *names)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    Tcl_HashEntry *he;
+    int isnew, isdir;
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        return(-1);
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        isdir = (de->d_type == DT_DIR);
+        if (de->d_type == DT_UNKNOWN) {
+            /* not all filesystems say; look, as lstat() would */
+            isdir = (fstatat(dirfd(dir), de->d_name, &st,
+                             AT_SYMLINK_NOFOLLOW) == 0 &&
+                     S_ISDIR(st.st_mode));
+        }
+        he = Tcl_CreateHashEntry(names, de->d_name, &isnew);
+        Tcl_SetHashValue(he, (void *)(uintptr_t)(isdir ? IN_ISDIR : 0));
+    }
+    closedir(dir);
+    return(0);
+}
+
+/* sockptyr_inot_names_free() -- Stop keeping track of the entries in the
+ * directory watched by 'w'.
+ */
+static void sockptyr_inot_names_free(struct sockptyr_inotw *w)
+{
+    if (w->names != NULL) {
+        Tcl_DeleteHashTable(w->names);
+        ckfree((void *)w->names);
+        w->names = NULL;
+    }
+}
+
+/* sockptyr_inot_release() -- Let go of a reference to an inotify(7) watch,
+ * and when nothing's using it any more, remove it.
+ */
+static void sockptyr_inot_release(struct sockptyr_data *sd,
+                                  struct sockptyr_inotw *w)
+{
+    Tcl_HashEntry *he;
+
+    assert(w->refs > 0);
+    if (--w->refs > 0) {
+        return;
+    }
+    assert(w->hdls == NULL);
+    if (w->wd >= 0) {
+        if (sd->inotify_fd >= 0) {
+            inotify_rm_watch(sd->inotify_fd, w->wd);
+        }
+        he = Tcl_FindHashEntry(&(sd->inotify_wds), (void *)(intptr_t)w->wd);
+        assert(he != NULL && Tcl_GetHashValue(he) == w);
+        Tcl_DeleteHashEntry(he);
+    }
+    sockptyr_inot_names_free(w);
+    ckfree(w->path);
+    ckfree((void *)w);
+}
+
+/* sockptyr_inotify_fatal_error() -- something bad happened involving
+ * "inotify", so bad we have to shut down "inotify".
+ */
+static void sockptyr_inotify_fatal_error(struct sockptyr_data *sd,
+                                         const char *fmt, ...)
+{
+    va_list ap;
+    Tcl_HashEntry *he;
+    Tcl_HashSearch hs;
+    struct sockptyr_inotw *w;
+
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
     va_end(ap);
     fprintf(stderr, "sockptyr inotify shutting down\n");
     Tcl_DeleteFileHandler(sd->inotify_fd);
     sd->inotify_fd = -1;
+
+    /* The existing watches are no more; forget their descriptors so
+     * they won't be mixed up with those of a new inotify instance.
+     */
+    for (he = Tcl_FirstHashEntry(&(sd->inotify_wds), &hs);
+         he != NULL; he = Tcl_NextHashEntry(&hs)) {
+        w = Tcl_GetHashValue(he);
+        w->wd = -1;
+        sockptyr_inot_names_free(w);
+        Tcl_DeleteHashEntry(he);
+    }
+}
+#endif /* USE_INOTIFY */
+
+/* sockptyr_lstn_handler(): Called by the Tcl event loop when a socket
+ * we've listen()ed on receives connections.  'cd' contains the
+ * 'struct sockptyr_hdl *' associated with that socket.
+ *
+ * Accepts the connections waiting, up to accept_batch of them at a time;
+ * sets up a sockptyr_hdl for each, and runs some code with the handle.
+ * If we're out of file descriptors, pauses the socket for a bit, with
+ * sockptyr_lstn_pause(), rather than keep getting called for connections
+ * we can't accept.
+ */
+static void sockptyr_lstn_handler(ClientData cd, int mask)
+{
+    struct sockptyr_hdl *hdl = cd, *chdl;
+    struct sockptyr_data *sd = hdl->sd;
+    Tcl_Interp *interp = sd->interp;
+    struct sockptyr_lstn *lstn;
+    unsigned long gen = hdl->gen;
+    int fd, n;
+#if USE_TCL_BACKGROUNDEXCEPTION
+    int result;
+#endif
+    struct sockaddr_un a;
+    socklen_t l;
+    Tcl_Obj *tclcom;
+
+    /* Sanity checks */
+    assert(hdl != NULL);
+    assert(hdl->usage == usage_lstn);
+    lstn = &(hdl->u.u_lstn);
+    assert(lstn->sok >= 0);
+    assert(mask & TCL_READABLE);
+
+    for (n = 0; n < accept_batch; ) {
+        /* Accept a connection */
+        memset(&a, 0, sizeof(a));
+        l = sizeof(a);
+#if USE_ACCEPT4
+        fd = accept4(lstn->sok, (void *)&a, &l, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else /* USE_ACCEPT4 */
+        fd = accept(lstn->sok, (void *)&a, &l);
+#endif /* USE_ACCEPT4 */
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* that's all of them for now */
+                return;
+            } else if (errno == EINTR || errno == ECONNABORTED ||
+                       errno == EPROTO) {
+                /* transient something or other, or a connection that
+                 * went away before we got to it; not an error
+                 */
+                continue;
+            } else if (errno == EMFILE || errno == ENFILE ||
+                       errno == ENOBUFS || errno == ENOMEM) {
+                /* Out of resources.  The connection waits in the
+                 * backlog until we can take it.
+                 */
+                sockptyr_lstn_pause(hdl, lstn_pause_ms);
+                return;
+            } else {
+                /* Some kind of error.  Not handled very intelligently
+                 * here.  The best way would be to have a callback into
+                 * the Tcl code to do something about it.  Right now,
+                 * just emits a message and then ignores the socket for
+                 * a second (to reduce error spewing).
+                 */
+                fprintf(stderr, "accept(): on %d, failed: %s\n",
+                        (int)lstn->sok, strerror(errno));
+                sockptyr_lstn_pause(hdl, 1000);
+                return;
+            }
+        }
+        ++n;
+#if !USE_ACCEPT4
+        if (sockptyr_set_nonblock(fd) < 0 ||
+            fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+            fprintf(stderr, "fcntl(): on %d, failed: %s\n",
+                    (int)fd, strerror(errno));
+            close(fd);
+            continue;
+        }
+#endif /* !USE_ACCEPT4 */
+        ++lstn->n_accepted;
+
+        /* Set up a connection handle for it */
+        chdl = sockptyr_allocate_handle(sd);
+        sockptyr_init_conn(chdl, fd, 'a');
+
+        /* Execute the Tcl handler proc */
+        tclcom = Tcl_DuplicateObj(lstn->proc);
+        Tcl_IncrRefCount(tclcom);
+        Tcl_ListObjAppendElement(interp, tclcom, sockptyr_handle_obj(chdl));
+        Tcl_ListObjAppendElement(interp, tclcom, Tcl_NewObj());
+        Tcl_Preserve(interp);
+#if USE_TCL_BACKGROUNDEXCEPTION
+        result =
+#endif
+        Tcl_EvalObjEx(interp, tclcom, TCL_EVAL_GLOBAL);
+#if USE_TCL_BACKGROUNDEXCEPTION
+        if (result != TCL_OK) {
+            Tcl_BackgroundException(interp, result);
+        }
+#endif
+        Tcl_Release(interp);
+        Tcl_DecrRefCount(tclcom);
+
+        if (hdl->usage != usage_lstn || hdl->gen != gen ||
+            lstn->paused) {
+            return; /* the script closed the socket, or caused a pause */
+        }
+    }
+}
+
+/* sockptyr_lstn_pause(): Stop accepting connections on a listen() socket
+ * for 'ms' milliseconds, or until sockptyr closes a file descriptor,
+ * whichever comes first.  Meanwhile connections wait in its backlog.
+ */
+static void sockptyr_lstn_pause(struct sockptyr_hdl *hdl, int ms)
+{
+    struct sockptyr_lstn *lstn = &(hdl->u.u_lstn);
+
+    if (lstn->paused) {
+        return;
+    }
+    Tcl_DeleteFileHandler(lstn->sok);
+    lstn->paused = 1;
+    ++lstn->n_paused;
+    ++hdl->sd->n_lstn_paused;
+    sockptyr_lst_insert(&(hdl->sd->lstn_paused), hdl);
+    lstn->resume = Tcl_CreateTimerHandler(ms, &sockptyr_lstn_resume_timer,
+                                          hdl);
+}
+
+/* sockptyr_lstn_resume_timer(): Timer handler to resume accepting
+ * connections after sockptyr_lstn_pause().
+ */
+static void sockptyr_lstn_resume_timer(ClientData cd)
+{
+    struct sockptyr_hdl *hdl = cd;
+
+    hdl->u.u_lstn.resume = NULL;
+    sockptyr_lstn_resume(hdl);
+}
+
+/* sockptyr_lstn_resume(): Resume accepting connections on a listen()
+ * socket paused by sockptyr_lstn_pause().
+ */
+static void sockptyr_lstn_resume(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_lstn *lstn = &(hdl->u.u_lstn);
+
+    if (!lstn->paused) {
+        return;
+    }
+    if (lstn->resume != NULL) {
+        Tcl_DeleteTimerHandler(lstn->resume);
+        lstn->resume = NULL;
+    }
+    lstn->paused = 0;
+    --hdl->sd->n_lstn_paused;
+    sockptyr_lst_remove(&(hdl->sd->lstn_paused), hdl);
+    Tcl_CreateFileHandler(lstn->sok, TCL_READABLE, &sockptyr_lstn_handler,
+                          (ClientData)hdl);
+}
+
+/* sockptyr_lstn_resume_all(): Called when sockptyr has closed a file
+ * descriptor, making room for a new one: resume any listen() sockets
+ * that were paused for lack of them.
+ */
+static void sockptyr_lstn_resume_all(struct sockptyr_data *sd)
+{
+    while (sd->lstn_paused != NULL) {
+        sockptyr_lstn_resume(sd->lstn_paused); /* takes it off the list */
+    }
+}
+
+/* sockptyr_cnct_start(): Start connecting a connection from "sockptyr
+ * connect -async", which has a socket to do it with: queue it for
+ * sockptyr_cnct_next(), and start the clock on -timeout.
+ */
+static void sockptyr_cnct_start(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_cnct *c = hdl->u.u_conn.cnct;
+
+    c->state = 'q';
+    c->started = 0;
+    c->err = 0;
+    c->failures = 0;
+    c->retry_ms = connect_retry_ms;
+    c->backoff_ms = c->backoff_first;
+    if (c->timeout > 0) {
+        c->deadline = Tcl_CreateTimerHandler(c->timeout,
+                                             &sockptyr_cnct_deadline,
+                                             (ClientData)hdl);
+    }
+    sockptyr_cnct_queue(hdl->sd, c);
+    sockptyr_cnct_next(hdl->sd);
+}
+
+/* sockptyr_cnct_next(): Start queued "sockptyr connect -async"
+ * connections, as many as sd->connect_limit allows.
+ */
+static void sockptyr_cnct_next(struct sockptyr_data *sd)
+{
+    struct sockptyr_cnct *c;
+
+    while (sd->cnct_head != NULL && sd->n_connecting < sd->connect_limit) {
+        c = sd->cnct_head;
+        sd->cnct_head = c->next;
+        if (sd->cnct_head == NULL) {
+            sd->cnct_tail = NULL;
+        }
+        c->next = NULL;
+        c->started = 1;
+        ++sd->n_connecting;
+        sockptyr_cnct_try(c->hdl);
+    }
+}
+
+/* sockptyr_cnct_queue(): Put 'c' at the end of the queue of connections
+ * waiting for sockptyr_cnct_next() to start them.
+ */
+static void sockptyr_cnct_queue(struct sockptyr_data *sd,
+                                struct sockptyr_cnct *c)
+{
+    c->next = NULL;
+    if (sd->cnct_tail) {
+        sd->cnct_tail->next = c;
+    } else {
+        sd->cnct_head = c;
+    }
+    sd->cnct_tail = c;
+}
+
+/* sockptyr_cnct_unqueue(): Take 'c' out of the queue of connections
+ * waiting for sockptyr_cnct_next() to start them.
+ */
+static void sockptyr_cnct_unqueue(struct sockptyr_data *sd,
+                                  struct sockptyr_cnct *c)
+{
+    struct sockptyr_cnct **cp, *p;
+
+    for (cp = &(sd->cnct_head); *cp != c; cp = &((*cp)->next)) {
+        assert(*cp != NULL);
+    }
+    *cp = c->next;
+    if (sd->cnct_tail == c) {
+        sd->cnct_tail = NULL;
+        for (p = sd->cnct_head; p != NULL; p = p->next) {
+            sd->cnct_tail = p;
+        }
+    }
+    c->next = NULL;
+}
+
+/* sockptyr_cnct_try(): Call connect() on a connection from "sockptyr
+ * connect -async", which has a non blocking socket.  Depending on how
+ * that goes, finish up, wait for it to be writable, or try again later.
+ * A unix domain socket on Linux either connects at once or, if the
+ * listener's backlog is full, fails with EAGAIN; other systems may
+ * give EINPROGRESS instead.
+ */
+static void sockptyr_cnct_try(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_cnct *c = conn->cnct;
+
+    assert(c != NULL);
+    c->retry = NULL;
+    if (connect(conn->fd, (void *)&(c->sa), sizeof(c->sa)) == 0 ||
+        errno == EISCONN) {
+        sockptyr_cnct_done(hdl, 0);
+    } else if (errno == EINPROGRESS || errno == EALREADY) {
+        c->state = 'w';
+        Tcl_CreateFileHandler(conn->fd, TCL_WRITABLE,
+                              &sockptyr_cnct_writable, (ClientData)hdl);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        c->state = 't';
+        c->retry = Tcl_CreateTimerHandler(c->retry_ms,
+                                          &sockptyr_cnct_retry_timer,
+                                          (ClientData)hdl);
+        c->retry_ms *= 2;
+        if (c->retry_ms > connect_retry_max_ms) {
+            c->retry_ms = connect_retry_max_ms;
+        }
+    } else {
+        sockptyr_cnct_done(hdl, errno);
+    }
+}
+
+/* sockptyr_cnct_retry_timer(): Timer handler to try connect() again. */
+static void sockptyr_cnct_retry_timer(ClientData cd)
+{
+    sockptyr_cnct_try((struct sockptyr_hdl *)cd);
+}
+
+/* sockptyr_cnct_writable(): File handler for when a connection's
+ * connect() said EINPROGRESS and its socket has become writable: the
+ * connect() is done, successfully or not.
+ */
+static void sockptyr_cnct_writable(ClientData cd, int mask)
+{
+    struct sockptyr_hdl *hdl = cd;
+    int e = 0;
+    socklen_t l = sizeof(e);
+
+    if (getsockopt(hdl->u.u_conn.fd, SOL_SOCKET, SO_ERROR, &e, &l) < 0) {
+        e = errno;
+    }
+    sockptyr_cnct_done(hdl, e);
+}
+
+/* sockptyr_cnct_deadline(): Timer handler for "sockptyr connect -timeout";
+ * give up.
+ */
+static void sockptyr_cnct_deadline(ClientData cd)
+{
+    struct sockptyr_hdl *hdl = cd;
+    struct sockptyr_cnct *c = hdl->u.u_conn.cnct;
+
+    c->deadline = NULL;
+    if (c->state == 'q') {
+        sockptyr_cnct_unqueue(hdl->sd, c);
+    }
+    sockptyr_cnct_done(hdl, ETIMEDOUT);
+}
+
+/* sockptyr_cnct_done(): A connection from "sockptyr connect -async" is
+ * done connecting, successfully if 'err' is 0, otherwise failed with
+ * that errno value.  Stop anything that might still go off, and
+ * arrange for sockptyr_cnct_report() to run its -command script from
+ * the event loop: this can happen within "sockptyr connect", which
+ * mustn't run it.
+ */
+static void sockptyr_cnct_done(struct sockptyr_hdl *hdl, int err)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_cnct *c = conn->cnct;
+
+    if (c->state == 'w') {
+        Tcl_DeleteFileHandler(conn->fd);
+    }
+    if (c->retry != NULL) {
+        Tcl_DeleteTimerHandler(c->retry);
+        c->retry = NULL;
+    }
+    if (err != 0 && sockptyr_cnct_backoff(hdl, &err) == 0) {
+        return; /* it'll try again */
+    }
+    if (c->deadline != NULL) {
+        Tcl_DeleteTimerHandler(c->deadline);
+        c->deadline = NULL;
+    }
+    c->state = 'd';
+    c->err = err;
+    Tcl_DoWhenIdle(&sockptyr_cnct_report, (ClientData)hdl);
+}
+
+/* sockptyr_cnct_socket(): Get a new socket for a connection from
+ * "sockptyr connect -async" to connect with: non-blocking and
+ * close-on-exec like all of sockptyr's file descriptors.  Returns it,
+ * or -1 (with errno set) on failure.
+ */
+static int sockptyr_cnct_socket(void)
+{
+    int fd, e;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && (sockptyr_set_nonblock(fd) < 0 ||
+                    fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)) {
+        e = errno;
+        close(fd);
+        errno = e;
+        fd = -1;
+    }
+    return(fd);
+}
+
+/* sockptyr_cnct_backoff(): A connection from "sockptyr connect -async"
+ * failed to connect, with errno value '*err'.  If its -attempts and
+ * -timeout allow, get a new socket and wait a while to try again:
+ * randomly between half and all of 'backoff_ms', so that connections
+ * that failed together don't all try again together.  Meanwhile it
+ * doesn't count against "sockptyr connect_limit".
+ *
+ * Returns 0 if it'll try again, -1 if not; changing '*err' if it
+ * couldn't get a socket.
+ */
+static int sockptyr_cnct_backoff(struct sockptyr_hdl *hdl, int *err)
+{
+    struct sockptyr_data *sd = hdl->sd;
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_cnct *c = conn->cnct;
+    int fd, ms;
+
+    if (c->timeout > 0 && c->deadline == NULL) {
+        return(-1); /* out of time */
+    }
+    ++c->failures;
+    if (c->attempts > 0 && c->failures >= c->attempts) {
+        return(-1); /* out of attempts */
+    }
+
+    /* a socket whose connect() failed can't be counted on to try again */
+    fd = sockptyr_cnct_socket();
+    if (fd < 0) {
+        *err = errno;
+        return(-1);
+    }
+    close(conn->fd);
+    conn->fd = fd;
+
+    ms = c->backoff_ms - sockptyr_random(sd) % (c->backoff_ms / 2 + 1);
+    if (c->backoff_ms > c->backoff_max / 2) {
+        c->backoff_ms = c->backoff_max;
+    } else {
+        c->backoff_ms *= 2;
+    }
+    c->state = 'b';
+    c->retry_ms = connect_retry_ms;
+    c->retry = Tcl_CreateTimerHandler(ms, &sockptyr_cnct_backoff_timer,
+                                      (ClientData)hdl);
+    if (c->started) {
+        c->started = 0;
+        --sd->n_connecting;
+        sockptyr_cnct_next(sd);
+    }
+    return(0);
+}
+
+/* sockptyr_cnct_backoff_timer(): Timer handler for when a connection
+ * has waited long enough after failing; queue it to try again.
+ */
+static void sockptyr_cnct_backoff_timer(ClientData cd)
+{
+    struct sockptyr_hdl *hdl = cd;
+    struct sockptyr_cnct *c = hdl->u.u_conn.cnct;
+
+    c->retry = NULL;
+    c->state = 'q';
+    sockptyr_cnct_queue(hdl->sd, c);
+    sockptyr_cnct_next(hdl->sd);
+}
+
+/* sockptyr_cnct_lost(): A connection from "sockptyr connect -reconnect"
+ * was closed or got an error, described by 'why'.  Instead of running
+ * its "sockptyr onclose" or "sockptyr onerror" script, start connecting
+ * it again, keeping its handle, link, and any data received before
+ * that's yet to be sent on; and run its -command script with "lost".
+ *
+ * The same cautions apply as for sockptyr_conn_event().
+ */
+static void sockptyr_cnct_lost(struct sockptyr_hdl *hdl, const char *why)
+{
+    struct sockptyr_data *sd = hdl->sd;
+    Tcl_Interp *interp = sd->interp;
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_cnct *c = conn->rcon;
+    Tcl_Obj *tclcom;
+    int fd, err;
+#if USE_TCL_BACKGROUNDEXCEPTION
+    int result;
+#endif
+
+    assert(c != NULL && conn->cnct == NULL && c->state == 'c');
+#if USE_OFFLOAD
+    sockptyr_offload_reclaim(hdl);
+#endif /* USE_OFFLOAD */
+    if (conn->fd >= 0) {
+        Tcl_DeleteFileHandler(conn->fd);
+        conn->reg_mask = -1;
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+    conn->cnct = c;
+    fd = sockptyr_cnct_socket();
+    err = errno; /* before anything else can change it */
+    if (fd < 0) {
+        /* can't reconnect; give up, through sockptyr_cnct_report() */
+        c->state = 'd';
+        c->err = err;
+        Tcl_DoWhenIdle(&sockptyr_cnct_report, (ClientData)hdl);
+    } else {
+        conn->fd = fd;
+        sockptyr_cnct_start(hdl);
+    }
+
+    tclcom = Tcl_DuplicateObj(c->proc);
+    Tcl_IncrRefCount(tclcom);
+    Tcl_ListObjAppendElement(interp, tclcom, sockptyr_handle_obj(hdl));
+    Tcl_ListObjAppendElement(interp, tclcom, Tcl_NewStringObj("lost", -1));
+    Tcl_ListObjAppendElement(interp, tclcom, Tcl_NewStringObj(why, -1));
+    Tcl_Preserve(interp);
+#if USE_TCL_BACKGROUNDEXCEPTION
+    result =
+#endif
+    Tcl_EvalObjEx(interp, tclcom, TCL_EVAL_GLOBAL);
+#if USE_TCL_BACKGROUNDEXCEPTION
+    if (result != TCL_OK) {
+        Tcl_BackgroundException(interp, result);
+    }
+#endif
+    Tcl_Release(interp);
+    Tcl_DecrRefCount(tclcom);
+}
+
+/* sockptyr_random(): A pseudorandom number, for sockptyr_cnct_backoff();
+ * xorshift, which is plenty for spreading out retries, and leaves the
+ * C library's rand() alone.
+ */
+static uint32_t sockptyr_random(struct sockptyr_data *sd)
+{
+    uint32_t x = sd->rand;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sd->rand = x;
+    return(x);
+}
+
+/* sockptyr_cnct_report(): Idle handler to finish up a connection from
+ * "sockptyr connect -async": let it do I/O, or close it if it failed;
+ * and run its -command script.
+ */
+static void sockptyr_cnct_report(ClientData cd)
+{
+    struct sockptyr_hdl *hdl = cd;
+    struct sockptyr_data *sd = hdl->sd;
+    Tcl_Interp *interp = sd->interp;
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_cnct *c = conn->cnct;
+    Tcl_Obj *tclcom;
+    int err;
+#if USE_TCL_BACKGROUNDEXCEPTION
+    int result;
+#endif
+
+    assert(c != NULL && c->state == 'd');
+    tclcom = Tcl_DuplicateObj(c->proc);
+    Tcl_IncrRefCount(tclcom);
+    Tcl_ListObjAppendElement(interp, tclcom, sockptyr_handle_obj(hdl));
+    if (c->err == 0) {
+        Tcl_ListObjAppendElement(interp, tclcom, Tcl_NewStringObj("ok", -1));
+        Tcl_ListObjAppendElement(interp, tclcom, Tcl_NewObj());
+    } else {
+        Tcl_ListObjAppendElement(interp, tclcom,
+                                 Tcl_NewStringObj("error", -1));
+        Tcl_ListObjAppendElement(interp, tclcom,
+                                 Tcl_ObjPrintf("connect(%s) failed: %s",
+                                               c->sa.sun_path,
+                                               strerror(c->err)));
+    }
+
+    /* done with 'c' unless it's to reconnect; the connection can start
+     * working, or go away
+     */
+    if (c->started) {
+        c->started = 0;
+        --sd->n_connecting;
+    }
+    conn->cnct = NULL;
+    err = c->err;
+    if (err == 0 && c->reconnect) {
+        c->state = 'c';
+    } else {
+        conn->rcon = NULL;
+        Tcl_DecrRefCount(c->proc);
+        ckfree((void *)c);
+    }
+    if (err == 0) {
+        sockptyr_register_conn_handler(hdl);
+    } else {
+        sockptyr_clobber_handle(hdl, 1);
+    }
+    sockptyr_cnct_next(sd);
+
+    /* Execute the Tcl handler proc */
+    Tcl_Preserve(interp);
+#if USE_TCL_BACKGROUNDEXCEPTION
+    result =
+#endif
+    Tcl_EvalObjEx(interp, tclcom, TCL_EVAL_GLOBAL);
+#if USE_TCL_BACKGROUNDEXCEPTION
+    if (result != TCL_OK) {
+        Tcl_BackgroundException(interp, result);
+    }
+#endif
+    Tcl_Release(interp);
+    Tcl_DecrRefCount(tclcom);
+}
+
+/* sockptyr_cnct_cancel(): A connection from "sockptyr connect -async" is
+ * being closed before its -command script was run, or it's from
+ * "sockptyr connect -reconnect" and being closed at all.  Forget about
+ * it without running the script.
+ */
+static void sockptyr_cnct_cancel(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_data *sd = hdl->sd;
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_cnct *c = conn->cnct ? conn->cnct : conn->rcon;
+
+    if (c->state == 'q') {
+        sockptyr_cnct_unqueue(sd, c);
+    } else if (c->state == 'd') {
+        Tcl_CancelIdleCall(&sockptyr_cnct_report, (ClientData)hdl);
+    } else if (c->state == 'w') {
+        Tcl_DeleteFileHandler(conn->fd);
+    }
+    if (c->retry != NULL) {
+        Tcl_DeleteTimerHandler(c->retry);
+    }
+    if (c->deadline != NULL) {
+        Tcl_DeleteTimerHandler(c->deadline);
+    }
+    if (c->started) {
+        --sd->n_connecting;
+    }
+    Tcl_DecrRefCount(c->proc);
+    ckfree((void *)c);
+    conn->cnct = conn->rcon = NULL;
+    sockptyr_cnct_next(sd);
+}
+
+/* sockptyr_conn_event() -- handle something happening on a connection,
+ * like an error or it being closed, by calling the registered Tcl handler.
+ * If it's just closure, 'errkws' and 'errstr' should be NULL.  If it's
+ * an error they should be filled in.
+ *
+ * This may execute Tcl code that may in turn change the state of the
+ * connection in hard to predict ways.  Be careful when you run this,
+ * especially of what you do afterwards.
+ *
+ * In the "close" case (where 'errkws' and 'errstr' are NULL) this will
+ * also clobber the handle (see sockptyr_clobber_handle()).
+ *
+ * 'hdl' is assumed to be a connection, not one of the other things.
+ */
+static void sockptyr_conn_event(struct sockptyr_hdl *hdl,
+                                char **errkws, char *errstr)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_data *sd = hdl->sd;
+    Tcl_Interp *interp = sd->interp;
+    Tcl_Obj *cmd, *es;
+#if USE_TCL_BACKGROUNDEXCEPTION
+    int result;
+#endif
+    int i;
+
+    SOCKPTYR_TRACE(sd, errkws ? trace_error : trace_close, hdl->num,
+                   0, 0, 0);
+
+    if (conn->rcon != NULL && errkws != sockptyr_errkws_bug
+        && errkws != sockptyr_errkws_fanslow
+#if USE_RECORD
+        && errkws != sockptyr_errkws_record
+#endif /* USE_RECORD */
+        ) {
+        /* from "sockptyr connect -reconnect": connect again instead;
+         * but not for a recording's errors or being cut out of a fan-out
+         * group, the connection's fine
+         */
+        sockptyr_cnct_lost(hdl, errstr ? errstr : "connection closed");
+        return;
+    }
+
+    if (errkws == NULL) {
+        if (conn->onclose == NULL) return; /* no handler */
+
+        cmd = conn->onclose;
+        Tcl_IncrRefCount(cmd); /* sockptyr_clobber_handle() lets go of it */
+
+        sockptyr_clobber_handle(hdl, 0);
+    } else {
+        if (conn->onerror == NULL) return; /* no handler */
+
+        cmd = Tcl_DuplicateObj(conn->onerror);
+        es = Tcl_NewListObj(0, NULL);
+        for (i = 0; errkws && errkws[i]; ++i) {
+            Tcl_ListObjAppendElement(interp, es,
+                                     Tcl_NewStringObj(errkws[i],
+                                                      strlen(errkws[i])));
+        }
+        if (errstr == NULL) errstr = "";
+        Tcl_ListObjAppendElement(interp, cmd, es);
+        Tcl_ListObjAppendElement(interp, cmd,
+                                 Tcl_NewStringObj(errstr, strlen(errstr)));
+        Tcl_IncrRefCount(cmd);
+    }
+
+    Tcl_Preserve(interp);
+#if USE_TCL_BACKGROUNDEXCEPTION
+    result =
+#endif
+    Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL);
+#if USE_TCL_BACKGROUNDEXCEPTION
+    if (result != TCL_OK) {
+        Tcl_BackgroundException(interp, result);
+    }
+#endif
+    Tcl_Release(interp);
+    Tcl_DecrRefCount(cmd);
 }
-#endif /* USE_INOTIFY */
 
-/* sockptyr_lstn_handler(): Called by the Tcl event loop when a socket
- * we've listen()ed on receives a connection.  'cd' contains the
- * 'struct sockptyr_hdl *' associated with that socket.
+/* sockptyr_conn_event_sys() -- wrapper around sockptyr_conn_event() for
+ * errors that come from system calls & set errno.
+ *
+ * This may execute Tcl code that may in turn change the state of the
+ * connection in hard to predict ways.  Be careful when you run this,
+ * especially of what you do afterwards.
  *
- * Accepts the connection, sets up a sockptyr_hdl for it, and runs
- * some code with the handle.
+ * Parameters:
+ *      hdl -- a connection handle
+ *      e -- error number (e.g. EIO) usually copied from errno
  */
-static void sockptyr_lstn_handler(ClientData cd, int mask)
+static void sockptyr_conn_event_sys(struct sockptyr_hdl *hdl, int e)
 {
-    struct sockptyr_hdl *hdl = cd, *chdl;
-    struct sockptyr_data *sd = hdl->sd;
-    Tcl_Interp *interp = sd->interp;
-    struct sockptyr_lstn *lstn;
-    int fd;
-#if USE_TCL_BACKGROUNDEXCEPTION
-    int result;
-#endif
-    struct sockaddr_un a;
-    socklen_t l;
-    Tcl_Obj *tclcom;
+    if (e == EAGAIN || e == EWOULDBLOCK) {
+        /* Our connections are non-blocking, but sockptyr_conn_io() takes
+         * care of these, so they shouldn't get here.
+         */
+        sockptyr_conn_event(hdl, sockptyr_errkws_bug,
+                            "unhandled would-block error");
+    } else {
+        char *errkws[3];
+        int ei;
+        ei = 0;
+        errkws[ei++] = "io";
+        switch (e) {
+            case EIO:
+                errkws[ei++] = "EIO";
+                break;
+            case EPIPE:
+                errkws[ei++] = "EPIPE";
+                break;
+            case ECONNRESET:
+                errkws[ei++] = "ECONNRESET";
+                break;
+            case ESHUTDOWN:
+                errkws[ei++] = "ESHUTDOWN";
+                break;
+            default:
+                /* nothing */
+                break;
+        }
+        errkws[ei] = NULL;
+        sockptyr_conn_event(hdl, errkws, strerror(e));
+    }
+}
+
+/*
+ * sockptyr_conn_unlink(): Given a connection handler unlink it from
+ * whatever it's linked to and empty their buffers.  (Emptying their
+ * buffers helps in detecting a closed connection.)
+ * If it's linked to itself this function handles it correctly. If it's
+ * not linked to anything, or it isn't a connection and couldn't be linked
+ * to anything, this function handles it correctly (by doing nothing).
+ */
+static void sockptyr_conn_unlink(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_conn *conns[2];
+    struct sockptyr_hdl *hdls[2];
+    int i;
+
+    hdls[0] = hdl;
+    if (hdl == NULL || hdl->usage != usage_conn) {
+        return;
+    }
+#if USE_OFFLOAD
+    sockptyr_offload_reclaim(hdl);
+#endif /* USE_OFFLOAD */
+    conns[0] = &(hdls[0]->u.u_conn);
+    hdls[1] = conns[0]->linked;
+
+    if (hdls[1] == NULL || hdl == hdls[1]) {
+        conns[1] = NULL;
+    } else {
+        assert(hdls[1]->usage == usage_conn);
+        conns[1] = &(hdls[1]->u.u_conn);
+    }
+
+    for (i = 0; i < 2; ++i) {
+        if (conns[i]) {
+            sockptyr_conn_drained(hdl->sd, conns[i]);
+            conns[i]->linked = NULL;
+            conns[i]->rpl_pos = conns[i]->rpl_end = 0;
+#if USE_SPLICE
+            sockptyr_conn_splice_stop(conns[i]);
+#endif /* USE_SPLICE */
+        }
+    }
+
+    for (i = 0; i < 2; ++i) {
+        if (conns[i]) {
+            sockptyr_register_conn_handler(hdls[i]);
+        }
+    }
+}
+
+/* sockptyr_fan_join(): Put a connection into a fan-out group, as its
+ * source if 'issrc', otherwise as a sink.  It leaves whatever it was
+ * linked to, or other group it was in, first.  A new sink starts with
+ * what the source receives next; or if 'replay', with what's in the
+ * source's scrollback.
+ */
+static void sockptyr_fan_join(struct sockptyr_fan *fan,
+                              struct sockptyr_hdl *hdl, int issrc,
+                              int replay)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+
+    assert(hdl->usage == usage_conn);
+    if (conn->fan == fan && !issrc) {
+        return; /* already in it */
+    }
+    if (conn->fan) {
+        sockptyr_fan_leave(hdl);
+    }
+    if (conn->linked) {
+        sockptyr_conn_unlink(hdl);
+    }
+
+    conn->fan = fan;
+    if (issrc) {
+        fan->src = hdl;
+    } else {
+        conn->fan_lag = conn->fan_slow = 0;
+        conn->fan_next = fan->sinks;
+        fan->sinks = hdl;
+        ++fan->nsinks;
+        if (replay) {
+            sockptyr_sbk_rewind(hdl);
+        }
+    }
+    sockptyr_fan_register(fan);
+}
+
+/* sockptyr_fan_leave(): Take a connection out of the fan-out group it's
+ * in, leaving it unlinked.  If it's the group's source, that's the end
+ * of the group: its handle becomes useless (see sockptyr_clobber_handle())
+ * and all its sinks are left unlinked.
+ */
+static void sockptyr_fan_leave(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_fan *fan = hdl->u.u_conn.fan;
+
+    if (fan == NULL) {
+        return; /* not in one */
+    }
+    if (fan->src == hdl) {
+        sockptyr_clobber_handle(fan->hdl, 0);
+        return;
+    }
+    sockptyr_fan_detach(hdl);
+    sockptyr_register_conn_handler(hdl);
+    sockptyr_register_conn_handler(fan->src);
+}
+
+/* sockptyr_fan_detach(): The part of sockptyr_fan_leave() for a sink that
+ * doesn't touch Tcl or the registered event handlers, so it can be used
+ * from sockptyr_conn_io().  Whatever it received that hasn't been sent
+ * to the source is thrown away, as by sockptyr_conn_unlink().
+ */
+static void sockptyr_fan_detach(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_fan *fan = conn->fan;
+    struct sockptyr_hdl **hp;
+
+    for (hp = &(fan->sinks); *hp != hdl; hp = &((*hp)->u.u_conn.fan_next)) {
+        assert(*hp != NULL);
+    }
+    *hp = conn->fan_next;
+    --fan->nsinks;
+    if (fan->in_next == hdl) {
+        fan->in_next = NULL;
+    }
+    conn->fan = NULL;
+    conn->fan_next = NULL;
+    conn->fan_lag = conn->fan_slow = 0;
+    conn->rpl_pos = conn->rpl_end = 0;
+    sockptyr_conn_drained(fan->sd, conn);
+    if (fan->src != NULL) {
+        sockptyr_fan_sync(fan);
+    }
+}
+
+/* sockptyr_fan_register(): Call sockptyr_register_conn_handler() on all
+ * the connections in a fan-out group, since I/O on any of them can change
+ * what the others can do.  And if the source's buffer has filled up,
+ * start timing how long the sinks take to catch up; see
+ * sockptyr_fan_slow().
+ */
+static void sockptyr_fan_register(struct sockptyr_fan *fan)
+{
+    struct sockptyr_hdl *sink;
+
+    if (fan->policy == 'd' && !sockptyr_conn_can_recv(&(fan->src->u.u_conn))) {
+        /* sinks already found slow don't get to hold it up again */
+        sockptyr_fan_drop(fan, 1);
+    }
+    sockptyr_register_conn_handler(fan->src);
+    for (sink = fan->sinks; sink != NULL; sink = sink->u.u_conn.fan_next) {
+        sockptyr_register_conn_handler(sink);
+    }
+    if (fan->policy != 'b' && fan->slow_timer == NULL &&
+        !sockptyr_conn_can_recv(&(fan->src->u.u_conn))) {
+        fan->slow_timer = Tcl_CreateTimerHandler(fan->grace_ms,
+                                                 &sockptyr_fan_slow,
+                                                 (ClientData)fan);
+    }
+}
+
+/* sockptyr_fan_pending(): Is there anything for a connection in a fan-out
+ * group to send?  For a sink, that's what it hasn't sent of the source's
+ * buffer; for the source, what's in the sinks' buffers.
+ */
+static int sockptyr_fan_pending(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_fan *fan = hdl->u.u_conn.fan;
+    struct sockptyr_hdl *sink;
+
+    if (fan->src != hdl) {
+        return(hdl->u.u_conn.fan_lag > 0);
+    }
+    for (sink = fan->sinks; sink != NULL; sink = sink->u.u_conn.fan_next) {
+        if (sockptyr_conn_has_data(&(sink->u.u_conn))) {
+            return(1);
+        }
+    }
+    return(0);
+}
+
+/* sockptyr_fan_received(): Called when 'n' bytes have been received into
+ * a fan-out group source's buffer: each sink has that much more to send.
+ */
+static void sockptyr_fan_received(struct sockptyr_fan *fan, int n)
+{
+    struct sockptyr_hdl *sink;
+
+    for (sink = fan->sinks; sink != NULL; sink = sink->u.u_conn.fan_next) {
+        sink->u.u_conn.fan_lag += n;
+    }
+}
+
+/* sockptyr_fan_sync(): Called when sinks of a fan-out group have sent
+ * some of the source's buffer (or skipped it, or left): let go of the
+ * data the furthest behind of them no longer needs.
+ */
+static void sockptyr_fan_sync(struct sockptyr_fan *fan)
+{
+    struct sockptyr_conn *conn = &(fan->src->u.u_conn);
+    struct sockptyr_hdl *sink;
+    int lag = 0;
+
+    if (conn->buf_empty) {
+        return; /* nothing to let go of */
+    }
+    for (sink = fan->sinks; sink != NULL; sink = sink->u.u_conn.fan_next) {
+        if (sink->u.u_conn.fan_lag > lag) {
+            lag = sink->u.u_conn.fan_lag;
+        }
+    }
+    if (lag == 0) {
+        sockptyr_conn_drained(fan->sd, conn);
+        return;
+    }
+    conn->buf_out = conn->buf_in - lag;
+    if (conn->buf_out < 0) {
+        conn->buf_out += conn->buf_sz; /* wrap around */
+    }
+}
+
+/* sockptyr_fan_data(): Like sockptyr_ring_data(), for a sink of a fan-out
+ * group: fill in 'iov' with the last 'lag' bytes received into the
+ * source's buffer, 'conn'.  'lag' mustn't be 0.
+ */
+static int sockptyr_fan_data(struct sockptyr_conn *conn, int lag,
+                             struct iovec *iov)
+{
+    int start;
+
+    start = conn->buf_in - lag;
+    if (start < 0) {
+        start += conn->buf_sz; /* wrap around */
+    }
+    iov[0].iov_base = conn->buf + start;
+    if (start + lag <= conn->buf_sz) {
+        iov[0].iov_len = lag;
+        return(1);
+    }
+    iov[0].iov_len = conn->buf_sz - start;
+    iov[1].iov_base = conn->buf;
+    iov[1].iov_len = lag - iov[0].iov_len;
+    return(2);
+}
+
+/* sockptyr_fan_send(): The part of sockptyr_conn_send() for connections
+ * in a fan-out group.  A sink sends from the source's buffer, starting
+ * at its own place in it.  The source sends from the sinks' buffers,
+ * taking them in turn.  Same parameters and return value as
+ * sockptyr_conn_send().
+ */
+static int sockptyr_fan_send(struct sockptyr_hdl *hdl, int *blocked,
+                             struct sockptyr_ioev *ev)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn), *lconn;
+    struct sockptyr_fan *fan = conn->fan;
+    struct sockptyr_hdl *sink;
+    struct iovec iov[2];
+    int rv, niov, i;
+
+    if (fan->src != hdl) {
+        /* a sink */
+        if (conn->fan_lag == 0) {
+            return(0); /* nothing to send */
+        }
+        if (conn->cnct) {
+            /* not connected yet; the data waits in the source's buffer */
+            *blocked = 1;
+            return(0);
+        }
+        niov = sockptyr_fan_data(&(fan->src->u.u_conn), conn->fan_lag, iov);
+        rv = sockptyr_conn_writev(hdl, iov, niov, blocked, ev);
+        if (rv > 0) {
+            conn->fan_lag -= rv;
+            if (conn->fan_lag == 0) {
+                conn->fan_slow = 0; /* caught up */
+            }
+            sockptyr_fan_sync(fan);
+        }
+        return(rv);
+    }
+
+    /* the source: find the next sink, in turn, with something for it */
+    sink = fan->in_next ? fan->in_next : fan->sinks;
+    for (i = 0; i < fan->nsinks; ++i) {
+        if (sockptyr_conn_has_data(&(sink->u.u_conn))) {
+            break;
+        }
+        sink = sink->u.u_conn.fan_next;
+        if (sink == NULL) {
+            sink = fan->sinks;
+        }
+    }
+    if (i >= fan->nsinks) {
+        return(0); /* nothing to send */
+    }
+    if (conn->cnct) {
+        /* not connected yet; the data waits in the sinks' buffers */
+        *blocked = 1;
+        return(0);
+    }
+    lconn = &(sink->u.u_conn);
+    niov = sockptyr_ring_data(lconn, iov);
+    rv = sockptyr_conn_writev(hdl, iov, niov, blocked, ev);
+    if (rv > 0) {
+        sockptyr_conn_consumed(hdl->sd, lconn, rv);
+        fan->in_next = lconn->fan_next;
+    }
+    return(rv);
+}
+
+/* sockptyr_fan_push(): For the source of a fan-out group, in
+ * sockptyr_conn_io(): try sending on each of the sinks, what they have yet
+ * to send of what it's received.  Returns the total number of bytes sent;
+ * sets '*blocked' if none of them can send any more.  If something
+ * should be reported, fills in '*ev' and returns -1, as sockptyr_conn_io().
+ */
+static int sockptyr_fan_push(struct sockptyr_hdl *hdl, int *blocked,
+                             struct sockptyr_ioev *ev)
+{
+    struct sockptyr_hdl *sink;
+    int rv, got = 0, more = 0, blk;
+
+    for (sink = hdl->u.u_conn.fan->sinks; sink != NULL;
+         sink = sink->u.u_conn.fan_next) {
+        if (sink->u.u_conn.fan_lag == 0 &&
+            sink->u.u_conn.rpl_pos == sink->u.u_conn.rpl_end) {
+            continue;
+        }
+        blk = 0;
+        rv = sockptyr_conn_send(sink, &blk, ev);
+        if (rv < 0) {
+            return(-1);
+        }
+        got += rv;
+        if (!blk) {
+            more = 1;
+        }
+    }
+    if (!more) {
+        *blocked = 1;
+    }
+    return(got);
+}
+
+/* sockptyr_fan_slow(): Timer handler, run "-grace" milliseconds after
+ * a fan-out group's source filled its buffer (as big as it can get).  If
+ * it's still full, the sinks that are the whole buffer behind haven't
+ * sent anything since then: either skip what they haven't sent, or take
+ * them out of the group, according to the group's policy.
+ */
+static void sockptyr_fan_slow(ClientData cd)
+{
+    struct sockptyr_fan *fan = cd;
+    struct sockptyr_conn *conn;
+    struct sockptyr_hdl *sink, **cut;
+    unsigned long *gens;
+    int sz, ncut, i;
+
+    fan->slow_timer = NULL;
+    if (sockptyr_conn_can_recv(&(fan->src->u.u_conn))) {
+        return; /* they caught up */
+    }
+
+    if (fan->policy == 'd') {
+        sockptyr_fan_drop(fan, 0);
+        sockptyr_fan_register(fan);
+        return;
+    }
+
+    /* take the slow ones out of the group */
+    sz = fan->src->u.u_conn.buf_sz;
+    cut = (void *)ckalloc(fan->nsinks * sizeof(cut[0]));
+    gens = (void *)ckalloc(fan->nsinks * sizeof(gens[0]));
+    ncut = 0;
+    for (sink = fan->sinks; sink != NULL; ) {
+        conn = &(sink->u.u_conn);
+        if (conn->fan_lag < sz) {
+            /* not one holding things up */
+            sink = conn->fan_next;
+        } else {
+            cut[ncut] = sink;
+            gens[ncut] = sink->gen;
+            ++ncut;
+            ++fan->n_cut;
+            sink = conn->fan_next;
+            sockptyr_fan_detach(cut[ncut - 1]);
+        }
+    }
+    sockptyr_fan_register(fan);
+
+    /* Report the ones taken out of the group.  That runs Tcl code that
+     * might close any of them, or the group.
+     */
+    for (i = 0; i < ncut; ++i) {
+        sockptyr_register_conn_handler(cut[i]);
+    }
+    for (i = 0; i < ncut; ++i) {
+        if (cut[i]->usage == usage_conn && cut[i]->gen == gens[i]) {
+            sockptyr_conn_event(cut[i], sockptyr_errkws_fanslow,
+                                "fell too far behind in fan-out group");
+        }
+    }
+    ckfree((void *)cut);
+    ckfree((void *)gens);
+}
+
+/* sockptyr_fan_drop(): For "-policy drop", when a fan-out group's source
+ * has filled its buffer: the sinks that are the whole buffer behind skip
+ * what they haven't sent.  If 'known', only those that have had that
+ * happen before, and not caught up since; see sockptyr_fan_register().
+ */
+static void sockptyr_fan_drop(struct sockptyr_fan *fan, int known)
+{
+    struct sockptyr_conn *conn;
+    struct sockptyr_hdl *sink;
+    int sz = fan->src->u.u_conn.buf_sz;
+
+    for (sink = fan->sinks; sink != NULL; sink = conn->fan_next) {
+        conn = &(sink->u.u_conn);
+        if (conn->fan_lag < sz || (known && !conn->fan_slow)) {
+            continue;
+        }
+        fan->n_dropped += conn->fan_lag;
+        conn->fan_lag = 0;
+        conn->fan_slow = 1;
+    }
+    sockptyr_fan_sync(fan);
+}
+
+/* sockptyr_sbk_open(): Set up a scrollback of 'size' bytes for
+ * "sockptyr scrollback": in file 'path', or if that's NULL, in anonymous
+ * memory.  A file that already holds a scrollback of the same size keeps
+ * its contents; otherwise it's resized and starts out empty.  Returns
+ * NULL, with an error message in 'interp', if that fails.
+ */
+static struct sockptyr_sbk *sockptyr_sbk_open(Tcl_Interp *interp,
+                                              long size, const char *path)
+{
+    struct sockptyr_sbk *sbk;
+    struct sockptyr_sbk_hdr *hdr;
+    struct stat st;
+    size_t len;
+    void *map;
+    int fd, e, reuse = 0;
+
+    len = sizeof(*hdr) + (size_t)size;
+    if (path != NULL) {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            e = errno;
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("sockptyr scrollback: %s: %s",
+                                           path, strerror(e)));
+            return(NULL);
+        }
+        if (fstat(fd, &st) >= 0 && st.st_size == (off_t)len) {
+            reuse = 1;
+        } else if (ftruncate(fd, (off_t)len) < 0) {
+            e = errno;
+            close(fd);
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("sockptyr scrollback: %s: %s",
+                                           path, strerror(e)));
+            return(NULL);
+        }
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        e = errno;
+        close(fd); /* the mapping stays */
+    } else {
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+        e = errno;
+    }
+    if (map == MAP_FAILED) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("sockptyr scrollback: mmap: %s",
+                                       strerror(e)));
+        return(NULL);
+    }
 
-    /* Sanity checks */
-    assert(hdl != NULL);
-    assert(hdl->usage == usage_lstn);
-    lstn = &(hdl->u.u_lstn);
-    assert(lstn->sok >= 0);
-    assert(mask & TCL_READABLE);
+    hdr = map;
+    if (!reuse || memcmp(hdr->magic, scrollback_magic, sizeof(hdr->magic)) ||
+        hdr->size != (uint64_t)size) {
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, scrollback_magic, sizeof(hdr->magic));
+        hdr->size = size;
+        hdr->total = 0;
+    }
+    sbk = (void *)ckalloc(sizeof(*sbk));
+    memset(sbk, 0, sizeof(*sbk));
+    sbk->hdr = hdr;
+    sbk->data = (unsigned char *)map + sizeof(*hdr);
+    sbk->size = size;
+    sbk->map_len = len;
+    return(sbk);
+}
 
-    /* Accept the connection */
-    memset(&a, 0, sizeof(a));
-    l = sizeof(a);
-    fd = accept(lstn->sok, (void *)&a, &l);
-    if (fd < 0) {
-        if (errno == EINTR) {
-            /* transient something or other, not an error; ignore */
-            return;
-        } else {
-            /* Some kind of error.  Not handled very intelligently here.
-             * The best way would be to have a callback into the Tcl
-             * code to do something about it.  Right now, just emits a
-             * message and then delays a second (to reduce error
-             * spewing; it also makes it all to obvious to the user that
-             * something is wrong).
-             */
-            fprintf(stderr, "accept(): on %d, failed: %s\n",
-                    (int)lstn->sok, strerror(errno));
-            sleep(1);
-            return;
-        }
+/* sockptyr_sbk_free(): Get rid of a scrollback from sockptyr_sbk_open().
+ * If it's in a file, the file stays, with what was recorded in it.
+ */
+static void sockptyr_sbk_free(struct sockptyr_sbk *sbk)
+{
+    munmap((void *)sbk->hdr, sbk->map_len);
+    Tcl_MutexFinalize(&(sbk->lock));
+    ckfree((void *)sbk);
+}
+
+/* sockptyr_sbk_space(): Like sockptyr_ring_space(), for receiving right
+ * into a scrollback: fill in 'iov' with the whole ring, starting where
+ * the next byte goes, so the oldest data is overwritten first.  Returns
+ * the number of pieces.  The caller adds what it receives to the
+ * scrollback's 'total'.
+ */
+static int sockptyr_sbk_space(struct sockptyr_sbk *sbk, struct iovec *iov)
+{
+    size_t pos = (size_t)(sbk->hdr->total % sbk->size);
+
+    iov[0].iov_base = sbk->data + pos;
+    iov[0].iov_len = sbk->size - pos;
+    if (pos == 0) {
+        return(1);
     }
+    iov[1].iov_base = sbk->data;
+    iov[1].iov_len = pos;
+    return(2);
+}
 
-    /* Set up a connection handle for it */
-    chdl = sockptyr_allocate_handle(sd);
-    sockptyr_init_conn(chdl, fd, 'a');
+/* sockptyr_sbk_append(): Record in a scrollback the 'n' bytes that have
+ * been received into the pieces in 'iov'.  If there's more than it holds,
+ * only the end is kept.  Can be called from any thread.
+ */
+static void sockptyr_sbk_append(struct sockptyr_sbk *sbk,
+                                struct iovec *iov, int n)
+{
+    const unsigned char *p;
+    size_t len, pos, k;
+    uint64_t total;
+
+    Tcl_MutexLock(&(sbk->lock));
+    total = sbk->hdr->total;
+    for (; n > 0; ++iov) {
+        p = iov->iov_base;
+        len = (iov->iov_len < (size_t)n) ? iov->iov_len : (size_t)n;
+        n -= len;
+        if (len > sbk->size) {
+            /* only the end of it fits */
+            p += len - sbk->size;
+            total += len - sbk->size;
+            len = sbk->size;
+        }
+        pos = (size_t)(total % sbk->size);
+        k = sbk->size - pos;
+        if (k > len) {
+            k = len;
+        }
+        memcpy(sbk->data + pos, p, k);
+        memcpy(sbk->data, p + k, len - k);
+        total += len;
+    }
+    sbk->hdr->total = total;
+    Tcl_MutexUnlock(&(sbk->lock));
+}
 
-    /* Execute the Tcl handler proc */
-    tclcom = Tcl_DuplicateObj(lstn->proc);
-    Tcl_IncrRefCount(tclcom);
-    Tcl_ListObjAppendElement(interp, tclcom,
-                             Tcl_ObjPrintf("%s%d",
-                                           handle_prefix, (int)chdl->num));
-    Tcl_ListObjAppendElement(interp, tclcom, Tcl_NewObj());
-    Tcl_Preserve(interp);
-#if USE_TCL_BACKGROUNDEXCEPTION
-    result =
-#endif
-    Tcl_EvalObjEx(interp, tclcom, TCL_EVAL_GLOBAL);
-#if USE_TCL_BACKGROUNDEXCEPTION
-        if (result != TCL_OK) {
-            Tcl_BackgroundException(interp, result);
+/* sockptyr_sbk_rewind(): For "-replay": have a connection send what's in
+ * the scrollback of the connection it's linked to (or of its fan-out
+ * group's source) before anything else.  Nothing, if that hasn't got one.
+ */
+static void sockptyr_sbk_rewind(struct sockptyr_hdl *hdl)
+{
+    struct sockptyr_conn *conn = &(hdl->u.u_conn);
+    struct sockptyr_hdl *peer;
+    struct sockptyr_sbk *sbk;
+
+    peer = conn->fan ? conn->fan->src : conn->linked;
+    sbk = peer ? peer->u.u_conn.sbk : NULL;
+    conn->rpl_pos = conn->rpl_end = 0;
+    if (sbk != NULL) {
+        conn->rpl_end = sbk->hdr->total;
+        if (conn->rpl_end > sbk->size) {
+            conn->rpl_pos = conn->rpl_end - sbk->size;
         }
-#endif
-    Tcl_Release(interp);
-    Tcl_DecrRefCount(tclcom);
+    }
 }
 
-/* sockptyr_conn_event() -- handle something happening on a connection,
- * like an error or it being closed, by calling the registered Tcl handler.
- * If it's just closure, 'errkws' and 'errstr' should be NULL.  If it's
- * an error they should be filled in.
- *
- * This may execute Tcl code that may in turn change the state of the
- * connection in hard to predict ways.  Be careful when you run this,
- * especially of what you do afterwards.
- *
- * In the "close" case (where 'errkws' and 'errstr' are NULL) this will
- * also clobber the handle (see sockptyr_clobber_handle()).
- *
- * 'hdl' is assumed to be a connection, not one of the other things.
+/* sockptyr_sbk_replay(): The part of sockptyr_conn_send() for history
+ * being replayed after sockptyr_sbk_rewind(): send what we can of it,
+ * straight from the scrollback.  If the scrollback has been overwritten
+ * meanwhile, what's gone is skipped.  Same parameters and return value as
+ * sockptyr_conn_send(); returns 0 without setting '*blocked' when there's
+ * no more to replay.
  */
-static void sockptyr_conn_event(struct sockptyr_hdl *hdl,
-                                char **errkws, char *errstr)
+static int sockptyr_sbk_replay(struct sockptyr_hdl *hdl, int *blocked,
+                               struct sockptyr_ioev *ev)
 {
     struct sockptyr_conn *conn = &(hdl->u.u_conn);
-    struct sockptyr_data *sd = hdl->sd;
-    Tcl_Interp *interp = sd->interp;
-    Tcl_Obj *cmd, *es;
-#if USE_TCL_BACKGROUNDEXCEPTION
-    int result;
-#endif
-    int i;
+    struct sockptyr_hdl *peer;
+    struct sockptyr_sbk *sbk;
+    struct iovec iov[2];
+    uint64_t start, end, total;
+    size_t pos;
+    int rv, niov;
+
+    peer = conn->fan ? conn->fan->src : conn->linked;
+    sbk = peer ? peer->u.u_conn.sbk : NULL;
+    if (sbk == NULL) {
+        conn->rpl_pos = conn->rpl_end = 0;
+        return(0); /* nothing to replay */
+    }
+    if (conn->cnct) {
+        /* not connected yet; the history waits */
+        *blocked = 1;
+        return(0);
+    }
+    total = sbk->hdr->total;
+    start = conn->rpl_pos;
+    end = (conn->rpl_end < total) ? conn->rpl_end : total;
+    if (total > sbk->size && start < total - sbk->size) {
+        start = total - sbk->size; /* overwritten */
+    }
+    if (start >= end) {
+        conn->rpl_pos = conn->rpl_end = 0;
+        return(0); /* all done */
+    }
 
-#if 0
-    fprintf(stderr, "sockptyr_conn_event(%d); %s = '%s'\n",
-            (int)hdl->num, errkws ? "onerror" : "onclose",
-            errkws ? conn->onerror : conn->onclose);
-#endif
+    pos = (size_t)(start % sbk->size);
+    iov[0].iov_base = sbk->data + pos;
+    if (end - start <= sbk->size - pos) {
+        iov[0].iov_len = (size_t)(end - start);
+        niov = 1;
+    } else {
+        iov[0].iov_len = sbk->size - pos;
+        iov[1].iov_base = sbk->data;
+        iov[1].iov_len = (size_t)(end - start) - iov[0].iov_len;
+        niov = 2;
+    }
+    rv = sockptyr_conn_writev(hdl, iov, niov, blocked, ev);
+    if (rv > 0) {
+        start += rv;
+    }
+    if (start >= end) {
+        conn->rpl_pos = conn->rpl_end = 0;
+    } else {
+        conn->rpl_pos = start;
+        conn->rpl_end = end;
+    }
+    return(rv);
+}
 
-    if (errkws == NULL) {
-        if (conn->onclose == NULL) return; /* no handler */
+#if USE_RECORD
+/* sockptyr_rec_writer(): Return the thread that writes "sockptyr record"
+ * recordings, starting it if it hasn't been.  Returns NULL if it can't
+ * be started.
+ */
+static struct sockptyr_recw *sockptyr_rec_writer(struct sockptyr_data *sd)
+{
+    struct sockptyr_recw *w;
 
-        cmd = Tcl_NewStringObj(conn->onclose, strlen(conn->onclose));
-        Tcl_IncrRefCount(cmd);
+    if (sd->recw != NULL) {
+        return(sd->recw);
+    }
+    w = (void *)ckalloc(sizeof(*w));
+    memset(w, 0, sizeof(*w));
+    w->sd = sd;
+    if (Tcl_CreateThread(&(w->tid), &sockptyr_recw_main, (ClientData)w,
+                         TCL_THREAD_STACK_DEFAULT,
+                         TCL_THREAD_JOINABLE) != TCL_OK) {
+        ckfree((void *)w);
+        return(NULL);
+    }
+    sd->recw = w;
+    return(w);
+}
 
-        sockptyr_clobber_handle(hdl, 0);
-    } else {
-        if (conn->onerror == NULL) return; /* no handler */
+/* sockptyr_rec_open(): Open the file a recording goes in, appending to
+ * it, or with 'trunc', starting it over.  Returns -1 with errno set if
+ * that fails.
+ */
+static int sockptyr_rec_open(struct sockptyr_rec *rec, int trunc)
+{
+    struct stat st;
 
-        cmd = Tcl_NewStringObj(conn->onerror, strlen(conn->onerror));
-        es = Tcl_NewListObj(0, NULL);
-        for (i = 0; errkws && errkws[i]; ++i) {
-            Tcl_ListObjAppendElement(interp, es,
-                                     Tcl_NewStringObj(errkws[i],
-                                                      strlen(errkws[i])));
+    rec->fd = open(rec->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC |
+                   (trunc ? O_TRUNC : 0), 0600);
+    if (rec->fd < 0) {
+        return(-1);
+    }
+    rec->written = (fstat(rec->fd, &st) >= 0) ? (long)st.st_size : 0;
+    rec->dirty = 0;
+    rec->synced = sockptyr_now_ms();
+    return(0);
+}
+
+/* sockptyr_rec_add(): Record 'n' bytes, in 'iov', received on the
+ * connection (or with 'sent', sent on it), adding them to the batch
+ * being filled for the writer thread.  Runs in whatever thread is
+ * handling the connection; if the writer's fallen too far behind, the
+ * data is dropped instead.
+ */
+static void sockptyr_rec_add(struct sockptyr_rec *rec, struct iovec *iov,
+                             int n, int sent)
+{
+    struct sockptyr_recw *w = rec->w;
+    struct sockptyr_recb *b;
+    struct timeval tv;
+    unsigned char *p;
+    uint32_t hdr[3];
+    int i, k, size;
+
+    gettimeofday(&tv, NULL);
+    hdr[0] = (uint32_t)tv.tv_sec;
+    hdr[1] = (uint32_t)tv.tv_usec;
+    hdr[2] = (uint32_t)n | (sent ? 0x80000000U : 0);
+
+    Tcl_MutexLock(&(w->lock));
+    if (rec->err) {
+        Tcl_MutexUnlock(&(w->lock));
+        return; /* writing's failed; that's been reported */
+    }
+    b = rec->cur;
+    if (b == NULL || b->len + 12 + n > b->size) {
+        /* start another batch; if there's a full one, time to write;
+         * if the queue was empty, the writer may be waiting for one
+         */
+        if (b != NULL) {
+            w->full = 1;
         }
-        if (errstr == NULL) errstr = "";
-        Tcl_ListObjAppendElement(interp, cmd, es);
-        Tcl_ListObjAppendElement(interp, cmd,
-                                 Tcl_NewStringObj(errstr, strlen(errstr)));
-        Tcl_IncrRefCount(cmd);
+        if (b != NULL || w->head == NULL) {
+            Tcl_ConditionNotify(&(w->cond));
+        }
+        size = (12 + n > record_batch) ? 12 + n : record_batch;
+        if (w->queued + size > record_queue_max) {
+            rec->n_dropped += n;
+            Tcl_MutexUnlock(&(w->lock));
+            return;
+        }
+        b = (void *)ckalloc(sizeof(*b) + size);
+        b->rec = rec;
+        b->data = (unsigned char *)(b + 1);
+        b->len = b->last = 0;
+        b->size = size;
+        b->next = NULL;
+        if (w->tail) {
+            w->tail->next = b;
+        } else {
+            w->head = b;
+        }
+        w->tail = b;
+        w->queued += size;
+        rec->cur = b;
     }
 
-    Tcl_Preserve(interp);
-#if USE_TCL_BACKGROUNDEXCEPTION
-    result =
-#endif
-    Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL);
-#if USE_TCL_BACKGROUNDEXCEPTION
-    if (result != TCL_OK) {
-        Tcl_BackgroundException(interp, result);
+    /* the header, little endian, then the data */
+    p = b->data + b->len;
+    for (i = 0; i < 3; ++i) {
+        sockptyr_put_le(p, hdr[i], 4);
+        p += 4;
     }
-#endif
-    Tcl_Release(interp);
-    Tcl_DecrRefCount(cmd);
+    for (i = 0; n > 0; ++i) {
+        k = ((size_t)n < iov[i].iov_len) ? n : (int)iov[i].iov_len;
+        memcpy(p, iov[i].iov_base, k);
+        p += k;
+        n -= k;
+        rec->n_bytes += k;
+    }
+    b->len = p - b->data;
+    Tcl_MutexUnlock(&(w->lock));
 }
 
-/* sockptyr_conn_event_sys() -- wrapper around sockptyr_conn_event() for
- * errors that come from system calls & set errno.
- *
- * This may execute Tcl code that may in turn change the state of the
- * connection in hard to predict ways.  Be careful when you run this,
- * especially of what you do afterwards.
- *
- * Parameters:
- *      hdl -- a connection handle
- *      e -- error number (e.g. EIO) usually copied from errno
- *      blocking -- is this supposed to be a blocking socket/file?
+/* sockptyr_rec_stop(): Stop a recording.  The writer thread writes out
+ * what was queued for it, closes the file and frees it.
  */
-static void sockptyr_conn_event_sys(struct sockptyr_hdl *hdl,
-                                    int e, int blocking)
+static void sockptyr_rec_stop(struct sockptyr_rec *rec)
 {
-    if (blocking && (e == EAGAIN || e == EWOULDBLOCK)) {
-        /* shouldn't be getting these errors on our blocking socket */
-        sockptyr_conn_event(hdl, sockptyr_errkws_bug,
-                            "blocking error on blocking socket");
-    } else {
-        char *errkws[3];
-        int ei;
-        ei = 0;
-        errkws[ei++] = "io";
-        switch (e) {
-            case EIO:
-                errkws[ei++] = "EIO";
-                break;
-            case EPIPE:
-                errkws[ei++] = "EPIPE";
-                break;
-            case ECONNRESET:
-                errkws[ei++] = "ECONNRESET";
-                break;
-            case ESHUTDOWN:
-                errkws[ei++] = "ESHUTDOWN";
-                break;
-            default:
-                /* nothing */
-                break;
+    struct sockptyr_recw *w = rec->w;
+    struct sockptyr_recb *b;
+
+    Tcl_MutexLock(&(w->lock));
+    b = rec->cur;
+    if (b == NULL) {
+        b = (void *)ckalloc(sizeof(*b));
+        b->rec = rec;
+        b->data = NULL;
+        b->len = b->size = 0;
+        b->next = NULL;
+        if (w->tail) {
+            w->tail->next = b;
+        } else {
+            w->head = b;
         }
-        errkws[ei] = NULL;
-        sockptyr_conn_event(hdl, errkws, strerror(e));
+        w->tail = b;
     }
+    b->last = 1;
+    rec->cur = NULL;
+    w->full = 1;
+    Tcl_ConditionNotify(&(w->cond));
+    Tcl_MutexUnlock(&(w->lock));
 }
 
-/*
- * sockptyr_conn_unlink(): Given a connection handler unlink it from
- * whatever it's linked to and empty their buffers.  (Emptying their
- * buffers helps in detecting a closed connection.)
- * If it's linked to itself this function handles it correctly. If it's
- * not linked to anything, or it isn't a connection and couldn't be linked
- * to anything, this function handles it correctly (by doing nothing).
+/* sockptyr_rec_shutdown(): Stop the writer thread, once it's written out
+ * all the recordings, which must have been stopped already.
  */
-static void sockptyr_conn_unlink(struct sockptyr_hdl *hdl)
+static void sockptyr_rec_shutdown(struct sockptyr_data *sd)
 {
-    struct sockptyr_conn *conns[2];
-    struct sockptyr_hdl *hdls[2];
-    int i;
+    struct sockptyr_recw *w = sd->recw;
+    int result;
 
-    hdls[0] = hdl;
-    if (hdl == NULL || hdl->usage != usage_conn) {
+    if (w == NULL) {
         return;
     }
-    conns[0] = &(hdls[0]->u.u_conn);
-    hdls[1] = conns[0]->linked;
+    Tcl_MutexLock(&(w->lock));
+    w->exiting = 1;
+    Tcl_ConditionNotify(&(w->cond));
+    Tcl_MutexUnlock(&(w->lock));
+    Tcl_JoinThread(w->tid, &result);
+    Tcl_DeleteEvents(&sockptyr_rec_evdel, (ClientData)sd);
+    Tcl_MutexFinalize(&(w->lock));
+    Tcl_ConditionFinalize(&(w->cond));
+    ckfree((void *)w);
+    sd->recw = NULL;
+}
 
-    if (hdls[1] == NULL || hdl == hdls[1]) {
-        conns[1] = NULL;
-    } else {
-        assert(hdls[1]->usage == usage_conn);
-        conns[1] = &(hdls[1]->u.u_conn);
+/* sockptyr_recw_main(): Main loop of the writer thread, 'cd' being its
+ * struct sockptyr_recw.  Once something's queued, waits record_flush_ms
+ * (or till a batch fills up) for more; takes what's been queued, all at
+ * once, and writes it out; then fsync()s what's due.
+ */
+static Tcl_ThreadCreateType sockptyr_recw_main(ClientData cd)
+{
+    struct sockptyr_recw *w = cd;
+    struct sockptyr_recb *b, *next;
+    struct sockptyr_rec *rec, **rp;
+    Tcl_Time flush;
+    long long now;
+    long freed;
+    int exiting, unsynced;
+
+    flush.sec = record_flush_ms / 1000;
+    flush.usec = (record_flush_ms % 1000) * 1000;
+
+    unsynced = 0;
+    Tcl_MutexLock(&(w->lock));
+    for (;;) {
+        if (!w->full && !w->exiting && w->head == NULL && !unsynced) {
+            /* nothing to do till something's queued */
+            Tcl_ConditionWait(&(w->cond), &(w->lock), NULL);
+        }
+        if (!w->full && !w->exiting) {
+            /* let the batches fill up a bit */
+            Tcl_ConditionWait(&(w->cond), &(w->lock), &flush);
+        }
+        b = w->head;
+        w->head = w->tail = NULL;
+        w->full = 0;
+        exiting = w->exiting;
+        for (next = b; next != NULL; next = next->next) {
+            if (next->rec->cur == next) {
+                next->rec->cur = NULL; /* more goes in a new batch */
+            }
+        }
+        Tcl_MutexUnlock(&(w->lock));
+
+        freed = 0;
+        for (; b != NULL; b = next) {
+            next = b->next;
+            sockptyr_recw_write(w, b);
+            freed += b->size;
+            ckfree((void *)b);
+        }
+
+        now = sockptyr_now_ms();
+        unsynced = 0;
+        for (rp = &(w->recs); (rec = *rp) != NULL; ) {
+            if (rec->dirty && (rec->done || exiting ||
+                               now - rec->synced >= record_fsync_ms)) {
+                fsync(rec->fd);
+                rec->dirty = 0;
+                rec->synced = now;
+            }
+            if (rec->done) {
+                *rp = rec->wnext;
+                close(rec->fd);
+                ckfree(rec->path);
+                ckfree((void *)rec);
+            } else {
+                unsynced |= rec->dirty;
+                rp = &(rec->wnext);
+            }
+        }
+
+        Tcl_MutexLock(&(w->lock));
+        w->queued -= freed;
+        if (exiting && w->head == NULL) {
+            break;
+        }
     }
+    Tcl_MutexUnlock(&(w->lock));
 
-    for (i = 0; i < 2; ++i) {
-        if (conns[i]) {
-            conns[i]->buf_empty = 1;
-            conns[i]->buf_in = 0;
-            conns[i]->buf_out = 0;
-            conns[i]->linked = NULL;
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/* sockptyr_recw_write(): In the writer thread, write out a batch of
+ * records to its recording's file, starting a new file first if it's
+ * time to rotate.
+ */
+static void sockptyr_recw_write(struct sockptyr_recw *w,
+                                struct sockptyr_recb *b)
+{
+    struct sockptyr_rec *rec = b->rec;
+    int pos, rv;
+
+    if (!rec->listed) {
+        rec->listed = 1;
+        rec->wnext = w->recs;
+        w->recs = rec;
+    }
+    if (b->last) {
+        rec->done = 1;
+    }
+    if (b->len == 0 || rec->err) {
+        return;
+    }
+
+    if (rec->rotate > 0 && rec->written > 0 &&
+        rec->written + b->len > rec->rotate) {
+        if (sockptyr_recw_rotate(rec) < 0) {
+            sockptyr_recw_fail(w, rec, errno);
+            return;
         }
     }
+    for (pos = 0; pos < b->len; pos += rv) {
+        rv = write(rec->fd, b->data + pos, b->len - pos);
+        if (rv < 0 && errno == EINTR) {
+            rv = 0;
+        } else if (rv <= 0) {
+            sockptyr_recw_fail(w, rec, rv < 0 ? errno : ENOSPC);
+            return;
+        }
+    }
+    rec->written += b->len;
+    rec->dirty = 1;
+}
 
-    for (i = 0; i < 2; ++i) {
-        if (conns[i]) {
-            sockptyr_register_conn_handler(hdls[i]);
+/* sockptyr_recw_rotate(): In the writer thread, for "sockptyr record
+ * -rotate": rename a recording's file to $path.1 (after $path.1 to
+ * $path.2 and so on, keeping rec->keep of them) and start a new one.
+ * Returns -1 with errno set if that fails.
+ */
+static int sockptyr_recw_rotate(struct sockptyr_rec *rec)
+{
+    char *from, *to;
+    size_t len = strlen(rec->path) + 24;
+    int i, rv = 0;
+
+    if (rec->dirty) {
+        fsync(rec->fd);
+        rec->dirty = 0;
+    }
+    close(rec->fd);
+    rec->fd = -1;
+
+    from = ckalloc(len);
+    to = ckalloc(len);
+    for (i = rec->keep; i > 0 && rv == 0; --i) {
+        if (i > 1) {
+            snprintf(from, len, "%s.%d", rec->path, i - 1);
+        } else {
+            snprintf(from, len, "%s", rec->path);
         }
+        snprintf(to, len, "%s.%d", rec->path, i);
+        if (rename(from, to) < 0 && errno != ENOENT) {
+            rv = -1;
+        }
+    }
+    ckfree(from);
+    ckfree(to);
+    if (rv == 0) {
+        rv = sockptyr_rec_open(rec, 1);
+    }
+    return(rv);
+}
+
+/* sockptyr_recw_fail(): In the writer thread, when writing a recording
+ * fails: stop recording anything more for it, and send an event to the
+ * Tcl thread to report it with "sockptyr onerror".
+ */
+static void sockptyr_recw_fail(struct sockptyr_recw *w,
+                               struct sockptyr_rec *rec, int err)
+{
+    struct sockptyr_recev *re;
+
+    Tcl_MutexLock(&(w->lock));
+    rec->err = err;
+    Tcl_MutexUnlock(&(w->lock));
+
+    re = (void *)ckalloc(sizeof(*re));
+    memset(re, 0, sizeof(*re));
+    re->header.proc = &sockptyr_rec_evproc;
+    re->sd = w->sd;
+    re->hdl = rec->hdl;
+    re->gen = rec->gen;
+    re->err = err;
+    Tcl_ThreadQueueEvent(w->sd->tid, &(re->header), TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(w->sd->tid);
+}
+
+/* sockptyr_rec_evproc(): Handle, in the Tcl thread, an event sent by
+ * sockptyr_recw_fail(): report the error on the connection, if it's
+ * still there.  Returns 1 when the event has been handled, 0 to leave
+ * it for later, as Tcl_QueueEvent() event handlers do.
+ */
+static int sockptyr_rec_evproc(Tcl_Event *evp, int flags)
+{
+    struct sockptyr_recev *re = (void *)evp;
+
+    if (!(flags & TCL_FILE_EVENTS)) {
+        return(0); /* not handling file events right now */
     }
+    if (re->hdl->usage == usage_conn && re->hdl->gen == re->gen) {
+        sockptyr_conn_event(re->hdl, sockptyr_errkws_record,
+                            strerror(re->err));
+    }
+    return(1);
+}
+
+/* sockptyr_rec_evdel(): For Tcl_DeleteEvents(), identify events sent by
+ * sockptyr_recw_fail() for 'struct sockptyr_data *' 'cd'.
+ */
+static int sockptyr_rec_evdel(Tcl_Event *evp, ClientData cd)
+{
+    return(evp->proc == &sockptyr_rec_evproc &&
+           ((struct sockptyr_recev *)evp)->sd == cd);
 }
+#endif /* USE_RECORD */
 
 #if USE_INOTIFY
 /* sockptyr_inot_flagrep(): Given a collection of inotify(7) flags, return
  * a list of names for them, derived from inotify_bits[].  The returned
- * Tcl object has a refcount of 1.
+ * Tcl object has a refcount of 1 more than it needs; it's likely shared,
+ * since the same few combinations of flags come up over and over and
+ * their lists are kept in sd->inotify_flagreps.
  */
-static Tcl_Obj *sockptyr_inot_flagrep(Tcl_Interp *interp, uint32_t flags)
+static Tcl_Obj *sockptyr_inot_flagrep(struct sockptyr_data *sd,
+                                      uint32_t flags)
 {
+    Tcl_Interp *interp = sd->interp;
+    Tcl_HashEntry *he;
     Tcl_Obj *o;
-    int i;
+    int i, isnew;
     uint32_t rep = 0;
     char *n;
 
+    /* maybe we've made this one before */
+    he = Tcl_FindHashEntry(&(sd->inotify_flagreps),
+                           (void *)(uintptr_t)flags);
+    if (he != NULL) {
+        o = Tcl_GetHashValue(he);
+        Tcl_IncrRefCount(o);
+        return(o);
+    }
+
     /* start with an empty list */
-    o = Tcl_NewListObj(0, &o);
+    o = Tcl_NewListObj(0, NULL);
     Tcl_IncrRefCount(o);
     
     for (i = 0; inotify_bits[i].name; ++i) {
@@ -1885,10 +8492,38 @@ static Tcl_Obj *sockptyr_inot_flagrep(Tcl_Interp *interp, uint32_t flags)
                                  Tcl_ObjPrintf("%lu", (unsigned long)rep));
     }
 
+    /* and keep it for next time, unless we've kept too many */
+    if (sd->inotify_flagreps.numEntries < inotify_flagreps_max) {
+        he = Tcl_CreateHashEntry(&(sd->inotify_flagreps),
+                                 (void *)(uintptr_t)flags, &isnew);
+        Tcl_SetHashValue(he, o);
+        Tcl_IncrRefCount(o);
+    }
+
     return(o);
 }
 #endif /* USE_INOTIFY */
 
+/* sockptyr_now_ms() -- Current time in milliseconds, from the monotonic
+ * clock so it doesn't jump around; only good for measuring intervals.
+ */
+static long long sockptyr_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* sockptyr_now_us() -- Like sockptyr_now_ms() but in microseconds. */
+static long long sockptyr_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
 /* sockptyr_lst_insert() -- Insert a handle into a doubly linked list. */
 static void sockptyr_lst_insert(struct sockptyr_hdl **head,
                                 struct sockptyr_hdl *hdl)
@@ -48,6 +48,9 @@ proc dmsg {msg} {
 # some defaults
 set config(verbosity) 0
 set config(directory_retries) {250 500 1250}
+set config(offload) 0
+set config(scrollback) 0
+set config(scrollback_dir) ""
 
 # find & read that config file
 set config_file_name [file join [file dirname [info script]] sockptyr.cfg]
@@ -402,8 +405,15 @@ if {[catch {load $sockptyr_library_path sockptyr} res]} {
 }
 
 set sockptyr_info(USE_INOTIFY) 0 ; # will be overwritten from [sockptyr info]
+set sockptyr_info(USE_OFFLOAD) 0 ; # will be overwritten from [sockptyr info]
 array set sockptyr_info [sockptyr info]
 
+# $link_opts: options to "sockptyr link" for linking connections
+set link_opts [list]
+if {$config(offload) && $sockptyr_info(USE_OFFLOAD)} {
+    lappend link_opts -offload
+}
+
 ## ## ## Connection handling
 
 # About how connection entries in .conns.can are tracked:
@@ -447,6 +457,7 @@ set conn_mark ""
 #   $qual -- if applicable, is a name or other qualifier that came up
 #       when making the connection.  For instance, where $source = "directory"
 #       and $ok = "1", $qual is the filename of the socket within the directory
+# Returns the full label given to the connection.
 proc conn_add {label ok source he qual} {
     dmsg [list conn_add label $label ok $ok source $source he $he qual $qual]
 
@@ -553,6 +564,7 @@ proc conn_add {label ok source he qual} {
     if {$conn_hdls($conn) ne ""} {
         sockptyr onclose $conn_hdls($conn) [list conn_onclose $conn]
         sockptyr onerror $conn_hdls($conn) [list conn_onerror $conn c]
+        conn_scrollback $conn
     }
 
     # Create UI elements in .conns.can; positioned later.
@@ -584,6 +596,26 @@ proc conn_add {label ok source he qual} {
     lappend conns $conn
     set conns [lsort $conns]
     conn_pos
+    return $conn
+}
+
+# conn_scrollback: Start keeping scrollback on a newly added connection,
+# if $config(scrollback) says to, so terminals attached to it later get
+# to see its recent history.
+proc conn_scrollback {conn} {
+    global config conn_hdls
+
+    if {$config(scrollback) <= 0} {
+        return
+    }
+    set sbk_args [list $config(scrollback)]
+    if {$config(scrollback_dir) ne ""} {
+        lappend sbk_args [file join $config(scrollback_dir) \
+                              "[string map {/ _} $conn].sbk"]
+    }
+    if {[catch {sockptyr scrollback $conn_hdls($conn) {*}$sbk_args} err]} {
+        dmsg "not keeping scrollback for $conn: $err"
+    }
 }
 
 # conn_pos: Go through the connection list after it has changed, to
@@ -817,7 +849,7 @@ proc conn_action_loopback {cfg conn} {
 proc conn_action_ptyrun {cmd statlong statshort cfg conn} {
     dmsg [list conn_action_ptyrun $cmd $statlong $statshort $cfg $conn]
 
-    global conn_deact conn_hdls
+    global conn_deact conn_hdls link_opts
 
     # undo whatever was done before
     if {$conn_deact($conn) ne ""} {
@@ -828,9 +860,78 @@ proc conn_action_ptyrun {cmd statlong statshort cfg conn} {
     # get the PTY
     lassign [sockptyr open_pty] pty_hdl pty_path
 
-    # Perform "%" substitution on cmd.  This could be faster than it is,
-    # by using "string first" to skip over long stretches without "%", but
-    # that would make the code more complicated.
+    # Perform "%" substitution on cmd.
+    if {[catch {ptyrun_subst $cmd $conn $pty_path} cmd2]} {
+        puts stderr "$cmd2, not running"
+        sockptyr close $pty_hdl
+        return
+    }
+
+    # Execute that command, in the background: closing the PTY when it
+    # exits.  Older configurations end it with "&" to run it in the
+    # background, which would make it exit right away; so drop that.
+    regsub {\s*&\s*$} $cmd2 "" cmd2
+    dmsg [list about to execute: $cmd2]
+    sockptyr spawn -pty $pty_hdl -onexit [list ptyrun_exited $conn] $cmd2
+
+    # Linkage, status, tracking, and cleanup; the terminal gets to see
+    # what the connection's scrollback kept from before
+    sockptyr link -replay {*}$link_opts $conn_hdls($conn) $pty_hdl
+    conn_record_status $conn "$statlong ($pty_path)" $statshort
+    set conn_deact($conn) [list ptyrun_byebye $conn $pty_hdl]
+    sockptyr onclose $pty_hdl [list ptyrun_byebye $conn $pty_hdl]
+    sockptyr onerror $pty_hdl [list conn_onerror ${conn} p]
+}
+
+# conn_action_ptyspawn: Handle GUI buttons that execute a process
+# directly on a PTY, with "sockptyr pty_spawn", which becomes its
+# controlling terminal, stdin, stdout and stderr.  Like conn_action_ptyrun,
+# except the process doesn't need to open the PTY.
+#       $cmd = shell command to run with limited "%" substitution
+#       $statlong, $statshort = long & short connection status strings
+#       $cfg = configuration label for the connection
+#       $conn = full label for the connection
+proc conn_action_ptyspawn {cmd statlong statshort cfg conn} {
+    dmsg [list conn_action_ptyspawn $cmd $statlong $statshort $cfg $conn]
+
+    global conn_deact conn_hdls link_opts
+
+    # undo whatever was done before
+    if {$conn_deact($conn) ne ""} {
+        uplevel "#0" $conn_deact($conn)
+        set conn_deact($conn) ""
+    }
+
+    # Perform "%" substitution on cmd; there's no PTY path for "%p".
+    if {[catch {ptyrun_subst $cmd $conn ""} cmd2]} {
+        puts stderr "$cmd2, not running"
+        return
+    }
+
+    # Execute that command on a new PTY
+    dmsg [list about to execute: $cmd2]
+    lassign [sockptyr pty_spawn -onexit [list ptyrun_exited $conn] $cmd2] \
+        pty_hdl
+
+    # Linkage, status, tracking, and cleanup; the terminal gets to see
+    # what the connection's scrollback kept from before
+    sockptyr link -replay {*}$link_opts $conn_hdls($conn) $pty_hdl
+    conn_record_status $conn $statlong $statshort
+    set conn_deact($conn) [list ptyrun_byebye $conn $pty_hdl]
+    sockptyr onclose $pty_hdl [list ptyrun_byebye $conn $pty_hdl]
+    sockptyr onerror $pty_hdl [list conn_onerror ${conn} p]
+}
+
+# ptyrun_subst: Perform the limited "%" substitution on a command for
+# conn_action_ptyrun and conn_action_ptyspawn, returning the result.
+# Raises an error if there's an unknown "%" sequence.
+#       $cmd = shell command to substitute into
+#       $conn = full label for the connection, for "%l"
+#       $pty_path = PTY pathname, for "%p"; or empty if there's none
+proc ptyrun_subst {cmd conn pty_path} {
+    # This could be faster than it is, by using "string first" to skip
+    # over long stretches without "%", but that would make the code more
+    # complicated.
     set cmd2 ""
     for {set i 0} {$i < [string length $cmd]} {incr i} {
         set ch [string index $cmd $i]
@@ -850,12 +951,13 @@ proc conn_action_ptyrun {cmd statlong statshort cfg conn} {
                 }
                 "p" {
                     # "%p" subs in the PTY path
+                    if {$pty_path eq ""} {
+                        error "no PTY path for %p in command"
+                    }
                     append cmd2 $pty_path
                 }
                 default {
-                    puts stderr "unknown % sequence in command, not running"
-                    sockptyr close $pty_hdl
-                    return
+                    error "unknown % sequence in command"
                 }
             }
         } else {
@@ -863,17 +965,7 @@ proc conn_action_ptyrun {cmd statlong statshort cfg conn} {
             append cmd2 $ch
         }
     }
-
-    # Execute that command
-    dmsg [list about to execute: $cmd2]
-    dmsg [list result: [sockptyr exec $cmd2]]
-
-    # Linkage, status, tracking, and cleanup
-    sockptyr link $conn_hdls($conn) $pty_hdl
-    conn_record_status $conn "$statlong ($pty_path)" $statshort
-    set conn_deact($conn) [list ptyrun_byebye $conn $pty_hdl]
-    sockptyr onclose $pty_hdl [list ptyrun_byebye $conn $pty_hdl]
-    sockptyr onerror $pty_hdl [list conn_onerror ${conn} p]
+    return $cmd2
 }
 
 # conn_action_mark: Handle the GUI "mark" action on the connection, marking
@@ -909,7 +1001,7 @@ proc conn_action_mark {cfg conn} {
 proc conn_action_link {cfg conn} {
     dmsg [list conn_action_link $cfg $conn]
 
-    global conn_deact conn_hdls conn_mark
+    global conn_deact conn_hdls conn_mark link_opts
 
     # has a connection been marked?
     if {$conn_mark eq "" || ![info exists conn_hdls($conn_mark)]} {
@@ -931,8 +1023,9 @@ proc conn_action_link {cfg conn} {
         }
     }
 
-    # link them
-    sockptyr link $conn_hdls($conn) $conn_hdls($conn_mark)
+    # link them; "-splice" avoids copying data when they're both sockets
+    sockptyr link -splice {*}$link_opts \
+        $conn_hdls($conn) $conn_hdls($conn_mark)
     conn_record_status $conn "Linked to $conn_mark" "L"
     conn_record_status $conn_mark "Linked to $conn" "L"
 
@@ -1028,6 +1121,15 @@ proc ptyrun_byebye {conn pty_hdl} {
     conn_record_status $conn "" ""
 }
 
+# ptyrun_exited: Run when the process started by "conn_action_ptyrun"
+# exits; "sockptyr spawn -pty" then closes the PTY, for ptyrun_byebye.
+#       $conn = full label for the connection
+#       $hdl = handle the process had
+#       $res = how it exited, like the result of "sockptyr exec"
+proc ptyrun_exited {conn hdl res} {
+    dmsg [list ptyrun_exited $conn $hdl $res]
+}
+
 # link_byebye: Run when a connection set up with "conn_action_link"
 # is ended for whatever reason, to clean up after it.
 #       $conn = full label for the connection
@@ -1153,23 +1255,86 @@ proc read_and_connect_inotify {path label retries_list flags cookie name} {
     }
 }
 
-# connect_with_retries: Connect to a socket.  If it fails, retry at
-# the given intervals until out of retries.  In either case add the
-# socket to the GUI list.
+# connect_with_retries: Connect to a socket.  If it fails, retry
+# until out of retries.  In either case add the socket to the GUI list.
+# The retrying is done by "sockptyr connect" itself, which waits
+# between tries for the first time in $retries_list, doubling up to the
+# largest, with some randomness.  Connects asynchronously, so many
+# sockets showing up at once don't hold things up;
+# connect_with_retries_done gets the result.
 proc connect_with_retries {fullpath label directory name retries_list} {
     dmsg [list connect_with_retries $fullpath $label $directory $name $retries_list]
 
-    if {![catch {sockptyr connect $fullpath} hdl]} {
+    set opts [list -attempts [expr {[llength $retries_list] + 1}]]
+    if {[llength $retries_list]} {
+        set sorted [lsort -integer $retries_list]
+        lappend opts -backoff \
+            [list [lindex $retries_list 0] [lindex $sorted end]]
+    }
+    if {[catch {
+        sockptyr connect -async {*}$opts -command \
+            [list connect_with_retries_done $label $name] $fullpath
+    } msg]} {
+        connect_with_retries_done $label $name "" error $msg
+    }
+}
+
+# connect_with_retries_done: Handle the result of connect_with_retries'
+# connection attempts.
+proc connect_with_retries_done {label name hdl status msg} {
+    dmsg [list connect_with_retries_done $label $name $hdl $status $msg]
+
+    if {$status eq "ok"} {
         # success
         conn_add $label 1 directory $hdl $name
-    } elseif {[llength $retries_list]} {
-        # try again
-        after [lindex $retries_list 0] \
-            [list connect_with_retries $fullpath $label $directory $name \
-                [lrange $retries_list 1 end]]
     } else {
         # failure
-        conn_add $label 0 directory $hdl $name
+        conn_add $label 0 directory $msg $name
+    }
+}
+
+# connect_source_done: Handle the result of connecting to a "connect"
+# source's socket: at startup, and if it's to reconnect, whenever it's
+# lost or reconnected.
+proc connect_source_done {label hdl status msg} {
+    dmsg [list connect_source_done $label $hdl $status $msg]
+    global connect_source_conns conn_hdls conn_line3 conn_tags
+
+    if {![info exists connect_source_conns($hdl)]} {
+        # first time
+        if {$status eq "ok"} {
+            set connect_source_conns($hdl) [conn_add $label 1 connect $hdl ""]
+        } else {
+            conn_add $label 0 connect $msg ""
+        }
+        return
+    }
+
+    set conn [lindex $connect_source_conns($hdl) 0]
+    if {![info exists conn_hdls($conn)] || $conn_hdls($conn) ne $hdl} {
+        # it's been removed or closed in the meantime
+        unset connect_source_conns($hdl)
+        return
+    }
+    switch -- $status {
+        lost {
+            # remember what status it had, to go back to
+            set connect_source_conns($hdl) [list $conn \
+                [string range $conn_line3($conn) [string length "Status: "] end] \
+                [.conns.can itemcget $conn_tags($conn).n -text]]
+            conn_record_status $conn "Reconnecting: $msg" "R"
+        }
+        ok {
+            lassign $connect_source_conns($hdl) conn long short
+            set connect_source_conns($hdl) [list $conn]
+            conn_record_status $conn $long $short
+        }
+        default {
+            # gave up; the handle's already closed
+            unset connect_source_conns($hdl)
+            set conn_hdls($conn) ""
+            conn_onclose $conn
+        }
     }
 }
 
@@ -1220,11 +1385,16 @@ foreach label [lsort $labels] {
             sockptyr listen $path [list conn_add $label 1 listen]
         }
         "connect" {
-            lassign $config($label:source) source path
-            if {[catch {sockptyr connect $path} hdl]} {
-                conn_add $label 0 connect $hdl ""
-            } else {
-                conn_add $label 1 connect $hdl ""
+            lassign $config($label:source) source path backoff
+            set opts [list]
+            if {[llength $backoff]} {
+                lappend opts -reconnect -attempts 0 -backoff $backoff
+            }
+            if {[catch {
+                sockptyr connect -async {*}$opts \
+                    -command [list connect_source_done $label] $path
+            } msg]} {
+                conn_add $label 0 connect $msg ""
             }
         }
         "directory" {
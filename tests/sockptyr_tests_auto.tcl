@@ -117,6 +117,28 @@ sockptyr close [lindex $pty_handles 0]
 update
 puts stderr "Done"
 
+puts stderr ""
+puts stderr "Using a stale handle after its number has been reused..."
+set stale [lindex $pty_handles 0]
+lassign [sockptyr open_pty] reused
+regexp {^sockptyr_(\d+)_} $stale - n_stale
+regexp {^sockptyr_(\d+)_} $reused - n_reused
+puts stderr "\tstale $stale new $reused"
+if {$n_stale ne $n_reused} {
+    error "expected handle number $n_stale to be reused, got $n_reused"
+}
+foreach cmd [list [list sockptyr close $stale] \
+                 [list sockptyr onclose $stale x] \
+                 [list sockptyr link $stale $reused]] {
+    if {![catch $cmd res]} {
+        error "stale handle accepted by: $cmd"
+    }
+    puts stderr "\t$cmd: $res"
+}
+sockptyr close $reused
+update
+puts stderr "Done"
+
 puts stderr ""
 puts stderr "Connection ops on non-connection handle"
 if {$use_inotify} {
@@ -142,6 +164,1077 @@ foreach what {link onclose onerror} {
     }
 }
 
+# pty_open: Allocate a PTY with "sockptyr open_pty" and open its other
+# end, raw and non-blocking, for the test to read & write.  Returns the
+# handle and the channel.  With $var, what's read from the channel is
+# appended to global variable $var; see pty_read_to.
+proc pty_open {{var ""}} {
+    lassign [sockptyr open_pty] hdl path
+    exec stty -F $path raw -echo
+    set f [open $path {RDWR NOCTTY NONBLOCK}]
+    fconfigure $f -translation binary -blocking 0 -buffering none
+    if {$var ne ""} {
+        pty_read_to $f $var
+    }
+    return [list $hdl $f]
+}
+
+# pty_read_to: From now on append whatever's read from channel $f to
+# global variable $var (which may be an array element), so tests can
+# "vwait" it.
+proc pty_read_to {f var} {
+    fileevent $f readable [list pty_read $f $var]
+}
+proc pty_read {f var} {
+    upvar "#0" $var v
+    append v [read $f]
+}
+
+# wait_until: Wait up to 5 seconds for Tcl expression $cond, evaluated
+# in the global scope, to be true.
+proc wait_until {cond} {
+    set deadline [expr {[clock milliseconds] + 5000}]
+    while {![uplevel "#0" [list expr $cond]]} {
+        if {[clock milliseconds] > $deadline} {
+            error "timed out waiting for: $cond"
+        }
+        after 20 [list set wait_until_tick 1]
+        vwait wait_until_tick
+    }
+}
+
+# relay_test: Relay data from one PTY to another through two socket
+# connections linked with "sockptyr link $opts":
+#       PTY 1 <-> c1 ... a1 <-> a2 ... c2 <-> PTY 2
+# where the c's and a's are the two ends of connections to a
+# "sockptyr listen" socket.  Then close c1 and check that a1 sees it.
+# $check is a list of names that should show up in "sockptyr dbg_handles"
+# for a1 & a2, such as "spl".
+proc relay_test {opts check} {
+    global accepted got closed
+
+    set sokpath [file join [pwd] eraseme_autosok]
+    catch {file delete $sokpath}
+    set accepted [list]
+    proc accept_proc {hdl es} {
+        global accepted
+        lappend accepted $hdl
+    }
+    set lstn [sockptyr listen $sokpath accept_proc]
+    set c1 [sockptyr connect $sokpath]
+    set c2 [sockptyr connect $sokpath]
+    while {[llength $accepted] < 2} {
+        vwait accepted
+    }
+    lassign $accepted a1 a2
+    set got ""
+    lassign [pty_open] p1 f1
+    lassign [pty_open got] p2 f2
+    sockptyr link $p1 $c1
+    sockptyr link {*}$opts $a1 $a2
+    sockptyr link $c2 $p2
+    array set dbg_handles [sockptyr dbg_handles]
+    foreach hdl [list $a1 $a2] {
+        regexp {^sockptyr_(\d+)_} $hdl - n
+        foreach c $check {
+            if {![info exists dbg_handles([list $n $c])]} {
+                error "$hdl has no \"$c\" after \"sockptyr link $opts\""
+            }
+        }
+    }
+    set sent ""
+    for {set i 0} {$i < 1000} {incr i} {
+        append sent [format "%d:%c " $i [expr {65 + $i % 26}]]
+    }
+    puts -nonewline $f1 $sent
+    set timeout [after 5000 [list set got timeout]]
+    while {$got ne "timeout" && [string length $got] < [string length $sent]} {
+        vwait got
+    }
+    after cancel $timeout
+    if {$got ne $sent} {
+        error "relayed data mismatch: sent [string length $sent] bytes, got [string length $got]"
+    }
+
+    set closed ""
+    sockptyr onclose $a1 [list set closed $a1]
+    sockptyr close $c1
+    set timeout [after 5000 [list set closed timeout]]
+    vwait closed
+    after cancel $timeout
+    if {$closed ne $a1} {
+        error "closing c1 wasn't noticed on a1"
+    }
+
+    foreach f [list $f1 $f2] {
+        close $f
+    }
+    foreach hdl [list $p1 $p2 $c2 $a1 $a2 $lstn] {
+        sockptyr close $hdl
+    }
+    file delete $sokpath
+}
+
+set relay_tests [list {} {}]
+if {$sockptyr_info(USE_SPLICE)} {
+    lappend relay_tests -splice spl
+}
+if {$sockptyr_info(USE_OFFLOAD)} {
+    lappend relay_tests -offload offload
+    if {$sockptyr_info(USE_SPLICE)} {
+        lappend relay_tests {-splice -offload} {spl offload}
+    }
+}
+foreach {opts check} $relay_tests {
+    puts stderr ""
+    puts stderr "Relaying through sockets linked with options: {$opts}"
+    relay_test $opts $check
+    puts stderr "Done"
+}
+
+puts stderr ""
+puts stderr "Accepting a burst of connections..."
+# Run in a child process with few file descriptors, so that it runs
+# out and has to pause accepting until some are closed.
+set burst_script [file join [pwd] eraseme_burst.tcl]
+set f [open $burst_script w]
+puts $f {
+    load [lindex $argv 0] sockptyr
+    set sokpath [file join [pwd] eraseme_burstsok]
+    catch {file delete $sokpath}
+    set accepted [list]
+    proc accept_proc {hdl es} {
+        global accepted
+        lappend accepted $hdl
+    }
+    set lstn [sockptyr listen -backlog 100 $sokpath accept_proc]
+    set conns [list]
+    for {set i 0} {$i < 40} {incr i} {
+        lappend conns [sockptyr connect $sokpath]
+    }
+    after 200 [list set wait 1]
+    vwait wait
+    set before [llength $accepted]
+    foreach hdl $conns {
+        sockptyr close $hdl
+    }
+    after 200 [list set wait 1]
+    vwait wait
+    regexp {^sockptyr_(\d+)_} $lstn - n
+    array set dbg_handles [sockptyr dbg_handles]
+    puts [list $before [llength $accepted] $dbg_handles([list $n accept])]
+    file delete $sokpath
+}
+close $f
+set res [exec sh -c {ulimit -n 64 && exec "$0" "$@"} \
+             [info nameofexecutable] $burst_script $path_to_dyl]
+file delete $burst_script
+lassign $res before after accinfo
+puts stderr "\taccepted $before, then $after after closing: $accinfo"
+if {$before >= 40 || $after != 40} {
+    error "burst of connections not accepted as expected"
+}
+puts stderr "Done"
+
+puts stderr ""
+puts stderr "Connecting asynchronously..."
+set sokpath [file join [pwd] eraseme_asyncsok]
+catch {file delete $sokpath}
+set accepted [list]
+proc accept_proc {hdl es} {
+    global accepted
+    lappend accepted $hdl
+}
+set lstn [sockptyr listen $sokpath accept_proc]
+set old_limit [sockptyr connect_limit]
+sockptyr connect_limit 4
+array set async_res [list]
+proc async_cb {hdl status msg} {
+    global async_res
+    set async_res($hdl) [list $status $msg]
+}
+set conns [list]
+for {set i 0} {$i < 20} {incr i} {
+    lappend conns [sockptyr connect -async -command async_cb $sokpath]
+}
+set bad [sockptyr connect -async -command async_cb -timeout 5000 \
+             [file join [pwd] eraseme_nosuchsok]]
+set cancelled [sockptyr connect -async -command async_cb $sokpath]
+sockptyr close $cancelled
+array set dbg_handles [sockptyr dbg_handles]
+if {$dbg_handles(connect) ne "limit 4 started 4 queued 17"} {
+    error "unexpected connect state: $dbg_handles(connect)"
+}
+if {[array size async_res]} {
+    error "connect -command ran within sockptyr connect"
+}
+set timeout [after 5000 [list set async_res(timeout) 1]]
+while {[array size async_res] < 21 && ![info exists async_res(timeout)]} {
+    vwait async_res
+}
+after cancel $timeout
+foreach hdl $conns {
+    if {![info exists async_res($hdl)] || $async_res($hdl) ne "ok {}"} {
+        error "async connect of $hdl didn't report success"
+    }
+}
+if {![info exists async_res($bad)] ||
+    [lindex $async_res($bad) 0] ne "error" ||
+    ![catch {sockptyr link $bad $bad}]} {
+    error "async connect to nonexistent socket didn't fail properly"
+}
+if {[info exists async_res($cancelled)]} {
+    error "closed async connect still reported"
+}
+while {[llength $accepted] < 20} {
+    vwait accepted
+}
+array set dbg_handles [sockptyr dbg_handles]
+if {$dbg_handles(connect) ne "limit 4 started 0 queued 0"} {
+    error "unexpected connect state: $dbg_handles(connect)"
+}
+foreach hdl [concat $conns $accepted [list $lstn]] {
+    sockptyr close $hdl
+}
+sockptyr connect_limit $old_limit
+file delete $sokpath
+puts stderr "Done"
+
+puts stderr ""
+puts stderr "Reconnecting..."
+# a connection that keeps failing gives up after its -attempts
+unset async_res
+set async_res [list]
+proc async_cb {hdl status msg} {
+    global async_res
+    lappend async_res $status
+}
+set t0 [clock milliseconds]
+sockptyr connect -async -command async_cb -attempts 3 -backoff {20 40} \
+    [file join [pwd] eraseme_nosuchsok]
+vwait async_res
+set ms [expr {[clock milliseconds] - $t0}]
+if {$async_res ne "error" || $ms < 30} {
+    error "connect -attempts 3 gave $async_res after $ms ms"
+}
+# one with -reconnect connects again when closed from the far end,
+# and stays linked, so data sent meanwhile gets through
+set sokpath [file join [pwd] eraseme_reconsok]
+catch {file delete $sokpath}
+set accepted [list]
+set lstn [sockptyr listen $sokpath accept_proc]
+set async_res [list]
+set c [sockptyr connect -async -reconnect -attempts 0 -backoff {20 40} \
+           -command async_cb $sokpath]
+lassign [pty_open] p f
+sockptyr link $p $c
+while {[llength $accepted] < 1} {
+    vwait accepted
+}
+sockptyr close $lstn
+file delete $sokpath
+sockptyr close [lindex $accepted 0]
+puts -nonewline $f "sent while down"
+set timeout [after 5000 [list set async_res timeout]]
+while {[llength $async_res] < 2} {
+    vwait async_res
+}
+after 200 [list set wait 1]
+vwait wait
+set lstn [sockptyr listen $sokpath accept_proc]
+while {[llength $async_res] < 3} {
+    vwait async_res
+}
+after cancel $timeout
+if {$async_res ne "ok lost ok"} {
+    error "connect -reconnect reported: $async_res"
+}
+while {[llength $accepted] < 2} {
+    vwait accepted
+}
+set got ""
+lassign [pty_open got] p2 f2
+sockptyr link [lindex $accepted 1] $p2
+set timeout [after 5000 [list set got timeout]]
+while {$got ne "timeout" && [string length $got] < 15} {
+    vwait got
+}
+after cancel $timeout
+if {$got ne "sent while down"} {
+    error "data not relayed after reconnecting: $got"
+}
+close $f
+close $f2
+foreach hdl [list $c $p $p2 $lstn [lindex $accepted 1]] {
+    sockptyr close $hdl
+}
+file delete $sokpath
+puts stderr "Done"
+
+puts stderr ""
+puts stderr "Spawning processes..."
+# each reports its exit status through -onexit, without blocking
+set spawn_res [list]
+proc spawn_cb {hdl res} {
+    global spawn_res
+    lappend spawn_res [list $hdl $res]
+}
+set t0 [clock milliseconds]
+set procs [list]
+for {set i 0} {$i < 50} {incr i} {
+    lappend procs [sockptyr spawn -onexit spawn_cb "sleep 0.2; exit $i"]
+}
+if {[clock milliseconds] - $t0 >= 200} {
+    error "sockptyr spawn waited for the processes"
+}
+# one whose handle is closed is still waited for, but not reported
+sockptyr close [sockptyr spawn -onexit spawn_cb "exit 99"]
+# one tied to a PTY closes it when it exits
+lassign [sockptyr open_pty] p ppath
+set pty_closed 0
+sockptyr onclose $p [list set pty_closed 1]
+lappend procs [sockptyr spawn -onexit spawn_cb -pty $p {kill -TERM $$}]
+set timeout [after 5000 [list lappend spawn_res timeout]]
+while {[llength $spawn_res] < 51 && [lindex $spawn_res end] ne "timeout"} {
+    vwait spawn_res
+}
+after cancel $timeout
+array set spawn_by_hdl [concat {*}$spawn_res]
+for {set i 0} {$i < 51} {incr i} {
+    set exp [expr {$i < 50 ? [list exit $i] : [list signal Terminated]}]
+    set hdl [lindex $procs $i]
+    if {![info exists spawn_by_hdl($hdl)] || $spawn_by_hdl($hdl) ne $exp} {
+        error "sockptyr spawn #$i didn't report $exp: $spawn_res"
+    }
+}
+update
+if {!$pty_closed} {
+    error "sockptyr spawn -pty didn't close the PTY"
+}
+sockptyr close $p
+if {![catch {sockptyr close [lindex $procs 0]}]} {
+    error "process handle still valid after it exited"
+}
+after 300
+update
+array set dbg_handles [sockptyr dbg_handles]
+if {![string match "running 0 *" $dbg_handles(spawn)]} {
+    error "processes not all waited for: $dbg_handles(spawn)"
+}
+puts stderr "Done"
+
+puts stderr ""
+puts stderr "Spawning a process on a PTY..."
+# its output is relayed till it's all closed the PTY, then that's a close
+set got ""
+lassign [pty_open got] p2 f2
+set spawn_res [list]
+lassign [sockptyr pty_spawn -onexit spawn_cb \
+             {stty -onlcr; ps -o sid= -o tty= -p $$; seq 1 5000; exit 4}] \
+    p proc
+sockptyr onerror $p [list set pty_closed error]
+set pty_closed 0
+sockptyr onclose $p [list set pty_closed 1]
+sockptyr link $p $p2
+set timeout [after 5000 [list set pty_closed timeout]]
+while {$pty_closed eq "0"} {
+    vwait pty_closed
+}
+while {![llength $spawn_res] && $pty_closed ne "timeout"} {
+    vwait spawn_res
+}
+after cancel $timeout
+if {$pty_closed ne "1" || $spawn_res ne [list [list $proc {exit 4}]]} {
+    error "sockptyr pty_spawn ended with: $pty_closed $spawn_res"
+}
+set timeout [after 5000 [list set got timeout]]
+while {![string match "*\n5000\n" $got] && $got ne "timeout"} {
+    vwait got
+}
+after cancel $timeout
+set lines [split $got "\n"]
+lassign [lindex $lines 0] sid tty
+if {$tty eq "?" || [llength $lines] != 5002} {
+    error "sockptyr pty_spawn output wrong: [lindex $lines 0] ..."
+}
+close $f2
+sockptyr close $p
+sockptyr close $p2
+puts stderr "Done"
+
+puts stderr ""
+puts stderr "Relaying with a small I/O budget..."
+set old_budget [sockptyr io_budget]
+if {[sockptyr io_budget 512] != 512} {
+    error "sockptyr io_budget didn't take"
+}
+relay_test {} {}
+sockptyr io_budget $old_budget
+puts stderr "Done"
+
+puts stderr ""
+puts stderr "Growing a buffer..."
+set old_bufsz [sockptyr buffer_size]
+foreach {bad msg} {
+    {-cap -1} "buffer size cap can't be negative"
+    {-min 0} "buffer size min must be positive"
+    {-foo 0} "usage: *"
+    {-max} "usage: *"
+    {0} "buffer size must be positive"
+} {
+    if {![catch {sockptyr buffer_size {*}$bad} err] ||
+        ![string match $msg $err]} {
+        error "sockptyr buffer_size $bad: got \"$err\""
+    }
+}
+if {[sockptyr buffer_size] ne $old_bufsz} {
+    error "sockptyr buffer_size changed by bad arguments"
+}
+sockptyr buffer_size 1024 -max 65536
+lassign [pty_open] p1 f1
+lassign [pty_open] p2 f2
+sockptyr link $p1 $p2
+# with nothing reading from PTY 2, what's written to PTY 1 backs up into
+# sockptyr's buffer, which should grow to hold it
+set sent [string repeat "0123456789abcdef" 4096]
+puts -nonewline $f1 $sent
+after 500 [list set grown 1]
+vwait grown
+array set dbg_handles [sockptyr dbg_handles]
+regexp {^sockptyr_(\d+)_} $p1 - n
+array set bufinfo $dbg_handles([list $n buf])
+puts stderr "\tbuffer: $dbg_handles([list $n buf])"
+if {$bufinfo(sz) <= 1024} {
+    error "buffer didn't grow"
+}
+set got ""
+pty_read_to $f2 got
+set timeout [after 5000 [list set got timeout]]
+while {$got ne "timeout" && [string length $got] < [string length $sent]} {
+    vwait got
+}
+after cancel $timeout
+if {$got ne $sent} {
+    error "relayed data mismatch: sent [string length $sent] bytes, got [string length $got]"
+}
+# now that they're idle, the connections' buffers don't count to -cap
+array set bufinfo [sockptyr buffer_size]
+if {$bufinfo(total) != 0} {
+    error "idle connections' buffers counted: $bufinfo(total) bytes"
+}
+foreach f [list $f1 $f2] {
+    close $f
+}
+sockptyr close $p1
+sockptyr close $p2
+# buffers only get used while there's data in them
+array set sockptyr_info [sockptyr info]
+puts stderr "\tpool: used $sockptyr_info(pool_used) gets $sockptyr_info(pool_gets) hits $sockptyr_info(pool_hits)"
+if {$sockptyr_info(pool_used) != 0 || $sockptyr_info(pool_bytes_used) != 0} {
+    error "buffers still in use after all data was relayed"
+}
+if {$sockptyr_info(pool_gets) < 1 || $sockptyr_info(pool_hits) < 1} {
+    error "buffers weren't gotten from the pool and reused"
+}
+array set bufinfo $old_bufsz
+sockptyr buffer_size $bufinfo(size) -min $bufinfo(min) -max $bufinfo(max) \
+    -cap $bufinfo(cap)
+puts stderr "Done"
+# fanout_test: One PTY feeding three others through a fan-out group
+# with "-policy $policy", with the third one not being read for a while:
+# the other two should get everything anyway, except with "block",
+# where they wait for it.
+proc fanout_test {policy} {
+    global fan_got fan_err fan_wait
+
+    set old_bufsz [sockptyr buffer_size]
+    sockptyr buffer_size 1024 -max 65536
+    set hdls [list]
+    set files [list]
+    foreach i {0 1 2 3} {
+        lassign [pty_open] hdl f
+        lappend hdls $hdl
+        lappend files $f
+        set fan_got($i) ""
+    }
+    lassign $hdls p0 p1 p2 p3
+    lassign $files f0 f1 f2 f3
+    set grp [sockptyr fanout -policy $policy $p0 $p1 $p2]
+    sockptyr fanout_add $grp $p3
+    set fan_err ""
+    proc fanout_err {kws msg} {
+        global fan_err
+        set fan_err [list $kws $msg]
+    }
+    sockptyr onerror $p3 fanout_err
+    foreach i {0 1 2} {
+        pty_read_to [lindex $files $i] fan_got($i)
+    }
+
+    # what the sinks send goes to the source
+    puts -nonewline $f1 "one."
+    puts -nonewline $f2 "two."
+    set timeout [after 5000 [list set fan_got(0) timeout]]
+    while {$fan_got(0) ne "timeout" && [string length $fan_got(0)] < 8} {
+        vwait fan_got(0)
+    }
+    after cancel $timeout
+    if {$fan_got(0) ne "one.two." && $fan_got(0) ne "two.one."} {
+        error "sinks to source: got \"$fan_got(0)\""
+    }
+
+    # what the source sends goes to all the sinks
+    set sent ""
+    for {set i 0} {$i < 40000} {incr i} {
+        append sent [format "%d:%c " $i [expr {65 + $i % 26}]]
+    }
+    puts -nonewline $f0 $sent
+    set timeout [after 10000 [list set fan_got(1) timeout]]
+    if {$policy eq "block"} {
+        # the unread sink holds up the others
+        after 1000 [list set fan_wait 1]
+        vwait fan_wait
+        puts stderr "\tbefore reading sink 3: got\
+                        [string length $fan_got(1)] of [string length $sent]"
+        if {[string length $fan_got(1)] >= [string length $sent]} {
+            error "slow sink didn't hold up the others"
+        }
+        pty_read_to $f3 fan_got(3)
+    }
+    foreach i {1 2} {
+        while {$fan_got(1) ne "timeout" &&
+               [string length $fan_got($i)] < [string length $sent]} {
+            vwait fan_got($i)
+        }
+    }
+    after cancel $timeout
+    foreach i {1 2} {
+        if {$fan_got($i) ne $sent} {
+            error "sink $i: sent [string length $sent] bytes,\
+                    got [string length $fan_got($i)]"
+        }
+    }
+
+    array set dbg_handles [sockptyr dbg_handles]
+    regexp {^sockptyr_(\d+)_} $grp - n
+    regexp {^sockptyr_(\d+)_} $p1 - n1
+    regexp {^sockptyr_(\d+)_} $p3 - n3
+    puts stderr "\tgroup: sinks $dbg_handles([list $n sinks])\
+                    policy $dbg_handles([list $n policy])"
+    if {[info exists dbg_handles(err)]} {
+        error "sockptyr dbg_handles error: $dbg_handles(err)"
+    }
+    array set pinfo [lrange $dbg_handles([list $n policy]) 1 end]
+    switch -- $policy {
+        block {
+            set timeout [after 5000 [list set fan_got(3) timeout]]
+            while {$fan_got(3) ne "timeout" &&
+                   [string length $fan_got(3)] < [string length $sent]} {
+                vwait fan_got(3)
+            }
+            after cancel $timeout
+            if {$fan_got(3) ne $sent} {
+                error "slow sink got [string length $fan_got(3)] bytes"
+            }
+        }
+        drop {
+            if {$pinfo(dropped) == 0 ||
+                [llength $dbg_handles([list $n sinks])] != 3} {
+                error "slow sink's data wasn't dropped"
+            }
+        }
+        disconnect {
+            if {$pinfo(cut) != 1 ||
+                [llength $dbg_handles([list $n sinks])] != 2 ||
+                [info exists dbg_handles([list $n3 fan])]} {
+                error "slow sink wasn't taken out of the group"
+            }
+            if {[lindex $fan_err 0] ne {fanout slow}} {
+                error "slow sink reported: $fan_err"
+            }
+        }
+    }
+
+    # closing a sink takes it out of the group; closing the source is
+    # the end of it
+    sockptyr close $p2
+    array unset dbg_handles
+    array set dbg_handles [sockptyr dbg_handles]
+    if {[llength $dbg_handles([list $n sinks])] !=
+        ($policy eq "disconnect" ? 1 : 2)} {
+        error "closed sink still in the group"
+    }
+    sockptyr close $p0
+    if {![catch {sockptyr fanout_add $grp $p1}]} {
+        error "group still usable without its source"
+    }
+    array unset dbg_handles
+    array set dbg_handles [sockptyr dbg_handles]
+    if {[info exists dbg_handles([list $n1 fan])]} {
+        error "sink still in the group after closing its source"
+    }
+    sockptyr close $grp
+
+    foreach f $files {
+        close $f
+    }
+    foreach hdl [list $p1 $p3] {
+        sockptyr close $hdl
+    }
+    array set bufinfo $old_bufsz
+    sockptyr buffer_size $bufinfo(size) -min $bufinfo(min) \
+        -max $bufinfo(max) -cap $bufinfo(cap)
+}
+
+foreach policy {block drop disconnect} {
+    puts stderr ""
+    puts stderr "Fanning out from one PTY to others with -policy $policy..."
+    fanout_test $policy
+    puts stderr "Done"
+}
+
+puts stderr ""
+puts stderr "Cutting a slow -reconnect sink out of a fan-out group..."
+# its connection is fine, so that's reported through onerror with
+# "fanout slow", rather than being taken as lost and reconnected.  The
+# far end of it is linked to a PTY nobody reads, so it backs up.
+set old_bufsz [sockptyr buffer_size]
+sockptyr buffer_size 1024 -max 65536
+set sokpath [file join [pwd] eraseme_fansok]
+catch {file delete $sokpath}
+set accepted [list]
+set async_res [list]
+set lstn [sockptyr listen $sokpath accept_proc]
+set c [sockptyr connect -async -reconnect -attempts 0 -backoff {20 40} \
+           -command async_cb $sokpath]
+wait_until {[llength $accepted] == 1 && [llength $async_res] == 1}
+lassign [pty_open] pa fa
+sockptyr link [lindex $accepted 0] $pa
+lassign [pty_open] p0 f0
+set grp [sockptyr fanout -policy disconnect -grace 100 $p0 $c]
+set fan_err ""
+sockptyr onerror $c fanout_err
+set chunk [string repeat "slow sink " 6553]
+for {set i 0} {$i < 40 && $fan_err eq ""} {incr i} {
+    puts -nonewline $f0 $chunk
+    wait_until {[chan pending output $f0] == 0 || $fan_err ne ""}
+}
+wait_until {$fan_err ne ""}
+if {[lindex $fan_err 0] ne {fanout slow} || $async_res ne "ok"} {
+    error "slow -reconnect sink: onerror $fan_err, -command $async_res"
+}
+array unset dbg_handles
+array set dbg_handles [sockptyr dbg_handles]
+regexp {^sockptyr_(\d+)_} $c - n
+if {![info exists dbg_handles([list $n connected])]} {
+    error "slow -reconnect sink isn't connected any more"
+}
+close $f0
+close $fa
+foreach hdl [list $grp $p0 $c $pa [lindex $accepted 0] $lstn] {
+    sockptyr close $hdl
+}
+file delete $sokpath
+array set bufinfo $old_bufsz
+sockptyr buffer_size $bufinfo(size) -min $bufinfo(min) -max $bufinfo(max) \
+    -cap $bufinfo(cap)
+puts stderr "Done"
+
+puts stderr ""
+puts stderr "Keeping scrollback and replaying it..."
+# PTY 0 is a console with a file-backed scrollback, written to while
+# nothing's attached; PTY 1 attaches later with "-replay".
+set sbk_file [file join [pwd] eraseme_sbk]
+file delete -force $sbk_file
+set sbk_hdls [list]
+set sbk_files [list]
+foreach i {0 1 2 3} {
+    lassign [pty_open] hdl f
+    lappend sbk_hdls $hdl
+    lappend sbk_files $f
+    set sbk_got($i) ""
+}
+lassign $sbk_hdls p0 p1 p2 p3
+lassign $sbk_files f0 f1 f2 f3
+sockptyr scrollback $p0 4096 $sbk_file
+set sent ""
+for {set i 0} {$i < 1000} {incr i} {
+    append sent [format "%d:%c " $i [expr {65 + $i % 26}]]
+}
+puts -nonewline $f0 $sent
+set history [string range $sent end-4095 end]
+wait_until {[sockptyr scrollback_get $p0] eq $history}
+sockptyr link -replay $p0 $p1
+pty_read_to $f1 sbk_got(1)
+wait_until {[string length $sbk_got(1)] >= 4096}
+puts -nonewline $f0 "live."
+append history "live."
+wait_until {[string length $sbk_got(1)] >= 4101}
+if {$sbk_got(1) ne $history} {
+    error "replay: got [string length $sbk_got(1)] bytes, wrong ones"
+}
+set history [string range $history end-4095 end]
+if {[sockptyr scrollback_get $p0] ne $history} {
+    error "scrollback while linked is wrong"
+}
+
+# the file keeps it for the next connection to use it
+sockptyr close $p0
+sockptyr scrollback $p2 4096 $sbk_file
+if {[sockptyr scrollback_get $p2] ne $history} {
+    error "scrollback file didn't keep its contents"
+}
+sockptyr scrollback $p2 0
+if {[sockptyr scrollback_get $p2] ne ""} {
+    error "scrollback still there after removing it"
+}
+if {![catch {sockptyr scrollback $p2 100}]} {
+    error "too small a scrollback was accepted"
+}
+
+# a new sink in a fan-out group can get the source's history too
+sockptyr scrollback $p2 8192
+puts -nonewline $f2 "earlier."
+wait_until {[sockptyr scrollback_get $p2] eq "earlier."}
+set grp [sockptyr fanout $p2]
+sockptyr fanout_add -replay $grp $p3
+pty_read_to $f3 sbk_got(3)
+puts -nonewline $f2 "later."
+wait_until {[string length $sbk_got(3)] >= 14}
+if {$sbk_got(3) ne "earlier.later."} {
+    error "fan-out replay: got \"$sbk_got(3)\""
+}
+array unset dbg_handles
+array set dbg_handles [sockptyr dbg_handles]
+if {[info exists dbg_handles(err)]} {
+    error "sockptyr dbg_handles error: $dbg_handles(err)"
+}
+sockptyr close $grp
+foreach f $sbk_files {
+    close $f
+}
+foreach hdl [list $p1 $p2 $p3] {
+    sockptyr close $hdl
+}
+file delete -force $sbk_file
+puts stderr "Done"
+
+if {$sockptyr_info(USE_RECORD)} {
+    puts stderr ""
+    puts stderr "Recording connections..."
+    # PTYs 0 & 1 linked; what goes each way is recorded on PTY 0
+    set rec_file [file join [pwd] eraseme_rec]
+    foreach f [glob -nocomplain $rec_file*] {
+        file delete -force $f
+    }
+    set rec_hdls [list]
+    set rec_files [list]
+    foreach i {0 1} {
+        set rec_got($i) ""
+        lassign [pty_open rec_got($i)] hdl f
+        lappend rec_hdls $hdl
+        lappend rec_files $f
+    }
+    lassign $rec_hdls p0 p1
+    lassign $rec_files f0 f1
+    # rec_parse: read a recording, returning a list of what was received
+    # and what was sent
+    proc rec_parse {path} {
+        set f [open $path rb]
+        set data [read $f]
+        close $f
+        set rcvd ""
+        set sent ""
+        set pos 0
+        while {$pos < [string length $data]} {
+            if {[binary scan $data @${pos}iuiuiu sec usec len] != 3} {
+                error "recording $path: truncated header at $pos"
+            }
+            if {abs($sec - [clock seconds]) > 60 || $usec >= 1000000} {
+                error "recording $path: bad timestamp $sec.$usec"
+            }
+            set chunk [string range $data [expr {$pos + 12}] \
+                           [expr {$pos + 11 + ($len & 0x7fffffff)}]]
+            if {$len & 0x80000000} {
+                append sent $chunk
+            } else {
+                append rcvd $chunk
+            }
+            incr pos [expr {12 + ($len & 0x7fffffff)}]
+        }
+        if {$pos != [string length $data]} {
+            error "recording $path: truncated data"
+        }
+        return [list $rcvd $sent]
+    }
+    sockptyr link $p0 $p1
+    sockptyr record -sent $p0 $rec_file
+    puts -nonewline $f0 "hello"
+    wait_until {$rec_got(1) eq "hello"}
+    puts -nonewline $f1 "back"
+    wait_until {$rec_got(0) eq "back"}
+    array unset dbg_handles
+    array set dbg_handles [sockptyr dbg_handles]
+    if {[info exists dbg_handles(err)]} {
+        error "sockptyr dbg_handles error: $dbg_handles(err)"
+    }
+    regexp {^sockptyr_([0-9]+)_} $p0 - num
+    if {$dbg_handles($num rec) ne "bytes 9 dropped 0 err 0"} {
+        error "recording: dbg_handles says $dbg_handles($num rec)"
+    }
+    sockptyr record $p0
+    wait_until {[file size $rec_file] >= 33}
+    if {[rec_parse $rec_file] ne [list "hello" "back"]} {
+        error "recording: got [list [rec_parse $rec_file]]"
+    }
+
+    # with rotation: each chunk's written separately, after the first
+    # starting a new file
+    file delete -force $rec_file
+    sockptyr record -rotate 100 -keep 2 $p0 $rec_file
+    foreach chunk {aaaa bbbb cccc dddd} {
+        set expect [list [string repeat $chunk 20] ""]
+        puts -nonewline $f0 [lindex $expect 0]
+        wait_until {[file exists $rec_file] &&
+                    [rec_parse $rec_file] eq $expect}
+    }
+    sockptyr record $p0
+    if {[file exists $rec_file.3]} {
+        error "recording: kept too many old files"
+    }
+    foreach suffix {.2 .1 ""} chunk {bbbb cccc dddd} {
+        set expect [list [string repeat $chunk 20] ""]
+        if {[rec_parse $rec_file$suffix] ne $expect} {
+            error "recording: wrong contents in $rec_file$suffix"
+        }
+    }
+
+    # a file that can't be opened
+    if {![catch {sockptyr record $p0 [pwd]}]} {
+        error "recording to a directory was accepted"
+    }
+    foreach f $rec_files {
+        close $f
+    }
+    foreach hdl $rec_hdls {
+        sockptyr close $hdl
+    }
+    foreach f [glob -nocomplain $rec_file*] {
+        file delete -force $f
+    }
+    puts stderr "Done"
+}
+
+puts stderr ""
+puts stderr "Counting, timing and tracing traffic..."
+set st_hdls [list]
+set st_files [list]
+foreach i {0 1} {
+    set st_got($i) ""
+    lassign [pty_open st_got($i)] hdl f
+    lappend st_hdls $hdl
+    lappend st_files $f
+}
+lassign $st_hdls p0 p1
+lassign $st_files f0 f1
+sockptyr link $p0 $p1
+puts -nonewline $f0 [string repeat x 100]
+wait_until {[string length $st_got(1)] >= 100}
+set st0 [sockptyr stats $p0]
+set st1 [sockptyr stats $p1]
+puts stderr "\t$p0: $st0"
+if {[dict get $st0 bytes_in] != 100 || [dict get $st0 bytes_out] != 0 ||
+    [dict get $st1 bytes_in] != 0 || [dict get $st1 bytes_out] != 100} {
+    error "stats: wrong byte counts"
+}
+if {[dict get $st0 reads] < 1 || [dict get $st1 writes] < 1 ||
+    [dict get $st0 events] < 1 || [dict get $st1 idle_ms] != -1 ||
+    [dict get $st0 idle_ms] < 0 || [dict get $st0 peak_fill] < 1 ||
+    [dict get $st0 peak_fill] > 100} {
+    error "stats: wrong counts"
+}
+set all [sockptyr stats]
+if {[dict get $all connections] < 2 || [dict get $all bytes_in] < 100} {
+    error "stats: wrong totals: $all"
+}
+if {![catch {sockptyr stats $stale}]} {
+    error "stats of a stale handle didn't fail"
+}
+sockptyr link -latency $p0 $p1
+foreach i {1 2 3 4 5} {
+    set want [expr {100 + $i}]
+    puts -nonewline $f0 x
+    wait_until {[string length $st_got(1)] >= $want}
+}
+set lat [sockptyr stats -latency $p0]
+puts stderr "\tlatency: $lat"
+if {[dict get $lat count] < 1 || [dict get $lat count] > 5 ||
+    [dict get $lat p50] > [dict get $lat p99] ||
+    [dict get $lat p99] > [dict get $lat p999] ||
+    [dict get $lat p999] > [dict get $lat max] ||
+    [dict get $lat max] < 1 || [dict get $lat max] > 5000000} {
+    error "stats -latency: wrong: $lat"
+}
+if {[dict get [sockptyr stats -latency $p1] count] != 0} {
+    error "stats -latency: counted on the wrong side"
+}
+
+# a trace of it, decoded
+sockptyr trace on 1024
+puts -nonewline $f1 "traced"
+wait_until {[string length $st_got(0)] >= 6}
+sockptyr trace off
+set trace_file [file join [pwd] eraseme_trace]
+set n [sockptyr trace dump $trace_file]
+set decoded [exec [info nameofexecutable] \
+                 [file join [file dirname [info script]] \
+                      sockptyr_trace_decode.tcl] $trace_file]
+file delete -force $trace_file
+regexp {^sockptyr_([0-9]+)_} $p0 - num0
+regexp {^sockptyr_([0-9]+)_} $p1 - num1
+if {$n < 2 || [llength [split $decoded "\n"]] != $n ||
+    ![regexp "\\s$num1 read +6 bytes" $decoded] ||
+    ![regexp "\\s$num0 write +6 bytes" $decoded]} {
+    error "trace: got $n records:\n$decoded"
+}
+if {![catch {sockptyr trace on 4096}]} {
+    error "trace: ring was resized"
+}
+foreach f $st_files {
+    close $f
+}
+foreach hdl $st_hdls {
+    sockptyr close $hdl
+}
+puts stderr "Done"
+
+
+if {$use_inotify} {
+    puts stderr ""
+    puts stderr "Two inotify watches on the same directory..."
+    set inotdir [file join [pwd] eraseme_inotdir]
+    file delete -force $inotdir
+    file mkdir $inotdir
+    set inot_got [list]
+    proc inot_cb {tag flags cookie name} {
+        global inot_got
+        lappend inot_got [list $tag [lindex $flags 0] $name]
+    }
+    set wc [sockptyr inotify $inotdir IN_CREATE [list inot_cb create]]
+    set wd [sockptyr inotify $inotdir IN_DELETE [list inot_cb delete]]
+    close [open [file join $inotdir f1] w]
+    file delete [file join $inotdir f1]
+    after 200 [list set inot_wait 1]
+    vwait inot_wait
+    puts stderr "\tgot: $inot_got"
+    if {$inot_got ne {{create IN_CREATE f1} {delete IN_DELETE f1}}} {
+        error "wrong events for shared watch: $inot_got"
+    }
+    array unset dbg_handles
+    array set dbg_handles [sockptyr dbg_handles]
+    regexp {^sockptyr_(\d+)_} $wc - n_wc
+    regexp {^sockptyr_(\d+)_} $wd - n_wd
+    if {$dbg_handles([list $n_wc wd]) != $dbg_handles([list $n_wd wd]) ||
+        $dbg_handles([list $n_wc refs]) != 2} {
+        error "watches not shared"
+    }
+    # closing one leaves the other working
+    sockptyr close $wc
+    set inot_got [list]
+    close [open [file join $inotdir f2] w]
+    file delete [file join $inotdir f2]
+    after 200 [list set inot_wait 1]
+    vwait inot_wait
+    puts stderr "\tgot: $inot_got"
+    if {$inot_got ne {{delete IN_DELETE f2}}} {
+        error "wrong events after closing one watch: $inot_got"
+    }
+    sockptyr close $wd
+    puts stderr "Done"
+
+    puts stderr ""
+    puts stderr "Coalescing inotify events..."
+    set inot_got [list]
+    proc inot_flags {flags cookie name} {
+        global inot_got
+        lappend inot_got [list [lsort $flags] $name]
+    }
+    set wc [sockptyr inotify -coalesce 100 $inotdir {IN_CREATE IN_ATTRIB} \
+                inot_flags]
+    close [open [file join $inotdir f3] w]
+    file attributes [file join $inotdir f3] -permissions 0600
+    after 300 [list set inot_wait 1]
+    vwait inot_wait
+    puts stderr "\tgot: $inot_got"
+    if {$inot_got ne {{{IN_ATTRIB IN_CREATE} f3}}} {
+        error "events weren't merged: $inot_got"
+    }
+    sockptyr close $wc
+    file delete [file join $inotdir f3]
+    puts stderr "Done"
+
+    # Overflow the kernel's event queue, if it's not too big to do
+    # quickly; the directory gets read again to find what was missed.
+    set qmax 0
+    catch {
+        set f [open /proc/sys/fs/inotify/max_queued_events r]
+        set qmax [string trim [read $f]]
+        close $f
+    }
+    if {$qmax > 0 && $qmax <= 20000} {
+        puts stderr ""
+        puts stderr "Overflowing the inotify queue..."
+        array unset inot_seen
+        proc inot_count {flags cookie name} {
+            global inot_seen
+            incr inot_seen($name)
+        }
+        set wc [sockptyr inotify $inotdir IN_CREATE inot_count]
+        # IN_MOVED_TO can't be made up from a rescan, so that one gets
+        # IN_Q_OVERFLOW
+        set inot_got [list]
+        set wm [sockptyr inotify $inotdir IN_MOVED_TO [list inot_cb moved]]
+        # a file deleted before the overflow and created again during
+        # it is reported again, though only IN_CREATE was asked for
+        set again [file join $inotdir again]
+        close [open $again w]
+        wait_until {[info exists inot_seen(again)]}
+        file delete $again
+        after 200 [list set inot_wait 1]
+        vwait inot_wait
+        set nfiles [expr {$qmax + 500}]
+        for {set i 0} {$i < $nfiles} {incr i} {
+            close [open [file join $inotdir o$i] w]
+        }
+        close [open $again w]
+        after 1000 [list set inot_wait 1]
+        vwait inot_wait
+        array unset dbg_handles
+        array set dbg_handles [sockptyr dbg_handles]
+        puts stderr "\t[array size inot_seen] of [expr {$nfiles + 1}] seen;\
+                        $dbg_handles(inotify)"
+        if {![regexp {^overflows (\d+)} $dbg_handles(inotify) - novf] ||
+            $novf < 1} {
+            error "queue didn't overflow: $dbg_handles(inotify)"
+        }
+        if {[array size inot_seen] != $nfiles + 1} {
+            error "missed files after overflow"
+        }
+        foreach {name count} [array get inot_seen] {
+            if {$count != ($name eq "again" ? 2 : 1)} {
+                error "$name reported $count times"
+            }
+        }
+        if {$inot_got ne {{moved IN_Q_OVERFLOW {}}}} {
+            error "IN_MOVED_TO watch got: $inot_got"
+        }
+        sockptyr close $wc
+        sockptyr close $wm
+        puts stderr "Done"
+    }
+    file delete -force $inotdir
+}
+
 puts stderr ""
 puts stderr "Running handle debug..."
 array set dbg_handles [sockptyr dbg_handles]
@@ -0,0 +1,605 @@
+/* sockptyr_tests_bench.c
+ * Copyright (c) 2019 Jeremy Dilatush
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY JEREMY DILATUSH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL JEREMY DILATUSH OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* This is a throughput benchmark for the "sockptyr" library, that doesn't
+ * need the GUI or Tk.
+ *
+ * To use:
+ *      make -f Makefile.linux bench
+ * or
+ *      cc -g -Wall -I/usr/include/tcl -o tests/sockptyr_tests_bench \
+ *          tests/sockptyr_tests_bench.c -ltcl
+ *      ./tests/sockptyr_tests_bench ./sockptyr.so ?$option $value ...?
+ *
+ * It loads the library into a bare Tcl interpreter, sets up pairs of
+ * connections -- PTYs, or UNIX domain sockets accepted by "sockptyr
+ * listen" -- links each pair together, and pumps data in one side of
+ * each pair and out the other.  The pumping is done in a child process,
+ * so that the CPU time measured in this one is that of sockptyr and the
+ * Tcl event loop (including offload worker threads) and not that of
+ * the load.  It does that for every combination of the values given in
+ * the options, and writes the results to standard output as JSON;
+ * progress goes to standard error.
+ *
+ * Options, each taking a list of values to sweep over:
+ *      -bufs -- connection buffer sizes ("sockptyr buffer_size");
+ *          default "4096 65536"
+ *      -chunks -- how many bytes the load writes at a time; default
+ *          "512 16384"
+ *      -conns -- how many linked pairs of connections; default "1 16 128"
+ *      -types -- "pty" and/or "unix"; default "pty"
+ *      -links -- options for "sockptyr link", "plain" for none; default
+ *          "plain"
+ * And taking one value:
+ *      -mb -- megabytes to pump through in each run, divided among the
+ *          pairs; default 32
+ * Tcl's notifier uses select(), so sockptyr can't have file descriptors
+ * numbered FD_SETSIZE (usually 1024) or higher.  Each pair uses two, or
+ * six with "-splice"; that limits the values in -conns.
+ *
+ * For each run it reports:
+ *      mb_per_s -- megabytes relayed per second of elapsed time
+ *      syscalls_per_mb -- system calls sockptyr made to receive and send,
+ *          per megabyte, from "sockptyr stats"
+ *      events_per_mb -- times sockptyr found connections ready for I/O,
+ *          per megabyte
+ *      cpu_s_per_gb -- CPU seconds (user + system) this process used
+ *          per gigabyte relayed
+ * Compare the output from two builds to see which relays faster.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <tcl.h>
+
+#define BENCH_TIMEOUT_MS 120000 /* give up on a run after this long */
+
+static Tcl_Interp *interp;
+
+/** ** ** utilities ** ** **/
+
+/* fail()
+ * Report an error and exit.
+ */
+static void fail(const char *what, const char *why)
+{
+    fprintf(stderr, "sockptyr_tests_bench: %s: %s\n", what, why);
+    exit(1);
+}
+
+/* tcl()
+ * Run a Tcl script (formatted from 'fmt' etc), and return its result.
+ * On error, exit.
+ */
+static Tcl_Obj *tcl(const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (Tcl_Eval(interp, buf) != TCL_OK) {
+        fail(buf, Tcl_GetStringResult(interp));
+    }
+    return(Tcl_GetObjResult(interp));
+}
+
+/* now_s() -- monotonic time in seconds */
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+/* cpu_s() -- CPU time used by this process (all threads) in seconds */
+static double cpu_s(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return(ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6);
+}
+
+/* dict_wide()
+ * Get an integer value out of a Tcl dict; exit if it's not there.
+ */
+static Tcl_WideInt dict_wide(Tcl_Obj *dict, const char *key)
+{
+    Tcl_Obj *k, *v;
+    Tcl_WideInt w;
+
+    k = Tcl_NewStringObj(key, -1);
+    Tcl_IncrRefCount(k);
+    if (Tcl_DictObjGet(interp, dict, k, &v) != TCL_OK || !v ||
+        Tcl_GetWideIntFromObj(interp, v, &w) != TCL_OK) {
+        fail(key, "missing from sockptyr's results");
+    }
+    Tcl_DecrRefCount(k);
+    return(w);
+}
+
+/** ** ** the load: runs in a child process ** ** **/
+
+/* pump()
+ * Write 'per_conn' bytes, 'chunk' at a time, into each of fds[0],
+ * fds[2], fds[4], ..., and read them out of fds[1], fds[3], fds[5], ...
+ * Returns NULL on success, or a message on failure.
+ */
+static const char *pump(int *fds, int nconns, long per_conn, int chunk)
+{
+    static char msg[128];
+    struct pollfd *pfds;
+    long *sent, *rcvd;
+    char *wbuf, rbuf[65536];
+    int i, left, npfds;
+    ssize_t got;
+
+    pfds = calloc(nconns * 2, sizeof(pfds[0]));
+    sent = calloc(nconns, sizeof(sent[0]));
+    rcvd = calloc(nconns, sizeof(rcvd[0]));
+    wbuf = malloc(chunk);
+    if (!pfds || !sent || !rcvd || !wbuf) {
+        return("out of memory");
+    }
+    for (i = 0; i < chunk; ++i) {
+        wbuf[i] = "sockptyr-bench. "[i & 15];
+    }
+
+    left = nconns;
+    while (left > 0) {
+        npfds = 0;
+        for (i = 0; i < nconns; ++i) {
+            if (sent[i] < per_conn) {
+                pfds[npfds].fd = fds[i * 2];
+                pfds[npfds].events = POLLOUT;
+                ++npfds;
+            }
+            if (rcvd[i] < per_conn) {
+                pfds[npfds].fd = fds[i * 2 + 1];
+                pfds[npfds].events = POLLIN;
+                ++npfds;
+            }
+        }
+        if (poll(pfds, npfds, BENCH_TIMEOUT_MS) <= 0) {
+            return("timed out or poll() failed");
+        }
+        npfds = 0;
+        for (i = 0; i < nconns; ++i) {
+            if (sent[i] < per_conn) {
+                if (pfds[npfds].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                    got = write(fds[i * 2], wbuf,
+                                (per_conn - sent[i] < chunk) ?
+                                (per_conn - sent[i]) : chunk);
+                    if (got > 0) {
+                        sent[i] += got;
+                    } else if (got < 0 && errno != EAGAIN) {
+                        snprintf(msg, sizeof(msg), "write(): %s",
+                                 strerror(errno));
+                        return(msg);
+                    }
+                }
+                ++npfds;
+            }
+            if (rcvd[i] < per_conn) {
+                if (pfds[npfds].revents & (POLLIN | POLLERR | POLLHUP)) {
+                    got = read(fds[i * 2 + 1], rbuf, sizeof(rbuf));
+                    if (got > 0) {
+                        rcvd[i] += got;
+                        if (rcvd[i] >= per_conn) {
+                            --left;
+                        }
+                    } else if (got == 0 || errno != EAGAIN) {
+                        snprintf(msg, sizeof(msg), "read(): %s",
+                                 got ? strerror(errno) : "end of file");
+                        return(msg);
+                    }
+                }
+                ++npfds;
+            }
+        }
+    }
+    for (i = 0; i < nconns; ++i) {
+        if (rcvd[i] != per_conn) {
+            snprintf(msg, sizeof(msg), "received %ld bytes, sent %ld",
+                     rcvd[i], per_conn);
+            return(msg);
+        }
+    }
+    free(pfds);
+    free(sent);
+    free(rcvd);
+    free(wbuf);
+    return(NULL);
+}
+
+/** ** ** setting up connections ** ** **/
+
+/* move_up()
+ * Tcl's notifier uses select(), so it can't watch file descriptors
+ * numbered FD_SETSIZE or higher.  Move one of our own, which Tcl won't
+ * be watching, up there if possible, to leave the lower numbers for
+ * sockptyr's.  Returns the new file descriptor.
+ */
+static int move_up(int fd)
+{
+    int nfd = fcntl(fd, F_DUPFD, FD_SETSIZE);
+
+    if (nfd < 0) {
+        return(fd);
+    }
+    close(fd);
+    return(nfd);
+}
+
+/* open_pty_pair()
+ * Create two PTYs within sockptyr, link them, and open their far ends
+ * in raw mode, into fds[0] and fds[1].
+ */
+static void open_pty_pair(int *fds, const char *link)
+{
+    Tcl_Obj *res;
+    const char *path;
+    struct termios tio;
+    int i;
+
+    tcl("set p1 [sockptyr open_pty]; set p2 [sockptyr open_pty]; "
+        "lappend bench_hdls [lindex $p1 0] [lindex $p2 0]; "
+        "sockptyr link %s [lindex $p1 0] [lindex $p2 0]; "
+        "list [lindex $p1 1] [lindex $p2 1]", link);
+    res = Tcl_GetObjResult(interp);
+    for (i = 0; i < 2; ++i) {
+        Tcl_Obj *o;
+
+        Tcl_ListObjIndex(interp, res, i, &o);
+        path = Tcl_GetString(o);
+        fds[i] = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (fds[i] < 0) {
+            fail(path, strerror(errno));
+        }
+        fds[i] = move_up(fds[i]);
+        if (tcgetattr(fds[i], &tio) < 0) {
+            fail(path, strerror(errno));
+        }
+        cfmakeraw(&tio);
+        if (tcsetattr(fds[i], TCSANOW, &tio) < 0) {
+            fail(path, strerror(errno));
+        }
+    }
+}
+
+/* open_unix_pair()
+ * Connect twice to the socket sockptyr is listening on at 'path', wait
+ * for sockptyr to accept the connections, and link them.  Our ends go
+ * into fds[0] and fds[1].
+ */
+static void open_unix_pair(int *fds, const char *path, const char *link)
+{
+    struct sockaddr_un aun;
+    int i, want, have;
+
+    memset(&aun, 0, sizeof(aun));
+    aun.sun_family = AF_UNIX;
+    snprintf(aun.sun_path, sizeof(aun.sun_path), "%s", path);
+    for (i = 0; i < 2; ++i) {
+        fds[i] = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fds[i] < 0 || connect(fds[i], (void *)&aun, sizeof(aun)) < 0 ||
+            fcntl(fds[i], F_SETFL, O_NONBLOCK) < 0) {
+            fail(path, strerror(errno));
+        }
+        fds[i] = move_up(fds[i]);
+
+        /* wait for it to be accepted, so the handles are in order */
+        Tcl_GetIntFromObj(interp, tcl("llength $bench_hdls"), &want);
+        for (have = want; have == want; ) {
+            Tcl_DoOneEvent(TCL_ALL_EVENTS);
+            Tcl_GetIntFromObj(interp, tcl("llength $bench_hdls"), &have);
+        }
+    }
+    tcl("sockptyr link %s [lindex $bench_hdls end-1] [lindex $bench_hdls end]",
+        link);
+}
+
+/** ** ** running the benchmark ** ** **/
+
+/* bench_done() -- file handler: the load has finished (or failed) */
+static void bench_done(ClientData cd, int mask)
+{
+    *(int *)cd = 1;
+}
+
+/* bench_timeout() -- timer handler: the load is taking too long */
+static void bench_timeout(ClientData cd)
+{
+    *(int *)cd = 1;
+}
+
+/* run()
+ * Do one run of the benchmark, and write its results as a JSON object.
+ */
+static void run(const char *type, const char *link, int bufsz, int chunk,
+                int nconns, long mb, const char *sockpath, int first)
+{
+    int *fds, i, done = 0, rpipe[2], gpipe[2];
+    long per_conn = (mb * 1048576 + nconns - 1) / nconns;
+    double t0, t1, c0, c1, bytes;
+    char msg[160];
+    ssize_t got;
+    pid_t pid;
+    Tcl_TimerToken timer;
+    Tcl_Obj *stats;
+    int status;
+
+    fprintf(stderr, "%s, link %s, buffer %d, chunk %d, %d pairs...\n",
+            type, link, bufsz, chunk, nconns);
+    tcl("sockptyr buffer_size %d", bufsz);
+    tcl("set bench_hdls [list]");
+    fds = calloc(nconns * 2, sizeof(fds[0]));
+    if (!fds) {
+        fail("calloc()", "out of memory");
+    }
+    if (!strcmp(link, "plain")) {
+        link = "";
+    }
+    for (i = 0; i < nconns; ++i) {
+        if (!strcmp(type, "pty")) {
+            open_pty_pair(fds + i * 2, link);
+        } else {
+            open_unix_pair(fds + i * 2, sockpath, link);
+        }
+    }
+    tcl("foreach h $bench_hdls { "
+        "sockptyr onclose $h bench_ignore; sockptyr onerror $h bench_ignore "
+        "}");
+
+    /* The child process writes a message (or nothing) on 'rpipe' when
+     * it's done, then waits for 'gpipe' to be closed before closing its
+     * connections and exiting, so that nothing happens to them until
+     * we've collected sockptyr's counts.
+     */
+    if (pipe(rpipe) < 0 || pipe(gpipe) < 0) {
+        fail("pipe()", strerror(errno));
+    }
+    c0 = cpu_s();
+    t0 = now_s();
+    pid = fork();
+    if (pid < 0) {
+        fail("fork()", strerror(errno));
+    } else if (pid == 0) {
+        const char *err;
+        char c;
+
+        close(rpipe[0]);
+        close(gpipe[1]);
+        err = pump(fds, nconns, per_conn, chunk);
+        if (err) {
+            if (write(rpipe[1], err, strlen(err)) < 0) {
+                /* nothing we can do about it */
+            }
+        }
+        close(rpipe[1]);
+        while (read(gpipe[0], &c, 1) > 0 || errno == EINTR)
+            ;
+        _exit(0);
+    }
+    close(rpipe[1]);
+    close(gpipe[0]);
+    for (i = 0; i < nconns * 2; ++i) {
+        close(fds[i]);
+    }
+    free(fds);
+
+    /* run the event loop until the load is done */
+    Tcl_CreateFileHandler(rpipe[0], TCL_READABLE, bench_done, &done);
+    timer = Tcl_CreateTimerHandler(BENCH_TIMEOUT_MS, bench_timeout, &done);
+    while (!done) {
+        Tcl_DoOneEvent(TCL_ALL_EVENTS);
+    }
+    t1 = now_s();
+    c1 = cpu_s();
+    Tcl_DeleteTimerHandler(timer);
+    Tcl_DeleteFileHandler(rpipe[0]);
+    got = read(rpipe[0], msg, sizeof(msg) - 1);
+    if (got != 0) {
+        kill(pid, SIGKILL);
+        msg[got > 0 ? got : 0] = '\0';
+        fail("load", got > 0 ? msg : "timed out");
+    }
+
+    /* collect the counts, then clean up */
+    stats = tcl("sockptyr stats");
+    Tcl_IncrRefCount(stats);
+    tcl("foreach h $bench_hdls { sockptyr close $h }");
+    close(rpipe[0]);
+    close(gpipe[1]);
+    waitpid(pid, &status, 0);
+
+    bytes = (double)per_conn * nconns;
+    printf("%s\n    {\"type\": \"%s\", \"link\": \"%s\", "
+           "\"buffer_size\": %d, \"chunk_size\": %d, \"connections\": %d,\n"
+           "     \"bytes\": %.0f, \"seconds\": %.4f, \"mb_per_s\": %.2f, "
+           "\"syscalls_per_mb\": %.2f,\n"
+           "     \"events_per_mb\": %.2f, \"buffer_full_per_mb\": %.2f, "
+           "\"cpu_s_per_gb\": %.3f}",
+           first ? "" : ",", type, *link ? link : "plain",
+           bufsz, chunk, nconns, bytes, t1 - t0,
+           bytes / 1048576.0 / (t1 - t0),
+           (dict_wide(stats, "reads") + dict_wide(stats, "writes")) /
+           (bytes / 1048576.0),
+           dict_wide(stats, "events") / (bytes / 1048576.0),
+           dict_wide(stats, "buffer_full") / (bytes / 1048576.0),
+           (c1 - c0) / (bytes / 1073741824.0));
+    fflush(stdout);
+    Tcl_DecrRefCount(stats);
+}
+
+/* sweep_opt() -- parse a list valued option into its elements */
+static void sweep_opt(const char *val, int *objc, Tcl_Obj ***objv)
+{
+    Tcl_Obj *o = Tcl_NewStringObj(val, -1);
+
+    Tcl_IncrRefCount(o); /* never freed; the elements are used until exit */
+    if (Tcl_ListObjGetElements(interp, o, objc, objv) != TCL_OK) {
+        fail(val, Tcl_GetStringResult(interp));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *bufs = "4096 65536", *chunks = "512 16384";
+    const char *conns = "1 16 128", *types = "pty", *links = "plain";
+    long mb = 32;
+    int nbufs, nchunks, nconns, ntypes, nlinks, b, c, n, t, l, first = 1;
+    int i, bufsz, chunk, npairs;
+    Tcl_Obj **vbufs, **vchunks, **vconns, **vtypes, **vlinks, *info, *k, *v;
+    Tcl_DictSearch search;
+    char sockpath[64];
+    int fin;
+
+    if (argc < 2 || (argc % 2) != 0) {
+        fprintf(stderr, "usage: %s $path_to_dyl ?-bufs $list? "
+                "?-chunks $list? ?-conns $list? ?-types $list? "
+                "?-links $list? ?-mb $megabytes?\n", argv[0]);
+        return(1);
+    }
+    for (i = 2; i < argc; i += 2) {
+        if (!strcmp(argv[i], "-bufs")) {
+            bufs = argv[i + 1];
+        } else if (!strcmp(argv[i], "-chunks")) {
+            chunks = argv[i + 1];
+        } else if (!strcmp(argv[i], "-conns")) {
+            conns = argv[i + 1];
+        } else if (!strcmp(argv[i], "-types")) {
+            types = argv[i + 1];
+        } else if (!strcmp(argv[i], "-links")) {
+            links = argv[i + 1];
+        } else if (!strcmp(argv[i], "-mb")) {
+            mb = atol(argv[i + 1]);
+        } else {
+            fail(argv[i], "unknown option");
+        }
+    }
+    if (mb < 1) {
+        fail("-mb", "must be at least 1");
+    }
+
+    /* the largest runs want lots of file descriptors */
+    {
+        struct rlimit rl;
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) >= 0) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    if (Tcl_Init(interp) != TCL_OK) {
+        fail("Tcl_Init()", Tcl_GetStringResult(interp));
+    }
+    tcl("load {%s} sockptyr", argv[1]);
+    tcl("proc bench_ignore {args} {}; "
+        "proc bench_accept {hdl args} { lappend ::bench_hdls $hdl }; "
+        "set bench_hdls [list]");
+    sweep_opt(bufs, &nbufs, &vbufs);
+    sweep_opt(chunks, &nchunks, &vchunks);
+    sweep_opt(conns, &nconns, &vconns);
+    sweep_opt(types, &ntypes, &vtypes);
+    sweep_opt(links, &nlinks, &vlinks);
+
+    /* a socket to connect to for the "unix" runs */
+    snprintf(sockpath, sizeof(sockpath), "/tmp/sockptyr_bench_%ld.sock",
+             (long)getpid());
+    for (t = 0; t < ntypes; ++t) {
+        if (!strcmp(Tcl_GetString(vtypes[t]), "unix")) {
+            unlink(sockpath);
+            tcl("set bench_lstn [sockptyr listen {%s} bench_accept]",
+                sockpath);
+            break;
+        } else if (strcmp(Tcl_GetString(vtypes[t]), "pty") != 0) {
+            fail(Tcl_GetString(vtypes[t]), "type must be pty or unix");
+        }
+    }
+
+    /* what was benchmarked */
+    printf("{\"library\": \"%s\",\n \"info\": {", argv[1]);
+    info = tcl("sockptyr info");
+    Tcl_IncrRefCount(info);
+    Tcl_DictObjFirst(interp, info, &search, &k, &v, &fin);
+    for (i = 0; !fin; ++i) {
+        printf("%s\"%s\": %s", i ? ", " : "",
+               Tcl_GetString(k), Tcl_GetString(v));
+        Tcl_DictObjNext(&search, &k, &v, &fin);
+    }
+    Tcl_DictObjDone(&search);
+    Tcl_DecrRefCount(info);
+    printf("},\n \"megabytes_per_run\": %ld,\n \"runs\": [", mb);
+
+    for (t = 0; t < ntypes; ++t) {
+        for (l = 0; l < nlinks; ++l) {
+            for (b = 0; b < nbufs; ++b) {
+                for (c = 0; c < nchunks; ++c) {
+                    for (n = 0; n < nconns; ++n) {
+                        if (Tcl_GetIntFromObj(interp, vbufs[b], &bufsz) ||
+                            Tcl_GetIntFromObj(interp, vchunks[c], &chunk) ||
+                            Tcl_GetIntFromObj(interp, vconns[n], &npairs) ||
+                            bufsz < 1 || chunk < 1 || npairs < 1) {
+                            fail("-bufs, -chunks, -conns",
+                                 "must be positive integers");
+                        }
+                        run(Tcl_GetString(vtypes[t]),
+                            Tcl_GetString(vlinks[l]),
+                            bufsz, chunk, npairs, mb, sockpath, first);
+                        first = 0;
+                    }
+                }
+            }
+        }
+    }
+    printf("\n ]}\n");
+
+    unlink(sockpath);
+    return(0);
+}
@@ -39,6 +39,12 @@
 #       hdalways -- run handle debugging output frequently
 #           but only check for errors
 #       cleanup -- clean up, as is done at the end of the run
+#       timed # # -- with the first number of idle handles open (inotify
+#           watches, which take no file descriptors), time the second
+#           number of each of several operations, and report operations
+#           per second, and how the handle table has grown; for
+#           instance: timed 1000 2000 timed 10000 2000 timed 100000 2000
+#           Needs inotify.
 # when it runs out of parameters it cleans up and exits.
 
 set keep_min 0
@@ -382,7 +388,7 @@ proc del {cyc} {
 
     # Close the PTY that was opened before
     set ptyh $db([list pty hdl $cyc])
-    sockptyr onclose $ptyh) [list expected_closes_proc $ptyh] ; # not called
+    sockptyr onclose $ptyh [list expected_closes_proc $ptyh] ; # not called
     set ppath $db([list pty path $cyc])
     sockptyr close $ptyh
     acremove $ptyh
@@ -392,6 +398,136 @@ proc del {cyc} {
     if {$hdalways} { hderrorcheck }
 }
 
+# timed mode: $timed(idle) is the list of idle handles, kept in the
+# order they were created; $timed(dir) the directory they watch.
+set timed(idle) [list]
+set timed(dir) eraseme_churndir
+set timed(lpath) ${sokpfx}_timed
+set timed(lstn) ""
+set timed_accepted [list]
+
+proc timed_accept {hdl es} {
+    global timed_accepted
+    lappend timed_accepted $hdl
+}
+
+# timed_connect - connect to our listen socket, wait for it to be
+# accepted, and return both handles
+proc timed_connect {} {
+    global timed timed_accepted
+    set conn [sockptyr connect $timed(lpath)]
+    while {![llength $timed_accepted]} {
+        vwait timed_accepted
+    }
+    set acc [lindex $timed_accepted 0]
+    set timed_accepted [list]
+    return [list $conn $acc]
+}
+
+# timed_rate - run $script $n times and return how many times per second
+proc timed_rate {n script} {
+    set us [lindex [uplevel 1 [list time $script $n]] 0]
+    return [expr {$us > 0 ? 1e6 / $us : 0}]
+}
+
+# timed_alloc - handle table information from "sockptyr dbg_handles"
+proc timed_alloc {} {
+    array set dbg_handles [sockptyr dbg_handles]
+    if {[info exists dbg_handles(err)]} {
+        error "sockptyr dbg_handles error: $dbg_handles(err)"
+    }
+    return $dbg_handles(alloc)
+}
+
+# timed_run - the "timed" direction
+proc timed_run {nidle nops} {
+    global timed USE_INOTIFY
+
+    if {!$USE_INOTIFY} {
+        error "'timed' needs inotify, for its idle handles"
+    }
+    if {$timed(lstn) eq ""} {
+        file mkdir $timed(dir)
+        catch {file delete $timed(lpath)}
+        set timed(lstn) [sockptyr listen $timed(lpath) timed_accept]
+    }
+
+    # get the number of idle handles right, timing adding them
+    set nadd [expr {$nidle - [llength $timed(idle)]}]
+    set fill ""
+    if {$nadd > 0} {
+        set t0 [clock microseconds]
+        for {set i 0} {$i < $nadd} {incr i} {
+            lappend timed(idle) \
+                [sockptyr inotify $timed(dir) IN_ATTRIB [list badcb idle]]
+        }
+        set t1 [clock microseconds]
+        set fill [format "%.1f ops/s" \
+                      [expr {$nadd * 1e6 / max(1, $t1 - $t0)}]]
+    }
+    while {[llength $timed(idle)] > $nidle} {
+        sockptyr close [lindex $timed(idle) end]
+        set timed(idle) [lreplace $timed(idle) end end]
+    }
+    lassign [timed_connect] c1 c2
+    set alloc0 [timed_alloc]
+    puts stderr "Timing $nops of each operation with $nidle idle handles."
+
+    set r(connect/close) [timed_rate $nops {
+        foreach hdl [timed_connect] {
+            sockptyr close $hdl
+        }
+    }]
+    set r(link/unlink) [timed_rate $nops {
+        sockptyr link $c1 $c2
+        sockptyr link $c1
+    }]
+    set r(onclose) [timed_rate $nops {
+        sockptyr onclose $c1 [list badcb timed $c1]
+        sockptyr onclose $c1
+    }]
+    set r(inotify) [timed_rate $nops {
+        sockptyr close [sockptyr inotify $timed(lpath) IN_ATTRIB badcb]
+    }]
+    set alloc1 [timed_alloc]
+    sockptyr close $c1
+    sockptyr close $c2
+
+    # report
+    puts [format "timed: %d idle handles, %d of each operation" $nidle $nops]
+    if {$fill ne ""} {
+        puts [format "    %-24s %s" "adding idle handles" $fill]
+    }
+    puts [format "    %-24s %.1f ops/s" "connect & close" $r(connect/close)]
+    puts [format "    %-24s %.1f ops/s" "link & unlink" $r(link/unlink)]
+    puts [format "    %-24s %.1f ops/s" "set & clear onclose" $r(onclose)]
+    puts [format "    %-24s %.1f ops/s" "inotify add & remove" $r(inotify)]
+    array set a $alloc1
+    puts [format "    handle table: %d handles, grown %d times (%d moved),\
+                      %lld us total, %lld us longest" \
+              $a(handles) $a(grows) $a(moved) $a(grow_us) $a(grow_max_us)]
+    if {$alloc0 ne $alloc1} {
+        puts "    (the timed operations grew it: $alloc0 -> $alloc1)"
+    }
+}
+
+# timed_cleanup - clean up after "timed"; the idle handles are closed
+# newest first, since that's the order inotify watches sharing a file
+# are fastest to remove in
+proc timed_cleanup {} {
+    global timed
+    for {set i [llength $timed(idle)]} {[incr i -1] >= 0} {} {
+        sockptyr close [lindex $timed(idle) $i]
+    }
+    set timed(idle) [list]
+    if {$timed(lstn) ne ""} {
+        sockptyr close $timed(lstn)
+        set timed(lstn) ""
+        file delete $timed(lpath)
+        file delete $timed(dir)
+    }
+}
+
 # process directions from the command line
 for {set i 0} {$i < [llength $argv]} {incr i} {
     set a [lindex $argv $i]
@@ -475,6 +611,17 @@ for {set i 0} {$i < [llength $argv]} {incr i} {
             del $octr
             incr octr
         }
+        timed_cleanup
+    } elseif {$a eq "timed"} {
+        incr i
+        set nidle [lindex $argv $i]
+        incr i
+        set nops [lindex $argv $i]
+        if {![string is integer -strict $nidle] || $nidle < 0 ||
+            ![string is integer -strict $nops] || $nops < 1} {
+            error "'timed $nidle $nops' not a nonnegative & a positive integer"
+        }
+        timed_run $nidle $nops
     } else {
         error "Unknown direction '$a'"
     }
@@ -486,6 +633,7 @@ while {$octr < $nctr} {
     del $octr
     incr octr
 }
+timed_cleanup
 puts stderr "Exiting."
 exit 0
 
@@ -0,0 +1,141 @@
+#!/usr/bin/tclsh
+# sockptyr_tests_iov.tcl
+# Copyright (c) 2019 Jeremy Dilatush
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY JEREMY DILATUSH AND CONTRIBUTORS
+# ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+# TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL JEREMY DILATUSH OR CONTRIBUTORS
+# BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+# Benchmark for sockptyr's ring buffer I/O.  Links two PTYs together,
+# pumps data through them, and reports how many system calls sockptyr
+# made per megabyte relayed, and how often it changed its file event
+# handlers, from the counters in "sockptyr dbg_handles".
+# To compare readv()/writev() against plain read()/write(), run it against
+# a build with USE_READV=1 and one with USE_READV=0:
+#       make -f Makefile.linux USE_READV=0
+#
+# Run with the following command line:
+#       tclsh sockptyr_tests_iov.tcl $path_to_dyl ?$megabytes? ?$buf_size? \
+#           ?$read_size?
+# where
+#       $path_to_dyl is the path to the dynamic library file
+#       $megabytes is how much data to pump through; default 8
+#       $buf_size is the connection buffer size; default 4096
+#       $read_size is the most to read from the receiving PTY at a time,
+#           to simulate a slow consumer; default 0 meaning no limit
+
+lassign $argv path_to_dyl megabytes buf_size read_size
+if {$path_to_dyl eq ""} {
+    puts stderr "usage: tclsh sockptyr_tests_iov.tcl \$path_to_dyl ?\$megabytes? ?\$buf_size? ?\$read_size?"
+    exit 1
+}
+if {$megabytes eq ""} { set megabytes 8 }
+if {$buf_size eq ""} { set buf_size 4096 }
+if {$read_size eq ""} { set read_size 0 }
+load $path_to_dyl sockptyr
+array set sockptyr_info [sockptyr info]
+sockptyr buffer_size $buf_size
+
+# set up the PTYs, linked together within sockptyr
+lassign [sockptyr open_pty] p1 p1path
+lassign [sockptyr open_pty] p2 p2path
+sockptyr link $p1 $p2
+set ptys [list]
+foreach path [list $p1path $p2path] {
+    exec stty -F $path raw -echo
+    set f [open $path {RDWR NOCTTY NONBLOCK}]
+    fconfigure $f -translation binary -blocking 0 -buffering none
+    lappend ptys $f
+}
+lassign $ptys f1 f2
+
+# Pump data in one PTY and out the other.  The chunk size is chosen so
+# that it doesn't line up with the buffer size, so when the buffers wrap
+# around they do it at varying places.  Reading less at a time than is
+# written makes the buffers fill up, and wrap around more often.
+set total [expr {$megabytes * 1048576}]
+set chunk [string repeat "sockptyr-iov-benchmark. " 125]
+set chunk [string range $chunk 0 2998]
+set nsent 0
+set nrcvd 0
+set done 0
+proc pump_write {f} {
+    global nsent total chunk
+    if {$nsent >= $total} {
+        fileevent $f writable {}
+        return
+    }
+    set len [expr {min([string length $chunk], $total - $nsent)}]
+    puts -nonewline $f [string range $chunk 0 [expr {$len - 1}]]
+    incr nsent $len
+}
+proc pump_read {f} {
+    global nrcvd total done read_size
+    if {$read_size > 0} {
+        incr nrcvd [string length [read $f $read_size]]
+    } else {
+        incr nrcvd [string length [read $f]]
+    }
+    if {$nrcvd >= $total} {
+        set done 1
+    }
+}
+fileevent $f1 writable [list pump_write $f1]
+fileevent $f2 readable [list pump_read $f2]
+set t0 [clock microseconds]
+set timeout [after [expr {10000 + 5000 * $megabytes}] [list set done timeout]]
+vwait done
+after cancel $timeout
+set t1 [clock microseconds]
+if {$done ne "1"} {
+    puts stderr "timed out: sent $nsent bytes, received $nrcvd"
+    exit 1
+}
+
+# report
+array set dbg_handles [sockptyr dbg_handles]
+set ev 0
+set rd 0
+set wr 0
+foreach hdl [list $p1 $p2] {
+    regexp {^sockptyr_(\d+)_} $hdl - n
+    array set io $dbg_handles([list $n io])
+    incr ev $io(ev)
+    incr rd $io(rd)
+    incr wr $io(wr)
+}
+set mb [expr {double($nrcvd) / 1048576.0}]
+puts [format "USE_READV=%d buf_size=%d read_size=%d: relayed %.1f MB in %.2f s" \
+          $sockptyr_info(USE_READV) $buf_size $read_size $mb \
+          [expr {($t1 - $t0) / 1e6}]]
+puts [format "    per MB: %8.1f events %8.1f reads %8.1f writes %8.1f syscalls" \
+          [expr {$ev / $mb}] [expr {$rd / $mb}] [expr {$wr / $mb}] \
+          [expr {($rd + $wr) / $mb}]]
+array set reg $dbg_handles(reg)
+puts [format "    per MB: %8.1f file handler registrations, %8.1f skipped" \
+          [expr {$reg(done) / $mb}] [expr {$reg(skipped) / $mb}]]
+
+foreach f $ptys {
+    close $f
+}
+foreach hdl [list $p1 $p2] {
+    sockptyr close $hdl
+}
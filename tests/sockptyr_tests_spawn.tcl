@@ -0,0 +1,90 @@
+#!/usr/bin/tclsh
+# sockptyr_tests_spawn.tcl
+# Copyright (c) 2019 Jeremy Dilatush
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY JEREMY DILATUSH AND CONTRIBUTORS
+# ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+# TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL JEREMY DILATUSH OR CONTRIBUTORS
+# BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+# Benchmark for "sockptyr exec", which the GUI uses to start terminal
+# windows.  Times how long it takes to run a trivial command, in processes
+# of various sizes (resident memory) and with various limits on the number
+# of open files; with fork() both can make it slow.  Each combination
+# runs in a child process started with that limit ("ulimit -n").
+# To compare posix_spawn() against fork(), run it against a build with
+# USE_POSIX_SPAWN=1 and one with USE_POSIX_SPAWN=0:
+#       make -f Makefile.linux USE_POSIX_SPAWN=0
+# Tcl's own "exec" is timed too, for reference.
+#
+# Run with the following command line:
+#       tclsh sockptyr_tests_spawn.tcl $path_to_dyl ?$count? ?$megabytes? \
+#           ?$nofiles?
+# where
+#       $path_to_dyl is the path to the dynamic library file
+#       $count is how many times to run the command; default 50
+#       $megabytes is a list of process sizes to try, in megabytes of
+#           memory allocated on top of what Tcl uses; default {0 256 1024}
+#       $nofiles is a list of open file limits to try; default
+#           {1024 65536 1048576}; those above the hard limit are skipped
+
+if {[lindex $argv 0] eq "-child"} {
+    # in the child process: time it & report microseconds per command
+    lassign $argv - path_to_dyl count megabytes
+    load $path_to_dyl sockptyr
+    set ballast [string repeat x [expr {$megabytes * 1048576}]]
+    set us_sockptyr [lindex [time {sockptyr exec true} $count] 0]
+    set us_tcl [lindex [time {exec true} $count] 0]
+    puts [list $us_sockptyr $us_tcl]
+    exit 0
+}
+
+lassign $argv path_to_dyl count megabytes nofiles
+if {$path_to_dyl eq ""} {
+    puts stderr "usage: tclsh sockptyr_tests_spawn.tcl \$path_to_dyl ?\$count? ?\$megabytes? ?\$nofiles?"
+    exit 1
+}
+if {$count eq ""} { set count 50 }
+if {$megabytes eq ""} { set megabytes {0 256 1024} }
+if {$nofiles eq ""} { set nofiles {1024 65536 1048576} }
+load $path_to_dyl sockptyr
+array set sockptyr_info [sockptyr info]
+
+set hard [exec sh -c {ulimit -Hn}]
+puts [format "USE_POSIX_SPAWN=%d USE_SPAWN_CLOSEFROM=%d: %d commands each" \
+          $sockptyr_info(USE_POSIX_SPAWN) \
+          $sockptyr_info(USE_SPAWN_CLOSEFROM) $count]
+puts [format "    %8s %10s %14s %14s" \
+          "nofile" "MB" "sockptyr us" "Tcl exec us"]
+foreach nofile $nofiles {
+    if {$hard ne "unlimited" && $nofile > $hard} {
+        puts [format "    %8d %10s (above hard limit %s; skipped)" \
+                  $nofile - $hard]
+        continue
+    }
+    foreach mb $megabytes {
+        set res [exec sh -c {ulimit -n "$0" && exec "$@"} \
+                     $nofile [info nameofexecutable] [info script] \
+                     -child $path_to_dyl $count $mb]
+        lassign $res us_sockptyr us_tcl
+        puts [format "    %8d %10d %14.1f %14.1f" \
+                  $nofile $mb $us_sockptyr $us_tcl]
+    }
+}
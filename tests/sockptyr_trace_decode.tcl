@@ -0,0 +1,103 @@
+#!/usr/bin/tclsh
+# sockptyr_trace_decode.tcl
+# Copyright (c) 2019 Jeremy Dilatush
+# All rights reserved.
+# 
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 
+# THIS SOFTWARE IS PROVIDED BY JEREMY DILATUSH AND CONTRIBUTORS
+# ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+# TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL JEREMY DILATUSH OR CONTRIBUTORS
+# BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+# Decoder for the files written by "sockptyr trace dump" (see
+# sockptyr-tcl-api.txt): prints each record on a line of its own,
+# oldest first:
+#       time of day, to the microsecond
+#       microseconds since the previous record
+#       handle number ("-" for none)
+#       event type
+#       details depending on the type: bytes, errno, mask etc
+#
+# Run with the following command line:
+#       tclsh sockptyr_trace_decode.tcl $file
+
+lassign $argv path
+if {$path eq "" || [llength $argv] != 1} {
+    puts stderr "usage: tclsh sockptyr_trace_decode.tcl \$file"
+    exit 1
+}
+set f [open $path rb]
+set data [read $f]
+close $f
+
+if {[string range $data 0 15] ne "sockptyr trc 1\n\0" ||
+    [binary scan $data @16iuiuw recsz nrecs offset] != 3 ||
+    $recsz < 24 || [string length $data] != 32 + $recsz * $nrecs} {
+    puts stderr "$path: not a sockptyr trace dump"
+    exit 1
+}
+
+# event types, from enum sockptyr_trace_type in sockptyr_core.c
+set types {{} reg io read write splice_in splice_out close error
+           inot_add inot_del inot_ev}
+
+# mask: describe a Tcl file event mask (TCL_READABLE etc)
+proc mask {m} {
+    set s ""
+    if {$m & 2} { append s r }
+    if {$m & 4} { append s w }
+    if {$m & 8} { append s x }
+    if {$s eq ""} { set s - }
+    return $s
+}
+
+set prev ""
+for {set i 0} {$i < $nrecs} {incr i} {
+    binary scan $data @[expr {32 + $i * $recsz}]wiuisusuiu \
+        us num len type err arg
+    set t [expr {$us + $offset}]
+    set when [clock format [expr {$t / 1000000}] -format %H:%M:%S]
+    append when [format .%06d [expr {$t % 1000000}]]
+    set delta [expr {$prev eq "" ? 0 : $us - $prev}]
+    set prev $us
+    set tname [lindex $types $type]
+    if {$tname eq ""} { set tname "type$type" }
+    if {$num == 0xffffffff} { set num - }
+    switch -- $tname {
+        reg - io {
+            set what "mask [mask $arg]"
+        }
+        read - write - splice_in - splice_out {
+            if {$len < 0} {
+                set what "errno $err"
+            } else {
+                set what "$len bytes"
+            }
+            if {$tname eq "read" || $tname eq "write"} {
+                append what " $arg pieces"
+            }
+        }
+        inot_add - inot_del - inot_ev {
+            set what "wd $arg"
+        }
+        default {
+            set what ""
+        }
+    }
+    puts [format "%s %+10d %5s %-10s %s" $when $delta $num $tname $what]
+}